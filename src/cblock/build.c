@@ -200,7 +200,7 @@ build_send_context(int sock, struct build_config *bcp)
 	}
 	strlcpy(pbc.p_tag, bcp->b_tag, sizeof(pbc.p_tag));
 	build_init_stage_count(bcp, &pbc);
-	sock_ipc_must_write(sock, &pbc, sizeof(pbc));
+	sock_ipc_send_build_context(sock, gcfg.c_proto, &pbc);
 	build_send_stages(sock, bcp);
 	print_bold_prefix(stdout);
 	fprintf(stdout,
@@ -213,7 +213,9 @@ build_send_context(int sock, struct build_config *bcp)
 	if (unlink(bcp->b_context_path) == -1) {
 		err(1, "failed to cleanup build context");
 	}
-        sock_ipc_must_read(sock, &resp, sizeof(resp));
+	if (sock_ipc_recv_response(sock, gcfg.c_proto, &resp) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
         if (resp.p_ecode != 0) {
                 err(1, "failed to spawn container");
         }
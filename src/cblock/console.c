@@ -27,6 +27,7 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/select.h>
+#include <sys/uio.h>
 #include <sys/ioctl.h>
 #include <sys/param.h>
 #include <sys/un.h>
@@ -53,17 +54,33 @@
 
 struct termios otermios;
 int need_resize;
+uint64_t console_offset;
+int console_watch;
+struct zstream *console_zs;
+int console_ptyfd = -1;		/* the pty, if it was handed to us */
+int console_direct;		/* the backlog is done, read the pty */
 
 void	console_reset_tty(void);
 int	console_mplex(int);
 
 struct console_config {
 	char		*c_name;
+	int		 c_resume;
+	uint64_t	 c_offset;
+	int		 c_watch;
+	uint64_t	 c_lines;
+	uint64_t	 c_bytes;
+	int		 c_direct;
 };
 
 static struct option console_options[] = {
 	{ "help",		no_argument, 0, 'h' },
 	{ "name",		required_argument, 0, 'n' },
+	{ "offset",		required_argument, 0, 'o' },
+	{ "watch",		no_argument, 0, 'w' },
+	{ "lines",		required_argument, 0, 'L' },
+	{ "bytes",		required_argument, 0, 'B' },
+	{ "direct",		no_argument, 0, 'd' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -82,6 +99,11 @@ console_usage(void)
 	    "Options\n"
 	    " -h, --help        Display program usage\n"
 	    " -n, --name        Name of console to connect to\n"
+	    " -o, --offset      Resume from this console output offset\n"
+	    " -w, --watch       Watch the console without sending input\n"
+	    " -L, --lines       Replay at most this many lines of output\n"
+	    " -B, --bytes       Replay at most this many bytes of output\n"
+	    " -d, --direct      Read and write the container's pty directly\n"
 	);
 	exit(1);
 }
@@ -134,6 +156,8 @@ console_tty_set_raw_mode(int fd)
 static int
 console_tty_handle_socket(int sock)
 {
+	struct cblock_console_offset co;
+	u_char *out;
 	uint32_t cmd;
 	size_t len;
 	char *buf;
@@ -147,6 +171,50 @@ console_tty_handle_socket(int sock)
 		buf = malloc(len);
 		sock_ipc_must_read(sock, buf, len);
 		(void) write(STDIN_FILENO, buf, len);
+		free(buf);
+		console_offset += len;
+		break;
+	case PRISON_IPC_CONSOLE_DEFLATE:
+		if (console_zs == NULL) {
+			console_zs = zstream_inflate_init();
+			if (console_zs == NULL) {
+				errx(1, "failed to set up console compression");
+			}
+		}
+		sock_ipc_must_read(sock, &len, sizeof(len));
+		buf = malloc(len);
+		if (buf == NULL) {
+			err(1, "malloc failed");
+		}
+		sock_ipc_must_read(sock, buf, len);
+		out = zstream_inflate(console_zs, (u_char *)buf, len, &len);
+		if (out == NULL) {
+			errx(1, "corrupt compressed console output");
+		}
+		(void) write(STDIN_FILENO, out, len);
+		free(out);
+		free(buf);
+		console_offset += len;
+		break;
+	case PRISON_IPC_CONSOLE_OFFSET:
+		sock_ipc_must_read(sock, &len, sizeof(len));
+		if (len != sizeof(co)) {
+			errx(1, "invalid console offset frame");
+		}
+		sock_ipc_must_read(sock, &co, sizeof(co));
+		if (co.co_gap > 0) {
+			(void) fprintf(stderr, "\r\n[%ju bytes of console "
+			    "output were no longer available]\r\n",
+			    (uintmax_t)co.co_gap);
+		}
+		console_offset = co.co_offset;
+		break;
+	case PRISON_IPC_CONSOLE_HANDOFF:
+		sock_ipc_must_read(sock, &len, sizeof(len));
+		if (len != 0) {
+			errx(1, "invalid console handoff frame");
+		}
+		console_direct = console_ptyfd != -1;
 		break;
 	case PRISON_IPC_CONSOLE_SESSION_DONE:
 		console_reset_tty();
@@ -158,6 +226,77 @@ console_tty_handle_socket(int sock)
 	return (0);
 }
 
+/*
+ * Send a frame of console input to a daemon which negotiated
+ * CBLOCK_CAP_CONSOLE_FRAMES. The frame has to go out whole, a partial
+ * write would leave the stream out of step.
+ */
+static int
+console_send_frame(int sock, uint32_t cmd, void *payload, size_t len)
+{
+	struct cblock_console_frame cf;
+	struct iovec iov[2], *iovp;
+	int iovcnt;
+	ssize_t cc;
+
+	cf.cf_cmd = cmd;
+	cf.cf_len = len;
+	iov[0].iov_base = &cf;
+	iov[0].iov_len = sizeof(cf);
+	iov[1].iov_base = payload;
+	iov[1].iov_len = len;
+	iovp = iov;
+	iovcnt = 2;
+	while (iovcnt > 0) {
+		cc = writev(sock, iovp, iovcnt);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc == -1) {
+			return (-1);
+		}
+		while (iovcnt > 0 && (size_t)cc >= iovp->iov_len) {
+			cc -= iovp->iov_len;
+			iovp++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iovp->iov_base = (char *)iovp->iov_base + cc;
+			iovp->iov_len -= cc;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Output read from the pty ourselves: it is written out first, then sent to
+ * the daemon for the scrollback and the other consoles.
+ */
+static void
+console_tty_handle_pty(int sock)
+{
+	char buf[65536];
+	ssize_t cc;
+
+	cc = read(console_ptyfd, buf, sizeof(buf));
+	if (cc == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return;
+	}
+	/*
+	 * The container has gone away, the daemon will tell us when it has
+	 * noticed.
+	 */
+	if (cc <= 0) {
+		(void) close(console_ptyfd);
+		console_ptyfd = -1;
+		console_direct = 0;
+		return;
+	}
+	(void) write(STDIN_FILENO, buf, cc);
+	console_offset += cc;
+	(void) console_send_frame(sock, PRISON_IPC_CONSOLE_TEE, buf, cc);
+}
+
 static void
 console_tty_send_resize(int sock)
 {
@@ -166,14 +305,19 @@ console_tty_send_resize(int sock)
 	size_t len;
 	uint32_t *cmd;
 
+	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &wsize) == -1) {
+		err(1, "ioctl(TIOCGWINSZ): failed");
+	}
+	if ((gcfg.c_caps & CBLOCK_CAP_CONSOLE_FRAMES) != 0) {
+		(void) console_send_frame(sock, PRISON_IPC_CONSOL_RESIZE,
+		    &wsize, sizeof(wsize));
+		return;
+	}
 	len = sizeof(struct winsize) + sizeof(uint32_t) + 1;
 	buf = calloc(1, len);
 	if (buf == NULL) {
 		err(1, "calloc failed");
 	}
-	if (ioctl(STDIN_FILENO, TIOCGWINSZ, &wsize) == -1) {
-		err(1, "ioctl(TIOCGWINSZ): failed");
-	}
 	vptr = buf;
 	cmd = (uint32_t *)vptr;
 	*cmd = PRISON_IPC_CONSOL_RESIZE;
@@ -182,20 +326,29 @@ console_tty_send_resize(int sock)
 	if (write(sock, buf, len) != len) {
 		err(1, "tty send resize failed");
 	}
+	free(buf);
 }
 
 static int
 console_tty_handle_stdin(int sock)
 {
-	char buf[4096], *vptr;
+	char buf[65536], *vptr;
 	uint32_t *cmd;
-	ssize_t cc;
+	size_t len;
+	ssize_t cc, n;
+	int framed;
 
+	/*
+	 * Framed input can be read in large chunks, so pastes go out in
+	 * few frames. Legacy daemons read at most 1024 bytes at a time.
+	 */
+	framed = (gcfg.c_caps & CBLOCK_CAP_CONSOLE_FRAMES) != 0;
+	len = framed ? sizeof(buf) : 4096;
 	vptr = buf;
 	cmd = (uint32_t *)buf;
 	*cmd = PRISON_IPC_CONSOLE_DATA;
 	vptr += sizeof(uint32_t);
-	cc = read(STDIN_FILENO, vptr, sizeof(buf) - sizeof(uint32_t));
+	cc = read(STDIN_FILENO, vptr, len - sizeof(uint32_t));
 	if (cc == 0) {
 		return (1);
 	}
@@ -211,10 +364,39 @@ console_tty_handle_stdin(int sock)
 	if (cc == 1 && *vptr == 0x11) {
 		return (1);
 	}
+	/*
+	 * Watchers are read-only, the daemon would discard our input anyway.
+	 */
+	if (console_watch) {
+		return (0);
+	}
 	if (need_resize) {
 		console_tty_send_resize(sock);
 		need_resize = 0;
 	}
+	/*
+	 * With the pty, input goes straight to it. If it has gone away, the
+	 * daemon is about to end the session.
+	 */
+	while (console_ptyfd != -1 && cc > 0) {
+		n = write(console_ptyfd, vptr, cc);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			return (0);
+		}
+		vptr += n;
+		cc -= n;
+	}
+	if (console_ptyfd != -1) {
+		return (0);
+	}
+	if (framed) {
+		(void) console_send_frame(sock, PRISON_IPC_CONSOLE_DATA,
+		    vptr, cc);
+		return (0);
+	}
 	if (write(sock, buf, cc + sizeof(uint32_t)) == -1 && errno == EPIPE) {
 		return (0);
 	}
@@ -236,18 +418,37 @@ int
 console_mplex(int sock)
 {
 	fd_set rfds;
-	int error;
+	int error, maxfd;
 
 	FD_ZERO(&rfds);
 	FD_SET(sock, &rfds);
 	FD_SET(STDIN_FILENO, &rfds);
-	error = select(sock + 1, &rfds, NULL, NULL, NULL);
+	maxfd = sock;
+	if (console_direct) {
+		FD_SET(console_ptyfd, &rfds);
+		if (console_ptyfd > maxfd) {
+			maxfd = console_ptyfd;
+		}
+	}
+	error = select(maxfd + 1, &rfds, NULL, NULL, NULL);
 	if (error == -1 && errno == EINTR) {
+		/*
+		 * Resize frames can not be confused with terminal input, so
+		 * there is no need to wait for the next key stroke.
+		 */
+		if (need_resize && !console_watch &&
+		    (gcfg.c_caps & CBLOCK_CAP_CONSOLE_FRAMES) != 0) {
+			console_tty_send_resize(sock);
+			need_resize = 0;
+		}
 		return (0);
 	}
 	if (error == -1) {
 		err(1, "select failed");
 	}
+	if (console_direct && FD_ISSET(console_ptyfd, &rfds)) {
+		console_tty_handle_pty(sock);
+	}
 	if (FD_ISSET(sock, &rfds)) {
 		if (console_tty_handle_socket(sock)) {
 			return (1);
@@ -270,6 +471,36 @@ console_tty_console_session(int sock)
 	console_evloop(sock);
 }
 
+/*
+ * Having asked for the pty, we are sent it (or told we will not be) before
+ * anything else.
+ */
+static void
+console_recv_pty(int sock)
+{
+	uint32_t cmd;
+	size_t len;
+	int nfds;
+
+	nfds = 1;
+	if (sock_ipc_recv_fds(sock, &cmd, sizeof(cmd), &console_ptyfd,
+	    &nfds) == 0) {
+		errx(1, "lost connection to the cblock daemon");
+	}
+	if (cmd != PRISON_IPC_CONSOLE_HANDOFF) {
+		errx(1, "invalid console frame type %u", cmd);
+	}
+	sock_ipc_must_read(sock, &len, sizeof(len));
+	if (len != 0) {
+		errx(1, "invalid console handoff frame");
+	}
+	if (nfds == 0) {
+		console_ptyfd = -1;
+		warnx("the cblock daemon did not hand the pty over, "
+		    "relaying the console");
+	}
+}
+
 static void
 console_connect_console(int sock, struct console_config *ccp)
 {
@@ -287,16 +518,55 @@ console_connect_console(int sock, struct console_config *ccp)
 	}
 	strlcpy(pcc.p_instance, ccp->c_name, sizeof(pcc.p_instance));
 	strlcpy(pcc.p_name, ccp->c_name, sizeof(pcc.p_name));
+	if ((ccp->c_resume || ccp->c_watch || ccp->c_lines != 0 ||
+	    ccp->c_bytes != 0) && gcfg.c_proto == CBLOCK_PROTO_LEGACY) {
+		errx(1, "the cblock daemon does not support resuming, "
+		    "watching or limiting the replay of consoles");
+	}
+	pcc.p_replay_lines = ccp->c_lines;
+	pcc.p_replay_bytes = ccp->c_bytes;
+	if (ccp->c_watch) {
+		pcc.p_watch = 1;
+		console_watch = 1;
+	}
+	if (ccp->c_resume) {
+		pcc.p_resume = 1;
+		pcc.p_resume_offset = ccp->c_offset;
+		console_offset = ccp->c_offset;
+	}
+	if (ccp->c_direct && !ccp->c_watch) {
+		if ((gcfg.c_caps & CBLOCK_CAP_CONSOLE_HANDOFF) == 0 ||
+		    (gcfg.c_caps & CBLOCK_CAP_CONSOLE_FRAMES) == 0) {
+			warnx("the cblock daemon can not hand the pty over, "
+			    "relaying the console");
+		} else {
+			pcc.p_handoff = 1;
+		}
+	}
 	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
-	sock_ipc_must_write(sock, &pcc, sizeof(pcc));
-	sock_ipc_must_read(sock, &resp, sizeof(resp));
+	sock_ipc_send_console_connect(sock, gcfg.c_proto, &pcc);
+	if (sock_ipc_recv_response(sock, gcfg.c_proto, &resp) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
 	if (resp.p_ecode != 0) {
 		(void) printf("failed to attach console to %s: %s\n",
 		    ccp->c_name, resp.p_errbuf);
 		return;
 	}
+	if (pcc.p_handoff) {
+		console_recv_pty(sock);
+	}
 	console_tty_set_raw_mode(STDIN_FILENO);
 	console_tty_console_session(sock);
+	/*
+	 * Report where we got to, so the console can be re-attached from
+	 * this point with --offset.
+	 */
+	if (ccp->c_resume) {
+		console_reset_tty();
+		(void) fprintf(stderr, "console offset: %ju\n",
+		    (uintmax_t)console_offset);
+	}
 }
 
 int
@@ -304,12 +574,13 @@ console_main(int argc, char *argv [], int cltlsock)
 {
 	struct console_config cc;
 	int option_index, c;
+	char *r;
 
 	bzero(&cc, sizeof(cc));
 	reset_getopt_state();
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "n:h", console_options,
+		c = getopt_long(argc, argv, "n:o:wL:B:dh", console_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -321,6 +592,31 @@ console_main(int argc, char *argv [], int cltlsock)
 		case 'n':
 			cc.c_name = optarg;
 			break;
+		case 'o':
+			cc.c_offset = strtoull(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid console offset: %s", optarg);
+			}
+			cc.c_resume = 1;
+			break;
+		case 'w':
+			cc.c_watch = 1;
+			break;
+		case 'd':
+			cc.c_direct = 1;
+			break;
+		case 'L':
+			cc.c_lines = strtoull(optarg, &r, 10);
+			if (*r != '\0' || cc.c_lines == 0) {
+				errx(1, "invalid line count: %s", optarg);
+			}
+			break;
+		case 'B':
+			cc.c_bytes = strtoull(optarg, &r, 10);
+			if (*r != '\0' || cc.c_bytes == 0) {
+				errx(1, "invalid byte count: %s", optarg);
+			}
+			break;
 		}
 	}
 	if (cc.c_name == NULL) {
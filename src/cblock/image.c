@@ -72,7 +72,7 @@ image_prune(struct image_config *icp, int ctlsock)
 	bzero(&arg, sizeof(arg));
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
 	sprintf(arg.p_cmdname, "image_prune");
-	sock_ipc_must_write(ctlsock, &arg, sizeof(arg));
+	sock_ipc_send_generic_command(ctlsock, gcfg.c_proto, &arg);
 	sock_ipc_from_sock_to_tty(ctlsock);
 }
 
@@ -86,7 +86,7 @@ image_get(struct image_config *icp, int ctlsock)
 	bzero(&arg, sizeof(arg));
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
 	sprintf(arg.p_cmdname, "image_list");
-	sock_ipc_must_write(ctlsock, &arg, sizeof(arg));
+	sock_ipc_send_generic_command(ctlsock, gcfg.c_proto, &arg);
 	sock_ipc_from_sock_to_tty(ctlsock);
 }
 
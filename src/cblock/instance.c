@@ -34,7 +34,9 @@
 #include <err.h>
 #include <fcntl.h>
 #include <time.h>
+#include <stdint.h>
 #include <unistd.h>
+#include <libutil.h>
 
 #include <cblock/libcblock.h>
 
@@ -44,13 +46,51 @@ struct instance_config {
 	int		 i_long;
 	int		 i_quiet;
 	int		 i_do_prune;
+	char		*i_limit;
+	uint64_t	 i_rate;
+	uint64_t	 i_burst;
+	int		 i_query;
+	struct cblock_instance_query i_q;
 };
 
+/*
+ * The columns a query (--fields) may ask for, in the order they are
+ * printed.
+ */
+struct instance_column {
+	const char	*ic_name;
+	const char	*ic_header;
+	uint32_t	 ic_field;
+	int		 ic_width;
+};
+
+static const struct instance_column instance_columns[] = {
+	{ "name",	"INSTANCE",	INSTANCE_F_NAME,	10 },
+	{ "image",	"IMAGE",	INSTANCE_F_IMAGE,	15 },
+	{ "tty",	"TTY",		INSTANCE_F_TTY,		12 },
+	{ "pid",	"PID",		INSTANCE_F_PID,		7 },
+	{ "type",	"TYPE",		INSTANCE_F_TYPE,	11 },
+	{ "up",		"UP",		INSTANCE_F_START,	10 },
+	{ "state",	"STATE",	INSTANCE_F_STATE,	8 },
+};
+#define	INSTANCE_NCOLUMNS	\
+	(sizeof(instance_columns) / sizeof(instance_columns[0]))
+
 static struct option instance_options[] = {
 	{ "long",		no_argument, 0, 'l' },
 	{ "help",		no_argument, 0, 'h' },
 	{ "quiet",		no_argument, 0, 'q' },
 	{ "prune",		no_argument, 0, 'p' },
+	{ "limit",		required_argument, 0, 'L' },
+	{ "rate",		required_argument, 0, 'r' },
+	{ "burst",		required_argument, 0, 'B' },
+	{ "image",		required_argument, 0, 'i' },
+	{ "type",		required_argument, 0, 't' },
+	{ "state",		required_argument, 0, 's' },
+	{ "fields",		required_argument, 0, 'o' },
+	{ "sort",		required_argument, 0, 'S' },
+	{ "count",		required_argument, 0, 'n' },
+	{ "cursor",		required_argument, 0, 'c' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -61,7 +101,18 @@ instance_usage(void)
 	    " -h, --help                  Print help\n"
 	    " -p, --prune                 Remove stopped/dead instances\n"
 	    " -l, --long                  Print full instance names\n"
-	    " -q, --quiet                 Do not print column headers\n");
+	    " -q, --quiet                 Do not print column headers\n"
+	    " -L, --limit=INSTANCE        Set the console output rate limit of INSTANCE\n"
+	    " -r, --rate=RATE             Bytes/second for --limit (0: unlimited)\n"
+	    " -B, --burst=SIZE            Largest burst of output for --limit\n"
+	    " -i, --image=IMAGE           Only list instances of IMAGE\n"
+	    " -t, --type=TYPE             Only list building or assembled instances\n"
+	    " -s, --state=STATE           Only list attached, detached or terminating\n"
+	    "                             instances\n"
+	    " -o, --fields=LIST           Columns: name,image,tty,pid,type,up,state\n"
+	    " -S, --sort=KEY              Order by name, image, up or pid\n"
+	    " -n, --count=N               List at most N instances\n"
+	    " -c, --cursor=CURSOR         Continue a listing where --count ended it\n");
 	exit(1);
 }
 
@@ -73,18 +124,12 @@ instance_get(struct instance_config *icp, int ctlsock)
 	size_t count;
 	time_t now;
 
-
 	cmd = PRISON_IPC_GET_INSTANCES;
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
-	sock_ipc_must_read(ctlsock, &count, sizeof(count));
+	ent = sock_ipc_recv_instances(ctlsock, gcfg.c_proto, &count);
 	if (count == 0) {
 		return;
 	}
-	ent = malloc(count * sizeof(struct instance_ent));
-	if (ent == NULL) {
-		err(1, "malloc for instance list failed");
-	}
-	sock_ipc_must_read(ctlsock, ent, count * sizeof(struct instance_ent));
 	if (!icp->i_quiet) {
 		printf("%-10.10s  %-15.15s %-12.12s %-7.7s %-11.11s %10.10s\n",
 		    "INSTANCE", "IMAGE", "TTY", "PID", "TYPE", "UP");
@@ -102,6 +147,111 @@ instance_get(struct instance_config *icp, int ctlsock)
 	}
 }
 
+static uint32_t
+instance_parse_fields(char *list)
+{
+	uint32_t fields;
+	char *name;
+	size_t k;
+
+	fields = 0;
+	while ((name = strsep(&list, ",")) != NULL) {
+		for (k = 0; k < INSTANCE_NCOLUMNS; k++) {
+			if (strcmp(name, instance_columns[k].ic_name) == 0) {
+				break;
+			}
+		}
+		if (k == INSTANCE_NCOLUMNS) {
+			errx(1, "unknown field: %s", name);
+		}
+		fields |= instance_columns[k].ic_field;
+	}
+	return (fields);
+}
+
+/*
+ * Filtering, projection and paging are done by the daemon, which sends
+ * just the page and the columns asked for.
+ */
+static void
+instance_query(struct instance_config *icp, int ctlsock)
+{
+	const struct instance_column *col;
+	struct cblock_instance_page pg;
+	struct instance_ent *ent, *cur;
+	struct cblock_instance_query *q;
+	char val[MAXPATHLEN];
+	uint32_t cmd, fields;
+	size_t k, j;
+	time_t now;
+
+	if ((gcfg.c_caps & CBLOCK_CAP_LIST_QUERY) == 0) {
+		errx(1, "the cblock daemon does not support instance queries");
+	}
+	q = &icp->i_q;
+	fields = (q->q_fields == 0) ? INSTANCE_F_ALL : q->q_fields;
+	cmd = PRISON_IPC_QUERY_INSTANCES;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	if (sock_ipc_send_instance_query(ctlsock, q) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
+	ent = sock_ipc_recv_instance_page(ctlsock, &pg);
+	if (!icp->i_quiet && pg.p_count != 0) {
+		for (j = 0; j < INSTANCE_NCOLUMNS; j++) {
+			col = &instance_columns[j];
+			if ((fields & col->ic_field) != 0) {
+				printf("%-*.*s ", col->ic_width, col->ic_width,
+				    col->ic_header);
+			}
+		}
+		printf("\n");
+	}
+	now = time(NULL);
+	for (k = 0; k < pg.p_count; k++) {
+		cur = &ent[k];
+		for (j = 0; j < INSTANCE_NCOLUMNS; j++) {
+			col = &instance_columns[j];
+			if ((fields & col->ic_field) == 0) {
+				continue;
+			}
+			switch (col->ic_field) {
+			case INSTANCE_F_NAME:
+				strlcpy(val, cur->p_instance_name, sizeof(val));
+				if (!icp->i_long) {
+					val[col->ic_width] = '\0';
+				}
+				break;
+			case INSTANCE_F_IMAGE:
+				strlcpy(val, cur->p_image_name, sizeof(val));
+				break;
+			case INSTANCE_F_TTY:
+				strlcpy(val, cur->p_tty_line, sizeof(val));
+				break;
+			case INSTANCE_F_PID:
+				snprintf(val, sizeof(val), "%d", cur->p_pid);
+				break;
+			case INSTANCE_F_TYPE:
+				strlcpy(val, cur->p_type, sizeof(val));
+				break;
+			case INSTANCE_F_START:
+				snprintf(val, sizeof(val), "%lds",
+				    now - cur->p_start_time);
+				break;
+			case INSTANCE_F_STATE:
+				strlcpy(val, cur->p_state, sizeof(val));
+				break;
+			}
+			printf("%-*s ", col->ic_width, val);
+		}
+		printf("\n");
+	}
+	free(ent);
+	if (pg.p_cursor[0] != '\0') {
+		fprintf(stderr, "%zu of %zu instances, next page: --cursor=%s\n",
+		    pg.p_count, pg.p_matched, pg.p_cursor);
+	}
+}
+
 static void
 instance_prune(struct instance_config *icp, int ctlsock)
 {
@@ -112,10 +262,32 @@ instance_prune(struct instance_config *icp, int ctlsock)
 	bzero(&arg, sizeof(arg));
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
 	sprintf(arg.p_cmdname, "instance_prune");
-	sock_ipc_must_write(ctlsock, &arg, sizeof(arg));
+	sock_ipc_send_generic_command(ctlsock, gcfg.c_proto, &arg);
 	sock_ipc_from_sock_to_tty(ctlsock);
 }
 
+static void
+instance_limit(struct instance_config *icp, int ctlsock)
+{
+	struct cblock_console_limit pcl;
+	struct cblock_response resp;
+	uint32_t cmd;
+
+	cmd = PRISON_IPC_CONSOLE_LIMIT;
+	bzero(&pcl, sizeof(pcl));
+	strlcpy(pcl.p_instance, icp->i_limit, sizeof(pcl.p_instance));
+	pcl.p_output_rate = icp->i_rate;
+	pcl.p_output_burst = icp->i_burst;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	sock_ipc_send_console_limit(ctlsock, gcfg.c_proto, &pcl);
+	if (sock_ipc_recv_response(ctlsock, gcfg.c_proto, &resp) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
+	if (resp.p_ecode != 0) {
+		errx(1, "%s", resp.p_errbuf);
+	}
+}
+
 int
 instance_main(int argc, char *argv [], int ctlsock)
 {
@@ -126,7 +298,8 @@ instance_main(int argc, char *argv [], int ctlsock)
 	reset_getopt_state();
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "qhl", instance_options,
+		c = getopt_long(argc, argv, "L:r:B:i:t:s:o:S:n:c:qhlp",
+		    instance_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -138,12 +311,79 @@ instance_main(int argc, char *argv [], int ctlsock)
 		case 'q':
 			ic.i_quiet = 1;
 			break;
+		case 'L':
+			ic.i_limit = optarg;
+			break;
+		case 'r':
+			if (expand_number(optarg, &ic.i_rate) == -1) {
+				errx(1, "invalid rate: %s", optarg);
+			}
+			break;
+		case 'B':
+			if (expand_number(optarg, &ic.i_burst) == -1) {
+				errx(1, "invalid burst: %s", optarg);
+			}
+			break;
 		case 'h':
 			instance_usage();
 			exit(1);
 		case 'l':
 			ic.i_long = 1;
 			break;
+		case 'i':
+			strlcpy(ic.i_q.q_image, optarg,
+			    sizeof(ic.i_q.q_image));
+			ic.i_query = 1;
+			break;
+		case 't':
+			if (strcmp(optarg, "building") == 0) {
+				ic.i_q.q_type = PRISON_TYPE_BUILD;
+			} else if (strcmp(optarg, "assembled") == 0) {
+				ic.i_q.q_type = PRISON_TYPE_REGULAR;
+			} else {
+				errx(1, "invalid type: %s", optarg);
+			}
+			ic.i_query = 1;
+			break;
+		case 's':
+			if (strcmp(optarg, "attached") == 0) {
+				ic.i_q.q_state = INSTANCE_STATE_ATTACHED;
+			} else if (strcmp(optarg, "detached") == 0) {
+				ic.i_q.q_state = INSTANCE_STATE_DETACHED;
+			} else if (strcmp(optarg, "terminating") == 0) {
+				ic.i_q.q_state = INSTANCE_STATE_TERMINATING;
+			} else {
+				errx(1, "invalid state: %s", optarg);
+			}
+			ic.i_query = 1;
+			break;
+		case 'o':
+			ic.i_q.q_fields = instance_parse_fields(optarg);
+			ic.i_query = 1;
+			break;
+		case 'S':
+			if (strcmp(optarg, "name") == 0) {
+				ic.i_q.q_sort = INSTANCE_SORT_NAME;
+			} else if (strcmp(optarg, "image") == 0) {
+				ic.i_q.q_sort = INSTANCE_SORT_IMAGE;
+			} else if (strcmp(optarg, "up") == 0) {
+				ic.i_q.q_sort = INSTANCE_SORT_START;
+			} else if (strcmp(optarg, "pid") == 0) {
+				ic.i_q.q_sort = INSTANCE_SORT_PID;
+			} else {
+				errx(1, "invalid sort key: %s", optarg);
+			}
+			ic.i_query = 1;
+			break;
+		case 'n':
+			ic.i_q.q_limit = strtoul(optarg, NULL, 10);
+			ic.i_query = 1;
+			break;
+		case 'c':
+			strlcpy(ic.i_q.q_cursor, optarg,
+			    sizeof(ic.i_q.q_cursor));
+			ic.i_query = 1;
+			break;
 		default:
 			instance_usage();
 			/* NOT REACHED */
@@ -151,10 +391,18 @@ instance_main(int argc, char *argv [], int ctlsock)
 	}
 	argc -= optind;
 	argv += optind;
+	if (ic.i_limit != NULL) {
+		instance_limit(&ic, ctlsock);
+		exit(0);
+	}
 	if (ic.i_do_prune) {
 		instance_prune(&ic, ctlsock);
 		exit(0);
 	}
+	if (ic.i_query) {
+		instance_query(&ic, ctlsock);
+		exit(0);
+	}
 	instance_get(&ic, ctlsock);
 	return (0);
 }
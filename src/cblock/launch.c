@@ -38,6 +38,7 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <libutil.h>
 
 #include <cblock/libcblock.h>
 #include <cblock/sbuf.h>
@@ -55,6 +56,8 @@ struct launch_config {
 	char		*l_tag;
 	char		*l_ports;
 	int		 l_host_networking;
+	uint64_t	 l_output_rate;
+	uint64_t	 l_output_burst;
 };
 
 static struct option launch_options[] = {
@@ -70,6 +73,8 @@ static struct option launch_options[] = {
 	{ "verbose",		no_argument, 0, 'v' },
 	{ "port",		required_argument, 0, 'P' },
 	{ "host-networking",	no_argument, 0, 'H' },
+	{ "output-rate",	required_argument, 0, 'r' },
+	{ "output-burst",	required_argument, 0, 'b' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -89,6 +94,8 @@ launch_usage(void)
 	    " -A, --no-attach            Do not attach to container console\n"
 	    " -v, --verbose              Launch container with verbosity enabled\n"
 	    " -H, --host-networking      Use host networking instead of NAT/bridge\n"
+	    " -r, --output-rate=RATE     Limit console output to RATE bytes/second\n"
+	    " -b, --output-burst=SIZE    Allow bursts of up to SIZE bytes of output\n"
 	);
 	exit(1);
 }
@@ -120,6 +127,12 @@ launch_container(int sock, struct launch_config *lcp)
 		free(args);
 		vec_free(lcp->l_vec);
 	}
+	if (lcp->l_output_rate != 0 && gcfg.c_proto == CBLOCK_PROTO_LEGACY) {
+		errx(1, "the cblock daemon does not support console output "
+		    "rate limits");
+	}
+	pl.p_output_rate = lcp->l_output_rate;
+	pl.p_output_burst = lcp->l_output_burst;
 	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
 	pl.p_verbose = lcp->l_verbose;
 	strlcpy(pl.p_tag, lcp->l_tag, sizeof(pl.p_tag));
@@ -128,8 +141,10 @@ launch_container(int sock, struct launch_config *lcp)
 	strlcpy(pl.p_volumes, lcp->l_volumes, sizeof(pl.p_volumes));
 	strlcpy(pl.p_ports, lcp->l_ports, sizeof(pl.p_ports));
 	strlcpy(pl.p_network, lcp->l_network, sizeof(pl.p_network));
-	sock_ipc_must_write(sock, &pl, sizeof(pl));
-	sock_ipc_must_read(sock, &resp, sizeof(resp));
+	sock_ipc_send_launch(sock, gcfg.c_proto, &pl);
+	if (sock_ipc_recv_response(sock, gcfg.c_proto, &resp) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
 	if (resp.p_ecode != 0) {
 		warnx("failed to spawn container");
 		return;
@@ -165,7 +180,7 @@ launch_main(int argc, char *argv [], int ctlsock)
 	reset_getopt_state();
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "AHP:vN:Fpn:t:V:T", launch_options,
+		c = getopt_long(argc, argv, "r:b:AHP:vN:Fpn:t:V:T", launch_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -174,6 +189,16 @@ launch_main(int argc, char *argv [], int ctlsock)
 		case 'H':
 			lc.l_host_networking = 1;
 			break;
+		case 'r':
+			if (expand_number(optarg, &lc.l_output_rate) == -1) {
+				errx(1, "invalid output rate: %s", optarg);
+			}
+			break;
+		case 'b':
+			if (expand_number(optarg, &lc.l_output_burst) == -1) {
+				errx(1, "invalid output burst: %s", optarg);
+			}
+			break;
 		case 'P':
 			sbuf_cat(pb, optarg);
 			sbuf_cat(pb, ",");
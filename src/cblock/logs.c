@@ -0,0 +1,705 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/param.h>
+#include <sys/ttycom.h>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <termios.h>
+#include <errno.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <time.h>
+#include <err.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "main.h"
+#include "sock_ipc.h"
+
+/*
+ * One subscription per instance, each on its own connection, or each on a
+ * channel of the one connection if the daemon does console multiplexing.
+ * When more than one instance is being followed, output is written a line
+ * at a time with the instance name in front of it.
+ */
+struct logs_stream {
+	char		*ls_name;
+	int		 ls_sock;
+	int		 ls_done;
+	uint64_t	 ls_offset;
+	struct zstream	*ls_zs;		/* NULL until output is compressed */
+	struct shmring	*ls_ring;	/* NULL if output is on the socket */
+	int		 ls_wakefd;
+	uint64_t	 ls_pos;	/* position in the ring */
+	int		 ls_live;	/* backlog is done, the ring is next */
+	char		*ls_line;
+	size_t		 ls_linelen;
+};
+
+struct logs_config {
+	int		 l_follow;
+	int		 l_print_offset;
+	int		 l_since_set;	/* --since was an offset */
+	int		 l_mux;		/* streams are channels */
+	int		 l_shm;		/* read output from shared memory */
+	uint64_t	 l_since_offset;
+	int64_t		 l_since_time;
+	size_t		 l_nstreams;
+	struct logs_stream *l_streams;
+};
+
+#define	LOGS_LINE_MAX	65536
+
+static struct option logs_options[] = {
+	{ "help",		no_argument, 0, 'h' },
+	{ "name",		required_argument, 0, 'n' },
+	{ "follow",		no_argument, 0, 'f' },
+	{ "since",		required_argument, 0, 'S' },
+	{ "print-offset",	no_argument, 0, 'O' },
+	{ "shm",		no_argument, 0, 'm' },
+	{ 0, 0, 0, 0 }
+};
+
+static void
+logs_usage(void)
+{
+	(void) fprintf(stderr,
+	    "Usage: cblock logs [OPTIONS] [NAME ...]\n\n"
+	    "Options\n"
+	    " -h, --help          Display program usage\n"
+	    " -n, --name          Name of a container to show output from\n"
+	    " -f, --follow        Keep streaming output as it is written\n"
+	    " -S, --since         Start at a byte offset, a time (2020-06-01T10:00:00)\n"
+	    "                     or an age (30s, 15m, 2h, 1d)\n"
+	    " -O, --print-offset  Print where each stream got to on exit\n"
+	    " -m, --shm           Read output from shared memory (local daemon only)\n"
+	);
+	exit(1);
+}
+
+static void
+logs_parse_since(struct logs_config *lcp, const char *arg)
+{
+	static const char *formats[] = {
+		"%Y-%m-%dT%H:%M:%S",
+		"%Y-%m-%d %H:%M:%S",
+		"%Y-%m-%d",
+		NULL,
+	};
+	const char **fmt;
+	uint64_t val;
+	struct tm tm;
+	char *r;
+
+	val = strtoull(arg, &r, 10);
+	if (r != arg && *r == '\0') {
+		lcp->l_since_offset = val;
+		lcp->l_since_set = 1;
+		return;
+	}
+	if (r != arg && r[1] == '\0') {
+		switch (*r) {
+		case 'd':
+			val *= 24;
+			/* FALLTHROUGH */
+		case 'h':
+			val *= 60;
+			/* FALLTHROUGH */
+		case 'm':
+			val *= 60;
+			/* FALLTHROUGH */
+		case 's':
+			lcp->l_since_time = time(NULL) - val;
+			return;
+		}
+	}
+	for (fmt = formats; *fmt != NULL; fmt++) {
+		bzero(&tm, sizeof(tm));
+		r = strptime(arg, *fmt, &tm);
+		if (r != NULL && *r == '\0') {
+			tm.tm_isdst = -1;
+			lcp->l_since_time = mktime(&tm);
+			return;
+		}
+	}
+	errx(1, "invalid --since: %s", arg);
+}
+
+static void
+logs_connect_init(struct logs_config *lcp, struct logs_stream *ls,
+    struct cblock_console_connect *pcc)
+{
+
+	bzero(pcc, sizeof(*pcc));
+	strlcpy(pcc->p_instance, ls->ls_name, sizeof(pcc->p_instance));
+	strlcpy(pcc->p_name, ls->ls_name, sizeof(pcc->p_name));
+	pcc->p_logs = 1;
+	pcc->p_watch = 1;
+	/*
+	 * Subscriptions always resume, so the end of the backlog is marked
+	 * by the offset at which live output starts.
+	 */
+	pcc->p_resume = 1;
+	pcc->p_resume_offset = lcp->l_since_offset;
+	pcc->p_since_time = lcp->l_since_time;
+	pcc->p_shm = lcp->l_shm;
+	ls->ls_offset = lcp->l_since_offset;
+}
+
+/*
+ * Having asked for shared memory output, the subscriber is sent the ring
+ * (or told there is none) before anything else.
+ */
+static void
+logs_shm_setup(struct logs_stream *ls)
+{
+	struct cblock_console_shm cs;
+	int fds[2], nfds, k;
+	uint32_t cmd;
+	size_t len;
+
+	nfds = 2;
+	if (sock_ipc_recv_fds(ls->ls_sock, &cmd, sizeof(cmd), fds,
+	    &nfds) == 0) {
+		errx(1, "lost connection to the cblock daemon");
+	}
+	if (cmd != PRISON_IPC_CONSOLE_SHM) {
+		errx(1, "invalid console frame type %u", cmd);
+	}
+	sock_ipc_must_read(ls->ls_sock, &len, sizeof(len));
+	if (len != sizeof(cs)) {
+		errx(1, "invalid console shm frame");
+	}
+	sock_ipc_must_read(ls->ls_sock, &cs, sizeof(cs));
+	if (cs.cs_size == 0 || nfds != 2) {
+		for (k = 0; k < nfds; k++) {
+			(void) close(fds[k]);
+		}
+		warnx("%s: no shared memory ring, reading output from the "
+		    "connection", ls->ls_name);
+		return;
+	}
+	ls->ls_ring = shmring_attach(fds[0]);
+	if (ls->ls_ring == NULL) {
+		err(1, "%s: failed to map the console ring", ls->ls_name);
+	}
+	if (fcntl(fds[1], F_SETFL, O_NONBLOCK) == -1) {
+		err(1, "fcntl(O_NONBLOCK) failed");
+	}
+	ls->ls_wakefd = fds[1];
+	ls->ls_pos = cs.cs_head;
+}
+
+static int
+logs_subscribe(struct logs_config *lcp, struct logs_stream *ls)
+{
+	struct cblock_console_connect pcc;
+	struct cblock_response resp;
+	uint32_t cmd;
+
+	logs_connect_init(lcp, ls, &pcc);
+	cmd = PRISON_IPC_CONSOLE_CONNECT;
+	sock_ipc_must_write(ls->ls_sock, &cmd, sizeof(cmd));
+	sock_ipc_send_console_connect(ls->ls_sock, gcfg.c_proto, &pcc);
+	if (sock_ipc_recv_response(ls->ls_sock, gcfg.c_proto, &resp) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
+	if (resp.p_ecode != 0) {
+		warnx("%s: %s", ls->ls_name, resp.p_errbuf);
+		return (-1);
+	}
+	if (lcp->l_shm) {
+		logs_shm_setup(ls);
+	}
+	return (0);
+}
+
+static void
+logs_write_line(struct logs_stream *ls, const char *buf, size_t len)
+{
+
+	(void) printf("%s | ", ls->ls_name);
+	(void) fwrite(ls->ls_line, 1, ls->ls_linelen, stdout);
+	(void) fwrite(buf, 1, len, stdout);
+	ls->ls_linelen = 0;
+}
+
+static void
+logs_output(struct logs_config *lcp, struct logs_stream *ls, char *buf,
+    size_t len)
+{
+	char *nl;
+	size_t n;
+
+	if (lcp->l_nstreams == 1) {
+		(void) fwrite(buf, 1, len, stdout);
+		return;
+	}
+	while (len > 0) {
+		nl = memchr(buf, '\n', len);
+		if (nl != NULL) {
+			n = nl - buf + 1;
+			logs_write_line(ls, buf, n);
+			buf += n;
+			len -= n;
+			continue;
+		}
+		/*
+		 * Hold on to a partial line, unless it gets too long.
+		 */
+		if (ls->ls_linelen + len > LOGS_LINE_MAX) {
+			logs_write_line(ls, buf, len);
+			(void) putchar('\n');
+			break;
+		}
+		memcpy(ls->ls_line + ls->ls_linelen, buf, len);
+		ls->ls_linelen += len;
+		break;
+	}
+}
+
+/*
+ * Read whatever there is in the ring.
+ */
+static void
+logs_shm_drain(struct logs_config *lcp, struct logs_stream *ls)
+{
+	char buf[65536];
+	uint64_t gap;
+	size_t n;
+
+	while (1) {
+		n = shmring_read(ls->ls_ring, &ls->ls_pos, buf, sizeof(buf),
+		    &gap);
+		if (gap > 0) {
+			warnx("%s: %ju bytes of output were lost, the reader "
+			    "fell behind", ls->ls_name, (uintmax_t)gap);
+			ls->ls_offset += gap;
+		}
+		if (n == 0) {
+			break;
+		}
+		logs_output(lcp, ls, buf, n);
+		ls->ls_offset += n;
+	}
+	(void) fflush(stdout);
+}
+
+static void
+logs_shm_wakeup(struct logs_config *lcp, struct logs_stream *ls)
+{
+	char buf[512];
+
+	while (read(ls->ls_wakefd, buf, sizeof(buf)) > 0)
+		;
+	logs_shm_drain(lcp, ls);
+}
+
+static void
+logs_stream_done(struct logs_stream *ls)
+{
+
+	if (ls->ls_linelen > 0) {
+		logs_write_line(ls, "\n", 1);
+	}
+	ls->ls_done = 1;
+}
+
+/*
+ * Handle a message for the stream, however it arrived.
+ */
+static void
+logs_handle_msg(struct logs_config *lcp, struct logs_stream *ls,
+    uint32_t cmd, char *buf, size_t len)
+{
+	struct cblock_console_offset co;
+	u_char *out;
+
+	switch (cmd) {
+	case PRISON_IPC_CONSOLE_TO_CLIENT:
+		logs_output(lcp, ls, buf, len);
+		ls->ls_offset += len;
+		break;
+	case PRISON_IPC_CONSOLE_DEFLATE:
+		if (ls->ls_zs == NULL) {
+			ls->ls_zs = zstream_inflate_init();
+			if (ls->ls_zs == NULL) {
+				errx(1, "failed to set up log decompression");
+			}
+		}
+		out = zstream_inflate(ls->ls_zs, (u_char *)buf, len, &len);
+		if (out == NULL) {
+			errx(1, "%s: corrupt compressed output", ls->ls_name);
+		}
+		logs_output(lcp, ls, (char *)out, len);
+		free(out);
+		ls->ls_offset += len;
+		break;
+	case PRISON_IPC_CONSOLE_OFFSET:
+		if (len != sizeof(co)) {
+			errx(1, "invalid console offset frame");
+		}
+		memcpy(&co, buf, sizeof(co));
+		if (co.co_gap > 0 && lcp->l_since_set) {
+			warnx("%s: %ju bytes of output were no longer "
+			    "available", ls->ls_name, (uintmax_t)co.co_gap);
+		}
+		ls->ls_offset = co.co_offset;
+		ls->ls_live = 1;
+		if (!lcp->l_follow) {
+			logs_stream_done(ls);
+		}
+		break;
+	case PRISON_IPC_CONSOLE_SESSION_DONE:
+		/*
+		 * The last of the output was in the ring before this was
+		 * sent.
+		 */
+		if (ls->ls_ring != NULL && ls->ls_live) {
+			logs_shm_drain(lcp, ls);
+		}
+		logs_stream_done(ls);
+		break;
+	default:
+		errx(1, "invalid console frame type %u", cmd);
+	}
+	(void) fflush(stdout);
+}
+
+/*
+ * Read a message from the stream's connection.
+ */
+static void
+logs_handle_stream(struct logs_config *lcp, struct logs_stream *ls)
+{
+	uint32_t cmd;
+	size_t len;
+	char *buf;
+
+	if (sock_ipc_may_read(ls->ls_sock, &cmd, sizeof(cmd))) {
+		logs_stream_done(ls);
+		return;
+	}
+	switch (cmd) {
+	case PRISON_IPC_CONSOLE_TO_CLIENT:
+	case PRISON_IPC_CONSOLE_DEFLATE:
+	case PRISON_IPC_CONSOLE_OFFSET:
+		break;
+	default:
+		/* the session done message has no length */
+		logs_handle_msg(lcp, ls, cmd, NULL, 0);
+		return;
+	}
+	sock_ipc_must_read(ls->ls_sock, &len, sizeof(len));
+	buf = malloc(len);
+	if (buf == NULL) {
+		err(1, "malloc failed");
+	}
+	sock_ipc_must_read(ls->ls_sock, buf, len);
+	logs_handle_msg(lcp, ls, cmd, buf, len);
+	free(buf);
+}
+
+static void
+logs_mux_send(int sock, uint32_t cmd, uint32_t channel, const void *buf,
+    size_t len)
+{
+	struct cblock_mux_frame mf;
+
+	mf.mf_cmd = cmd;
+	mf.mf_channel = channel;
+	mf.mf_len = len;
+	sock_ipc_must_write(sock, &mf, sizeof(mf));
+	if (len > 0) {
+		sock_ipc_must_write(sock, (void *)buf, len);
+	}
+}
+
+/*
+ * Subscribe to every stream on a multiplexing connection, using the index
+ * of each stream as its channel. The replies are handled by the event loop.
+ */
+static void
+logs_mux_subscribe(struct logs_config *lcp, int sock)
+{
+	struct cblock_console_connect pcc;
+	struct cblock_response resp;
+	char buf[TLV_MSG_MAX];
+	struct logs_stream *ls;
+	struct sbuf sb;
+	uint32_t cmd;
+	size_t k;
+
+	cmd = PRISON_IPC_CONSOLE_MUX;
+	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
+	if (sock_ipc_recv_response(sock, gcfg.c_proto, &resp) != 1) {
+		errx(1, "lost connection to the cblock daemon");
+	}
+	if (resp.p_ecode != 0) {
+		errx(1, "%s", resp.p_errbuf);
+	}
+	for (k = 0; k < lcp->l_nstreams; k++) {
+		ls = &lcp->l_streams[k];
+		logs_connect_init(lcp, ls, &pcc);
+		sbuf_new(&sb, buf, sizeof(buf), SBUF_FIXEDLEN);
+		tlv_put_console_connect(&sb, &pcc);
+		if (sbuf_finish(&sb) != 0) {
+			errx(1, "%s: subscription too large", ls->ls_name);
+		}
+		logs_mux_send(sock, PRISON_IPC_MUX_SUBSCRIBE, k,
+		    sbuf_data(&sb), sbuf_len(&sb));
+	}
+}
+
+static void
+logs_mux_evloop(struct logs_config *lcp, int sock)
+{
+	struct cblock_mux_frame mf;
+	struct logs_stream *ls;
+	size_t k, live;
+	char *buf;
+
+	live = lcp->l_nstreams;
+	while (live > 0) {
+		if (sock_ipc_may_read(sock, &mf, sizeof(mf))) {
+			errx(1, "lost connection to the cblock daemon");
+		}
+		buf = NULL;
+		if (mf.mf_len > 0) {
+			buf = malloc(mf.mf_len);
+			if (buf == NULL) {
+				err(1, "malloc failed");
+			}
+			sock_ipc_must_read(sock, buf, mf.mf_len);
+		}
+		/*
+		 * Anything still in flight for a stream which has finished is
+		 * dropped.
+		 */
+		if (mf.mf_channel >= lcp->l_nstreams ||
+		    lcp->l_streams[mf.mf_channel].ls_done) {
+			free(buf);
+			continue;
+		}
+		ls = &lcp->l_streams[mf.mf_channel];
+		if (mf.mf_cmd == PRISON_IPC_MUX_SUBSCRIBE) {
+			if (mf.mf_len > 0) {
+				warnx("%s: %.*s", ls->ls_name, (int)mf.mf_len,
+				    buf);
+				ls->ls_done = 1;
+			}
+		} else {
+			logs_handle_msg(lcp, ls, mf.mf_cmd, buf, mf.mf_len);
+			if (ls->ls_done) {
+				logs_mux_send(sock, PRISON_IPC_MUX_UNSUBSCRIBE,
+				    mf.mf_channel, NULL, 0);
+			}
+		}
+		free(buf);
+		live = 0;
+		for (k = 0; k < lcp->l_nstreams; k++) {
+			live += !lcp->l_streams[k].ls_done;
+		}
+	}
+}
+
+static void
+logs_evloop(struct logs_config *lcp)
+{
+	struct logs_stream *ls;
+	int error, maxfd, live;
+	fd_set rfds;
+	size_t k;
+
+	while (1) {
+		FD_ZERO(&rfds);
+		maxfd = live = 0;
+		for (k = 0; k < lcp->l_nstreams; k++) {
+			ls = &lcp->l_streams[k];
+			if (ls->ls_done) {
+				continue;
+			}
+			FD_SET(ls->ls_sock, &rfds);
+			if (ls->ls_sock > maxfd) {
+				maxfd = ls->ls_sock;
+			}
+			/*
+			 * Live output is only read from the ring once the
+			 * backlog has been, so it comes out in order.
+			 */
+			if (ls->ls_ring != NULL && ls->ls_live) {
+				FD_SET(ls->ls_wakefd, &rfds);
+				if (ls->ls_wakefd > maxfd) {
+					maxfd = ls->ls_wakefd;
+				}
+			}
+			live++;
+		}
+		if (live == 0) {
+			break;
+		}
+		error = select(maxfd + 1, &rfds, NULL, NULL, NULL);
+		if (error == -1 && errno == EINTR) {
+			continue;
+		}
+		if (error == -1) {
+			err(1, "select failed");
+		}
+		for (k = 0; k < lcp->l_nstreams; k++) {
+			ls = &lcp->l_streams[k];
+			if (!ls->ls_done && ls->ls_ring != NULL &&
+			    ls->ls_live && FD_ISSET(ls->ls_wakefd, &rfds)) {
+				logs_shm_wakeup(lcp, ls);
+			}
+			if (!ls->ls_done && FD_ISSET(ls->ls_sock, &rfds)) {
+				logs_handle_stream(lcp, ls);
+			}
+		}
+	}
+}
+
+int
+logs_main(int argc, char *argv [], int ctlsock)
+{
+	struct logs_config lc;
+	struct logs_stream *ls;
+	int option_index, c;
+	char **names;
+	size_t k, n;
+
+	bzero(&lc, sizeof(lc));
+	names = calloc(argc + 1, sizeof(*names));
+	if (names == NULL) {
+		err(1, "calloc failed");
+	}
+	n = 0;
+	reset_getopt_state();
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "n:fS:Omh", logs_options,
+		    &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'n':
+			names[n++] = optarg;
+			break;
+		case 'f':
+			lc.l_follow = 1;
+			break;
+		case 'S':
+			logs_parse_since(&lc, optarg);
+			break;
+		case 'O':
+			lc.l_print_offset = 1;
+			break;
+		case 'm':
+			lc.l_shm = 1;
+			break;
+		case 'h':
+		default:
+			logs_usage();
+			/* NOT REACHED */
+		}
+	}
+	while (optind < argc) {
+		names[n++] = argv[optind++];
+	}
+	if (n == 0) {
+		errx(1, "must specify the containers to show output from");
+	}
+	if ((gcfg.c_caps & CBLOCK_CAP_CONSOLE_LOGS) == 0) {
+		errx(1, "the cblock daemon does not support log subscriptions");
+	}
+	lc.l_nstreams = n;
+	lc.l_streams = calloc(n, sizeof(*lc.l_streams));
+	if (lc.l_streams == NULL) {
+		err(1, "calloc failed");
+	}
+	if (lc.l_shm && (gcfg.c_caps & CBLOCK_CAP_CONSOLE_SHM) == 0) {
+		warnx("shared memory output is only available from a local "
+		    "cblock daemon which supports it");
+		lc.l_shm = 0;
+	}
+	/*
+	 * Each ring reader has a connection of its own.
+	 */
+	lc.l_mux = n > 1 && !lc.l_shm &&
+	    (gcfg.c_caps & CBLOCK_CAP_CONSOLE_MUX) != 0;
+	for (k = 0; k < n; k++) {
+		ls = &lc.l_streams[k];
+		ls->ls_name = names[k];
+		ls->ls_wakefd = -1;
+		if (n > 1) {
+			ls->ls_line = malloc(LOGS_LINE_MAX);
+			if (ls->ls_line == NULL) {
+				err(1, "malloc failed");
+			}
+		}
+		if (lc.l_mux) {
+			ls->ls_sock = ctlsock;
+			continue;
+		}
+		ls->ls_sock = k == 0 ? ctlsock : sock_ipc_connect(&gcfg);
+		if (logs_subscribe(&lc, ls) == -1) {
+			ls->ls_done = 1;
+		}
+	}
+	if (lc.l_mux) {
+		logs_mux_subscribe(&lc, ctlsock);
+		logs_mux_evloop(&lc, ctlsock);
+	} else {
+		logs_evloop(&lc);
+	}
+	for (k = 0; k < n; k++) {
+		ls = &lc.l_streams[k];
+		if (lc.l_print_offset) {
+			(void) fprintf(stderr, "%s: offset %ju\n", ls->ls_name,
+			    (uintmax_t)ls->ls_offset);
+		}
+		if (k > 0 && !lc.l_mux) {
+			(void) close(ls->ls_sock);
+		}
+		if (ls->ls_ring != NULL) {
+			shmring_free(ls->ls_ring);
+			(void) close(ls->ls_wakefd);
+		}
+		free(ls->ls_line);
+	}
+	free(lc.l_streams);
+	free(names);
+	return (0);
+}
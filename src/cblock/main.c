@@ -61,10 +61,12 @@ struct sub_command {
 static struct sub_command sub_command_list[] = {
 	{ "launch",	launch_main, "Launch a new container instance"  },
 	{ "console",	console_main, "Attach to a container console" },
+	{ "logs",	logs_main, "Show or follow container output" },
 	{ "build",	build_main, "Build a new container image" },
 	{ "instances",	instance_main, "Get information about running instances" },
 	{ "network",    network_main, "Configure networking parameters" },
 	{ "images",	image_main, "Manage cblock images" },
+	{ "stats",	stats_main, "Display daemon statistics" },
 	{ NULL,		NULL, NULL }
 };
 
@@ -196,10 +198,6 @@ main(int argc, char *argv [])
 			break;
 		}
 	}
-	if (gcfg.c_host) {
-		ctlsock = sock_ipc_connect_inet(&gcfg);
-	} else {
-		ctlsock = sock_ipc_connect_unix(&gcfg);
-	}
+	ctlsock = sock_ipc_connect(&gcfg);
 	return ((*scp->sc_callback)(argc, argv, ctlsock));
 }
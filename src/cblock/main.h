@@ -34,8 +34,12 @@ struct global_params {
 	char		*c_host;
 	char		*c_port;
 	int		 c_family;
+	int		 c_proto;
+	uint32_t	 c_caps;
 };
 
+extern struct global_params gcfg;
+
 void		reset_getopt_state(void);
 int		console_main(int, char **, int);
 int		launch_main(int, char **, int);
@@ -43,6 +47,8 @@ int		build_main(int, char **, int);
 int		instance_main(int, char **, int);
 int		network_main(int, char **, int);
 int		image_main(int, char **, int);
+int		stats_main(int, char **, int);
+int		logs_main(int, char **, int);
 
 int		console_tty_set_raw_mode(int);
 void		console_tty_console_session(int);
@@ -99,7 +99,7 @@ network_list(int ctlsock, struct network_config *nc)
 	}
 	arg.p_mlen = vec->vec_marshalled_len;
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
-	sock_ipc_must_write(ctlsock, &arg, sizeof(arg));
+	sock_ipc_send_generic_command(ctlsock, gcfg.c_proto, &arg);
 	sock_ipc_must_write(ctlsock, payload, arg.p_mlen);
 	sock_ipc_from_sock_to_tty(ctlsock);
 	return (0);
@@ -133,7 +133,7 @@ network_destroy(int ctlsock, struct network_config *nc)
 	}
 	arg.p_mlen = vec->vec_marshalled_len;
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
-	sock_ipc_must_write(ctlsock, &arg, sizeof(arg));
+	sock_ipc_send_generic_command(ctlsock, gcfg.c_proto, &arg);
 	sock_ipc_must_write(ctlsock, payload, arg.p_mlen);
 	sock_ipc_from_sock_to_tty(ctlsock);
 	return (0);
@@ -181,7 +181,7 @@ network_create(int ctlsock, struct network_config *nc)
 	}
 	arg.p_mlen = vec->vec_marshalled_len;
 	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
-	sock_ipc_must_write(ctlsock, &arg, sizeof(arg));
+	sock_ipc_send_generic_command(ctlsock, gcfg.c_proto, &arg);
 	sock_ipc_must_write(ctlsock, payload, arg.p_mlen);
 	sock_ipc_from_sock_to_tty(ctlsock);
 	return (0);
@@ -40,7 +40,10 @@
 #include <string.h>
 #include <err.h>
 
+#include <cblock/libcblock.h>
+
 #include "main.h"
+#include "sock_ipc.h"
 
 int
 sock_ipc_connect_inet(struct global_params *gc)
@@ -85,3 +88,50 @@ sock_ipc_connect_unix(struct global_params *gc)
 	}
 	return (sock);
 }
+
+static int
+sock_ipc_open(struct global_params *gc)
+{
+
+	if (gc->c_host) {
+		return (sock_ipc_connect_inet(gc));
+	}
+	return (sock_ipc_connect_unix(gc));
+}
+
+/*
+ * Connect to the daemon and negotiate the protocol version. Daemons which
+ * pre-date the hello message will drop the connection when they see it,
+ * in which case we re-connect and fall back to the legacy protocol.
+ */
+int
+sock_ipc_connect(struct global_params *gc)
+{
+	struct cblock_hello hello;
+	uint32_t cmd;
+	int sock;
+
+	sock = sock_ipc_open(gc);
+	cmd = PRISON_IPC_HELLO;
+	hello.h_magic = CBLOCK_PROTO_MAGIC;
+	hello.h_version = CBLOCK_PROTO_VERSION;
+	hello.h_caps = CBLOCK_CAPS;
+	if (gc->c_host == NULL) {
+		hello.h_caps &= ~CBLOCK_CAP_CONSOLE_DEFLATE;
+	} else {
+		hello.h_caps &= ~(CBLOCK_CAP_CONSOLE_SHM |
+		    CBLOCK_CAP_CONSOLE_HANDOFF);
+	}
+	sock_ipc_must_write(sock, &cmd, sizeof(cmd));
+	sock_ipc_must_write(sock, &hello, sizeof(hello));
+	if (sock_ipc_may_read(sock, &hello, sizeof(hello)) == 0 &&
+	    hello.h_magic == CBLOCK_PROTO_MAGIC) {
+		gc->c_proto = hello.h_version;
+		gc->c_caps = hello.h_caps;
+		return (sock);
+	}
+	(void) close(sock);
+	gc->c_proto = CBLOCK_PROTO_LEGACY;
+	gc->c_caps = 0;
+	return (sock_ipc_open(gc));
+}
@@ -0,0 +1,117 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <string.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+
+#include "main.h"
+
+static struct option stats_options[] = {
+	{ "help",		no_argument, 0, 'h' },
+	{ 0, 0, 0, 0 }
+};
+
+static void
+stats_usage(void)
+{
+	(void) fprintf(stderr,
+	    " -h, --help                  Print help\n");
+	exit(1);
+}
+
+/*
+ * Statistics arrive as a series of TLV messages holding name/value pairs.
+ * The final message carries TLV_COUNT with the total number of pairs.
+ */
+static void
+stats_get(int ctlsock)
+{
+	u_char buf[TLV_MSG_MAX], *val;
+	char name[256];
+	struct tlv_iter ti;
+	uint16_t type;
+	uint32_t cmd;
+	size_t len, mlen;
+	int done;
+
+	cmd = PRISON_IPC_GET_STATS;
+	sock_ipc_must_write(ctlsock, &cmd, sizeof(cmd));
+	done = 0;
+	name[0] = '\0';
+	while (!done) {
+		if (tlv_msg_read(ctlsock, buf, sizeof(buf), &mlen) != 1) {
+			errx(1, "failed to read statistics from daemon");
+		}
+		tlv_iter_init(&ti, buf, mlen);
+		while (tlv_next(&ti, &type, (const u_char **)&val, &len) == 1) {
+			switch (type) {
+			case TLV_STAT_NAME:
+				tlv_get_str(val, len, name, sizeof(name));
+				break;
+			case TLV_STAT_VALUE:
+				printf("%-32s %" PRIu64 "\n", name,
+				    tlv_get_u64(val, len));
+				break;
+			case TLV_COUNT:
+				done = 1;
+				break;
+			}
+		}
+	}
+}
+
+int
+stats_main(int argc, char *argv [], int ctlsock)
+{
+	int option_index, c;
+
+	reset_getopt_state();
+	while (1) {
+		option_index = 0;
+		c = getopt_long(argc, argv, "h", stats_options,
+		    &option_index);
+		if (c == -1) {
+			break;
+		}
+		switch (c) {
+		case 'h':
+		default:
+			stats_usage();
+			/* NOT REACHED */
+		}
+	}
+	stats_get(ctlsock);
+	return (0);
+}
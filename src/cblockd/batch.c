@@ -0,0 +1,308 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <err.h>
+
+#include "batch.h"
+
+void
+batch_init(struct batch *ba, size_t size, uint64_t delay)
+{
+
+	bzero(ba, sizeof(*ba));
+	ba->ba_size = size;
+	ba->ba_delay = delay;
+}
+
+void
+batch_free(struct batch *ba)
+{
+
+	free(ba->ba_data);
+	ba->ba_data = NULL;
+	ba->ba_len = 0;
+	ba->ba_alloc = 0;
+}
+
+uint64_t
+batch_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+/*
+ * Offer len bytes of output, seen at time now, to the batch. Returns
+ * BATCH_SEND if the output was not held and should be sent as is,
+ * BATCH_HELD if it was, and BATCH_FULL if it was and the batch should be
+ * sent now. A batch can exceed ba_size by at most the last output added to
+ * it. The buffer is only allocated once output starts being held, so
+ * consoles which are mostly idle never have one.
+ */
+int
+batch_add(struct batch *ba, const u_char *buf, size_t len, uint64_t now)
+{
+	size_t alloc;
+	int idle;
+	void *p;
+
+	idle = now - ba->ba_last >= ba->ba_delay;
+	ba->ba_last = now;
+	if (ba->ba_size == 0 || (ba->ba_len == 0 && idle)) {
+		return (BATCH_SEND);
+	}
+	if (ba->ba_len + len > ba->ba_alloc) {
+		alloc = ba->ba_len + len;
+		if (alloc < ba->ba_size) {
+			alloc = ba->ba_size;
+		}
+		p = realloc(ba->ba_data, alloc);
+		if (p == NULL) {
+			err(1, "realloc(console batch) failed");
+		}
+		ba->ba_data = p;
+		ba->ba_alloc = alloc;
+	}
+	if (ba->ba_len == 0) {
+		ba->ba_deadline = now + ba->ba_delay;
+	}
+	memcpy(ba->ba_data + ba->ba_len, buf, len);
+	ba->ba_len += len;
+	if (ba->ba_len >= ba->ba_size || now >= ba->ba_deadline) {
+		return (BATCH_FULL);
+	}
+	return (BATCH_HELD);
+}
+
+/*
+ * The batch has been sent.
+ */
+void
+batch_clear(struct batch *ba)
+{
+
+	ba->ba_len = 0;
+}
+
+#ifdef __BENCH_BATCH_CODE__
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "outq.h"
+#include "poller.h"
+
+/*
+ * A producer writes console output into a socket pair standing in for the
+ * pty, one write(2) per line. The other end is serviced the way the tty I/O
+ * loop does it and framed out to a console peer, which a thread drains.
+ * Reports the send calls made per MB of output with and without batching,
+ * and how long key strokes typed after a quiet spell take to arrive.
+ *
+ * cc -O2 -D__BENCH_BATCH_CODE__ batch.c outq.c poller.c -lpthread
+ */
+#define	BENCH_LINES		200000
+#define	BENCH_KEYS		200
+#define	BENCH_KEY_GAP		5000	/* usecs */
+
+static size_t bench_line_len;
+static int bench_keys;
+static volatile uint64_t bench_key_sent;
+static uint64_t bench_key_delay;
+
+static void *
+bench_produce(void *arg)
+{
+	char line[256];
+	int fd, k;
+
+	fd = *(int *)arg;
+	memset(line, 'x', sizeof(line));
+	line[bench_line_len - 1] = '\n';
+	for (k = 0; k < (bench_keys ? BENCH_KEYS : BENCH_LINES); k++) {
+		if (bench_keys) {
+			usleep(BENCH_KEY_GAP);
+			bench_key_sent = batch_now();
+			(void) write(fd, "k", 1);
+			continue;
+		}
+		(void) write(fd, line, bench_line_len);
+	}
+	(void) shutdown(fd, SHUT_WR);
+	return (NULL);
+}
+
+static void *
+bench_drain(void *arg)
+{
+	u_char buf[65536];
+	int fd;
+
+	fd = *(int *)arg;
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		if (bench_keys) {
+			bench_key_delay += batch_now() - bench_key_sent;
+		}
+	}
+	return (NULL);
+}
+
+static void
+bench_send(struct outq *oq, int sock, u_char *buf, size_t len)
+{
+	u_char hdr[sizeof(uint32_t) + sizeof(size_t)];
+	struct iovec iov[2];
+
+	memset(hdr, 0, sizeof(uint32_t));
+	memcpy(hdr + sizeof(uint32_t), &len, sizeof(len));
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	if (!TAILQ_EMPTY(&oq->oq_head)) {
+		(void) outq_flush(oq, sock);
+	}
+	(void) outq_send(oq, sock, iov, 2);
+}
+
+static void
+bench_run(size_t size, uint64_t delay, size_t line_len, int keys)
+{
+	struct poller_event ev[1];
+	int pty[2], peer[2], timeout;
+	struct timespec start, end;
+	pthread_t prod, drain;
+	u_char buf[8192];
+	struct poller *pp;
+	struct batch ba;
+	struct outq oq;
+	uint64_t now, reads;
+	double ns, mb;
+	ssize_t cc;
+
+	bench_line_len = line_len;
+	bench_keys = keys;
+	bench_key_delay = 0;
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, pty) == -1 ||
+	    socketpair(PF_UNIX, SOCK_STREAM, 0, peer) == -1) {
+		err(1, "socketpair");
+	}
+	batch_init(&ba, size, delay);
+	outq_init(&oq, SIZE_MAX);
+	pp = poller_create();
+	if (poller_add(pp, pty[0], NULL, 0) == -1) {
+		err(1, "poller_add");
+	}
+	if (pthread_create(&prod, NULL, bench_produce, &pty[1]) != 0 ||
+	    pthread_create(&drain, NULL, bench_drain, &peer[1]) != 0) {
+		errx(1, "pthread_create failed");
+	}
+	reads = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	while (1) {
+		timeout = -1;
+		if (ba.ba_len != 0) {
+			now = batch_now();
+			timeout = ba.ba_deadline > now ?
+			    ba.ba_deadline - now : 0;
+		}
+		if (poller_wait(pp, ev, 1, timeout) == 0) {
+			bench_send(&oq, peer[0], ba.ba_data, ba.ba_len);
+			batch_clear(&ba);
+			continue;
+		}
+		cc = read(pty[0], buf, sizeof(buf));
+		if (cc <= 0) {
+			break;
+		}
+		reads++;
+		switch (batch_add(&ba, buf, cc, batch_now())) {
+		case BATCH_SEND:
+			bench_send(&oq, peer[0], buf, cc);
+			break;
+		case BATCH_FULL:
+			bench_send(&oq, peer[0], ba.ba_data, ba.ba_len);
+			batch_clear(&ba);
+			break;
+		}
+	}
+	if (ba.ba_len != 0) {
+		bench_send(&oq, peer[0], ba.ba_data, ba.ba_len);
+	}
+	(void) outq_drain(&oq, peer[0], -1);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	(void) shutdown(peer[0], SHUT_WR);
+	(void) pthread_join(prod, NULL);
+	(void) pthread_join(drain, NULL);
+	ns = (end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec);
+	mb = oq.oq_written / (1024.0 * 1024.0);
+	if (keys) {
+		printf("keys      batch %6zu/%5juus %8ju sends %8.1f us/key\n",
+		    size, (uintmax_t)delay, (uintmax_t)oq.oq_writes,
+		    (double)bench_key_delay / BENCH_KEYS);
+	} else {
+		printf("%3zu B/line batch %6zu/%5juus %8ju reads %8ju sends "
+		    "%8.0f sends/MB %7.1f ms cpu/MB\n", line_len, size,
+		    (uintmax_t)delay, (uintmax_t)reads,
+		    (uintmax_t)oq.oq_writes, oq.oq_writes / mb,
+		    ns / 1e6 / mb);
+	}
+	batch_free(&ba);
+	close(pp->p_fd);
+	free(pp);
+	close(pty[0]);
+	close(pty[1]);
+	close(peer[0]);
+	close(peer[1]);
+}
+
+int
+main(int argc, char *argv [])
+{
+	static const size_t line_lens[] = { 20, 80, 200 };
+	int k;
+
+	for (k = 0; k < 3; k++) {
+		bench_run(0, 0, line_lens[k], 0);
+		bench_run(32768, 1000, line_lens[k], 0);
+	}
+	bench_run(0, 0, 0, 1);
+	bench_run(32768, 1000, 0, 1);
+	return (0);
+}
+#endif	/* __BENCH_BATCH_CODE__ */
@@ -0,0 +1,57 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef BATCH_DOT_H_
+#define	BATCH_DOT_H_
+
+/*
+ * Coalesces console output into fewer, larger frames. Output which follows
+ * a quiet spell (an echoed key stroke, a prompt) is not held at all. Once
+ * output keeps coming it is held until ba_size bytes have built up or
+ * ba_delay microseconds have passed since the first of them was held,
+ * whichever comes first.
+ */
+struct batch {
+	u_char		*ba_data;
+	size_t		 ba_len;
+	size_t		 ba_alloc;
+	size_t		 ba_size;	/* 0 disables batching */
+	uint64_t	 ba_delay;	/* usecs */
+	uint64_t	 ba_deadline;	/* flush by then, if ba_len != 0 */
+	uint64_t	 ba_last;	/* when output was last seen */
+};
+
+#define	BATCH_SEND	0	/* not held, send it now */
+#define	BATCH_HELD	1
+#define	BATCH_FULL	2	/* held, send the batch now */
+
+void		batch_init(struct batch *, size_t, uint64_t);
+void		batch_free(struct batch *);
+int		batch_add(struct batch *, const u_char *, size_t, uint64_t);
+void		batch_clear(struct batch *);
+uint64_t	batch_now(void);
+
+#endif	/* BATCH_DOT_H_ */
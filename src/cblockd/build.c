@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -48,11 +49,18 @@
 #include <string.h>
 
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "dispatch.h"
 #include "cblock.h"
+#include "registry.h"
 #include "sock_ipc.h"
 #include "config.h"
+#include "conlog.h"
 #include "probes.h"
 
 #include <cblock/libcblock.h>
@@ -626,21 +634,20 @@ dispatch_build_set_outfile(struct build_context *bcp,
 }
 
 int
-dispatch_build_recieve(int sock)
+dispatch_build_recieve(struct cblock_peer *p)
 {
-	extern cblock_instance_head_t pr_head;
-	extern pthread_mutex_t cblock_mutex;
+	extern pthread_rwlock_t cblock_lock;
 	struct cblock_instance *pi;
 
 	struct cblock_response resp;
 	struct build_context bctx;
 	char *build_type;
-	ssize_t cc;
-	int fd;
+	int fd, sock;
 
+	sock = p->p_sock;
 	bzero(&bctx, sizeof(bctx));
-	cc = sock_ipc_must_read(sock, &bctx.pbc, sizeof(bctx.pbc));
-	if (cc == 0) {
+	bzero(&resp, sizeof(resp));
+	if (sock_ipc_recv_build_context(sock, p->p_proto, &bctx.pbc) != 1) {
 		printf("didn't get proper build context headers\n");
 		return (0);
 	}
@@ -649,21 +656,21 @@ dispatch_build_recieve(int sock)
 	    bctx.pbc.p_nsteps > MAX_BUILD_STEPS) {
 		resp.p_ecode = -1;
 		sprintf(resp.p_errbuf, "too many build stages/steps\n");
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
 	bctx.stages = calloc(bctx.pbc.p_nstages, sizeof(*bctx.stages));
 	if (bctx.stages == NULL) {
 		resp.p_ecode = -1;
 		sprintf(resp.p_errbuf, "out of memory");
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
 	bctx.steps = calloc(bctx.pbc.p_nsteps, sizeof(*bctx.steps));
 	if (bctx.steps == NULL) {
 		resp.p_ecode = -1;
 		sprintf(resp.p_errbuf, "out of memory");
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
 	sock_ipc_must_read(sock, bctx.stages,
@@ -678,7 +685,7 @@ dispatch_build_recieve(int sock)
 		free(bctx.steps);
 		free(bctx.stages);
 		resp.p_ecode = -1;
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
         }
 	if (sock_ipc_from_to(sock, fd, bctx.pbc.p_context_size) == -1) {
@@ -689,30 +696,40 @@ dispatch_build_recieve(int sock)
 		return (1);
 	}
 	close(fd);
-	pi = calloc(1, sizeof(*pi));
-	if (pi == NULL) {
-		err(1, "calloc failed");
-	}
-	pi->p_type = PRISON_TYPE_BUILD;
+	pi = cblock_instance_alloc(PRISON_TYPE_BUILD);
 	pi->p_instance_tag = strdup(bctx.instance); /* NB: check free */
+	pi->p_log = conlog_open(pi->p_instance_tag);
 	strlcpy(pi->p_image_name, bctx.pbc.p_image_name, sizeof(pi->p_image_name));
 	pi->p_launch_time = time(NULL);
 	pi->p_pid = forkpty(&pi->p_ttyfd, pi->p_ttyname, NULL, NULL);
 	if (pi->p_pid == -1) {
 		warn("failed to fork build job");
+		cblock_instance_rele(pi);
+		resp.p_ecode = -1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "failed to fork build job");
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
 	if (pi->p_pid > 0) {
 		CBLOCKD_CBLOCK_CREATE(pi->p_instance_tag);
-		TAILQ_INIT(&pi->p_ttybuf.t_head);
 		cblock_create_pid_file(pi);
-		pi->p_ttybuf.t_tot_len = 0;
-		pthread_mutex_lock(&cblock_mutex);
-		TAILQ_INSERT_HEAD(&pr_head, pi, p_glue);
-		pthread_mutex_unlock(&cblock_mutex);
+		pthread_rwlock_wrlock(&cblock_lock);
+		if (tty_io_watch_exit(pi) == -1) {
+			pthread_rwlock_unlock(&cblock_lock);
+			cblock_abort(pi);
+			resp.p_ecode = -1;
+			snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+			    "failed to watch build job");
+			sock_ipc_send_response(sock, p->p_proto, &resp);
+			return (1);
+		}
+		registry_insert(pi);
+		(void) tty_io_register(pi);
+		pthread_rwlock_unlock(&cblock_lock);
 		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
 		    pi->p_instance_tag);
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
 	/*
@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -50,22 +51,46 @@
 
 #include <openssl/sha.h>
 
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "cblock.h"
+#include "registry.h"
+#include "conlog.h"
 #include "config.h"
+#include "vt.h"
+#include "stats.h"
 
 #include "probes.h"
 
-#include <cblock/libcblock.h>
-
-static int reap_children;
 cblock_peer_head_t p_head;
-cblock_instance_head_t pr_head;
 pthread_mutex_t peer_mutex;
-pthread_mutex_t cblock_mutex;
+struct worker_pool dispatch_pool;
+struct worker_pool control_pool;
+struct worker_pool console_pool;
+struct worker_pool cleanup_pool;
+
+/*
+ * Instance teardown counters. Latency is measured from the moment the
+ * instance is reaped until it is unlinked from the registry, so it includes
+ * the time spent waiting for a cleanup thread.
+ */
+static struct {
+	pthread_mutex_t		 cs_mutex;
+	uint64_t		 cs_cleanups;
+	uint64_t		 cs_failed;	/* cleanup handlers failed */
+	uint64_t		 cs_usecs;
+	uint64_t		 cs_usecs_max;
+} cleanup_stats = { PTHREAD_MUTEX_INITIALIZER };
 
 int
 cblock_create_pid_file(struct cblock_instance *p)
@@ -94,84 +119,11 @@ cblock_create_pid_file(struct cblock_instance *p)
 	return (0);
 }
 
-size_t
-cblock_instance_get_count(void)
-{
-	struct cblock_instance *p;
-	size_t count;
-
-	if (TAILQ_EMPTY(&pr_head)) {
-		return (0);
-	}
-	count = 0;
-	pthread_mutex_lock(&cblock_mutex);
-	TAILQ_FOREACH(p, &pr_head, p_glue) {
-		count++;
-	}
-	pthread_mutex_unlock(&cblock_mutex);
-	return (count);
-}
-
-struct instance_ent *
-cblock_populate_instance_entries(size_t max_ents)
-{
-	struct instance_ent *vec, *cur;
-	struct cblock_instance *p;
-	int counter;
-
-	vec = calloc(max_ents, sizeof(*vec));
-	if (vec == NULL) {
-		return (NULL);
-	}
-	counter = 0;
-	pthread_mutex_lock(&cblock_mutex);
-	TAILQ_FOREACH(p, &pr_head, p_glue) {
-		cur = &vec[counter];
-		strlcpy(cur->p_instance_name, p->p_instance_tag,
-		    sizeof(cur->p_instance_name));
-		strlcpy(cur->p_image_name, p->p_image_name,
-		    sizeof(cur->p_image_name));
-		cur->p_pid = p->p_pid;
-		strlcpy(cur->p_tty_line, p->p_ttyname,
-		    sizeof(cur->p_tty_line));
-		cur->p_start_time = p->p_launch_time;
-		if (counter == max_ents) {
-			break;
-		}
-		switch (p->p_type) {
-		case PRISON_TYPE_BUILD:
-			(void) snprintf(cur->p_type, sizeof(cur->p_type),
-			    "building");
-			break;
-		case PRISON_TYPE_REGULAR:
-			(void) snprintf(cur->p_type, sizeof(cur->p_type),
-			    "assembled");
-			break;
-		default:
-			assert(0);
-		}
-		counter++;
-	}
-	pthread_mutex_unlock(&cblock_mutex);
-	return (vec);
-}
-
+/*
+ * Run the cleanup handlers for an instance, returning their exit status, or
+ * -1 if they could not be started.
+ */
 int
-cblock_instance_match(char *full_instance_name, const char *user_supplied)
-{
-	size_t slen;
-
-	slen = strlen(user_supplied);
-	if (slen == 10) {
-		if (strncmp(full_instance_name, user_supplied, 10) == 0) {
-			return (1);
-		}
-		return (0);
-	}
-	return (strcmp(full_instance_name, user_supplied) == 0);
-}
-
-void
 cblock_fork_cleanup(char *instance, char *type, int dup_sock, int verbose)
 {
 	extern struct global_params gcfg;
@@ -181,7 +133,8 @@ cblock_fork_cleanup(char *instance, char *type, int dup_sock, int verbose)
 
         pid_t pid = fork();
         if (pid == -1) {
-                err(1, "cblock_remove: failed to execute cleanup handlers");
+                warn("cblock_remove: failed to execute cleanup handlers");
+		return (-1);
         }
         if (pid == 0) {
 		vec_env = vec_init(8);
@@ -211,34 +164,100 @@ cblock_fork_cleanup(char *instance, char *type, int dup_sock, int verbose)
 	}
 	waitpid_ignore_intr(pid, &status);
 	CBLOCKD_CBLOCK_CLEANUP(instance, status, type);
+	return (status);
 }
 
-void
-cblock_remove(struct cblock_instance *pi)
+struct cblock_instance *
+cblock_instance_alloc(int type)
 {
 	extern struct global_params gcfg;
-	char *instance_type;
-	uint32_t cmd;
-	size_t cur;
+	struct cblock_instance *pi;
 
+	pi = calloc(1, sizeof(*pi));
+	if (pi == NULL) {
+		err(1, "calloc failed");
+	}
+	pi->p_type = type;
+	pi->p_ttyfd = -1;
+	pi->p_procfd = -1;
+	pthread_mutex_init(&pi->p_mtx, NULL);
 	/*
-	 * Tell the remote side to dis-connect.
-	 *
-	 * NB: we are holding a lock here. We need to re-factor this a bit
-	 * so we aren't performing socket io while this lock is held.
+	 * The initial reference belongs to the registry (pr_head) and is
+	 * dropped by cblock_remove().
 	 */
-	if ((pi->p_state & STATE_CONNECTED) != 0) {
-		cmd = PRISON_IPC_CONSOLE_SESSION_DONE;
-		sock_ipc_must_write(pi->p_peer_sock, &cmd, sizeof(cmd));
-		/*
-		 * If this is a cellblock build, the peer will be waiting for
-		 * ultimate status code of the build job, so send it.
-		 */
-		if (pi->p_type == PRISON_TYPE_BUILD) {
-			sock_ipc_must_write(pi->p_peer_sock, &pi->p_status,
-			    sizeof(pi->p_status));
-		}
+	pi->p_refcount = 1;
+	TAILQ_INIT(&pi->p_peers);
+	termbuf_init(&pi->p_ttybuf, &pi->p_mtx);
+	batch_init(&pi->p_batch, gcfg.c_console_batch,
+	    gcfg.c_console_delay);
+	sched_ent_init(&pi->p_sched, pi);
+	ratelimit_init(&pi->p_limit, 0, 0, 0);
+	/*
+	 * The pty starts out without a size, the model takes the default
+	 * one until a console tells it otherwise.
+	 */
+	if (gcfg.c_console_screen) {
+		pi->p_vt = vt_create(0, 0);
+	}
+	return (pi);
+}
+
+void
+cblock_instance_hold(struct cblock_instance *pi)
+{
+
+	pthread_mutex_lock(&pi->p_mtx);
+	assert(pi->p_refcount > 0);
+	pi->p_refcount++;
+	pthread_mutex_unlock(&pi->p_mtx);
+}
+
+void
+cblock_instance_rele(struct cblock_instance *pi)
+{
+	u_int refs;
+
+	pthread_mutex_lock(&pi->p_mtx);
+	assert(pi->p_refcount > 0);
+	refs = --pi->p_refcount;
+	pthread_mutex_unlock(&pi->p_mtx);
+	if (refs > 0) {
+		return;
+	}
+	/*
+	 * The pty is kept open until the last reference is gone, so console
+	 * sessions which are still winding down never write to a descriptor
+	 * which has been closed (and possibly re-used).
+	 */
+	assert(pi->p_ttyfd != 0);
+	if (pi->p_ttyfd != -1) {
+		(void) close(pi->p_ttyfd);
+	}
+	assert(TAILQ_EMPTY(&pi->p_peers));
+	termbuf_free(&pi->p_ttybuf);
+	batch_free(&pi->p_batch);
+	if (pi->p_vt != NULL) {
+		vt_destroy(pi->p_vt);
+	}
+	if (pi->p_log != NULL) {
+		conlog_close(pi->p_log);
 	}
+	pthread_mutex_destroy(&pi->p_mtx);
+	free(pi->p_instance_tag);
+	free(pi);
+}
+
+/*
+ * Run the cleanup handlers of an instance which has exited and remove its
+ * pid file, returning the handlers' exit status.
+ */
+static int
+cblock_cleanup(struct cblock_instance *pi)
+{
+	extern struct global_params gcfg;
+	char *instance_type;
+	int status;
+
 	switch (pi->p_type) {
 	case PRISON_TYPE_BUILD:
 		instance_type = "build";
@@ -250,119 +269,224 @@ cblock_remove(struct cblock_instance *pi)
 		assert(0);
 	}
 	CBLOCKD_CBLOCK_DESTROY(pi->p_instance_tag, pi->p_status);
-	cblock_fork_cleanup(pi->p_instance_tag, instance_type, -1, gcfg.c_verbose);
-	assert(pi->p_ttyfd != 0);
-	(void) close(pi->p_ttyfd);
-	TAILQ_REMOVE(&pr_head, pi, p_glue);
-	cur = pi->p_ttybuf.t_tot_len;
-	while (cur > 0) {
-		cur = termbuf_remove_oldest(&pi->p_ttybuf);
-	}
+	status = cblock_fork_cleanup(pi->p_instance_tag, instance_type, -1,
+	    gcfg.c_verbose);
 	assert(pi->p_pid_file != 0);
 	close(pi->p_pid_file);
 	if (unlink(pi->p_pid_file_path) == -1) {
 		warn("unable to remove pidfile");
 	}
 	free(pi->p_pid_file_path);
-	free(pi);
+	pi->p_pid_file_path = NULL;
+	return (status);
 }
 
+/*
+ * Tear down an instance which has been reaped. This runs on the cleanup
+ * pool, so the handlers of several instances run at once (as many as there
+ * are cleanup threads) and neither the tty I/O loop nor the registry lock
+ * waits for them. The instance is listed as terminating until they have
+ * completed, and only then unlinked.
+ */
 void
-cblock_detach_console(const char *instance)
+cblock_remove(struct cblock_instance *pi)
 {
-	struct cblock_instance *pi;
+	extern pthread_rwlock_t cblock_lock;
+	uint64_t usecs;
+	int status;
 
-	pthread_mutex_lock(&cblock_mutex);
-	TAILQ_FOREACH(pi, &pr_head, p_glue) {
-		if (!cblock_instance_match(pi->p_instance_tag, instance)) {
-			continue;
-		}
-		pi->p_state &= ~STATE_CONNECTED;
-		pi->p_peer_sock = -1;
-		pthread_mutex_unlock(&cblock_mutex);
-		CBLOCKD_CBLOCK_CONSOLE_DETACH(pi->p_instance_tag);
-		return;
+	status = cblock_cleanup(pi);
+	pthread_rwlock_wrlock(&cblock_lock);
+	registry_unlink(pi);
+	pthread_rwlock_unlock(&cblock_lock);
+	usecs = batch_now() - pi->p_reaped;
+	pthread_mutex_lock(&cleanup_stats.cs_mutex);
+	cleanup_stats.cs_cleanups++;
+	if (status != 0) {
+		cleanup_stats.cs_failed++;
 	}
-	pthread_mutex_unlock(&cblock_mutex);
-	/*
-	 * If we are here, the process was non-interactive (build job) and
-	 * has completed already.
-	 */
+	cleanup_stats.cs_usecs += usecs;
+	if (usecs > cleanup_stats.cs_usecs_max) {
+		cleanup_stats.cs_usecs_max = usecs;
+	}
+	pthread_mutex_unlock(&cleanup_stats.cs_mutex);
+	cblock_instance_rele(pi);
 }
 
+/*
+ * Kill an instance which has been forked but could not be set up: if its
+ * exit can not be watched for, nothing would ever reap it. The instance has
+ * not been inserted in the registry, or its pty registered with the tty I/O
+ * loop, so it is waited for and torn down here.
+ */
 void
-cblock_reap_children(void)
+cblock_abort(struct cblock_instance *pi)
 {
-	struct cblock_instance *pi, *p_temp;
 	int status;
-	pid_t pid;
 
-	pthread_mutex_lock(&cblock_mutex);
-	TAILQ_FOREACH_SAFE(pi, &pr_head, p_glue, p_temp) {
-		pid = waitpid(pi->p_pid, &status, WNOHANG);
-		if (pid != pi->p_pid) {
-			continue;
+	/*
+	 * forkpty() made the child a session (and process group) leader,
+	 * so this takes anything it has started with it.
+	 */
+	(void) kill(-pi->p_pid, SIGKILL);
+	while (waitpid(pi->p_pid, &status, 0) == -1) {
+		if (errno != EINTR) {
+			warn("%s: waitpid failed", pi->p_instance_tag);
+			status = 0;
+			break;
 		}
-		pi->p_state |= STATE_DEAD;
-		pi->p_status = status;
-		cblock_remove(pi);
 	}
-	pthread_mutex_unlock(&cblock_mutex);
-	reap_children = 0;
+	pi->p_status = status;
+	(void) cblock_cleanup(pi);
+	cblock_instance_rele(pi);
 }
 
-int
-cblock_instance_is_dead(const char *instance)
+static void
+cblock_cleanup_work(void *arg)
+{
+
+	cblock_remove(arg);
+}
+
+void
+cblock_cleanup_stats(struct stats_ctx *ctx)
+{
+	uint64_t cleanups, failed, usecs, usecs_max;
+
+	pthread_mutex_lock(&cleanup_stats.cs_mutex);
+	cleanups = cleanup_stats.cs_cleanups;
+	failed = cleanup_stats.cs_failed;
+	usecs = cleanup_stats.cs_usecs;
+	usecs_max = cleanup_stats.cs_usecs_max;
+	pthread_mutex_unlock(&cleanup_stats.cs_mutex);
+	stats_put(ctx, "cleanup.completed", cleanups);
+	stats_put(ctx, "cleanup.failed", failed);
+	stats_put(ctx, "cleanup.latency_usecs_total", usecs);
+	stats_put(ctx, "cleanup.latency_usecs_max", usecs_max);
+}
+
+void
+cblock_detach_console(struct console_peer *cp)
 {
 	struct cblock_instance *pi;
-	int isdead;
 
-	isdead = 0;
-	pthread_mutex_lock(&cblock_mutex);
-	TAILQ_FOREACH(pi, &pr_head, p_glue) {
-		if (!cblock_instance_match(pi->p_instance_tag, instance)) {
-			continue;
-		}
-		isdead = ((pi->p_state & STATE_DEAD) != 0);
-		pthread_mutex_unlock(&cblock_mutex);
-		return (isdead);
-        }
-        pthread_mutex_unlock(&cblock_mutex);
+	pi = cp->cp_inst;
+	pthread_mutex_lock(&pi->p_mtx);
+	tty_io_detach(cp);
+	pthread_mutex_unlock(&pi->p_mtx);
+	CBLOCKD_CBLOCK_CONSOLE_DETACH(pi->p_instance_tag);
+}
+
+/*
+ * Reap the instance whose process has exited, which the tty I/O loop has
+ * been told about by the poller. Console peers are told the session is
+ * over right away, and the instance is listed as terminating until the
+ * rest of its teardown, which the caller hands to cblock_teardown(), has
+ * finished. Exits of processes which are not instances (they are waited
+ * for by whoever started them) are ignored, and NULL returned.
+ */
+struct cblock_instance *
+cblock_reap(pid_t pid)
+{
+	extern pthread_rwlock_t cblock_lock;
+	struct cblock_instance *pi;
+	int status;
+
+	pthread_rwlock_wrlock(&cblock_lock);
+	pi = registry_find_pid(pid);
+	if (pi == NULL || waitpid(pid, &status, WNOHANG) != pid) {
+		pthread_rwlock_unlock(&cblock_lock);
+		return (NULL);
+	}
+	pthread_mutex_lock(&pi->p_mtx);
+	pi->p_state |= STATE_DEAD;
+	pi->p_status = status;
+	pthread_mutex_unlock(&pi->p_mtx);
+	registry_reaped(pi);
+	pthread_rwlock_unlock(&cblock_lock);
+	pi->p_reaped = batch_now();
+	if (pi->p_procfd != -1) {
+		(void) close(pi->p_procfd);
+		pi->p_procfd = -1;
+	}
+	tty_io_unregister(pi);
+	pthread_mutex_lock(&pi->p_mtx);
+	tty_io_session_done(pi);
+	pthread_mutex_unlock(&pi->p_mtx);
+	return (pi);
+}
+
+/*
+ * Queue the teardown of a reaped instance for the cleanup pool, which
+ * drops the registry's reference once it is done. The caller must not use
+ * the instance after this.
+ */
+void
+cblock_teardown(struct cblock_instance *pi)
+{
+
 	/*
-	 * The console was non-interactive (i.e.: a build job) and it is
-	 * complete and the process(s) have been reaped. We might want
-	 * to assert that this is the case some place.
+	 * The cleanup queue is not bounded (the number of cleanup threads
+	 * is), so this does not fail.
 	 */
-        return (1);
+	pi->p_cleanup.w_fn = cblock_cleanup_work;
+	pi->p_cleanup.w_arg = pi;
+	(void) worker_pool_enqueue(&cleanup_pool, &pi->p_cleanup);
 }
 
+int
+cblock_instance_is_dead(struct cblock_instance *pi)
+{
+	int isdead;
+
+	pthread_mutex_lock(&pi->p_mtx);
+	isdead = ((pi->p_state & STATE_DEAD) != 0);
+	pthread_mutex_unlock(&pi->p_mtx);
+	return (isdead);
+}
+
+/*
+ * Look up an instance by (possibly abbreviated) name. On success the
+ * instance is returned with a reference held, which the caller must drop
+ * with cblock_instance_rele(). Instances which are terminating are not
+ * found.
+ */
 struct cblock_instance *
 cblock_lookup_instance(const char *instance)
 {
+	extern pthread_rwlock_t cblock_lock;
 	struct cblock_instance *pi;
 
-	TAILQ_FOREACH(pi, &pr_head, p_glue) {
-		if (!cblock_instance_match(pi->p_instance_tag, instance)) {
-			continue;
-		}
-		return (pi);
+	pthread_rwlock_rdlock(&cblock_lock);
+	pi = registry_find(instance);
+	if (pi != NULL && pi->p_terminating) {
+		pi = NULL;
 	}
-	return (NULL);
+	if (pi != NULL) {
+		cblock_instance_hold(pi);
+	}
+	pthread_rwlock_unlock(&cblock_lock);
+	return (pi);
 }
 
+/*
+ * Register the newly accepted peer and hand it to the event loop. Commands
+ * are serviced by dispatch_peer_ready() once the socket becomes readable.
+ */
 void *
 cblock_handle_request(void *arg)
 {
 	struct cblock_peer *p;
 
 	p = (struct cblock_peer *)arg;
-	pthread_attr_init(&p->p_detached);
-	pthread_attr_setdetachstate(&p->p_detached, PTHREAD_CREATE_DETACHED);
+	p->p_work.w_fn = dispatch_work;
+	p->p_work.w_arg = p;
 	pthread_mutex_lock(&peer_mutex);
 	TAILQ_INSERT_HEAD(&p_head, p, p_glue);
 	pthread_mutex_unlock(&peer_mutex);
-	if (pthread_create(&p->p_thr, &p->p_detached, dispatch_work, arg) != 0) {
-		err(1, "pthread_create(dispatch_work) failed");
+	if (sock_ipc_rearm(p) == -1) {
+		warn("failed to register peer %d", p->p_sock);
+		dispatch_peer_close(p);
 	}
 	return (NULL);
 }
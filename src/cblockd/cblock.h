@@ -2,18 +2,21 @@
 #define CBLOCK_DOT_H_
 
 int		cblock_create_pid_file(struct cblock_instance *);
-size_t		cblock_instance_get_count(void);
-struct instance_ent *
-		cblock_populate_instance_entries(size_t);
-int		cblock_instance_match(char *, const char *);
-void		cblock_fork_cleanup(char *, char *, int, int);
+int		cblock_fork_cleanup(char *, char *, int, int);
 void		cblock_remove(struct cblock_instance *);
-void		cblock_detach_console(const char *);
-void		cblock_reap_children(void);
-int		cblock_instance_is_dead(const char *);
+void		cblock_abort(struct cblock_instance *);
+void		cblock_detach_console(struct console_peer *);
+struct cblock_instance *
+		cblock_reap(pid_t);
+void		cblock_teardown(struct cblock_instance *);
+void		cblock_cleanup_stats(struct stats_ctx *);
+int		cblock_instance_is_dead(struct cblock_instance *);
+struct cblock_instance *
+		cblock_instance_alloc(int);
+void		cblock_instance_hold(struct cblock_instance *);
+void		cblock_instance_rele(struct cblock_instance *);
 struct cblock_instance *
 		cblock_lookup_instance(const char *);
 void *		cblock_handle_request(void *);
-void *		cblock_handle_request(void *);
 
 #endif	/* CBLOCK_DOT_H_ */
@@ -0,0 +1,706 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/ioctl.h>
+#include <sys/ttycom.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <termios.h>
+#include <errno.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+
+#include "conin.h"
+
+void
+conin_init(struct conin *ci)
+{
+
+	bzero(ci, sizeof(*ci));
+	ci->ci_buf = malloc(CONIN_BUF_SIZE);
+	if (ci->ci_buf == NULL) {
+		err(1, "malloc(console input) failed");
+	}
+}
+
+void
+conin_free(struct conin *ci)
+{
+
+	free(ci->ci_buf);
+	ci->ci_buf = NULL;
+}
+
+/*
+ * Parse the next event out of the receive buffer. CONIN_DATA events point
+ * into the buffer, and remain valid until more input is read into it.
+ */
+int
+conin_next(struct conin *ci, struct conin_event *ev)
+{
+	struct cblock_console_frame cf;
+	const u_char *payload;
+	int32_t sig;
+	size_t avail, n;
+
+	for (;;) {
+		avail = ci->ci_tail - ci->ci_head;
+		if (ci->ci_left > 0) {
+			if (avail == 0) {
+				return (CONIN_MORE);
+			}
+			n = avail < ci->ci_left ? avail : ci->ci_left;
+			ev->ce_data = ci->ci_buf + ci->ci_head;
+			ev->ce_len = n;
+			ci->ci_head += n;
+			ci->ci_left -= n;
+			if (ci->ci_cmd == PRISON_IPC_CONSOLE_DATA) {
+				return (CONIN_DATA);
+			}
+			if (ci->ci_cmd == PRISON_IPC_CONSOLE_TEE) {
+				return (CONIN_TEE);
+			}
+			continue;
+		}
+		if (avail < sizeof(cf)) {
+			return (CONIN_MORE);
+		}
+		memcpy(&cf, ci->ci_buf + ci->ci_head, sizeof(cf));
+		payload = ci->ci_buf + ci->ci_head + sizeof(cf);
+		switch (cf.cf_cmd) {
+		case PRISON_IPC_CONSOL_RESIZE:
+			if (cf.cf_len != sizeof(ev->ce_winsize)) {
+				return (CONIN_ERROR);
+			}
+			if (avail < sizeof(cf) + cf.cf_len) {
+				return (CONIN_MORE);
+			}
+			memcpy(&ev->ce_winsize, payload, cf.cf_len);
+			ci->ci_head += sizeof(cf) + cf.cf_len;
+			return (CONIN_RESIZE);
+		case PRISON_IPC_CONSOLE_SIGNAL:
+			if (cf.cf_len != sizeof(sig)) {
+				return (CONIN_ERROR);
+			}
+			if (avail < sizeof(cf) + cf.cf_len) {
+				return (CONIN_MORE);
+			}
+			memcpy(&sig, payload, cf.cf_len);
+			if (sig <= 0 || sig >= NSIG) {
+				return (CONIN_ERROR);
+			}
+			ev->ce_signal = sig;
+			ci->ci_head += sizeof(cf) + cf.cf_len;
+			return (CONIN_SIGNAL);
+		default:
+			/*
+			 * Terminal input and output, or a frame we do not
+			 * understand and skip, is streamed out of the buffer.
+			 */
+			ci->ci_cmd = cf.cf_cmd;
+			ci->ci_left = cf.cf_len;
+			ci->ci_head += sizeof(cf);
+			break;
+		}
+	}
+}
+
+static int
+conin_write(struct conin *ci, int ttyfd, struct iovec *iov, int iovcnt)
+{
+	ssize_t cc;
+
+	while (iovcnt > 0) {
+		cc = writev(ttyfd, iov, iovcnt);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc == -1) {
+			return (-1);
+		}
+		ci->ci_writes++;
+		ci->ci_bytes += cc;
+		while (iovcnt > 0 && (size_t)cc >= iov->iov_len) {
+			cc -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+		if (iovcnt > 0) {
+			iov->iov_base = (u_char *)iov->iov_base + cc;
+			iov->iov_len -= cc;
+		}
+	}
+	return (0);
+}
+
+/*
+ * Read whatever console input is available from sock and apply it to the
+ * pty: the terminal input which arrived with it is written with a single
+ * writev(2) (control frames aside), so large pastes reach the pty in
+ * batches of up to CONIN_BUF_SIZE. If discard is set the input is parsed
+ * but not applied. Returns 1 if input was handled, 0 on EOF and -1 on
+ * error.
+ */
+int
+conin_pump(struct conin *ci, int sock, int ttyfd, int discard)
+{
+	struct iovec iov[CONIN_MAX_IOV];
+	struct conin_event ev;
+	int iovcnt, ret;
+	ssize_t cc;
+
+	/*
+	 * Anything left over is part of a control frame header or payload,
+	 * so this never moves more than a few bytes.
+	 */
+	if (ci->ci_head > 0) {
+		memmove(ci->ci_buf, ci->ci_buf + ci->ci_head,
+		    ci->ci_tail - ci->ci_head);
+		ci->ci_tail -= ci->ci_head;
+		ci->ci_head = 0;
+	}
+	cc = read(sock, ci->ci_buf + ci->ci_tail,
+	    CONIN_BUF_SIZE - ci->ci_tail);
+	if (cc == -1 && errno == EINTR) {
+		return (1);
+	}
+	if (cc == -1) {
+		warn("console input: read failed");
+		return (-1);
+	}
+	if (cc == 0) {
+		return (0);
+	}
+	ci->ci_tail += cc;
+	iovcnt = 0;
+	while ((ret = conin_next(ci, &ev)) != CONIN_MORE) {
+		if (ret == CONIN_ERROR) {
+			warnx("console input: invalid frame");
+			return (-1);
+		}
+		if (discard) {
+			continue;
+		}
+		if (ret == CONIN_DATA) {
+			iov[iovcnt].iov_base = (void *)ev.ce_data;
+			iov[iovcnt].iov_len = ev.ce_len;
+			if (++iovcnt < CONIN_MAX_IOV) {
+				continue;
+			}
+		}
+		/*
+		 * Terminal input which preceded a control frame has to reach
+		 * the pty first.
+		 */
+		if (conin_write(ci, ttyfd, iov, iovcnt) == -1) {
+			warn("console input: write to pty failed");
+			return (-1);
+		}
+		iovcnt = 0;
+		switch (ret) {
+		case CONIN_RESIZE:
+			if (ci->ci_resize != NULL) {
+				ci->ci_resize(ci->ci_arg, &ev.ce_winsize);
+			}
+			if (ioctl(ttyfd, TIOCSWINSZ, &ev.ce_winsize) == -1) {
+				warn("console input: ioctl(TIOCSWINSZ)");
+				return (-1);
+			}
+			break;
+		case CONIN_SIGNAL:
+			if (ioctl(ttyfd, TIOCSIG, ev.ce_signal) == -1) {
+				warn("console input: ioctl(TIOCSIG)");
+				return (-1);
+			}
+			break;
+		case CONIN_TEE:
+			if (ci->ci_tee != NULL) {
+				ci->ci_tee(ci->ci_arg, ev.ce_data, ev.ce_len);
+			}
+			break;
+		}
+	}
+	if (conin_write(ci, ttyfd, iov, iovcnt) == -1) {
+		warn("console input: write to pty failed");
+		return (-1);
+	}
+	return (1);
+}
+
+#ifdef __TEST_CONIN_CODE__
+#include <sys/socket.h>
+#include <pthread.h>
+#include <libutil.h>
+#include <time.h>
+
+/*
+ * Paste 50MB of terminal input through the console input path into a pty,
+ * with resize and unknown frames mixed in, and the framed stream written
+ * to the socket in random sized pieces so frames are split and merged.
+ * The slave side of the pty is drained and checked byte for byte.
+ *
+ * cc -O2 -D__TEST_CONIN_CODE__ -I../include conin.c -lpthread -lutil
+ */
+#define	TEST_PASTE_SIZE		(50 * 1024 * 1024)
+#define	TEST_PATTERN_SIZE	(1024 * 1024)
+
+static u_char *test_pattern;
+static u_char *test_stream;
+static size_t test_stream_len;
+static uint64_t test_sum;
+
+static uint64_t
+test_hash(uint64_t h, const u_char *buf, size_t len)
+{
+	size_t k;
+
+	for (k = 0; k < len; k++) {
+		h = h * 31 + buf[k];
+	}
+	return (h);
+}
+
+static void
+test_frame(uint32_t cmd, const void *payload, uint32_t len)
+{
+	struct cblock_console_frame cf;
+
+	cf.cf_cmd = cmd;
+	cf.cf_len = len;
+	memcpy(test_stream + test_stream_len, &cf, sizeof(cf));
+	memcpy(test_stream + test_stream_len + sizeof(cf), payload, len);
+	test_stream_len += sizeof(cf) + len;
+}
+
+/*
+ * Build the framed paste. Returns the last window size sent.
+ */
+static struct winsize
+test_build(void)
+{
+	struct winsize ws;
+	size_t off, n, next_resize;
+
+	test_stream = malloc(TEST_PASTE_SIZE * 2);
+	if (test_stream == NULL) {
+		err(1, "malloc");
+	}
+	bzero(&ws, sizeof(ws));
+	next_resize = 0;
+	for (off = 0; off < TEST_PASTE_SIZE; off += n) {
+		if (off >= next_resize) {
+			ws.ws_row = 24 + random() % 100;
+			ws.ws_col = 80 + random() % 100;
+			test_frame(PRISON_IPC_CONSOL_RESIZE, &ws, sizeof(ws));
+			test_frame(0xdead, "ignored", 7);
+			next_resize += 1024 * 1024;
+		}
+		n = 1 + random() % 8192;
+		if (n > TEST_PASTE_SIZE - off) {
+			n = TEST_PASTE_SIZE - off;
+		}
+		if ((off % TEST_PATTERN_SIZE) + n > TEST_PATTERN_SIZE) {
+			n = TEST_PATTERN_SIZE - off % TEST_PATTERN_SIZE;
+		}
+		test_frame(PRISON_IPC_CONSOLE_DATA,
+		    test_pattern + off % TEST_PATTERN_SIZE, n);
+		test_sum = test_hash(test_sum,
+		    test_pattern + off % TEST_PATTERN_SIZE, n);
+	}
+	return (ws);
+}
+
+static void *
+test_send(void *arg)
+{
+	size_t off, n;
+	ssize_t cc;
+	int sock;
+
+	sock = *(int *)arg;
+	for (off = 0; off < test_stream_len; off += cc) {
+		n = 1 + random() % 100000;
+		if (n > test_stream_len - off) {
+			n = test_stream_len - off;
+		}
+		cc = write(sock, test_stream + off, n);
+		if (cc == -1) {
+			err(1, "write(socket)");
+		}
+	}
+	(void) shutdown(sock, SHUT_WR);
+	return (NULL);
+}
+
+static void *
+test_drain(void *arg)
+{
+	u_char buf[65536];
+	uint64_t *sum;
+	size_t total;
+	ssize_t cc;
+	int fd;
+
+	fd = *(int *)arg;
+	sum = malloc(sizeof(*sum));
+	*sum = 0;
+	for (total = 0; total < TEST_PASTE_SIZE; total += cc) {
+		cc = read(fd, buf, sizeof(buf));
+		if (cc <= 0) {
+			err(1, "read(pty slave)");
+		}
+		*sum = test_hash(*sum, buf, cc);
+	}
+	return (sum);
+}
+
+/*
+ * Feed a small stream through the parser one byte at a time.
+ */
+static void
+test_split(void)
+{
+	struct conin_event ev;
+	struct winsize ws;
+	struct conin ci;
+	char data[8];
+	size_t k, n;
+	int32_t sig;
+	int ret;
+
+	conin_init(&ci);
+	test_stream = malloc(256);
+	test_stream_len = 0;
+	ws.ws_row = 50;
+	ws.ws_col = 132;
+	sig = SIGINT;
+	test_frame(PRISON_IPC_CONSOLE_DATA, "abc", 3);
+	test_frame(PRISON_IPC_CONSOLE_SIGNAL, &sig, sizeof(sig));
+	test_frame(PRISON_IPC_CONSOL_RESIZE, &ws, sizeof(ws));
+	test_frame(PRISON_IPC_CONSOLE_DATA, "defg", 4);
+	n = 0;
+	for (k = 0; k < test_stream_len; k++) {
+		ci.ci_buf[ci.ci_tail++] = test_stream[k];
+		while ((ret = conin_next(&ci, &ev)) != CONIN_MORE) {
+			switch (ret) {
+			case CONIN_DATA:
+				memcpy(data + n, ev.ce_data, ev.ce_len);
+				n += ev.ce_len;
+				break;
+			case CONIN_SIGNAL:
+				if (n != 3 || ev.ce_signal != SIGINT) {
+					errx(1, "signal out of order");
+				}
+				break;
+			case CONIN_RESIZE:
+				if (ev.ce_winsize.ws_col != 132) {
+					errx(1, "bad window size");
+				}
+				break;
+			default:
+				errx(1, "parse error");
+			}
+		}
+	}
+	if (n != 7 || memcmp(data, "abcdefg", 7) != 0) {
+		errx(1, "split stream mismatch");
+	}
+	sig = 0;
+	test_stream_len = 0;
+	test_frame(PRISON_IPC_CONSOLE_SIGNAL, &sig, sizeof(sig));
+	memcpy(ci.ci_buf, test_stream, test_stream_len);
+	ci.ci_head = 0;
+	ci.ci_tail = test_stream_len;
+	if (conin_next(&ci, &ev) != CONIN_ERROR) {
+		errx(1, "invalid signal accepted");
+	}
+	free(test_stream);
+	conin_free(&ci);
+}
+
+int
+main(int argc, char *argv [])
+{
+	int master, slave, sv[2], ret;
+	struct winsize ws, last;
+	struct timespec start, end;
+	struct termios tios;
+	pthread_t snd, drn;
+	struct conin ci;
+	uint64_t *sum;
+	double secs;
+	size_t k;
+
+	test_split();
+	test_pattern = malloc(TEST_PATTERN_SIZE);
+	if (test_pattern == NULL) {
+		err(1, "malloc");
+	}
+	for (k = 0; k < TEST_PATTERN_SIZE; k++) {
+		test_pattern[k] = random();
+	}
+	last = test_build();
+	if (openpty(&master, &slave, NULL, NULL, NULL) == -1) {
+		err(1, "openpty");
+	}
+	if (tcgetattr(slave, &tios) == -1) {
+		err(1, "tcgetattr");
+	}
+	cfmakeraw(&tios);
+	if (tcsetattr(slave, TCSANOW, &tios) == -1) {
+		err(1, "tcsetattr");
+	}
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		err(1, "socketpair");
+	}
+	conin_init(&ci);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (pthread_create(&snd, NULL, test_send, &sv[1]) != 0 ||
+	    pthread_create(&drn, NULL, test_drain, &slave) != 0) {
+		errx(1, "pthread_create failed");
+	}
+	while ((ret = conin_pump(&ci, sv[0], master, 0)) == 1) {
+		;
+	}
+	if (ret == -1) {
+		errx(1, "conin_pump failed");
+	}
+	(void) pthread_join(snd, NULL);
+	(void) pthread_join(drn, (void **)&sum);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = (end.tv_sec - start.tv_sec) +
+	    (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (*sum != test_sum || ci.ci_bytes != TEST_PASTE_SIZE) {
+		errx(1, "pasted data does not match");
+	}
+	if (ioctl(slave, TIOCGWINSZ, &ws) == -1) {
+		err(1, "ioctl(TIOCGWINSZ)");
+	}
+	if (ws.ws_row != last.ws_row || ws.ws_col != last.ws_col) {
+		errx(1, "window size not applied");
+	}
+	printf("pasted %d MB in %.2f s (%.1f MB/s), %ju pty writes, "
+	    "%.0f bytes per write\n", TEST_PASTE_SIZE / (1024 * 1024), secs,
+	    TEST_PASTE_SIZE / (1024 * 1024) / secs, (uintmax_t)ci.ci_writes,
+	    (double)ci.ci_bytes / ci.ci_writes);
+	return (0);
+}
+#endif	/* __TEST_CONIN_CODE__ */
+
+#ifdef __BENCH_ECHO_CODE__
+#include <sys/socket.h>
+#include <pthread.h>
+#include <libutil.h>
+#include <time.h>
+
+/*
+ * Key stroke echo latency, with the console relayed by the daemon and with
+ * the pty handed to the client. The pty echoes input itself (ECHO, raw
+ * mode), so what is measured is the path from the client writing a key to
+ * it reading the echo back. The relay is the same as the daemon's: input
+ * frames go through conin_pump() and output is read from the pty and sent
+ * over the socket as a console message.
+ *
+ * cc -O2 -D__BENCH_ECHO_CODE__ -I../include conin.c -lpthread -lutil
+ */
+#define	BENCH_KEYS	20000
+
+static int bench_master, bench_relay;
+
+static uint64_t
+bench_usec(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000);
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	uint64_t x, y;
+
+	x = *(const uint64_t *)a;
+	y = *(const uint64_t *)b;
+	return (x < y ? -1 : x > y);
+}
+
+static void
+bench_report(const char *name, uint64_t *lat)
+{
+
+	qsort(lat, BENCH_KEYS, sizeof(*lat), bench_cmp);
+	printf("%-8s p50 %4ju us  p99 %4ju us  max %5ju us\n", name,
+	    (uintmax_t)lat[BENCH_KEYS / 2],
+	    (uintmax_t)lat[BENCH_KEYS * 99 / 100],
+	    (uintmax_t)lat[BENCH_KEYS - 1]);
+}
+
+/* what the application on the slave side reads is thrown away */
+static void *
+bench_slave(void *arg)
+{
+	char buf[512];
+	int fd;
+
+	fd = *(int *)arg;
+	while (read(fd, buf, sizeof(buf)) > 0)
+		;
+	return (NULL);
+}
+
+static void *
+bench_input(void *arg)
+{
+	struct conin ci;
+
+	conin_init(&ci);
+	while (conin_pump(&ci, bench_relay, bench_master, 0) == 1)
+		;
+	conin_free(&ci);
+	return (NULL);
+}
+
+static void *
+bench_output(void *arg)
+{
+	u_char buf[8192 + sizeof(uint32_t) + sizeof(size_t)];
+	uint32_t cmd;
+	size_t hlen;
+	ssize_t cc;
+
+	cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
+	hlen = sizeof(cmd) + sizeof(size_t);
+	while ((cc = read(bench_master, buf + hlen, 8192)) > 0) {
+		memcpy(buf, &cmd, sizeof(cmd));
+		memcpy(buf + sizeof(cmd), &cc, sizeof(size_t));
+		if (write(bench_relay, buf, hlen + cc) == -1) {
+			break;
+		}
+	}
+	return (NULL);
+}
+
+static void
+bench_read(int fd, void *buf, size_t len)
+{
+	ssize_t cc;
+
+	while (len > 0) {
+		cc = read(fd, buf, len);
+		if (cc <= 0) {
+			err(1, "read");
+		}
+		buf = (u_char *)buf + cc;
+		len -= cc;
+	}
+}
+
+int
+main(int argc, char *argv [])
+{
+	struct cblock_console_frame cf;
+	u_char frame[sizeof(cf) + 1];
+	u_char hdr[sizeof(uint32_t) + sizeof(size_t)];
+	pthread_t thr[3];
+	struct termios t;
+	uint64_t *lat, t0;
+	int slave, sv[2], k;
+	char key, echo;
+
+	if (openpty(&bench_master, &slave, NULL, NULL, NULL) == -1) {
+		err(1, "openpty");
+	}
+	if (tcgetattr(slave, &t) == -1) {
+		err(1, "tcgetattr");
+	}
+	cfmakeraw(&t);
+	t.c_lflag |= ECHO;
+	if (tcsetattr(slave, TCSANOW, &t) == -1) {
+		err(1, "tcsetattr");
+	}
+	lat = calloc(BENCH_KEYS, sizeof(*lat));
+	if (lat == NULL ||
+	    pthread_create(&thr[0], NULL, bench_slave, &slave) != 0) {
+		errx(1, "setup failed");
+	}
+	/*
+	 * Direct: the client has the pty.
+	 */
+	for (k = 0; k < BENCH_KEYS; k++) {
+		key = 'a' + k % 26;
+		t0 = bench_usec();
+		if (write(bench_master, &key, 1) != 1) {
+			err(1, "write(pty)");
+		}
+		bench_read(bench_master, &echo, 1);
+		lat[k] = bench_usec() - t0;
+		if (echo != key) {
+			errx(1, "unexpected echo");
+		}
+	}
+	bench_report("direct", lat);
+	/*
+	 * Relayed: key strokes and their echo go through the daemon.
+	 */
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		err(1, "socketpair");
+	}
+	bench_relay = sv[1];
+	if (pthread_create(&thr[1], NULL, bench_input, NULL) != 0 ||
+	    pthread_create(&thr[2], NULL, bench_output, NULL) != 0) {
+		errx(1, "pthread_create failed");
+	}
+	cf.cf_cmd = PRISON_IPC_CONSOLE_DATA;
+	cf.cf_len = 1;
+	memcpy(frame, &cf, sizeof(cf));
+	for (k = 0; k < BENCH_KEYS; k++) {
+		key = 'a' + k % 26;
+		frame[sizeof(cf)] = key;
+		t0 = bench_usec();
+		if (write(sv[0], frame, sizeof(frame)) != sizeof(frame)) {
+			err(1, "write(socket)");
+		}
+		bench_read(sv[0], hdr, sizeof(hdr));
+		bench_read(sv[0], &echo, 1);
+		lat[k] = bench_usec() - t0;
+		if (echo != key) {
+			errx(1, "unexpected echo");
+		}
+	}
+	bench_report("relayed", lat);
+	return (0);
+}
+#endif	/* __BENCH_ECHO_CODE__ */
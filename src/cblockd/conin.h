@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef CONIN_DOT_H_
+#define	CONIN_DOT_H_
+
+/*
+ * Incremental parser for framed console input (CBLOCK_CAP_CONSOLE_FRAMES).
+ * Frames may be split or merged arbitrarily by the socket. Terminal input
+ * is handed out as it arrives, straight from the receive buffer, without
+ * waiting for the rest of its frame; control frames are handed out once
+ * they are complete.
+ */
+#define	CONIN_BUF_SIZE		(64 * 1024)
+#define	CONIN_MAX_IOV		64
+
+#define	CONIN_MORE		0	/* need more input */
+#define	CONIN_DATA		1
+#define	CONIN_RESIZE		2
+#define	CONIN_SIGNAL		3
+#define	CONIN_TEE		4
+#define	CONIN_ERROR		-1
+
+struct conin_event {
+	const u_char		*ce_data;
+	size_t			 ce_len;
+	struct winsize		 ce_winsize;
+	int			 ce_signal;
+};
+
+struct conin {
+	u_char			*ci_buf;
+	size_t			 ci_head;	/* first unparsed byte */
+	size_t			 ci_tail;	/* end of received data */
+	uint32_t		 ci_cmd;	/* frame being streamed */
+	size_t			 ci_left;	/* of its payload */
+	uint64_t		 ci_bytes;	/* terminal input written */
+	uint64_t		 ci_writes;	/* writes to the pty */
+	/* called before the pty is resized, if set */
+	void			(*ci_resize)(void *, const struct winsize *);
+	/* console output read by a client with the pty, if set */
+	void			(*ci_tee)(void *, const u_char *, size_t);
+	void			*ci_arg;
+};
+
+void		conin_init(struct conin *);
+void		conin_free(struct conin *);
+int		conin_next(struct conin *, struct conin_event *);
+int		conin_pump(struct conin *, int, int, int);
+
+#endif	/* CONIN_DOT_H_ */
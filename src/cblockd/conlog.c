@@ -0,0 +1,586 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <zlib.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "stats.h"
+#include "conlog.h"
+
+/*
+ * Output which has not been written yet. A frame with no data asks the
+ * writer to close the log, since it is queued behind all of the log's
+ * output it is always the last frame which references it.
+ */
+struct conlog_frame {
+	TAILQ_ENTRY(conlog_frame)	 cf_glue;
+	struct conlog			*cf_log;
+	uint64_t			 cf_off;	/* stream offset */
+	size_t				 cf_len;
+	u_char				 cf_data[];
+};
+
+typedef TAILQ_HEAD( , conlog_frame) conlog_frame_head_t;
+
+struct conlog {
+	char			*cl_tag;
+	pthread_mutex_t		 cl_mutex;	/* protects cl_map to cl_base */
+	u_char			*cl_map;	/* active segment */
+	size_t			 cl_off;	/* bytes in active segment */
+	uint64_t		 cl_base;	/* stream offset of cl_map */
+	int			 cl_fd;
+	u_int			 cl_seq;
+	time_t			 cl_opened;
+	int			 cl_failed;
+	int			 cl_started;
+	TAILQ_ENTRY(conlog)	 cl_glue;
+};
+
+/*
+ * Everything below is only touched by the writer thread, with the
+ * exception of the queue and counters which are protected by cq_mutex.
+ */
+static struct conlog_queue {
+	pthread_mutex_t		 cq_mutex;
+	pthread_cond_t		 cq_cond;
+	conlog_frame_head_t	 cq_head;
+	size_t			 cq_bytes;
+	size_t			 cq_limit;
+	uint64_t		 cq_dropped;
+	uint64_t		 cq_written;
+	uint64_t		 cq_segments;
+	uint64_t		 cq_errors;
+	int			 cq_running;
+} conlog_queue = {
+	.cq_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.cq_cond = PTHREAD_COND_INITIALIZER,
+	.cq_head = TAILQ_HEAD_INITIALIZER(conlog_queue.cq_head),
+};
+
+static TAILQ_HEAD( , conlog) conlog_active =
+    TAILQ_HEAD_INITIALIZER(conlog_active);
+static char	*conlog_dir;
+static size_t	 conlog_seg_size;
+static time_t	 conlog_max_age;
+static u_int	 conlog_keep;
+
+/*
+ * Bytes of output we are willing to hold for the writer. If the disk can
+ * not keep up, output is dropped from the log rather than stalling the pty.
+ */
+#define	CONLOG_QUEUE_LIMIT	(8 * 1024 * 1024)
+
+static void
+conlog_counter_add(uint64_t *counter, uint64_t val)
+{
+
+	pthread_mutex_lock(&conlog_queue.cq_mutex);
+	*counter += val;
+	pthread_mutex_unlock(&conlog_queue.cq_mutex);
+}
+
+static void
+conlog_path(struct conlog *cl, u_int seq, const char *suffix, char *buf,
+    size_t len)
+{
+
+	(void) snprintf(buf, len, "%s/%s/console.%06u.log%s", conlog_dir,
+	    cl->cl_tag, seq, suffix);
+}
+
+/*
+ * Segments are numbered per instance. If the instance has logged before
+ * (e.g.: the daemon was restarted), carry on from the last segment.
+ */
+static int
+conlog_start(struct conlog *cl)
+{
+	struct dirent *de;
+	char path[1024];
+	u_int seq;
+	DIR *dirp;
+
+	(void) snprintf(path, sizeof(path), "%s/%s", conlog_dir, cl->cl_tag);
+	if (mkdir(path, 0700) == -1 && errno != EEXIST) {
+		warn("conlog: mkdir %s", path);
+		return (-1);
+	}
+	dirp = opendir(path);
+	if (dirp == NULL) {
+		warn("conlog: opendir %s", path);
+		return (-1);
+	}
+	cl->cl_seq = 0;
+	while ((de = readdir(dirp)) != NULL) {
+		if (sscanf(de->d_name, "console.%u.log", &seq) != 1) {
+			continue;
+		}
+		if (seq >= cl->cl_seq) {
+			cl->cl_seq = seq + 1;
+		}
+	}
+	(void) closedir(dirp);
+	cl->cl_started = 1;
+	TAILQ_INSERT_TAIL(&conlog_active, cl, cl_glue);
+	return (0);
+}
+
+/*
+ * Create a new active segment, starting at stream offset off. The file is
+ * sized up front and mapped, so appending is a memcpy and readers can see
+ * the tail without a system call.
+ */
+static int
+conlog_segment_open(struct conlog *cl, uint64_t off)
+{
+	char path[1024];
+	u_char *map;
+	int fd;
+
+	if (!cl->cl_started && conlog_start(cl) == -1) {
+		return (-1);
+	}
+	conlog_path(cl, cl->cl_seq, "", path, sizeof(path));
+	fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		warn("conlog: open %s", path);
+		return (-1);
+	}
+	if (ftruncate(fd, conlog_seg_size) == -1) {
+		warn("conlog: ftruncate %s", path);
+		(void) close(fd);
+		return (-1);
+	}
+	map = mmap(NULL, conlog_seg_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+	    fd, 0);
+	if (map == MAP_FAILED) {
+		warn("conlog: mmap %s", path);
+		(void) close(fd);
+		return (-1);
+	}
+	pthread_mutex_lock(&cl->cl_mutex);
+	cl->cl_map = map;
+	cl->cl_off = 0;
+	cl->cl_base = off;
+	pthread_mutex_unlock(&cl->cl_mutex);
+	cl->cl_fd = fd;
+	cl->cl_opened = time(NULL);
+	return (0);
+}
+
+/*
+ * Write a closed segment out compressed. The data is taken straight from
+ * the mapping, which is still in place. Returns -1 if the compressed copy
+ * could not be written, in which case the raw segment is left behind.
+ */
+static int
+conlog_compress(struct conlog *cl, u_int seq)
+{
+	char path[1024];
+	size_t off, n;
+	gzFile gz;
+	int fd;
+
+	conlog_path(cl, seq, ".gz", path, sizeof(path));
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (fd == -1) {
+		warn("conlog: open %s", path);
+		return (-1);
+	}
+	gz = gzdopen(fd, "wb6");
+	if (gz == NULL) {
+		warnx("conlog: gzdopen %s failed", path);
+		(void) close(fd);
+		(void) unlink(path);
+		return (-1);
+	}
+	for (off = 0; off < cl->cl_off; off += n) {
+		n = cl->cl_off - off;
+		if (n > 65536) {
+			n = 65536;
+		}
+		if (gzwrite(gz, cl->cl_map + off, n) != (int)n) {
+			warnx("conlog: gzwrite %s failed", path);
+			(void) gzclose(gz);
+			(void) unlink(path);
+			return (-1);
+		}
+	}
+	if (gzclose(gz) != Z_OK) {
+		warnx("conlog: gzclose %s failed", path);
+		(void) unlink(path);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Close the active segment: compress it, trim the raw file back to what
+ * was written if compression failed, and expire segments beyond the
+ * retention limit.
+ */
+static void
+conlog_segment_close(struct conlog *cl)
+{
+	char path[1024];
+	u_char *map;
+	int ret;
+
+	ret = -1;
+	if (cl->cl_off > 0) {
+		ret = conlog_compress(cl, cl->cl_seq);
+		if (ret == -1) {
+			conlog_counter_add(&conlog_queue.cq_errors, 1);
+		}
+	}
+	pthread_mutex_lock(&cl->cl_mutex);
+	map = cl->cl_map;
+	cl->cl_map = NULL;
+	pthread_mutex_unlock(&cl->cl_mutex);
+	(void) munmap(map, conlog_seg_size);
+	conlog_path(cl, cl->cl_seq, "", path, sizeof(path));
+	if (ret == 0 || cl->cl_off == 0) {
+		(void) unlink(path);
+	} else if (ftruncate(cl->cl_fd, cl->cl_off) == -1) {
+		warn("conlog: ftruncate %s", path);
+	}
+	(void) close(cl->cl_fd);
+	cl->cl_fd = -1;
+	if (cl->cl_off > 0) {
+		conlog_counter_add(&conlog_queue.cq_segments, 1);
+		if (conlog_keep > 0 && cl->cl_seq >= conlog_keep) {
+			conlog_path(cl, cl->cl_seq - conlog_keep, ".gz", path,
+			    sizeof(path));
+			(void) unlink(path);
+		}
+		cl->cl_seq++;
+	}
+	cl->cl_off = 0;
+}
+
+/*
+ * Append output at stream offset off. A segment only ever holds output
+ * which is contiguous in the stream, so that it can be read back by offset:
+ * if output has been dropped since the last write, a new one is started.
+ */
+static void
+conlog_write(struct conlog *cl, uint64_t off, const u_char *bytes,
+    size_t len)
+{
+	size_t n;
+
+	if (cl->cl_map != NULL && off != cl->cl_base + cl->cl_off) {
+		conlog_segment_close(cl);
+	}
+	while (len > 0) {
+		if (cl->cl_failed) {
+			conlog_counter_add(&conlog_queue.cq_dropped, len);
+			return;
+		}
+		if (cl->cl_map == NULL && conlog_segment_open(cl, off) == -1) {
+			conlog_counter_add(&conlog_queue.cq_errors, 1);
+			cl->cl_failed = 1;
+			continue;
+		}
+		n = conlog_seg_size - cl->cl_off;
+		if (n > len) {
+			n = len;
+		}
+		pthread_mutex_lock(&cl->cl_mutex);
+		memcpy(cl->cl_map + cl->cl_off, bytes, n);
+		cl->cl_off += n;
+		pthread_mutex_unlock(&cl->cl_mutex);
+		conlog_counter_add(&conlog_queue.cq_written, n);
+		bytes += n;
+		off += n;
+		len -= n;
+		if (cl->cl_off == conlog_seg_size) {
+			conlog_segment_close(cl);
+		}
+	}
+}
+
+static void
+conlog_finish(struct conlog *cl)
+{
+
+	if (cl->cl_map != NULL) {
+		conlog_segment_close(cl);
+	}
+	if (cl->cl_started) {
+		TAILQ_REMOVE(&conlog_active, cl, cl_glue);
+	}
+	pthread_mutex_destroy(&cl->cl_mutex);
+	free(cl->cl_tag);
+	free(cl);
+}
+
+/*
+ * Rotate segments which have been open for longer than the age limit, so
+ * an instance which logs slowly still has its output compressed and
+ * expired eventually.
+ */
+static void
+conlog_rotate_aged(void)
+{
+	struct conlog *cl;
+	time_t now;
+
+	if (conlog_max_age == 0) {
+		return;
+	}
+	now = time(NULL);
+	TAILQ_FOREACH(cl, &conlog_active, cl_glue) {
+		if (cl->cl_map == NULL || cl->cl_off == 0) {
+			continue;
+		}
+		if (now - cl->cl_opened >= conlog_max_age) {
+			conlog_segment_close(cl);
+		}
+	}
+}
+
+static void *
+conlog_writer(void *arg)
+{
+	struct conlog_frame *cf, *cf_temp;
+	conlog_frame_head_t batch;
+	struct timespec ts;
+	size_t bytes;
+
+	TAILQ_INIT(&batch);
+	for (;;) {
+		pthread_mutex_lock(&conlog_queue.cq_mutex);
+		if (TAILQ_EMPTY(&conlog_queue.cq_head)) {
+			clock_gettime(CLOCK_REALTIME, &ts);
+			ts.tv_sec += 1;
+			(void) pthread_cond_timedwait(&conlog_queue.cq_cond,
+			    &conlog_queue.cq_mutex, &ts);
+		}
+		TAILQ_CONCAT(&batch, &conlog_queue.cq_head, cf_glue);
+		pthread_mutex_unlock(&conlog_queue.cq_mutex);
+		bytes = 0;
+		TAILQ_FOREACH_SAFE(cf, &batch, cf_glue, cf_temp) {
+			TAILQ_REMOVE(&batch, cf, cf_glue);
+			if (cf->cf_len == 0) {
+				conlog_finish(cf->cf_log);
+			} else {
+				conlog_write(cf->cf_log, cf->cf_off,
+				    cf->cf_data, cf->cf_len);
+				bytes += cf->cf_len;
+			}
+			free(cf);
+		}
+		/*
+		 * The queue limit covers the batch we have been working on
+		 * as well, so release its bytes only once it is written.
+		 */
+		pthread_mutex_lock(&conlog_queue.cq_mutex);
+		conlog_queue.cq_bytes -= bytes;
+		pthread_mutex_unlock(&conlog_queue.cq_mutex);
+		conlog_rotate_aged();
+	}
+	/* NOT REACHED */
+	return (NULL);
+}
+
+/*
+ * Start the writer. Logs are stored under dir, segments are closed once
+ * they reach seg_size bytes or have been open for max_age seconds, and
+ * keep compressed segments are retained per instance (0 keeps all).
+ */
+void
+conlog_init(const char *dir, size_t seg_size, time_t max_age, u_int keep)
+{
+	pthread_t thr;
+
+	conlog_dir = strdup(dir);
+	if (conlog_dir == NULL) {
+		err(1, "strdup failed");
+	}
+	conlog_seg_size = seg_size;
+	conlog_max_age = max_age;
+	conlog_keep = keep;
+	conlog_queue.cq_limit = CONLOG_QUEUE_LIMIT;
+	if (pthread_create(&thr, NULL, conlog_writer, NULL) != 0) {
+		err(1, "pthread_create(conlog_writer)");
+	}
+	conlog_queue.cq_running = 1;
+}
+
+/*
+ * Returns NULL if console logging is not enabled.
+ */
+struct conlog *
+conlog_open(const char *tag)
+{
+	struct conlog *cl;
+
+	if (!conlog_queue.cq_running) {
+		return (NULL);
+	}
+	cl = calloc(1, sizeof(*cl));
+	if (cl == NULL) {
+		err(1, "calloc(conlog) failed");
+	}
+	cl->cl_tag = strdup(tag);
+	if (cl->cl_tag == NULL) {
+		err(1, "strdup failed");
+	}
+	cl->cl_fd = -1;
+	pthread_mutex_init(&cl->cl_mutex, NULL);
+	return (cl);
+}
+
+/*
+ * Queue output for the log. off is the offset of the output in the
+ * instance's console stream (the offsets the scrollback uses), by which it
+ * can be read back. This never blocks on the writer: if the queue is full
+ * the output is dropped from the log and counted.
+ */
+void
+conlog_append(struct conlog *cl, uint64_t off, const u_char *bytes,
+    size_t len)
+{
+	struct conlog_frame *cf;
+
+	pthread_mutex_lock(&conlog_queue.cq_mutex);
+	if (conlog_queue.cq_bytes + len > conlog_queue.cq_limit) {
+		conlog_queue.cq_dropped += len;
+		pthread_mutex_unlock(&conlog_queue.cq_mutex);
+		return;
+	}
+	conlog_queue.cq_bytes += len;
+	pthread_mutex_unlock(&conlog_queue.cq_mutex);
+	cf = malloc(sizeof(*cf) + len);
+	if (cf == NULL) {
+		err(1, "malloc(conlog frame) failed");
+	}
+	cf->cf_log = cl;
+	cf->cf_off = off;
+	cf->cf_len = len;
+	memcpy(cf->cf_data, bytes, len);
+	pthread_mutex_lock(&conlog_queue.cq_mutex);
+	TAILQ_INSERT_TAIL(&conlog_queue.cq_head, cf, cf_glue);
+	pthread_cond_signal(&conlog_queue.cq_cond);
+	pthread_mutex_unlock(&conlog_queue.cq_mutex);
+}
+
+/*
+ * Hand the log back to the writer, which flushes and compresses whatever
+ * is outstanding and frees it. The caller must not use cl afterwards.
+ */
+void
+conlog_close(struct conlog *cl)
+{
+	struct conlog_frame *cf;
+
+	cf = calloc(1, sizeof(*cf));
+	if (cf == NULL) {
+		err(1, "calloc(conlog frame) failed");
+	}
+	cf->cf_log = cl;
+	pthread_mutex_lock(&conlog_queue.cq_mutex);
+	TAILQ_INSERT_TAIL(&conlog_queue.cq_head, cf, cf_glue);
+	pthread_cond_signal(&conlog_queue.cq_cond);
+	pthread_mutex_unlock(&conlog_queue.cq_mutex);
+}
+
+/*
+ * Copy out the output logged at stream offsets from up to end, as far back
+ * as the active segment goes, straight out of its mapping. Output still
+ * queued for the writer is not included, so if the segment does not reach
+ * end (or begins at or after it) nothing is returned, rather than output
+ * with a gap before end. Otherwise returns a copy, which the caller must
+ * free, starting at stream offset end - *lenp.
+ */
+u_char *
+conlog_tail(struct conlog *cl, uint64_t from, uint64_t end, size_t *lenp)
+{
+	u_char *buf;
+	uint64_t start;
+	size_t n;
+
+	*lenp = 0;
+	buf = NULL;
+	pthread_mutex_lock(&cl->cl_mutex);
+	start = from > cl->cl_base ? from : cl->cl_base;
+	if (cl->cl_map != NULL && start < end &&
+	    cl->cl_base + cl->cl_off >= end) {
+		n = end - start;
+		buf = malloc(n);
+		if (buf == NULL) {
+			err(1, "malloc(conlog tail) failed");
+		}
+		memcpy(buf, cl->cl_map + (start - cl->cl_base), n);
+		*lenp = n;
+	}
+	pthread_mutex_unlock(&cl->cl_mutex);
+	return (buf);
+}
+
+void
+conlog_stats(struct stats_ctx *ctx)
+{
+	uint64_t written, dropped, segments, errors;
+	size_t bytes, limit;
+
+	if (!conlog_queue.cq_running) {
+		return;
+	}
+	pthread_mutex_lock(&conlog_queue.cq_mutex);
+	bytes = conlog_queue.cq_bytes;
+	limit = conlog_queue.cq_limit;
+	written = conlog_queue.cq_written;
+	dropped = conlog_queue.cq_dropped;
+	segments = conlog_queue.cq_segments;
+	errors = conlog_queue.cq_errors;
+	pthread_mutex_unlock(&conlog_queue.cq_mutex);
+	stats_put(ctx, "conlog.queue_bytes", bytes);
+	stats_put(ctx, "conlog.queue_limit", limit);
+	stats_put(ctx, "conlog.written_bytes", written);
+	stats_put(ctx, "conlog.dropped_bytes", dropped);
+	stats_put(ctx, "conlog.segments", segments);
+	stats_put(ctx, "conlog.errors", errors);
+}
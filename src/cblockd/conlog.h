@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef CONLOG_DOT_H_
+#define	CONLOG_DOT_H_
+
+/*
+ * Optional on-disk console log. Output read from an instance's pty is
+ * copied onto a queue and written out by a dedicated thread, so the pty
+ * read path never waits on the disk. Each instance gets a directory under
+ * <data dir>/logs holding a series of numbered segments: the active segment
+ * is memory-mapped and closed segments are gzip compressed. zlib is used
+ * rather than LZ4 or zstd since it is the compression library the base
+ * system ships for applications to link against; segments are compressed
+ * by the writer thread once closed, so its speed does not matter to the
+ * pty. Output is logged by its offset in the console stream, so a console
+ * which asks for more than the scrollback holds can be sent the rest out of
+ * the active segment.
+ */
+struct stats_ctx;
+struct conlog;
+
+void		 conlog_init(const char *, size_t, time_t, u_int);
+struct conlog	*conlog_open(const char *);
+void		 conlog_append(struct conlog *, uint64_t, const u_char *,
+		    size_t);
+void		 conlog_close(struct conlog *);
+u_char		*conlog_tail(struct conlog *, uint64_t, uint64_t, size_t *);
+void		 conlog_stats(struct stats_ctx *);
+
+#endif	/* CONLOG_DOT_H_ */
@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -50,192 +51,1980 @@
 
 #include <openssl/sha.h>
 
+#include <cblock/sbuf.h>
+
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "config.h"
 #include "cblock.h"
+#include "registry.h"
+#include "poller.h"
+#include "conlog.h"
+#include "vt.h"
+#include "scan.h"
+
+#include "probes.h"
+
+#include <cblock/libcblock.h>
+
+#include "mux.h"
+#include "stats.h"
+
+/*
+ * Most console peers (the writer and watchers) an instance may have.
+ */
+#define	TTY_MAX_CONSOLE_PEERS	64
+
+/*
+ * Instances with a console writer attached are given this many times the
+ * read quantum on each turn.
+ */
+#define	TTY_INTERACTIVE_WEIGHT	4
+
+/*
+ * A rate limited instance is left alone until it may read a worthwhile
+ * amount, but is looked at again at least this often so a limit which is
+ * raised at runtime takes effect promptly.
+ */
+#define	TTY_THROTTLE_MIN	RATELIMIT_MIN_BURST
+#define	TTY_THROTTLE_MAX_US	100000
+#define	TTY_BURST_MAX		(1024 * 1024 * 1024)
+
+/*
+ * Output shorter than this (typically echoed keystrokes) is sent to peers
+ * which negotiated compression as it is; compressing it would only add
+ * latency and the flush overhead.
+ */
+#define	TTY_DEFLATE_MIN		64
+
+/*
+ * The output queue of a console multiplexing connection may hold this many
+ * times as much as that of a console connection.
+ */
+#define	TTY_MUX_QUEUE_SCALE	16
+
+/*
+ * Size of the shared memory ring of an instance with local log subscribers
+ * reading it. A subscriber which falls further behind than this loses
+ * output.
+ */
+#define	TTY_SHM_RING_SIZE	(4 * 1024 * 1024)
+
+static struct poller *tty_poller;
+static struct poller *logs_poller;
+static struct sched tty_sched;
+
+/*
+ * Instances which are holding back console output. Only the tty I/O loop
+ * touches this list.
+ */
+static TAILQ_HEAD( , cblock_instance) batch_head =
+    TAILQ_HEAD_INITIALIZER(batch_head);
+
+/*
+ * Instances taken off the poller by their rate limit. Only the tty I/O
+ * loop touches this list.
+ */
+static TAILQ_HEAD( , cblock_instance) throttle_head =
+    TAILQ_HEAD_INITIALIZER(throttle_head);
+
+/*
+ * Console back pressure counters, cumulative across all instances.
+ */
+static struct {
+	pthread_mutex_t		 cs_mutex;
+	uint64_t		 cs_dropped;
+	uint64_t		 cs_disconnects;
+	uint64_t		 cs_pauses;
+	uint64_t		 cs_writes;	/* of detached peers */
+	uint64_t		 cs_written;
+	uint64_t		 cs_redraws;	/* screens sent on attach */
+	uint64_t		 cs_redraw_bytes;
+	uint64_t		 cs_throttles;
+	uint64_t		 cs_throttled;	/* of instances torn down */
+	uint64_t		 cs_deflate_in;	/* of peers detached */
+	uint64_t		 cs_deflate_out;
+	uint64_t		 cs_muxes;	/* connections, currently */
+	uint64_t		 cs_channels;	/* subscriptions, in total */
+	uint64_t		 cs_handoffs;
+	uint64_t		 cs_tee_bytes;
+} console_stats = { PTHREAD_MUTEX_INITIALIZER };
+
+static void	tty_io_batch_flush(struct cblock_instance *);
+static void	dispatch_console_backlog(struct console_peer *,
+		    struct cblock_console_connect *);
+
+void
+tty_io_queue_init(void)
+{
+	extern struct global_params gcfg;
+
+	sched_init(&tty_sched, gcfg.c_console_quantum,
+	    TTY_INTERACTIVE_WEIGHT);
+	tty_poller = poller_create();
+	logs_poller = poller_create();
+}
+
+/*
+ * Pty descriptors are registered once when the instance is created and
+ * removed when the instance is torn down, so the I/O loop never has to
+ * walk the instance list to figure out what to wait on.
+ */
+int
+tty_io_register(struct cblock_instance *pi)
+{
+
+	if (poller_add(tty_poller, pi->p_ttyfd, pi, 0) == -1) {
+		warn("%s: failed to register pty", pi->p_instance_tag);
+		return (-1);
+	}
+	return (0);
+}
+
+void
+tty_io_unregister(struct cblock_instance *pi)
+{
+
+	if (poller_del(tty_poller, pi->p_ttyfd, 0) == -1) {
+		warn("%s: failed to unregister pty", pi->p_instance_tag);
+	}
+}
+
+/*
+ * Have the I/O loop told when the instance's process exits, so that it is
+ * reaped right away rather than found by polling. Called with the registry
+ * write lock held, which the reaper needs to look the pid up, so the exit
+ * can not be handled before the instance is in the registry. There is no
+ * other way for an instance to be reaped, so if this fails the caller must
+ * not insert the instance, but kill it with cblock_abort().
+ */
+int
+tty_io_watch_exit(struct cblock_instance *pi)
+{
+
+	if (poller_add_proc(tty_poller, pi->p_pid, &pi->p_procfd) == -1) {
+		warn("%s: failed to watch pid %d", pi->p_instance_tag,
+		    pi->p_pid);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * The functions below manage the console peers attached to an instance and
+ * must be called with the instance lock held. Output is written to each
+ * peer with non-blocking sends; whatever a peer does not accept is held in
+ * its cp_outq, and the peer socket is registered for write readiness until
+ * the queue drains. Output which has to be queued for several peers is
+ * copied once and shared between their queues.
+ */
+static void
+tty_io_pause(struct cblock_instance *pi)
+{
+
+	if ((pi->p_state & STATE_PAUSED) != 0) {
+		return;
+	}
+	(void) poller_del(tty_poller, pi->p_ttyfd, 0);
+	pi->p_state |= STATE_PAUSED;
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_pauses++;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
+
+static void
+tty_io_resume(struct cblock_instance *pi)
+{
+
+	if ((pi->p_state & STATE_PAUSED) == 0) {
+		return;
+	}
+	pi->p_state &= ~STATE_PAUSED;
+	if ((pi->p_state &
+	    (STATE_DEAD | STATE_THROTTLED | STATE_DIRECT)) == 0) {
+		(void) tty_io_register(pi);
+	}
+}
+
+/*
+ * Attach a console peer. Returns NULL if a writer was asked for and the
+ * instance already has one, or if the instance has as many watchers as it
+ * may have.
+ */
+struct console_peer *
+tty_io_attach(struct cblock_instance *pi, int sock, int writer)
+{
+	extern struct global_params gcfg;
+	struct console_peer *cp;
+
+	if (writer && pi->p_writer != NULL) {
+		return (NULL);
+	}
+	if (!writer && pi->p_npeers >= TTY_MAX_CONSOLE_PEERS) {
+		return (NULL);
+	}
+	/*
+	 * Held back output is already in the scrollback the new peer will be
+	 * sent, so it must go out to the existing peers first.
+	 */
+	tty_io_batch_flush(pi);
+	cp = calloc(1, sizeof(*cp));
+	if (cp == NULL) {
+		err(1, "calloc(console peer) failed");
+	}
+	cp->cp_sock = sock;
+	cp->cp_wakefd = -1;
+	cp->cp_inst = pi;
+	outq_init(&cp->cp_outq, gcfg.c_console_queue_size);
+	if (writer) {
+		cp->cp_flags |= PEER_WRITER;
+		pi->p_writer = cp;
+	}
+	TAILQ_INSERT_TAIL(&pi->p_peers, cp, cp_glue);
+	pi->p_npeers++;
+	if ((pi->p_state & STATE_CONNECTED) == 0) {
+		pi->p_state |= STATE_CONNECTED;
+		registry_touch();
+	}
+	return (cp);
+}
+
+/*
+ * Detach a peer and free it. The peer's console session is responsible
+ * for closing the socket.
+ */
+void
+tty_io_detach(struct console_peer *cp)
+{
+	struct cblock_instance *pi;
+	uint64_t zin, zout;
+
+	pi = cp->cp_inst;
+	if ((cp->cp_flags & PEER_WAIT) != 0) {
+		(void) poller_del(tty_poller, cp->cp_sock, POLLER_WRITE);
+	}
+	outq_purge(&cp->cp_outq);
+	/*
+	 * The pty is ours again.
+	 */
+	if ((cp->cp_flags & PEER_DIRECT) != 0) {
+		pi->p_state &= ~STATE_DIRECT;
+		if ((pi->p_state &
+		    (STATE_DEAD | STATE_PAUSED | STATE_THROTTLED)) == 0) {
+			(void) tty_io_register(pi);
+		}
+	}
+	if (cp->cp_wakefd != -1) {
+		(void) close(cp->cp_wakefd);
+		if (--pi->p_ring_readers == 0) {
+			shmring_free(pi->p_ring);
+			pi->p_ring = NULL;
+		}
+	}
+	if (cp->cp_zs != NULL) {
+		zstream_counts(cp->cp_zs, &zin, &zout);
+		zstream_free(cp->cp_zs);
+	}
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_writes += cp->cp_outq.oq_writes;
+	console_stats.cs_written += cp->cp_outq.oq_written;
+	if (cp->cp_zs != NULL) {
+		console_stats.cs_deflate_in += zin;
+		console_stats.cs_deflate_out += zout;
+	}
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+	if (cp == pi->p_writer) {
+		pi->p_writer = NULL;
+		tty_io_resume(pi);
+	}
+	TAILQ_REMOVE(&pi->p_peers, cp, cp_glue);
+	if (--pi->p_npeers == 0) {
+		pi->p_state &= ~STATE_CONNECTED;
+		registry_touch();
+	}
+	free(cp);
+}
+
+/*
+ * Shutting the socket down wakes up the console session thread, which
+ * detaches the peer and closes the socket. Until then the peer stays on the
+ * list, but has nothing queued and is not sent anything further.
+ */
+static void
+tty_io_disconnect(struct console_peer *cp)
+{
+
+	(void) shutdown(cp->cp_sock, SHUT_RDWR);
+	if ((cp->cp_flags & PEER_WAIT) != 0) {
+		(void) poller_del(tty_poller, cp->cp_sock, POLLER_WRITE);
+		cp->cp_flags &= ~PEER_WAIT;
+	}
+	outq_purge(&cp->cp_outq);
+	cp->cp_flags |= PEER_GONE;
+	if (cp == cp->cp_inst->p_writer) {
+		tty_io_resume(cp->cp_inst);
+	}
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_disconnects++;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
+
+/*
+ * Update the write registration of the peer, and the pause state of the
+ * instance, once the peer queue has been written to or flushed. Only the
+ * writer can pause the instance.
+ */
+static int
+tty_io_peer_update(struct console_peer *cp, int ret)
+{
+	struct cblock_instance *pi;
+	struct outq *oq;
+
+	pi = cp->cp_inst;
+	oq = &cp->cp_outq;
+	if (ret == -1) {
+		tty_io_disconnect(cp);
+		return (-1);
+	}
+	/* a held queue is flushed by whoever holds it */
+	if (ret == 1 && (cp->cp_flags & PEER_WAIT) == 0 && !oq->oq_held) {
+		if (poller_add(tty_poller, cp->cp_sock, pi,
+		    POLLER_WRITE) == -1) {
+			warn("%s: failed to register console peer",
+			    pi->p_instance_tag);
+			tty_io_disconnect(cp);
+			return (-1);
+		}
+		cp->cp_flags |= PEER_WAIT;
+	}
+	if (ret == 0 && (cp->cp_flags & PEER_WAIT) != 0) {
+		(void) poller_del(tty_poller, cp->cp_sock, POLLER_WRITE);
+		cp->cp_flags &= ~PEER_WAIT;
+	}
+	if (cp == pi->p_writer && oq->oq_bytes <= oq->oq_limit / 2) {
+		tty_io_resume(pi);
+	}
+	return (0);
+}
+
+/*
+ * Send a message to a console peer regardless of how much is queued.
+ */
+int
+tty_io_peer_send(struct console_peer *cp, const struct iovec *iov,
+    int iovcnt)
+{
+	int ret;
+
+	if ((cp->cp_flags & PEER_GONE) != 0) {
+		return (-1);
+	}
+	ret = outq_send(&cp->cp_outq, cp->cp_sock, iov, iovcnt);
+	return (tty_io_peer_update(cp, ret));
+}
+
+/*
+ * Send a message to a console peer: the cmd header followed by the payload
+ * in iov. A peer which is a channel of a multiplexing connection is sent it
+ * as a frame on that connection; force is passed on to mux_send().
+ */
+static int
+tty_io_peer_msg(struct console_peer *cp, uint32_t cmd,
+    const struct iovec *iov, int iovcnt, int force)
+{
+	u_char hdr[sizeof(uint32_t) + sizeof(size_t)];
+	struct iovec *miov;
+	size_t len;
+	int k, ret;
+
+	if ((cp->cp_flags & PEER_GONE) != 0) {
+		return (-1);
+	}
+	if (cp->cp_mux != NULL) {
+		ret = mux_send(cp->cp_mux, cmd, cp->cp_channel, iov, iovcnt,
+		    force);
+		if (ret == -1) {
+			cp->cp_flags |= PEER_GONE;
+		}
+		return (ret);
+	}
+	len = 0;
+	for (k = 0; k < iovcnt; k++) {
+		len += iov[k].iov_len;
+	}
+	miov = calloc(iovcnt + 1, sizeof(*miov));
+	if (miov == NULL) {
+		err(1, "calloc(iovec) failed");
+	}
+	memcpy(hdr, &cmd, sizeof(cmd));
+	memcpy(hdr + sizeof(cmd), &len, sizeof(len));
+	miov[0].iov_base = hdr;
+	miov[0].iov_len = sizeof(hdr);
+	memcpy(&miov[1], iov, iovcnt * sizeof(*iov));
+	ret = tty_io_peer_send(cp, miov, iovcnt + 1);
+	free(miov);
+	return (ret);
+}
+
+/*
+ * Send len bytes of console output to a peer. Peers with their own
+ * compression stream are sent it compressed, so unlike the uncompressed
+ * output it is not shared with the other peers.
+ */
+static int
+tty_io_peer_output(struct console_peer *cp, const struct iovec *iov,
+    int iovcnt, size_t len, int force)
+{
+	struct iovec ziov;
+	size_t zlen;
+	u_char *z;
+	int ret;
+
+	if (cp->cp_zs == NULL || len < TTY_DEFLATE_MIN) {
+		return (tty_io_peer_msg(cp, PRISON_IPC_CONSOLE_TO_CLIENT, iov,
+		    iovcnt, force));
+	}
+	if ((cp->cp_flags & PEER_GONE) != 0) {
+		return (-1);
+	}
+	z = zstream_deflate(cp->cp_zs, iov, iovcnt, &zlen);
+	if (z == NULL) {
+		err(1, "%s: zstream_deflate failed", __func__);
+	}
+	ziov.iov_base = z;
+	ziov.iov_len = zlen;
+	ret = tty_io_peer_msg(cp, PRISON_IPC_CONSOLE_DEFLATE, &ziov, 1, force);
+	free(z);
+	return (ret);
+}
+
+/*
+ * Apply the configured policy to a peer which has fallen too far behind to
+ * take need more bytes. Returns 0 if the output should still be sent to it.
+ * Watchers can not hold up the instance, they are disconnected rather than
+ * paused. Dropping output would leave a peer which tracks stream offsets
+ * with the wrong offset, so it is disconnected too: it can resume from
+ * where it got to. The same goes for a peer whose output is compressed,
+ * dropping part of the stream would leave the rest undecodable.
+ */
+static int
+tty_io_peer_policy(struct console_peer *cp, size_t need)
+{
+	extern struct global_params gcfg;
+	struct outq *oq;
+	size_t dropped;
+	int policy;
+
+	oq = &cp->cp_outq;
+	policy = gcfg.c_console_policy;
+	if (policy == CONSOLE_POLICY_PAUSE &&
+	    (cp->cp_flags & PEER_WRITER) == 0) {
+		policy = CONSOLE_POLICY_DISCONNECT;
+	}
+	if (policy == CONSOLE_POLICY_DROP &&
+	    ((cp->cp_flags & PEER_RESUME) != 0 || cp->cp_zs != NULL)) {
+		policy = CONSOLE_POLICY_DISCONNECT;
+	}
+	switch (policy) {
+	case CONSOLE_POLICY_DISCONNECT:
+		warnx("%s: console peer is not keeping up, disconnecting",
+		    cp->cp_inst->p_instance_tag);
+		tty_io_disconnect(cp);
+		return (-1);
+	case CONSOLE_POLICY_PAUSE:
+		/*
+		 * Queue this output anyway, the queue can exceed its limit by
+		 * at most one pty read.
+		 */
+		tty_io_pause(cp->cp_inst);
+		return (0);
+	case CONSOLE_POLICY_DROP:
+	default:
+		dropped = outq_drop_oldest(oq, need);
+		if (oq->oq_bytes + need > oq->oq_limit) {
+			oq->oq_dropped += need;
+			dropped += need;
+		}
+		pthread_mutex_lock(&console_stats.cs_mutex);
+		console_stats.cs_dropped += dropped;
+		pthread_mutex_unlock(&console_stats.cs_mutex);
+		if (oq->oq_bytes + need > oq->oq_limit) {
+			return (-1);
+		}
+		return (0);
+	}
+}
+
+/*
+ * A message which has to reach a new console peer ahead of its backlog,
+ * along with the descriptors it passes. It is put together with p_mtx
+ * held, and sent by tty_io_setup_send() once the lock has been dropped,
+ * while the peer's queue is held.
+ */
+struct tty_io_setup {
+	u_char			 ts_msg[sizeof(uint32_t) + sizeof(size_t) +
+				    sizeof(struct cblock_console_shm)];
+	size_t			 ts_len;
+	int			 ts_fds[2];
+	int			 ts_nfds;
+	int			 ts_close;	/* closed once sent, or -1 */
+};
+
+static void
+tty_io_setup_init(struct tty_io_setup *ts, uint32_t cmd, const void *buf,
+    size_t len)
+{
+
+	memcpy(ts->ts_msg, &cmd, sizeof(cmd));
+	memcpy(ts->ts_msg + sizeof(cmd), &len, sizeof(len));
+	if (len > 0) {
+		memcpy(ts->ts_msg + sizeof(cmd) + sizeof(len), buf, len);
+	}
+	ts->ts_len = sizeof(cmd) + sizeof(len) + len;
+	ts->ts_nfds = 0;
+	ts->ts_close = -1;
+}
+
+/*
+ * Returns -1 if the peer went away before taking the message.
+ */
+static int
+tty_io_setup_send(struct console_peer *cp, struct tty_io_setup *ts)
+{
+	ssize_t cc;
+
+	cc = sock_ipc_send_fds(cp->cp_sock, ts->ts_msg, ts->ts_len,
+	    ts->ts_fds, ts->ts_nfds);
+	if (ts->ts_close != -1) {
+		(void) close(ts->ts_close);
+	}
+	if (cc != (ssize_t)ts->ts_len) {
+		warnx("%s: console peer went away during setup",
+		    cp->cp_inst->p_instance_tag);
+		return (-1);
+	}
+	return (0);
+}
+
+/*
+ * Set a log subscriber up to read live output from the ring of the
+ * instance, creating the ring for its first reader, and prepare the
+ * message which passes it the ring and its end of a wakeup socket. Called
+ * with p_mtx held, before the backlog is queued. If anything goes wrong,
+ * the subscriber is told to expect its output over the connection instead.
+ */
+static void
+tty_io_shm_attach(struct console_peer *cp, struct tty_io_setup *ts)
+{
+	struct cblock_console_shm cs;
+	struct cblock_instance *pi;
+	int sv[2];
+
+	pi = cp->cp_inst;
+	bzero(&cs, sizeof(cs));
+	if (pi->p_ring == NULL) {
+		pi->p_ring = shmring_create(TTY_SHM_RING_SIZE);
+		if (pi->p_ring == NULL) {
+			warn("%s: failed to create console ring",
+			    pi->p_instance_tag);
+		}
+	}
+	if (pi->p_ring != NULL) {
+		if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == 0) {
+			cs.cs_size = shmring_size(pi->p_ring);
+			cs.cs_head = shmring_head(pi->p_ring);
+		} else {
+			warn("%s: socketpair failed", pi->p_instance_tag);
+		}
+	}
+	tty_io_setup_init(ts, PRISON_IPC_CONSOLE_SHM, &cs, sizeof(cs));
+	if (cs.cs_size == 0) {
+		if (pi->p_ring_readers == 0 && pi->p_ring != NULL) {
+			shmring_free(pi->p_ring);
+			pi->p_ring = NULL;
+		}
+		return;
+	}
+	ts->ts_fds[0] = shmring_fd(pi->p_ring);
+	ts->ts_fds[1] = sv[1];
+	ts->ts_nfds = 2;
+	ts->ts_close = sv[1];
+	cp->cp_wakefd = sv[0];
+	pi->p_ring_readers++;
+}
+
+/*
+ * Fan pty output out to every console peer. Peers which are keeping up are
+ * sent the output straight from the read buffer. It is copied at most once
+ * for all of the peers which have to queue it. Ring readers are only sent
+ * a wakeup, the output itself is copied into the ring once for all of them.
+ */
+static void
+tty_io_console_output(struct cblock_instance *pi, u_char *buf, size_t len)
+{
+	u_char hdr[sizeof(uint32_t) + sizeof(size_t)];
+	struct console_peer *cp;
+	struct outq_buf *ob;
+	struct iovec iov[2];
+	struct outq *oq;
+	uint32_t cmd;
+	size_t need;
+	int ret;
+
+	cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
+	memcpy(hdr, &cmd, sizeof(cmd));
+	memcpy(hdr + sizeof(cmd), &len, sizeof(len));
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = len;
+	need = sizeof(hdr) + len;
+	ob = NULL;
+	if (pi->p_ring != NULL) {
+		shmring_write(pi->p_ring, buf, len);
+	}
+	TAILQ_FOREACH(cp, &pi->p_peers, cp_glue) {
+		if ((cp->cp_flags & PEER_GONE) != 0) {
+			continue;
+		}
+		/*
+		 * If the wakeup can not be sent, one is already pending. A
+		 * reader which went away is noticed when its connection is.
+		 */
+		if (cp->cp_wakefd != -1) {
+			(void) send(cp->cp_wakefd, "", 1,
+			    MSG_DONTWAIT | MSG_NOSIGNAL);
+			continue;
+		}
+		/* it reads the output from the pty itself */
+		if ((cp->cp_flags & PEER_DIRECT) != 0) {
+			continue;
+		}
+		/* channels are subject to the limit of their connection */
+		if (cp->cp_mux != NULL) {
+			(void) tty_io_peer_output(cp, &iov[1], 1, len, 0);
+			continue;
+		}
+		oq = &cp->cp_outq;
+		if (oq->oq_bytes + need > oq->oq_limit &&
+		    tty_io_peer_policy(cp, need) != 0) {
+			continue;
+		}
+		if (cp->cp_zs != NULL) {
+			(void) tty_io_peer_output(cp, &iov[1], 1, len, 1);
+			continue;
+		}
+		ret = outq_send_shared(oq, cp->cp_sock, iov, 2, &ob);
+		(void) tty_io_peer_update(cp, ret);
+	}
+	if (ob != NULL) {
+		outq_buf_rele(ob);
+	}
+}
+
+/*
+ * Console output is batched per instance rather than per peer, since every
+ * peer is sent the same output. The batch is sent when it fills up, when
+ * its deadline passes, when a peer attaches and when the session ends.
+ */
+static void
+tty_io_batch_flush(struct cblock_instance *pi)
+{
+	struct batch *ba;
+
+	ba = &pi->p_batch;
+	if (ba->ba_len == 0) {
+		return;
+	}
+	tty_io_console_output(pi, ba->ba_data, ba->ba_len);
+	batch_clear(ba);
+}
+
+static void
+tty_io_batch_output(struct cblock_instance *pi, u_char *buf, size_t len)
+{
+
+	switch (batch_add(&pi->p_batch, buf, len, batch_now())) {
+	case BATCH_SEND:
+		tty_io_console_output(pi, buf, len);
+		break;
+	case BATCH_FULL:
+		tty_io_batch_flush(pi);
+		break;
+	case BATCH_HELD:
+		if ((pi->p_state & STATE_BATCHED) == 0) {
+			TAILQ_INSERT_TAIL(&batch_head, pi, p_batch_glue);
+			pi->p_state |= STATE_BATCHED;
+		}
+		break;
+	}
+}
+
+/*
+ * Send the batches which are due. Instances whose batch has already been
+ * sent are taken off the list here. Returns the number of microseconds
+ * until the next batch is due, or -1 if no output is being held.
+ */
+static int
+tty_io_batch_expire(void)
+{
+	struct cblock_instance *pi, *pi_temp;
+	uint64_t now, next;
+	struct batch *ba;
+
+	now = batch_now();
+	next = UINT64_MAX;
+	TAILQ_FOREACH_SAFE(pi, &batch_head, p_batch_glue, pi_temp) {
+		pthread_mutex_lock(&pi->p_mtx);
+		ba = &pi->p_batch;
+		if (ba->ba_len != 0 && ba->ba_deadline <= now) {
+			tty_io_batch_flush(pi);
+		}
+		if (ba->ba_len == 0) {
+			TAILQ_REMOVE(&batch_head, pi, p_batch_glue);
+			pi->p_state &= ~STATE_BATCHED;
+		} else if (ba->ba_deadline < next) {
+			next = ba->ba_deadline;
+		}
+		pthread_mutex_unlock(&pi->p_mtx);
+	}
+	if (next == UINT64_MAX) {
+		return (-1);
+	}
+	return (next - now);
+}
+
+/*
+ * Write out whatever the peers which were waiting for the socket to drain
+ * have queued.
+ */
+static void
+tty_io_handle_writable(struct cblock_instance *pi)
+{
+	struct console_peer *cp;
+
+	pthread_mutex_lock(&pi->p_mtx);
+	TAILQ_FOREACH(cp, &pi->p_peers, cp_glue) {
+		if ((cp->cp_flags & PEER_WAIT) != 0) {
+			(void) tty_io_peer_update(cp,
+			    outq_flush(&cp->cp_outq, cp->cp_sock));
+		}
+	}
+	pthread_mutex_unlock(&pi->p_mtx);
+}
+
+/*
+ * The instance is going away, deliver the session termination (and for
+ * builds, the exit status) to the console peers.
+ */
+void
+tty_io_session_done(struct cblock_instance *pi)
+{
+	struct console_peer *cp;
+	struct iovec iov[2];
+	uint32_t cmd;
+	int ret;
+
+	/*
+	 * This is called from the tty I/O loop, so the instance can be taken
+	 * off the batch list here.
+	 */
+	tty_io_batch_flush(pi);
+	if ((pi->p_state & STATE_BATCHED) != 0) {
+		TAILQ_REMOVE(&batch_head, pi, p_batch_glue);
+		pi->p_state &= ~STATE_BATCHED;
+	}
+	sched_remove(&tty_sched, &pi->p_sched);
+	if ((pi->p_state & STATE_THROTTLED) != 0) {
+		TAILQ_REMOVE(&throttle_head, pi, p_throttle_glue);
+		pi->p_state &= ~STATE_THROTTLED;
+	}
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_throttled += pi->p_throttled;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+	cmd = PRISON_IPC_CONSOLE_SESSION_DONE;
+	iov[0].iov_base = &cmd;
+	iov[0].iov_len = sizeof(cmd);
+	/*
+	 * If this is a cellblock build, the peer will be waiting for
+	 * ultimate status code of the build job, so send it.
+	 */
+	iov[1].iov_base = &pi->p_status;
+	iov[1].iov_len = 0;
+	if (pi->p_type == PRISON_TYPE_BUILD) {
+		iov[1].iov_len = sizeof(pi->p_status);
+	}
+	TAILQ_FOREACH(cp, &pi->p_peers, cp_glue) {
+		if ((cp->cp_flags & PEER_GONE) != 0) {
+			continue;
+		}
+		/*
+		 * Channels are left for the client to unsubscribe, or for the
+		 * connection to close.
+		 */
+		if (cp->cp_mux != NULL) {
+			(void) tty_io_peer_msg(cp, cmd, &iov[1], 1, 1);
+			continue;
+		}
+		/*
+		 * Whatever the peer does not take right away is written out
+		 * as its socket drains, like any other console output, rather
+		 * than waited for here.
+		 */
+		ret = outq_send(&cp->cp_outq, cp->cp_sock, iov, 2);
+		(void) tty_io_peer_update(cp, ret);
+	}
+}
+
+/*
+ * Report console queue statistics. The per-instance figures are copied out
+ * under the locks first, so no socket I/O happens while they are held.
+ */
+void
+tty_io_stats(struct stats_ctx *ctx)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_rwlock_t cblock_lock;
+	struct tty_io_stat {
+		char		 ts_name[64];
+		size_t		 ts_bytes;
+		size_t		 ts_hwm;
+		uint64_t	 ts_dropped;
+		int		 ts_paused;
+		u_int		 ts_peers;
+		int		 ts_connected;
+		size_t		 ts_scroll_bytes;
+		size_t		 ts_scroll_pages;
+		uint64_t	 ts_writes;
+		uint64_t	 ts_written;
+		uint64_t	 ts_rate;
+		uint64_t	 ts_throttled;
+		uint64_t	 ts_zin;
+		uint64_t	 ts_zout;
+		uint64_t	 ts_shm_readers;
+	} *vec, *cur;
+	uint64_t dropped, disconnects, pauses, writes, written, redraws;
+	uint64_t redraw_bytes, throttles, throttled, zin, zout, in, out;
+	uint64_t muxes, channels, shm_readers, handoffs, tee_bytes;
+	struct termbuf_usage tu;
+	struct console_peer *cp;
+	struct cblock_instance *pi;
+	size_t count, k, total;
+	char name[128];
+
+	pthread_rwlock_rdlock(&cblock_lock);
+	count = registry_count();
+	vec = calloc(count + 1, sizeof(*vec));	/* never calloc(0) */
+	if (vec == NULL) {
+		pthread_rwlock_unlock(&cblock_lock);
+		return;
+	}
+	count = 0;
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		pthread_mutex_lock(&pi->p_mtx);
+		cur = &vec[count++];
+		strlcpy(cur->ts_name, pi->p_instance_tag,
+		    sizeof(cur->ts_name));
+		cur->ts_scroll_bytes = termbuf_len(&pi->p_ttybuf);
+		cur->ts_scroll_pages = pi->p_ttybuf.t_npages;
+		cur->ts_rate = pi->p_limit.rl_rate;
+		cur->ts_throttled = pi->p_throttled;
+		if ((pi->p_state & STATE_CONNECTED) != 0) {
+			cur->ts_connected = 1;
+			cur->ts_peers = pi->p_npeers;
+			cur->ts_paused = (pi->p_state & STATE_PAUSED) != 0;
+		}
+		/*
+		 * Queue figures are summed over the peers, except for the
+		 * high water mark which is that of the worst peer.
+		 */
+		TAILQ_FOREACH(cp, &pi->p_peers, cp_glue) {
+			cur->ts_bytes += cp->cp_outq.oq_bytes;
+			cur->ts_dropped += cp->cp_outq.oq_dropped;
+			cur->ts_writes += cp->cp_outq.oq_writes;
+			cur->ts_written += cp->cp_outq.oq_written;
+			cur->ts_shm_readers += cp->cp_wakefd != -1;
+			if (cp->cp_zs != NULL) {
+				zstream_counts(cp->cp_zs, &in, &out);
+				cur->ts_zin += in;
+				cur->ts_zout += out;
+			}
+			if (cp->cp_outq.oq_hwm > cur->ts_hwm) {
+				cur->ts_hwm = cp->cp_outq.oq_hwm;
+			}
+		}
+		pthread_mutex_unlock(&pi->p_mtx);
+	}
+	pthread_rwlock_unlock(&cblock_lock);
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	dropped = console_stats.cs_dropped;
+	disconnects = console_stats.cs_disconnects;
+	pauses = console_stats.cs_pauses;
+	writes = console_stats.cs_writes;
+	written = console_stats.cs_written;
+	redraws = console_stats.cs_redraws;
+	redraw_bytes = console_stats.cs_redraw_bytes;
+	throttles = console_stats.cs_throttles;
+	throttled = console_stats.cs_throttled;
+	zin = console_stats.cs_deflate_in;
+	zout = console_stats.cs_deflate_out;
+	muxes = console_stats.cs_muxes;
+	handoffs = console_stats.cs_handoffs;
+	tee_bytes = console_stats.cs_tee_bytes;
+	channels = console_stats.cs_channels;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+	stats_put(ctx, "console.dropped_bytes", dropped);
+	stats_put(ctx, "console.disconnects", disconnects);
+	stats_put(ctx, "console.pauses", pauses);
+	stats_put(ctx, "console.redraws", redraws);
+	stats_put(ctx, "console.redraw_bytes", redraw_bytes);
+	/* tty_sched is the I/O loop's, a torn read here does no harm */
+	stats_put(ctx, "console.sched_rounds", tty_sched.s_rounds);
+	stats_put(ctx, "console.throttles", throttles);
+	total = shm_readers = 0;
+	for (k = 0; k < count; k++) {
+		total += vec[k].ts_bytes;
+		writes += vec[k].ts_writes;
+		written += vec[k].ts_written;
+		throttled += vec[k].ts_throttled;
+		zin += vec[k].ts_zin;
+		zout += vec[k].ts_zout;
+		shm_readers += vec[k].ts_shm_readers;
+	}
+	stats_put(ctx, "console.throttled_bytes", throttled);
+	/*
+	 * The ratio is the compressed size as a percentage of the original,
+	 * for the output sent compressed (short writes are not).
+	 */
+	stats_put(ctx, "console.deflate_in_bytes", zin);
+	stats_put(ctx, "console.deflate_out_bytes", zout);
+	stats_put(ctx, "console.deflate_ratio_pct",
+	    zin == 0 ? 0 : zout * 100 / zin);
+	stats_put(ctx, "console.mux_connections", muxes);
+	stats_put(ctx, "console.mux_channels", channels);
+	stats_put(ctx, "console.shm_readers", shm_readers);
+	stats_put(ctx, "console.handoffs", handoffs);
+	stats_put(ctx, "console.tee_bytes", tee_bytes);
+	stats_put(ctx, "console.queue_bytes", total);
+	stats_put(ctx, "console.writes", writes);
+	stats_put(ctx, "console.written_bytes", written);
+	termbuf_pool_usage(&tu);
+	stats_put(ctx, "scrollback.budget_bytes", tu.tu_budget);
+	stats_put(ctx, "scrollback.used_bytes", tu.tu_used);
+	stats_put(ctx, "scrollback.free_bytes", tu.tu_free);
+	stats_put(ctx, "scrollback.min_bytes", tu.tu_min);
+	stats_put(ctx, "scrollback.evictions", tu.tu_evictions);
+	for (k = 0; k < count; k++) {
+		cur = &vec[k];
+		snprintf(name, sizeof(name), "scrollback.%s.bytes",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_scroll_bytes);
+		snprintf(name, sizeof(name), "scrollback.%s.pages",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_scroll_pages);
+		if (cur->ts_rate != 0) {
+			snprintf(name, sizeof(name), "ratelimit.%s.rate",
+			    cur->ts_name);
+			stats_put(ctx, name, cur->ts_rate);
+			snprintf(name, sizeof(name),
+			    "ratelimit.%s.throttled_bytes", cur->ts_name);
+			stats_put(ctx, name, cur->ts_throttled);
+		}
+		if (!cur->ts_connected) {
+			continue;
+		}
+		snprintf(name, sizeof(name), "console.%s.peers",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_peers);
+		snprintf(name, sizeof(name), "console.%s.queue_bytes",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_bytes);
+		snprintf(name, sizeof(name), "console.%s.queue_bytes_max",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_hwm);
+		snprintf(name, sizeof(name), "console.%s.dropped_bytes",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_dropped);
+		snprintf(name, sizeof(name), "console.%s.paused",
+		    cur->ts_name);
+		stats_put(ctx, name, cur->ts_paused);
+	}
+	free(vec);
+}
+
+/*
+ * Read up to len bytes of console output. Called with the instance lock
+ * held, which is dropped. Returns the number of bytes read, or 0 if nothing
+ * more should be read from the pty for now.
+ */
+static size_t
+tty_io_handle_event(struct cblock_instance *pi, size_t len)
+{
+	u_char buf[8192];
+	ssize_t cc;
+
+	if (len > sizeof(buf)) {
+		len = sizeof(buf);
+	}
+	cc = read(pi->p_ttyfd, buf, len);
+	if (cc == -1 && (errno == EINTR || errno == EAGAIN)) {
+		pthread_mutex_unlock(&pi->p_mtx);
+		return (0);
+	}
+	/*
+	 * Once the slave side has been closed, BSD returns 0 while Linux
+	 * returns EIO. Either way, stop listening on this pty; the instance
+	 * is cleaned up once the poller reports that its process has exited.
+	 */
+	if (cc == 0 || (cc == -1 && errno == EIO)) {
+		pi->p_state |= STATE_DEAD;
+		pthread_mutex_unlock(&pi->p_mtx);
+		tty_io_unregister(pi);
+		return (0);
+	}
+	if (cc == -1) {
+		err(1, "%s: read failed:", __func__);
+	}
+	/*
+	 * The output is logged at the offset the scrollback is about to
+	 * give it, so the log can be read back where the scrollback ends.
+	 */
+	if (pi->p_log != NULL) {
+		conlog_append(pi->p_log, termbuf_head(&pi->p_ttybuf), buf, cc);
+	}
+	ratelimit_take(&pi->p_limit, cc);
+	if ((pi->p_state & STATE_LIMITED) != 0) {
+		pi->p_throttled += cc;
+		/* a short read means the backlog has been caught up on */
+		if ((size_t)cc < len) {
+			pi->p_state &= ~STATE_LIMITED;
+		}
+	}
+	termbuf_append(&pi->p_ttybuf, buf, cc);
+	if (pi->p_vt != NULL) {
+		vt_feed(pi->p_vt, buf, cc);
+	}
+	if ((pi->p_state & STATE_CONNECTED) != 0) {
+		tty_io_batch_output(pi, buf, cc);
+	}
+	pthread_mutex_unlock(&pi->p_mtx);
+	return (cc);
+}
+
+/*
+ * Console output which a client with the pty read and sent back to us. It
+ * is recorded and sent to the other consoles the way output read from the
+ * pty is, except that it is not batched (this is not the I/O loop) or rate
+ * limited (the client reads the pty at its own pace).
+ */
+void
+tty_io_tee(struct cblock_instance *pi, const u_char *buf, size_t len)
+{
+
+	pthread_mutex_lock(&pi->p_mtx);
+	if (pi->p_log != NULL) {
+		conlog_append(pi->p_log, termbuf_head(&pi->p_ttybuf), buf,
+		    len);
+	}
+	termbuf_append(&pi->p_ttybuf, buf, len);
+	if (pi->p_vt != NULL) {
+		vt_feed(pi->p_vt, buf, len);
+	}
+	tty_io_batch_flush(pi);
+	tty_io_console_output(pi, (u_char *)buf, len);
+	pthread_mutex_unlock(&pi->p_mtx);
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_tee_bytes += len;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
+
+/*
+ * Hand the pty to a console writer which asked for it, if it is trusted
+ * with it, and stop reading it ourselves. Called with p_mtx held, before
+ * the backlog is queued; the message passing the pty (or refusing it) is
+ * prepared in ts.
+ */
+static void
+tty_io_handoff(struct cblock_peer *p, struct console_peer *cp,
+    struct tty_io_setup *ts)
+{
+	struct cblock_instance *pi;
+
+	pi = cp->cp_inst;
+	tty_io_setup_init(ts, PRISON_IPC_CONSOLE_HANDOFF, NULL, 0);
+	if (p->p_family != PF_UNIX ||
+	    (p->p_uid != 0 && p->p_uid != geteuid())) {
+		return;
+	}
+	if ((pi->p_state &
+	    (STATE_DEAD | STATE_PAUSED | STATE_THROTTLED)) == 0) {
+		(void) poller_del(tty_poller, pi->p_ttyfd, 0);
+	}
+	pi->p_state |= STATE_DIRECT;
+	cp->cp_flags |= PEER_DIRECT;
+	ts->ts_fds[0] = pi->p_ttyfd;
+	ts->ts_nfds = 1;
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_handoffs++;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
+
+/*
+ * Take a rate limited instance off the poller until it has earned enough
+ * credit to be worth reading from again. Called with the instance lock held.
+ */
+static void
+tty_io_throttle(struct cblock_instance *pi, uint64_t now)
+{
+	uint64_t wait;
+
+	if ((pi->p_state & STATE_PAUSED) == 0) {
+		(void) poller_del(tty_poller, pi->p_ttyfd, 0);
+	}
+	pi->p_state |= STATE_THROTTLED | STATE_LIMITED;
+	wait = ratelimit_wait(&pi->p_limit, TTY_THROTTLE_MIN);
+	if (wait > TTY_THROTTLE_MAX_US) {
+		wait = TTY_THROTTLE_MAX_US;
+	}
+	pi->p_wakeup = now + wait;
+	TAILQ_INSERT_TAIL(&throttle_head, pi, p_throttle_glue);
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_throttles++;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
+
+/*
+ * Put the throttled instances which are due back on the poller. Returns the
+ * number of microseconds until the next one is due, or -1 if there are none.
+ */
+static int
+tty_io_throttle_expire(void)
+{
+	struct cblock_instance *pi, *pi_temp;
+	uint64_t now, next;
+
+	now = batch_now();
+	next = UINT64_MAX;
+	TAILQ_FOREACH_SAFE(pi, &throttle_head, p_throttle_glue, pi_temp) {
+		pthread_mutex_lock(&pi->p_mtx);
+		if (pi->p_wakeup <= now) {
+			TAILQ_REMOVE(&throttle_head, pi, p_throttle_glue);
+			pi->p_state &= ~STATE_THROTTLED;
+			if ((pi->p_state &
+			    (STATE_DEAD | STATE_PAUSED | STATE_DIRECT)) == 0) {
+				(void) tty_io_register(pi);
+			}
+		} else if (pi->p_wakeup < next) {
+			next = pi->p_wakeup;
+		}
+		pthread_mutex_unlock(&pi->p_mtx);
+	}
+	if (next == UINT64_MAX) {
+		return (-1);
+	}
+	return (next - now);
+}
+
+/*
+ * Scheduler callback: read up to len bytes from a ready pty, within the
+ * instance's rate limit. The pty is left blocking (console sessions write
+ * to it, and a client it is handed to shares its file flags), so only the
+ * first read after the poller reported it readable is known not to block;
+ * before any further read FIONREAD is used to check there is something
+ * left. The check and the read are done with the instance lock held: the
+ * pty is only handed off with it held, so a client which has been given
+ * the pty can not drain it in between and leave this thread (and every
+ * other instance's console output) blocked in read().
+ */
+static size_t
+tty_io_service(void *arg, size_t len)
+{
+	struct cblock_instance *pi;
+	size_t allowed;
+	uint64_t now;
+	int avail, ready;
+
+	pi = arg;
+	ready = pi->p_sched.se_ready;
+	pi->p_sched.se_ready = 0;
+	pthread_mutex_lock(&pi->p_mtx);
+	if ((pi->p_state & (STATE_DEAD | STATE_PAUSED | STATE_THROTTLED |
+	    STATE_DIRECT)) != 0) {
+		pthread_mutex_unlock(&pi->p_mtx);
+		return (0);
+	}
+	if (!ready) {
+		if (ioctl(pi->p_ttyfd, FIONREAD, &avail) == -1 ||
+		    avail <= 0) {
+			pi->p_state &= ~STATE_LIMITED;
+			pthread_mutex_unlock(&pi->p_mtx);
+			return (0);
+		}
+	}
+	if (pi->p_limit.rl_rate != 0) {
+		now = batch_now();
+		allowed = ratelimit_avail(&pi->p_limit, now);
+		if (allowed < len && allowed < TTY_THROTTLE_MIN) {
+			tty_io_throttle(pi, now);
+			pthread_mutex_unlock(&pi->p_mtx);
+			return (0);
+		}
+		if (allowed < len) {
+			pi->p_state |= STATE_LIMITED;
+			len = allowed;
+		}
+	}
+	return (tty_io_handle_event(pi, len));
+}
+
+/*
+ * Queue a pty which the poller reported readable. Instances with a console
+ * writer attached are serviced ahead of (and with a larger quantum than)
+ * those which are only producing output.
+ */
+static void
+tty_io_ready(struct cblock_instance *pi)
+{
+	int class;
+
+	pthread_mutex_lock(&pi->p_mtx);
+	/*
+	 * Reaped earlier in the same batch, and already taken off the
+	 * scheduler by tty_io_session_done().
+	 */
+	if ((pi->p_state & STATE_DEAD) != 0) {
+		pthread_mutex_unlock(&pi->p_mtx);
+		return;
+	}
+	class = pi->p_writer != NULL ? SCHED_INTERACTIVE : SCHED_BULK;
+	pthread_mutex_unlock(&pi->p_mtx);
+	sched_add(&tty_sched, &pi->p_sched, class);
+}
+
+void
+tty_io_set_limit(struct cblock_instance *pi, uint64_t rate, uint64_t burst)
+{
+
+	if (burst > TTY_BURST_MAX) {
+		burst = TTY_BURST_MAX;
+	}
+	pthread_mutex_lock(&pi->p_mtx);
+	ratelimit_init(&pi->p_limit, rate, burst, batch_now());
+	/* a throttled instance is looked at again on the next pass */
+	if ((pi->p_state & STATE_THROTTLED) != 0) {
+		pi->p_wakeup = 0;
+	}
+	pthread_mutex_unlock(&pi->p_mtx);
+}
+
+/*
+ * Pty events are serviced without the registry lock. Instances are only
+ * ever unregistered from this thread, and the teardown of those reaped
+ * during a batch (which runs on the cleanup pool, and frees them) is not
+ * queued until the batch has been handled. So the instance pointers handed
+ * back by the poller remain valid for the whole batch, and those on the
+ * scheduler queues until tty_io_session_done() takes them off.
+ *
+ * Ready ptys are not read straight away, but queued with the deficit
+ * round-robin scheduler: each gets to read a quantum's worth of output per
+ * turn, so an instance flooding its console cannot starve the others, and
+ * the loop checks for new events between turns.
+ */
+void *
+tty_io_queue_loop(void *arg)
+{
+	struct cblock_instance *reaped[POLLER_MAX_EVENTS];
+	struct poller_event events[POLLER_MAX_EVENTS];
+	int k, n, nreaped, queued, timeout, next;
+
+	queued = 0;
+	while (1) {
+		timeout = tty_io_batch_expire();
+		next = tty_io_throttle_expire();
+		if (next != -1 && (timeout == -1 || next < timeout)) {
+			timeout = next;
+		}
+		/*
+		 * While ptys are left with output to read, only check for
+		 * new events between turns.
+		 */
+		if (queued) {
+			timeout = 0;
+		}
+		n = poller_wait(tty_poller, events, POLLER_MAX_EVENTS,
+		    timeout);
+		if (n == -1 && errno == EINTR) {
+			continue;
+		}
+		if (n == -1) {
+			err(1, "poller_wait(tty io) failed");
+		}
+		nreaped = 0;
+		for (k = 0; k < n; k++) {
+			if (events[k].pe_pid != 0) {
+				reaped[nreaped] = cblock_reap(events[k].pe_pid);
+				if (reaped[nreaped] != NULL) {
+					nreaped++;
+				}
+				continue;
+			}
+			if (events[k].pe_write) {
+				tty_io_handle_writable(events[k].pe_arg);
+				continue;
+			}
+			tty_io_ready(events[k].pe_arg);
+		}
+		for (k = 0; k < nreaped; k++) {
+			cblock_teardown(reaped[k]);
+		}
+		queued = sched_run(&tty_sched, tty_io_service);
+	}
+}
+
+/*
+ * Log subscribers and console multiplexing connections are console peers
+ * without a session thread. Their output is written by the tty I/O loop
+ * like any other peer's. For a log subscriber, this loop only waits for the
+ * connection to be closed, and then tears the peer down the way the end of
+ * a console session would. For a multiplexing connection, it services the
+ * client's subscriptions and writes out the output which is queued.
+ */
+static void
+tty_io_logs_close(struct cblock_peer *p)
+{
+	struct cblock_instance *pi;
+	struct console_peer *cp;
+	struct mux_channel *mc;
+	struct console_mux *cm;
 
-#include "probes.h"
+	if (p->p_mux == NULL) {
+		cp = p->p_console;
+		pi = cp->cp_inst;
+		cblock_detach_console(cp);
+		cblock_instance_rele(pi);
+		dispatch_peer_close(p);
+		return;
+	}
+	cm = p->p_mux;
+	while ((mc = TAILQ_FIRST(&cm->cm_channels)) != NULL) {
+		cp = mc->mc_peer;
+		pi = cp->cp_inst;
+		cblock_detach_console(cp);
+		cblock_instance_rele(pi);
+		mux_channel_remove(cm, mc);
+	}
+	mux_free(cm);
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_muxes--;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+	dispatch_peer_close(p);
+}
 
-#include <cblock/libcblock.h>
+void
+tty_io_logs_add(struct cblock_peer *p)
+{
+
+	if (poller_add(logs_poller, p->p_sock, p, 0) == 0) {
+		return;
+	}
+	warn("failed to register log subscriber");
+	tty_io_logs_close(p);
+}
+
+static void
+tty_io_mux_reply(struct console_mux *cm, uint32_t channel, const char *msg)
+{
+	struct iovec iov;
+
+	iov.iov_base = (void *)msg;
+	iov.iov_len = strlen(msg);
+	(void) mux_send(cm, PRISON_IPC_MUX_SUBSCRIBE, channel, &iov, 1, 1);
+}
+
+/*
+ * Open a channel: attach a watcher to the instance which sends its output
+ * on the connection.
+ */
+static void
+tty_io_mux_subscribe(struct cblock_peer *p, struct cblock_mux_frame *mf,
+    u_char *payload)
+{
+	extern struct global_params gcfg;
+	struct cblock_console_connect pcc;
+	struct cblock_instance *pi;
+	struct console_peer *cp;
+	struct console_mux *cm;
+	struct tlv_iter ti;
+	char msg[MAX_ERR_BUF];
 
-static int reap_children;
+	cm = p->p_mux;
+	tlv_iter_init(&ti, payload, mf->mf_len);
+	if (tlv_get_console_connect(&ti, &pcc) != 1) {
+		tty_io_mux_reply(cm, mf->mf_channel, "malformed subscription");
+		return;
+	}
+	if (mux_channel_find(cm, mf->mf_channel) != NULL) {
+		tty_io_mux_reply(cm, mf->mf_channel, "channel already in use");
+		return;
+	}
+	pi = cblock_lookup_instance(pcc.p_instance);
+	if (pi == NULL) {
+		snprintf(msg, sizeof(msg), "%s invalid container",
+		    pcc.p_instance);
+		tty_io_mux_reply(cm, mf->mf_channel, msg);
+		return;
+	}
+	pcc.p_watch = 1;
+	pthread_mutex_lock(&pi->p_mtx);
+	cp = NULL;
+	if ((pi->p_state & STATE_DEAD) == 0) {
+		cp = tty_io_attach(pi, p->p_sock, 0);
+	}
+	if (cp == NULL) {
+		snprintf(msg, sizeof(msg), "%s %s", pcc.p_instance,
+		    (pi->p_state & STATE_DEAD) != 0 ?
+		    "is not running" : "has too many consoles attached");
+		pthread_mutex_unlock(&pi->p_mtx);
+		cblock_instance_rele(pi);
+		tty_io_mux_reply(cm, mf->mf_channel, msg);
+		return;
+	}
+	CBLOCKD_CBLOCK_CONSOLE_ATTACH(pcc.p_instance);
+	cp->cp_mux = cm;
+	cp->cp_channel = mf->mf_channel;
+	if ((p->p_caps & CBLOCK_CAP_CONSOLE_DEFLATE) != 0) {
+		cp->cp_zs = zstream_deflate_init(gcfg.c_console_compress);
+		if (cp->cp_zs == NULL) {
+			warnx("%s: failed to set up console compression, "
+			    "sending it uncompressed", pcc.p_instance);
+		}
+	}
+	/*
+	 * As with console connections, the reply and the backlog are queued
+	 * before any live output can be.
+	 */
+	tty_io_mux_reply(cm, mf->mf_channel, "");
+	dispatch_console_backlog(cp, &pcc);
+	pthread_mutex_unlock(&pi->p_mtx);
+	(void) mux_channel_add(cm, mf->mf_channel, cp);
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_channels++;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
 
 static void
-handle_reap_children(int sig)
+tty_io_mux_unsubscribe(struct cblock_peer *p, struct cblock_mux_frame *mf)
 {
+	struct cblock_instance *pi;
+	struct console_peer *cp;
+	struct mux_channel *mc;
 
-	reap_children = 1;
+	mc = mux_channel_find(p->p_mux, mf->mf_channel);
+	if (mc == NULL) {
+		return;
+	}
+	cp = mc->mc_peer;
+	pi = cp->cp_inst;
+	cblock_detach_console(cp);
+	cblock_instance_rele(pi);
+	mux_channel_remove(p->p_mux, mc);
 }
 
+/*
+ * Service an event on a log subscriber or multiplexing connection. Returns
+ * -1 if the connection has been torn down.
+ */
 static int
-tty_initialize_fdset(fd_set *rfds)
+tty_io_logs_event(struct cblock_peer *p, int write)
 {
-	extern cblock_instance_head_t pr_head;
-	extern pthread_mutex_t cblock_mutex;
-	struct cblock_instance *pi, *p_temp;
-	int maxfd;
-
-	FD_ZERO(rfds);
-	maxfd = 0;
-	pthread_mutex_lock(&cblock_mutex);
-	TAILQ_FOREACH_SAFE(pi, &pr_head, p_glue, p_temp) {
-		if ((pi->p_state & STATE_DEAD) != 0) {
-			continue;
+	struct cblock_mux_frame mf;
+	u_char *payload;
+	char buf[512];
+	ssize_t cc;
+	int ret;
+
+	if (p->p_mux != NULL && write) {
+		(void) mux_flush(p->p_mux);
+		return (0);
+	}
+	if (p->p_mux != NULL) {
+		ret = mux_fill(p->p_mux);
+		while (ret == 0 &&
+		    (ret = mux_frame(p->p_mux, &mf, &payload)) == 1) {
+			switch (mf.mf_cmd) {
+			case PRISON_IPC_MUX_SUBSCRIBE:
+				tty_io_mux_subscribe(p, &mf, payload);
+				break;
+			case PRISON_IPC_MUX_UNSUBSCRIBE:
+				tty_io_mux_unsubscribe(p, &mf);
+				break;
+			}
+			ret = 0;
+		}
+		if (ret == 0) {
+			return (0);
 		}
-		if (pi->p_ttyfd > maxfd) {
-			maxfd = pi->p_ttyfd;
+	} else {
+		/*
+		 * Anything a subscriber sends is discarded.
+		 */
+		cc = read(p->p_sock, buf, sizeof(buf));
+		if (cc > 0 ||
+		    (cc == -1 && (errno == EINTR || errno == EAGAIN))) {
+			return (0);
 		}
-		FD_SET(pi->p_ttyfd, rfds);
 	}
-	pthread_mutex_unlock(&cblock_mutex);
-	return (maxfd);
+	(void) poller_del(logs_poller, p->p_sock, 0);
+	tty_io_logs_close(p);
+	return (-1);
 }
 
 void *
-tty_io_queue_loop(void *arg)
+tty_io_logs_loop(void *arg)
 {
-	extern cblock_instance_head_t pr_head;
-	extern pthread_mutex_t cblock_mutex;
-	struct cblock_instance *pi;
-	struct timeval tv;
-	u_char buf[8192];
-	int maxfd, error;
-	uint32_t cmd;
-	fd_set rfds;
-	ssize_t cc;
-	size_t len;
+	struct poller_event events[POLLER_MAX_EVENTS];
+	void *gone;
+	int j, k, n;
 
 	while (1) {
-		cblock_reap_children();
-		maxfd = tty_initialize_fdset(&rfds);
-		tv.tv_sec = 0;
-		tv.tv_usec = 500000;
-		error = select(maxfd + 1, &rfds, NULL, NULL, &tv);
-		if (error == -1 && errno == EINTR) {
-			printf("select interrupted\n");
+		n = poller_wait(logs_poller, events, POLLER_MAX_EVENTS, -1);
+		if (n == -1 && errno == EINTR) {
 			continue;
 		}
-		if (error == -1) {
-			err(1, "select(tty io) failed");
-		}
-		if (error == 0) {
-			continue;
+		if (n == -1) {
+			err(1, "poller_wait(logs) failed");
 		}
-		pthread_mutex_lock(&cblock_mutex);
-		TAILQ_FOREACH(pi, &pr_head, p_glue) {
-			if (!FD_ISSET(pi->p_ttyfd, &rfds)) {
+		for (k = 0; k < n; k++) {
+			if (events[k].pe_arg == NULL ||
+			    tty_io_logs_event(events[k].pe_arg,
+			    events[k].pe_write) == 0) {
 				continue;
 			}
-			cc = read(pi->p_ttyfd, buf, sizeof(buf));
-			if (cc == 0) {
-				reap_children = 1;
-				pi->p_state |= STATE_DEAD;
-				continue;
+			/*
+			 * A multiplexing connection can have both a read and
+			 * a write event in this batch.
+			 */
+			gone = events[k].pe_arg;
+			for (j = k + 1; j < n; j++) {
+				if (events[j].pe_arg == gone) {
+					events[j].pe_arg = NULL;
+				}
 			}
-			if (cc == -1) {
-				err(1, "%s: read failed:", __func__);
+		}
+	}
+}
+
+/*
+ * Turn the connection into a console multiplexing connection, which is
+ * handed to the logs loop.
+ */
+int
+dispatch_console_mux(struct cblock_peer *p)
+{
+	extern struct global_params gcfg;
+	struct cblock_response resp;
+
+	bzero(&resp, sizeof(resp));
+	if ((p->p_caps & CBLOCK_CAP_CONSOLE_MUX) == 0) {
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "console multiplexing was not negotiated");
+		resp.p_ecode = 1;
+		sock_ipc_send_response(p->p_sock, p->p_proto, &resp);
+		return (0);
+	}
+	/*
+	 * Channels share the one queue, so it is allowed to hold as much
+	 * as several console connections would.
+	 */
+	p->p_mux = mux_create(p->p_sock,
+	    gcfg.c_console_queue_size * TTY_MUX_QUEUE_SCALE, logs_poller, p);
+	if (p->p_mux == NULL) {
+		warn("failed to set up console mux");
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "failed to set up console multiplexing");
+		resp.p_ecode = 1;
+		sock_ipc_send_response(p->p_sock, p->p_proto, &resp);
+		return (0);
+	}
+	sock_ipc_send_response(p->p_sock, p->p_proto, &resp);
+	p->p_flags |= PEER_HANDOFF;
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_muxes++;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+	return (1);
+}
+
+/*
+ * Resize the screen model, if the instance has one. This has to happen
+ * before the pty is resized, so the output which follows SIGWINCH is
+ * parsed at the new size.
+ */
+void
+tty_io_resize(struct cblock_instance *pi, u_int rows, u_int cols)
+{
+
+	pthread_mutex_lock(&pi->p_mtx);
+	if (pi->p_vt != NULL) {
+		vt_resize(pi->p_vt, rows, cols);
+	}
+	pthread_mutex_unlock(&pi->p_mtx);
+}
+
+/*
+ * Queue a redraw of the current screen for a newly attached peer, in place
+ * of the backlog. Called with the instance lock held.
+ */
+static void
+dispatch_console_screen(struct console_peer *cp)
+{
+	struct iovec iov;
+	struct sbuf *sb;
+	size_t len;
+
+	sb = sbuf_new_auto();
+	if (sb == NULL) {
+		err(1, "%s: sbuf_new_auto failed", __func__);
+	}
+	vt_redraw(cp->cp_inst->p_vt, sb);
+	if (sbuf_finish(sb) != 0) {
+		err(1, "%s: sbuf_finish failed", __func__);
+	}
+	len = sbuf_len(sb);
+	iov.iov_base = sbuf_data(sb);
+	iov.iov_len = len;
+	(void) tty_io_peer_output(cp, &iov, 1, len, 1);
+	sbuf_delete(sb);
+	pthread_mutex_lock(&console_stats.cs_mutex);
+	console_stats.cs_redraws++;
+	console_stats.cs_redraw_bytes += len;
+	pthread_mutex_unlock(&console_stats.cs_mutex);
+}
+
+/*
+ * Output from before the start of the scrollback which a console asked for
+ * by offset, byte or line count, read back from the console log. Called
+ * with the instance lock held, so no output can be logged in between and
+ * what is returned runs on into the scrollback. Returns a copy of the
+ * output from *fromp (or as near to it as the log goes back, which *fromp
+ * is moved to) up to the start of the scrollback, or NULL if the log has
+ * none of it. If nlines is non-zero, only that many lines are returned.
+ */
+static u_char *
+dispatch_console_history(struct cblock_instance *pi, uint64_t *fromp,
+    size_t nlines, size_t *lenp)
+{
+	const u_char *nl;
+	u_char *hist;
+	uint64_t end;
+	size_t skip;
+
+	*lenp = 0;
+	end = termbuf_start(&pi->p_ttybuf);
+	if (pi->p_log == NULL || *fromp >= end) {
+		return (NULL);
+	}
+	hist = conlog_tail(pi->p_log, *fromp, end, lenp);
+	if (hist == NULL) {
+		return (NULL);
+	}
+	skip = 0;
+	if (nlines != 0) {
+		nl = scan_rnewline(hist, *lenp, &nlines);
+		if (nl != NULL) {
+			skip = nl - hist + 1;
+		}
+	}
+	if (skip == *lenp) {
+		free(hist);
+		*lenp = 0;
+		return (NULL);
+	}
+	memmove(hist, hist + skip, *lenp - skip);
+	*lenp -= skip;
+	*fromp = end - *lenp;
+	return (hist);
+}
+
+/*
+ * Queue the console backlog for a newly attached peer. Called with the
+ * instance lock held. The backlog is sent straight out of the scrollback
+ * pages. Consoles which are resuming only get the output after their
+ * offset, untrimmed, followed by the offset at which live output starts
+ * and how much of what they asked for had already been discarded. An
+ * offset beyond the end of the stream (e.g.: one from an earlier instance
+ * with the same name) gets the whole backlog. Otherwise the backlog can be
+ * limited to the last N lines and/or bytes, whichever is shorter. Either
+ * way it can be limited to the output written since a given time. When
+ * none of these were asked for and the instance has a screen model, the
+ * current screen is sent instead. Output asked for by offset, line or byte
+ * count which has already left the scrollback is read back from the
+ * console log, if the instance has one and it still holds the output.
+ */
+static void
+dispatch_console_backlog(struct console_peer *cp,
+    struct cblock_console_connect *pcc)
+{
+	struct cblock_instance *pi;
+	struct cblock_console_offset co;
+	struct iovec *iov, oiov;
+	uint64_t from, start;
+	size_t len, hlen, nlines;
+	u_char *hist;
+	int iovcnt, k;
+
+	pi = cp->cp_inst;
+	termbuf_touch(&pi->p_ttybuf);
+	if (pi->p_vt != NULL && !pcc->p_resume && !pcc->p_logs &&
+	    pcc->p_replay_lines == 0 && pcc->p_replay_bytes == 0 &&
+	    pcc->p_since_time == 0) {
+		dispatch_console_screen(cp);
+		return;
+	}
+	from = 0;
+	nlines = 0;
+	hist = NULL;
+	hlen = 0;
+	bzero(&co, sizeof(co));
+	co.co_offset = termbuf_head(&pi->p_ttybuf);
+	if (pcc->p_since_time != 0) {
+		from = termbuf_time_start(&pi->p_ttybuf, pcc->p_since_time);
+	}
+	if (pcc->p_resume && pcc->p_resume_offset <= co.co_offset) {
+		/*
+		 * Output from before the requested time was not wanted, so
+		 * it is not counted as a gap.
+		 */
+		if (pcc->p_resume_offset > from) {
+			from = pcc->p_resume_offset;
+		}
+		start = from;
+		hist = dispatch_console_history(pi, &start, 0, &hlen);
+		if (hist == NULL) {
+			start = termbuf_start(&pi->p_ttybuf);
+		}
+		if (from < start) {
+			co.co_gap = start - from;
+		}
+	} else if (!pcc->p_resume) {
+		if (pcc->p_replay_lines != 0) {
+			/*
+			 * If the scrollback holds fewer lines, the rest are
+			 * looked for in the log.
+			 */
+			nlines = pcc->p_replay_lines;
+			start = termbuf_lines_start(&pi->p_ttybuf, &nlines);
+			if (nlines == 0 && start > from) {
+				from = start;
 			}
-			termbuf_append(&pi->p_ttybuf, buf, cc);
-			if (pi->p_state != STATE_CONNECTED) {
-				continue;
+		}
+		if (pcc->p_replay_bytes != 0 &&
+		    pcc->p_replay_bytes < co.co_offset) {
+			start = co.co_offset - pcc->p_replay_bytes;
+			if (start > from) {
+				from = start;
 			}
-			len = cc;
-			cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
-			sock_ipc_must_write(pi->p_peer_sock, &cmd, sizeof(cmd));
-			sock_ipc_must_write(pi->p_peer_sock, &len, sizeof(len));
-			sock_ipc_must_write(pi->p_peer_sock, buf, cc);
 		}
-		pthread_mutex_unlock(&cblock_mutex);
+		if (nlines != 0 || pcc->p_replay_bytes != 0) {
+			hist = dispatch_console_history(pi, &from, nlines,
+			    &hlen);
+		}
+	}
+	iovcnt = pi->p_ttybuf.t_npages;
+	iov = calloc(iovcnt + 2, sizeof(*iov));	/* never calloc(0) */
+	if (iov == NULL) {
+		err(1, "calloc(iovec) failed");
+	}
+	k = 0;
+	if (hist != NULL) {
+		iov[0].iov_base = hist;
+		iov[0].iov_len = hlen;
+		k = 1;
+	}
+	iovcnt = k + termbuf_snapshot(&pi->p_ttybuf, iov + k, iovcnt, from);
+	if (pcc->p_resume) {
+		len = 0;
+		for (k = 0; k < iovcnt; k++) {
+			len += iov[k].iov_len;
+		}
+	} else {
+		len = tty_trim_iov(iov, &iovcnt);
+	}
+	if (len > 0 && tty_io_peer_output(cp, iov, iovcnt, len, 1) == -1) {
+		free(iov);
+		free(hist);
+		return;
+	}
+	free(iov);
+	free(hist);
+	if (!pcc->p_resume) {
+		return;
+	}
+	oiov.iov_base = &co;
+	oiov.iov_len = sizeof(co);
+	if (tty_io_peer_msg(cp, PRISON_IPC_CONSOLE_OFFSET, &oiov, 1,
+	    1) == 0) {
+		cp->cp_flags |= PEER_RESUME;
 	}
 }
 
 int
-dispatch_connect_console(int sock)
+dispatch_connect_console(struct cblock_peer *p)
 {
-	extern pthread_mutex_t cblock_mutex;
+	extern struct global_params gcfg;
 	struct cblock_console_connect pcc;
 	struct cblock_response resp;
 	struct cblock_instance *pi;
-	char *tty_block, *trimmed;
-	ssize_t tty_buflen;
-	uint32_t cmd;
-	size_t len;
-	int ttyfd;
+	struct console_peer *cp;
+	struct tty_io_setup ts;
+	int ttyfd, sock, handoff, ret;
 
+	sock = p->p_sock;
 	bzero(&resp, sizeof(resp));
-	sock_ipc_must_read(sock, &pcc, sizeof(pcc));
-	pthread_mutex_lock(&cblock_mutex);
+	if (sock_ipc_recv_console_connect(sock, p->p_proto, &pcc) != 1) {
+		return (1);
+	}
+	if (pcc.p_logs) {
+		pcc.p_watch = 1;
+	}
 	pi = cblock_lookup_instance(pcc.p_instance);
 	if (pi == NULL) {
-		pthread_mutex_unlock(&cblock_mutex);
 		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
 		    "%s invalid container", pcc.p_instance);
 		resp.p_ecode = 1;
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
-	if ((pi->p_state & STATE_CONNECTED) != 0) {
-		pthread_mutex_unlock(&cblock_mutex);
+	pthread_mutex_lock(&pi->p_mtx);
+	cp = NULL;
+	if ((pi->p_state & STATE_DEAD) == 0) {
+		cp = tty_io_attach(pi, sock, !pcc.p_watch);
+	}
+	if (cp == NULL) {
 		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
-		    "%s console already attached", pcc.p_instance);
+		    "%s %s", pcc.p_instance,
+		    (pi->p_state & STATE_DEAD) != 0 ? "is not running" :
+		    pcc.p_watch ? "has too many consoles attached" :
+		    "console already attached");
+		pthread_mutex_unlock(&pi->p_mtx);
+		cblock_instance_rele(pi);
 		resp.p_ecode = 1;
-		sock_ipc_must_write(sock, &resp, sizeof(resp));
+		sock_ipc_send_response(sock, p->p_proto, &resp);
 		return (1);
 	}
 	CBLOCKD_CBLOCK_CONSOLE_ATTACH(pcc.p_instance);
-	pi->p_state = STATE_CONNECTED;
+	if ((p->p_caps & CBLOCK_CAP_CONSOLE_FRAMES) != 0) {
+		cp->cp_flags |= PEER_FRAMED;
+	}
+	if ((p->p_caps & CBLOCK_CAP_CONSOLE_DEFLATE) != 0) {
+		cp->cp_zs = zstream_deflate_init(gcfg.c_console_compress);
+		if (cp->cp_zs == NULL) {
+			warnx("%s: failed to set up console compression, "
+			    "sending it uncompressed", pcc.p_instance);
+		}
+	}
 	ttyfd = pi->p_ttyfd;
-	tty_block = termbuf_to_contig(&pi->p_ttybuf);
-	tty_buflen = pi->p_ttybuf.t_tot_len;
-	pi->p_peer_sock = sock;
-	pthread_mutex_unlock(&cblock_mutex);
+	/*
+	 * The response, and the message setting up a ring reader or a pty
+	 * handoff, have to reach the peer ahead of the backlog and of any pty
+	 * output. The peer's queue is held while the backlog is queued, so
+	 * output from the I/O loop can only queue up behind it, and they are
+	 * sent with blocking writes once the instance lock has been dropped,
+	 * where a slow peer does not hold up the instance.
+	 */
+	cp->cp_outq.oq_held = 1;
+	ts.ts_len = 0;
+	if (pcc.p_logs && pcc.p_shm &&
+	    (p->p_caps & CBLOCK_CAP_CONSOLE_SHM) != 0) {
+		tty_io_shm_attach(cp, &ts);
+	}
+	handoff = !pcc.p_watch && pcc.p_handoff &&
+	    (p->p_caps & CBLOCK_CAP_CONSOLE_HANDOFF) != 0 &&
+	    (p->p_caps & CBLOCK_CAP_CONSOLE_FRAMES) != 0;
+	if (handoff) {
+		tty_io_handoff(p, cp, &ts);
+	}
+	dispatch_console_backlog(cp, &pcc);
+	/*
+	 * The end of the backlog, from here on the client reads the pty.
+	 */
+	if (handoff && (cp->cp_flags & PEER_DIRECT) != 0) {
+		(void) tty_io_peer_msg(cp, PRISON_IPC_CONSOLE_HANDOFF, NULL,
+		    0, 1);
+	}
+	pthread_mutex_unlock(&pi->p_mtx);
 	resp.p_ecode = 0;
-	sock_ipc_must_write(sock, &resp, sizeof(resp));
-	if (tty_block) {
-		cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
-		sock_ipc_must_write(sock, &cmd, sizeof(cmd));
-		trimmed = tty_trim_buffer(tty_block, tty_buflen, &len);
-		sock_ipc_must_write(sock, &len, sizeof(len));
-		sock_ipc_must_write(sock, trimmed, len);
-		free(tty_block);
-	}
-	if (tcsetattr(ttyfd, TCSANOW, &pcc.p_termios) == -1) {
-		err(1, "tcsetattr(TCSANOW) console connect");
-	}
-	if (ioctl(ttyfd, TIOCSWINSZ, &pcc.p_winsize) == -1) {
-		err(1, "ioctl(TIOCSWINSZ): failed");
-	}
-	tty_console_session(pcc.p_instance, sock, ttyfd);
-	cblock_detach_console(pcc.p_instance);
+	sock_ipc_send_response(sock, p->p_proto, &resp);
+	ret = 0;
+	if (ts.ts_len != 0) {
+		ret = tty_io_setup_send(cp, &ts);
+	}
+	pthread_mutex_lock(&pi->p_mtx);
+	cp->cp_outq.oq_held = 0;
+	if (ret == -1 && (cp->cp_flags & PEER_GONE) == 0) {
+		tty_io_disconnect(cp);
+	}
+	if ((cp->cp_flags & PEER_GONE) == 0) {
+		(void) tty_io_peer_update(cp,
+		    outq_flush(&cp->cp_outq, cp->cp_sock));
+	}
+	pthread_mutex_unlock(&pi->p_mtx);
+	/*
+	 * Log subscribers send no input, so there is no need to tie up a
+	 * worker thread reading it. The connection is handed to the logs
+	 * loop, which only waits for it to close.
+	 */
+	if (pcc.p_logs) {
+		p->p_console = cp;
+		p->p_flags |= PEER_HANDOFF;
+		return (1);
+	}
+	/*
+	 * Only the writer gets to set the terminal up, watchers see it the
+	 * way it is.
+	 */
+	if (!pcc.p_watch) {
+		if (tcsetattr(ttyfd, TCSANOW, &pcc.p_termios) == -1) {
+			err(1, "tcsetattr(TCSANOW) console connect");
+		}
+		tty_io_resize(pi, pcc.p_winsize.ws_row, pcc.p_winsize.ws_col);
+		if (ioctl(ttyfd, TIOCSWINSZ, &pcc.p_winsize) == -1) {
+			err(1, "ioctl(TIOCSWINSZ): failed");
+		}
+	}
+	tty_console_session(cp);
+	cblock_detach_console(cp);
+	cblock_instance_rele(pi);
 	return (1);
 }
 
 int
-dispatch_launch_cblock(int sock)
+dispatch_launch_cblock(struct cblock_peer *p)
 {
-	extern cblock_instance_head_t pr_head;
-	extern pthread_mutex_t cblock_mutex;
+	extern pthread_rwlock_t cblock_lock;
 	extern struct global_params gcfg;
 	char **env, **argv, buf[128];
 	struct cblock_response resp;
 	struct cblock_instance *pi;
 	vec_t *cmd_vec, *env_vec;
 	struct cblock_launch pl;
-	ssize_t cc;
+	int sock;
 
-	cc = sock_ipc_must_read(sock, &pl, sizeof(pl));
-	if (cc == 0) {
+	sock = p->p_sock;
+	if (sock_ipc_recv_launch(sock, p->p_proto, &pl) != 1) {
 		return (0);
 	}
-	pi = calloc(1, sizeof(*pi));
-	if (pi == NULL) {
-		err(1, "calloc failed");
-	}
-	pi->p_type = PRISON_TYPE_REGULAR;
+	pi = cblock_instance_alloc(PRISON_TYPE_REGULAR);
 	strlcpy(pi->p_image_name, pl.p_name, sizeof(pi->p_image_name));
+	if (pl.p_output_rate != 0) {
+		tty_io_set_limit(pi, pl.p_output_rate, pl.p_output_burst);
+	}
 	cmd_vec = vec_init(64);
 	env_vec = vec_init(64);
 	/*
@@ -260,6 +2049,7 @@ dispatch_launch_cblock(int sock)
 	vec_append(cmd_vec, gcfg.c_data_dir);
 	vec_append(cmd_vec, pl.p_name);
 	pi->p_instance_tag = gen_sha256_instance_id(pl.p_name);
+	pi->p_log = conlog_open(pi->p_instance_tag);
 	pi->p_launch_time = time(NULL);
 	vec_append(cmd_vec, pi->p_instance_tag);
 	vec_append(cmd_vec, pl.p_volumes);
@@ -281,71 +2071,269 @@ dispatch_launch_cblock(int sock)
 		execve(*argv, argv, env);
 		err(1, "execve failed");
 	}
+	if (pi->p_pid == -1) {
+		warn("failed to fork launch job");
+		cblock_instance_rele(pi);
+		bzero(&resp, sizeof(resp));
+		resp.p_ecode = -1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "failed to fork launch job");
+		sock_ipc_send_response(sock, p->p_proto, &resp);
+		return (1);
+	}
 	cblock_create_pid_file(pi);
-	TAILQ_INIT(&pi->p_ttybuf.t_head);
-	pi->p_ttybuf.t_tot_len = 0;
-	pthread_mutex_lock(&cblock_mutex);
+	pthread_rwlock_wrlock(&cblock_lock);
 	CBLOCKD_CBLOCK_CREATE(pi->p_instance_tag);
-	TAILQ_INSERT_HEAD(&pr_head, pi, p_glue);
-	pthread_mutex_unlock(&cblock_mutex);
-	resp.p_ecode = 0;
+	if (tty_io_watch_exit(pi) == -1) {
+		pthread_rwlock_unlock(&cblock_lock);
+		cblock_abort(pi);
+		bzero(&resp, sizeof(resp));
+		resp.p_ecode = -1;
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "failed to watch launch job");
+		sock_ipc_send_response(sock, p->p_proto, &resp);
+		return (1);
+	}
+	registry_insert(pi);
+	(void) tty_io_register(pi);
+	pthread_rwlock_unlock(&cblock_lock);
+	bzero(&resp, sizeof(resp));
 	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "%s",
 	    pi->p_instance_tag);
-	sock_ipc_must_write(sock, &resp, sizeof(resp));
+	sock_ipc_send_response(sock, p->p_proto, &resp);
 	return (1);
 }
 
-void *
-dispatch_work(void *arg)
+/*
+ * Change the console output rate limit of a running instance. The new
+ * limit starts out with a full bucket.
+ */
+int
+dispatch_console_limit(struct cblock_peer *p)
+{
+	struct cblock_console_limit pcl;
+	struct cblock_response resp;
+	struct cblock_instance *pi;
+
+	if (sock_ipc_recv_console_limit(p->p_sock, p->p_proto, &pcl) != 1) {
+		return (0);
+	}
+	bzero(&resp, sizeof(resp));
+	pi = cblock_lookup_instance(pcl.p_instance);
+	if (pi == NULL) {
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf),
+		    "%s invalid container", pcl.p_instance);
+		resp.p_ecode = 1;
+		sock_ipc_send_response(p->p_sock, p->p_proto, &resp);
+		return (1);
+	}
+	tty_io_set_limit(pi, pcl.p_output_rate, pcl.p_output_burst);
+	cblock_instance_rele(pi);
+	sock_ipc_send_response(p->p_sock, p->p_proto, &resp);
+	return (1);
+}
+
+/*
+ * Negotiate the protocol version for this connection. We settle on the
+ * lowest version supported by both ends, and only the capabilities which
+ * are common to both.
+ */
+static int
+dispatch_hello(struct cblock_peer *p)
+{
+	extern struct global_params gcfg;
+	struct cblock_hello hello;
+
+	if (sock_ipc_must_read(p->p_sock, &hello, sizeof(hello)) == 0) {
+		return (0);
+	}
+	if (hello.h_magic != CBLOCK_PROTO_MAGIC) {
+		hello.h_version = CBLOCK_PROTO_LEGACY;
+		hello.h_caps = 0;
+	}
+	if (hello.h_version > CBLOCK_PROTO_VERSION) {
+		hello.h_version = CBLOCK_PROTO_VERSION;
+	}
+	hello.h_magic = CBLOCK_PROTO_MAGIC;
+	hello.h_caps &= CBLOCK_CAPS;
+	/*
+	 * Compression only pays off over the network, local consoles would
+	 * just spend CPU on it.
+	 */
+	if ((p->p_family != PF_INET && p->p_family != PF_INET6) ||
+	    gcfg.c_console_compress == 0) {
+		hello.h_caps &= ~CBLOCK_CAP_CONSOLE_DEFLATE;
+	}
+	/*
+	 * Descriptors can only be passed over UNIX domain sockets.
+	 */
+	if (p->p_family != PF_UNIX) {
+		hello.h_caps &= ~(CBLOCK_CAP_CONSOLE_SHM |
+		    CBLOCK_CAP_CONSOLE_HANDOFF);
+	}
+	if ((hello.h_caps & CBLOCK_CAP_TLV) == 0) {
+		hello.h_version = CBLOCK_PROTO_LEGACY;
+	}
+	sock_ipc_must_write(p->p_sock, &hello, sizeof(hello));
+	p->p_proto = hello.h_version;
+	p->p_caps = hello.h_caps;
+	return (1);
+}
+
+static int
+dispatch_command(struct cblock_peer *p, uint32_t cmd)
 {
-	extern pthread_mutex_t peer_mutex;
-	extern cblock_peer_head_t p_head;
-	struct cblock_peer *p;
-	uint32_t cmd;
-	ssize_t cc;
 	int done;
 
-	signal(SIGCHLD, handle_reap_children);
-	p = (struct cblock_peer *)arg;
-	printf("newly accepted socket: %d\n", p->p_sock);
 	done = 0;
-	while (!done) {
-		printf("waiting for command\n");
-		cc = sock_ipc_may_read(p->p_sock, &cmd, sizeof(cmd));
-		if (cc == 1) {
-			break;
-		}
-		switch (cmd) {
-		case PRISON_IPC_GENERIC_COMMAND:
-			cc = dispatch_generic_command(p->p_sock);
-			done = 1;
-			break;
-		case PRISON_IPC_GET_INSTANCES:
-			cc = dispatch_get_instances(p->p_sock);
-			break;
-		case PRISON_IPC_SEND_BUILD_CTX:
-			cc = dispatch_build_recieve(p->p_sock);
-			break;
-		case PRISON_IPC_CONSOLE_CONNECT:
-			cc = dispatch_connect_console(p->p_sock);
-			done = 1;
-			break;
-		case PRISON_IPC_LAUNCH_PRISON:
-			cc = dispatch_launch_cblock(p->p_sock);
-			break;
-		default:
-			/*
-			 * NB: maybe best to send a response
-			 */
-			warnx("unknown command %u", cmd);
-			done = 1;
-			break;
-		}
+	switch (cmd) {
+	case PRISON_IPC_HELLO:
+		(void) dispatch_hello(p);
+		break;
+	case PRISON_IPC_GET_STATS:
+		(void) dispatch_get_stats(p);
+		break;
+	case PRISON_IPC_CONSOLE_LIMIT:
+		(void) dispatch_console_limit(p);
+		break;
+	case PRISON_IPC_CONSOLE_MUX:
+		done = !dispatch_console_mux(p);
+		break;
+	case PRISON_IPC_GENERIC_COMMAND:
+		(void) dispatch_generic_command(p);
+		done = 1;
+		break;
+	case PRISON_IPC_GET_INSTANCES:
+		(void) dispatch_get_instances(p);
+		break;
+	case PRISON_IPC_QUERY_INSTANCES:
+		done = !dispatch_query_instances(p);
+		break;
+	case PRISON_IPC_SEND_BUILD_CTX:
+		(void) dispatch_build_recieve(p);
+		break;
+	case PRISON_IPC_CONSOLE_CONNECT:
+		(void) dispatch_connect_console(p);
+		done = 1;
+		break;
+	case PRISON_IPC_LAUNCH_PRISON:
+		(void) dispatch_launch_cblock(p);
+		break;
+	default:
+		/*
+		 * NB: maybe best to send a response
+		 */
+		warnx("unknown command %u", cmd);
+		done = 1;
+		break;
 	}
+	return (done);
+}
+
+void
+dispatch_peer_close(struct cblock_peer *p)
+{
+	extern pthread_mutex_t peer_mutex;
+	extern cblock_peer_head_t p_head;
+
 	close(p->p_sock);
 	pthread_mutex_lock(&peer_mutex);
 	TAILQ_REMOVE(&p_head, p, p_glue);
 	pthread_mutex_unlock(&peer_mutex);
 	free(p);
-	return (NULL);
+}
+
+/*
+ * Once a command has been serviced, either tear the connection down or
+ * hand it back to the event loop to wait for the next command.
+ */
+static void
+dispatch_peer_done(struct cblock_peer *p, int done)
+{
+
+	if ((p->p_flags & PEER_HANDOFF) != 0) {
+		tty_io_logs_add(p);
+		return;
+	}
+	if (done || sock_ipc_rearm(p) == -1) {
+		dispatch_peer_close(p);
+	}
+}
+
+/*
+ * Called from the event loop when a peer has a command waiting. Nothing
+ * beyond the command word is read here, and it is read without blocking:
+ * a peer which has sent only part of it is handed back to the poller until
+ * the rest arrives. The rest of a command, and its reply, are exchanged
+ * with blocking I/O by a worker, which a slow or stalled peer would
+ * otherwise hold the event loop (and every other accept) up with.
+ * Short commands go to the control pool, so they are not queued behind
+ * anything which can block for an extended period of time (builds,
+ * launches and generic commands), which goes to the dispatch pool. Console
+ * sessions hold their thread for as long as they stay attached, so they
+ * have a pool of their own, and idle consoles can not use up the threads
+ * the other commands need.
+ */
+void
+dispatch_peer_ready(struct cblock_peer *p)
+{
+	extern struct worker_pool dispatch_pool, control_pool, console_pool;
+	struct worker_pool *wp;
+	ssize_t cc;
+	u_char *s;
+
+	s = (u_char *)&p->p_cmd;
+	while (p->p_cmdlen < sizeof(p->p_cmd)) {
+		cc = read(p->p_sock, s + p->p_cmdlen,
+		    sizeof(p->p_cmd) - p->p_cmdlen);
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			if (sock_ipc_rearm(p) == -1) {
+				dispatch_peer_close(p);
+			}
+			return;
+		}
+		if (cc <= 0) {
+			dispatch_peer_close(p);
+			return;
+		}
+		p->p_cmdlen += cc;
+	}
+	p->p_cmdlen = 0;
+	if (sock_ipc_set_nonblock(p->p_sock, 0) == -1) {
+		dispatch_peer_close(p);
+		return;
+	}
+	switch (p->p_cmd) {
+	case PRISON_IPC_HELLO:
+	case PRISON_IPC_GET_INSTANCES:
+	case PRISON_IPC_QUERY_INSTANCES:
+	case PRISON_IPC_GET_STATS:
+	case PRISON_IPC_CONSOLE_LIMIT:
+	case PRISON_IPC_CONSOLE_MUX:
+		wp = &control_pool;
+		break;
+	case PRISON_IPC_CONSOLE_CONNECT:
+		wp = &console_pool;
+		break;
+	default:
+		wp = &dispatch_pool;
+		break;
+	}
+	if (worker_pool_enqueue(wp, &p->p_work) == -1) {
+		warnx("%s queue full, dropping connection %d", wp->wp_name,
+		    p->p_sock);
+		dispatch_peer_close(p);
+	}
+}
+
+void
+dispatch_work(void *arg)
+{
+	struct cblock_peer *p;
+
+	p = arg;
+	dispatch_peer_done(p, dispatch_command(p, p->p_cmd));
 }
@@ -27,18 +27,70 @@
 #ifndef DISPATCH_DOT_H_
 #define DISPATCH_DOT_H_
 
+struct conlog;
+struct vt;
+struct cblock_instance;
+
+/*
+ * A console attached to an instance. Any number of peers may watch the
+ * console output, at most one of them (the writer) may send input.
+ */
+struct console_peer {
+	int				 cp_sock;
+	uint32_t			 cp_flags;
+#define	PEER_WRITER		0x00000001
+#define	PEER_WAIT		0x00000002	/* waiting for peer to drain */
+#define	PEER_RESUME		0x00000004	/* peer tracks stream offsets */
+#define	PEER_GONE		0x00000008	/* disconnected, awaiting detach */
+#define	PEER_FRAMED		0x00000010	/* input is framed */
+#define	PEER_DIRECT		0x00000020	/* has the pty itself */
+	struct outq			 cp_outq;	/* pending output */
+	struct zstream			*cp_zs;	/* NULL if not compressing */
+	struct console_mux		*cp_mux; /* NULL if not a channel */
+	uint32_t			 cp_channel;
+	int				 cp_wakefd; /* -1 unless reading the ring */
+	struct cblock_instance		*cp_inst;
+	TAILQ_ENTRY(console_peer)	 cp_glue;
+};
+
 struct cblock_instance {
         int                             p_type;
+	pthread_mutex_t			p_mtx;	/* protects state, peers, ttybuf */
+	u_int				p_refcount; /* protected by p_mtx */
         uint32_t                        p_state;
 #define STATE_DEAD              0x00000001
 #define STATE_CONNECTED         0x00000002
+#define	STATE_PAUSED		0x00000004	/* pty reads paused */
+#define	STATE_BATCHED		0x00000008	/* on the batch list */
+#define	STATE_THROTTLED		0x00000010	/* pty reads rate limited */
+#define	STATE_LIMITED		0x00000020	/* output held back by limit */
+#define	STATE_DIRECT		0x00000040	/* pty handed to the writer */
         char                            p_name[256];
         pid_t                           p_pid;
         int                             p_ttyfd;
         char                            p_ttyname[256];
         TAILQ_ENTRY(cblock_instance)    p_glue;
+	TAILQ_ENTRY(cblock_instance)	p_hash_glue; /* registry bucket */
+	TAILQ_ENTRY(cblock_instance)	p_pid_glue; /* by pid */
+	int				p_procfd; /* exit watch, or -1 */
+	int				p_terminating; /* cblock_lock */
+	uint64_t			p_reaped; /* usecs */
+	struct work			p_cleanup; /* teardown */
         struct tty_buffer               p_ttybuf;
-        int                             p_peer_sock;
+	TAILQ_HEAD( , console_peer)	p_peers;
+	u_int				p_npeers;
+	struct console_peer		*p_writer;
+	struct conlog			*p_log;	/* NULL if not logging */
+	struct vt			*p_vt;	/* NULL if no screen model */
+	struct shmring			*p_ring; /* NULL if no ring readers */
+	u_int				p_ring_readers;
+	struct batch			p_batch; /* console output held back */
+	TAILQ_ENTRY(cblock_instance)	p_batch_glue;
+	struct sched_ent		p_sched; /* tty I/O loop only */
+	struct ratelimit		p_limit; /* console output rate */
+	uint64_t			p_throttled; /* bytes held back */
+	uint64_t			p_wakeup; /* usecs, if throttled */
+	TAILQ_ENTRY(cblock_instance)	p_throttle_glue;
         int                             p_pipe[2];
         char                            *p_instance_tag;
         time_t                          p_launch_time;
@@ -50,17 +102,42 @@ struct cblock_instance {
 typedef TAILQ_HEAD( , cblock_peer) cblock_peer_head_t;
 typedef TAILQ_HEAD( , cblock_instance) cblock_instance_head_t;
 
-int		dispatch_get_instances(int);
-int		dispatch_generic_command(int);
+struct cblock_peer;
+struct stats_ctx;
+
+int		dispatch_get_instances(struct cblock_peer *);
+int		dispatch_query_instances(struct cblock_peer *);
+int		dispatch_generic_command(struct cblock_peer *);
 void *		tty_io_queue_loop(void *);
-int		dispatch_build_recieve(int);
+void *		tty_io_logs_loop(void *);
+void		tty_io_logs_add(struct cblock_peer *);
+void		tty_io_queue_init(void);
+int		tty_io_register(struct cblock_instance *);
+void		tty_io_unregister(struct cblock_instance *);
+int		tty_io_watch_exit(struct cblock_instance *);
+struct console_peer *
+		tty_io_attach(struct cblock_instance *, int, int);
+void		tty_io_detach(struct console_peer *);
+int		tty_io_peer_send(struct console_peer *,
+		    const struct iovec *, int);
+void		tty_io_session_done(struct cblock_instance *);
+void		tty_io_resize(struct cblock_instance *, u_int, u_int);
+void		tty_io_tee(struct cblock_instance *, const u_char *, size_t);
+void		tty_io_set_limit(struct cblock_instance *, uint64_t,
+		    uint64_t);
+int		dispatch_console_limit(struct cblock_peer *);
+int		dispatch_console_mux(struct cblock_peer *);
+void		tty_io_stats(struct stats_ctx *);
+int		dispatch_build_recieve(struct cblock_peer *);
 char *		gen_sha256_instance_id(char *instance_name);
-void		cblock_fork_cleanup(char *instance, char *, int, int);
+int		cblock_fork_cleanup(char *instance, char *, int, int);
 void		tty_handle_resize(int, char *);
-void		tty_console_session(const char *, int, int);
-char *		tty_trim_buffer(char *, size_t, size_t *);
+void		tty_console_session(struct console_peer *);
+size_t		tty_trim_iov(struct iovec *, int *);
 void		gen_sha256_string(unsigned char *, char *);
 char *		gen_sha256_instance_id(char *);
-void *		dispatch_work(void *);
+void		dispatch_work(void *);
+void		dispatch_peer_ready(struct cblock_peer *);
+void		dispatch_peer_close(struct cblock_peer *);
 
 #endif
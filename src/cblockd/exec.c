@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 
@@ -36,9 +37,15 @@
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
+#include <pthread.h>
 
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "config.h"
@@ -74,7 +81,7 @@ lookup_script(char *command)
 }
 
 int
-dispatch_generic_command(int sock)
+dispatch_generic_command(struct cblock_peer *p)
 {
 	struct cblock_generic_command arg;
 	extern struct global_params gcfg;
@@ -83,14 +90,19 @@ dispatch_generic_command(int sock)
 	ssize_t cc;
 	vec_t *vec;
 	pid_t pid;
+	int sock;
 
+	sock = p->p_sock;
 	/*
 	 * The un-marshalling operation will initializ the vector. Use
 	 * 0 here.
 	 */
 	vec = vec_init(0);
 	marshalled = NULL;
-	sock_ipc_must_read(sock, &arg, sizeof(arg));
+	if (sock_ipc_recv_generic_command(sock, p->p_proto, &arg) != 1) {
+		vec_free(vec);
+		return (1);
+	}
 	printf("got command %s\n", arg.p_cmdname);
 	if (arg.p_mlen != 0) {
 		marshalled = malloc(arg.p_mlen);
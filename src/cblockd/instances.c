@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <stdio.h>
 #include <pthread.h>
@@ -37,28 +38,536 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include <cblock/sbuf.h>
+
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "config.h"
 #include "cblock.h"
+#include "registry.h"
 
 #include <cblock/libcblock.h>
 
-int
-dispatch_get_instances(sock)
+/*
+ * Instance listings are served from a snapshot of the registry: a compact
+ * copy of the fields listings show. The first listing after an instance
+ * has come, started terminating or gone, or been attached to (that is,
+ * once the registry epoch has moved on) copies the registry under the read
+ * lock; every listing until the next change shares that copy, and none of
+ * them hold a lock while they filter, sort or send it.
+ */
+struct instance_snap_ent {
+	const char		*se_name;
+	const char		*se_image;
+	const char		*se_tty;
+	pid_t			 se_pid;
+	time_t			 se_start;
+	int			 se_type;
+	int			 se_attached;
+	int			 se_terminating;
+};
+
+struct instance_snap {
+	u_int			 is_refs;	/* snap_mtx */
+	uint64_t		 is_epoch;
+	size_t			 is_count;
+	struct instance_snap_ent *is_ents;
+	char			*is_strs;	/* the entries' strings */
+};
+
+/*
+ * Entries are packed into messages as they are encoded.
+ */
+struct instance_writer {
+	int			 iw_fd;
+	int			 iw_error;
+	struct sbuf		 iw_sb;
+	char			 iw_buf[TLV_MSG_MAX];
+};
+
+static pthread_mutex_t		 snap_mtx = PTHREAD_MUTEX_INITIALIZER;
+static struct instance_snap	*snap_cur;
+
+static const char *
+instance_snap_str(char **arena, const char *str)
+{
+	const char *ret;
+	size_t len;
+
+	ret = *arena;
+	len = strlen(str) + 1;
+	bcopy(str, *arena, len);
+	*arena += len;
+	return (ret);
+}
+
+static struct instance_snap *
+instance_snap_build(void)
+{
+	extern cblock_instance_head_t pr_head;
+	extern pthread_rwlock_t cblock_lock;
+	struct instance_snap_ent *se;
+	struct cblock_instance *pi;
+	struct instance_snap *is;
+	size_t len;
+	char *arena;
+
+	is = calloc(1, sizeof(*is));
+	if (is == NULL) {
+		err(1, "calloc failed");
+	}
+	is->is_refs = 1;
+	pthread_rwlock_rdlock(&cblock_lock);
+	is->is_epoch = registry_epoch();
+	is->is_count = registry_count();
+	is->is_ents = calloc(is->is_count + 1, sizeof(*is->is_ents));
+	len = 1;
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		len += strlen(pi->p_instance_tag) + strlen(pi->p_image_name) +
+		    strlen(pi->p_ttyname) + 3;
+	}
+	is->is_strs = malloc(len);
+	if (is->is_ents == NULL || is->is_strs == NULL) {
+		err(1, "%s: malloc failed", __func__);
+	}
+	arena = is->is_strs;
+	se = is->is_ents;
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		se->se_name = instance_snap_str(&arena, pi->p_instance_tag);
+		se->se_image = instance_snap_str(&arena, pi->p_image_name);
+		se->se_tty = instance_snap_str(&arena, pi->p_ttyname);
+		se->se_pid = pi->p_pid;
+		se->se_start = pi->p_launch_time;
+		se->se_type = pi->p_type;
+		se->se_terminating = pi->p_terminating;
+		pthread_mutex_lock(&pi->p_mtx);
+		se->se_attached = (pi->p_state & STATE_CONNECTED) != 0;
+		pthread_mutex_unlock(&pi->p_mtx);
+		se++;
+	}
+	pthread_rwlock_unlock(&cblock_lock);
+	return (is);
+}
+
+static void
+instance_snap_rele(struct instance_snap *is)
+{
+	u_int refs;
+
+	pthread_mutex_lock(&snap_mtx);
+	refs = --is->is_refs;
+	pthread_mutex_unlock(&snap_mtx);
+	if (refs != 0) {
+		return;
+	}
+	free(is->is_ents);
+	free(is->is_strs);
+	free(is);
+}
+
+/*
+ * Return the snapshot for the current epoch, with a reference held.
+ */
+static struct instance_snap *
+instance_snap_get(void)
+{
+	struct instance_snap *is, *old;
+
+	pthread_mutex_lock(&snap_mtx);
+	is = snap_cur;
+	if (is != NULL && is->is_epoch == registry_epoch()) {
+		is->is_refs++;
+		pthread_mutex_unlock(&snap_mtx);
+		return (is);
+	}
+	pthread_mutex_unlock(&snap_mtx);
+	is = instance_snap_build();
+	/*
+	 * Another listing may have raced us here, keep whichever snapshot
+	 * is the more recent one.
+	 */
+	old = NULL;
+	pthread_mutex_lock(&snap_mtx);
+	if (snap_cur == NULL || snap_cur->is_epoch < is->is_epoch) {
+		old = snap_cur;
+		snap_cur = is;
+		is->is_refs++;
+	}
+	pthread_mutex_unlock(&snap_mtx);
+	if (old != NULL) {
+		instance_snap_rele(old);
+	}
+	return (is);
+}
+
+static const char *
+instance_type_name(int type)
+{
+
+	switch (type) {
+	case PRISON_TYPE_BUILD:
+		return ("building");
+	case PRISON_TYPE_REGULAR:
+		return ("assembled");
+	}
+	return ("");
+}
+
+static const char *
+instance_state_name(const struct instance_snap_ent *se)
+{
+
+	if (se->se_terminating) {
+		return ("terminating");
+	}
+	return (se->se_attached ? "attached" : "detached");
+}
+
+static void
+instance_writer_init(struct instance_writer *iw, int fd)
+{
+
+	iw->iw_fd = fd;
+	iw->iw_error = 0;
+	tlv_msg_init(&iw->iw_sb, iw->iw_buf, sizeof(iw->iw_buf));
+}
+
+static int
+instance_writer_flush(struct instance_writer *iw)
+{
+
+	if (iw->iw_error == 0 && tlv_msg_write(iw->iw_fd, &iw->iw_sb) <= 0) {
+		iw->iw_error = 1;
+	}
+	tlv_msg_init(&iw->iw_sb, iw->iw_buf, sizeof(iw->iw_buf));
+	return (iw->iw_error == 0);
+}
+
+/*
+ * Add the given fields of an entry to the current message, starting a new
+ * one if they do not fit. Query responses start each entry with a
+ * TLV_ENTRY field, as the name need not be among the fields.
+ */
+static void
+instance_writer_put(struct instance_writer *iw,
+    const struct instance_snap_ent *se, uint32_t fields, int delim)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	sbuf_new(&sb, buf, sizeof(buf), SBUF_FIXEDLEN);
+	if (delim) {
+		tlv_put(&sb, TLV_ENTRY, NULL, 0);
+	}
+	if ((fields & INSTANCE_F_NAME) != 0) {
+		tlv_put_str(&sb, TLV_INSTANCE, se->se_name);
+	}
+	if ((fields & INSTANCE_F_IMAGE) != 0) {
+		tlv_put_str(&sb, TLV_IMAGE_NAME, se->se_image);
+	}
+	if ((fields & INSTANCE_F_PID) != 0) {
+		tlv_put_u32(&sb, TLV_PID, se->se_pid);
+	}
+	if ((fields & INSTANCE_F_TTY) != 0) {
+		tlv_put_str(&sb, TLV_TTY_LINE, se->se_tty);
+	}
+	if ((fields & INSTANCE_F_START) != 0) {
+		tlv_put_u64(&sb, TLV_START_TIME, se->se_start);
+	}
+	if ((fields & INSTANCE_F_TYPE) != 0) {
+		tlv_put_str(&sb, TLV_TYPE, instance_type_name(se->se_type));
+	}
+	if ((fields & INSTANCE_F_STATE) != 0) {
+		tlv_put_str(&sb, TLV_STATE, instance_state_name(se));
+	}
+	if (sbuf_finish(&sb) != 0) {
+		return;
+	}
+	if (sbuf_len(&iw->iw_sb) + sbuf_len(&sb) >= sizeof(iw->iw_buf)) {
+		(void) instance_writer_flush(iw);
+	}
+	sbuf_bcat(&iw->iw_sb, sbuf_data(&sb), sbuf_len(&sb));
+}
+
+/*
+ * Peers with CBLOCK_CAP_LIST_STREAM get the entries packed into as few
+ * messages as they fit in.
+ */
+static int
+instance_snap_stream(int fd, struct instance_snap *is)
+{
+	struct instance_writer iw;
+	size_t k;
+
+	instance_writer_init(&iw, fd);
+	tlv_put_u64(&iw.iw_sb, TLV_COUNT, is->is_count);
+	for (k = 0; k < is->is_count; k++) {
+		instance_writer_put(&iw, &is->is_ents[k], INSTANCE_F_ALL, 0);
+	}
+	return (instance_writer_flush(&iw));
+}
+
+/*
+ * Everyone else gets the entries the way they always have, as instance_ent
+ * structures.
+ */
+static int
+instance_snap_send(int fd, int proto, struct instance_snap *is)
 {
-	struct instance_ent *ents;
-	size_t count;
+	struct instance_snap_ent *se;
+	struct instance_ent *ents, *cur;
+	size_t k;
+	int ret;
 
-	count = cblock_instance_get_count();
-	sock_ipc_must_write(sock, &count, sizeof(count));
-	if (count == 0) {
-		return (1);
+	ents = calloc(is->is_count + 1, sizeof(*ents));	/* never calloc(0) */
+	if (ents == NULL) {
+		return (0);
+	}
+	for (k = 0; k < is->is_count; k++) {
+		se = &is->is_ents[k];
+		cur = &ents[k];
+		strlcpy(cur->p_instance_name, se->se_name,
+		    sizeof(cur->p_instance_name));
+		strlcpy(cur->p_image_name, se->se_image,
+		    sizeof(cur->p_image_name));
+		cur->p_pid = se->se_pid;
+		strlcpy(cur->p_tty_line, se->se_tty, sizeof(cur->p_tty_line));
+		cur->p_start_time = se->se_start;
+		strlcpy(cur->p_type, instance_type_name(se->se_type),
+		    sizeof(cur->p_type));
+		strlcpy(cur->p_state, instance_state_name(se),
+		    sizeof(cur->p_state));
 	}
-	ents = cblock_populate_instance_entries(count);
-	sock_ipc_must_write(sock, ents, count * sizeof(struct instance_ent));
+	ret = sock_ipc_send_instances(fd, proto, ents, is->is_count);
 	free(ents);
+	return (ret);
+}
+
+int
+dispatch_get_instances(struct cblock_peer *p)
+{
+	struct instance_snap *is;
+
+	is = instance_snap_get();
+	if ((p->p_caps & CBLOCK_CAP_LIST_STREAM) != 0) {
+		(void) instance_snap_stream(p->p_sock, is);
+	} else {
+		(void) instance_snap_send(p->p_sock, p->p_proto, is);
+	}
+	instance_snap_rele(is);
+	return (1);
+}
+
+/*
+ * Sort orders for queries. Entries are ordered by the sort key and then by
+ * name, which is unique, so that a page can be picked up where the last
+ * one ended even if instances came and went in between.
+ */
+#define	SNAP_ENT(x)	(*(const struct instance_snap_ent * const *)(x))
+
+static int
+instance_cmp_name(const void *a, const void *b)
+{
+
+	return (strcmp(SNAP_ENT(a)->se_name, SNAP_ENT(b)->se_name));
+}
+
+static int
+instance_cmp_image(const void *a, const void *b)
+{
+	int cmp;
+
+	cmp = strcmp(SNAP_ENT(a)->se_image, SNAP_ENT(b)->se_image);
+	if (cmp != 0) {
+		return (cmp);
+	}
+	return (instance_cmp_name(a, b));
+}
+
+static int
+instance_cmp_start(const void *a, const void *b)
+{
+
+	if (SNAP_ENT(a)->se_start != SNAP_ENT(b)->se_start) {
+		return (SNAP_ENT(a)->se_start < SNAP_ENT(b)->se_start ?
+		    -1 : 1);
+	}
+	return (instance_cmp_name(a, b));
+}
+
+static int
+instance_cmp_pid(const void *a, const void *b)
+{
+
+	if (SNAP_ENT(a)->se_pid != SNAP_ENT(b)->se_pid) {
+		return (SNAP_ENT(a)->se_pid < SNAP_ENT(b)->se_pid ? -1 : 1);
+	}
+	return (instance_cmp_name(a, b));
+}
+
+static int (*instance_sorts[])(const void *, const void *) = {
+	[INSTANCE_SORT_NAME] = instance_cmp_name,
+	[INSTANCE_SORT_IMAGE] = instance_cmp_image,
+	[INSTANCE_SORT_START] = instance_cmp_start,
+	[INSTANCE_SORT_PID] = instance_cmp_pid,
+};
+
+static int
+instance_query_match(const struct instance_snap_ent *se,
+    const struct cblock_instance_query *q)
+{
+
+	if (q->q_image[0] != '\0' && strcmp(se->se_image, q->q_image) != 0) {
+		return (0);
+	}
+	if (q->q_type != PRISON_TYPE_NONE && se->se_type != q->q_type) {
+		return (0);
+	}
+	switch (q->q_state) {
+	case INSTANCE_STATE_ATTACHED:
+		return (!se->se_terminating && se->se_attached);
+	case INSTANCE_STATE_DETACHED:
+		return (!se->se_terminating && !se->se_attached);
+	case INSTANCE_STATE_TERMINATING:
+		return (se->se_terminating);
+	}
 	return (1);
 }
+
+/*
+ * A cursor is the name of the last entry of a page, followed by a colon
+ * and its sort key (nothing when sorting by name).
+ */
+static void
+instance_cursor_make(const struct instance_snap_ent *se, uint32_t sort,
+    char *buf, size_t len)
+{
+
+	switch (sort) {
+	case INSTANCE_SORT_IMAGE:
+		(void) snprintf(buf, len, "%s:%s", se->se_name, se->se_image);
+		break;
+	case INSTANCE_SORT_START:
+		(void) snprintf(buf, len, "%s:%jd", se->se_name,
+		    (intmax_t)se->se_start);
+		break;
+	case INSTANCE_SORT_PID:
+		(void) snprintf(buf, len, "%s:%d", se->se_name, se->se_pid);
+		break;
+	default:
+		(void) snprintf(buf, len, "%s:", se->se_name);
+		break;
+	}
+}
+
+static void
+instance_cursor_parse(char *cursor, struct instance_snap_ent *key)
+{
+	char *val;
+
+	bzero(key, sizeof(*key));
+	key->se_name = cursor;
+	key->se_image = "";
+	val = strchr(cursor, ':');
+	if (val == NULL) {
+		return;
+	}
+	*val++ = '\0';
+	key->se_image = val;
+	key->se_start = strtoll(val, NULL, 10);
+	key->se_pid = strtol(val, NULL, 10);
+}
+
+static int
+instance_query_send(int fd, struct instance_snap *is,
+    struct cblock_instance_query *q)
+{
+	int (*cmp)(const void *, const void *);
+	const struct instance_snap_ent **vec, *keyp;
+	struct instance_snap_ent key;
+	size_t matched, first, count, lo, hi, mid, k;
+	char cursor[INSTANCE_CURSOR_MAX];
+	struct instance_writer iw;
+	uint32_t fields;
+
+	vec = calloc(is->is_count + 1, sizeof(*vec));	/* never calloc(0) */
+	if (vec == NULL) {
+		return (0);
+	}
+	matched = 0;
+	for (k = 0; k < is->is_count; k++) {
+		if (instance_query_match(&is->is_ents[k], q)) {
+			vec[matched++] = &is->is_ents[k];
+		}
+	}
+	if (q->q_sort >= sizeof(instance_sorts) / sizeof(instance_sorts[0])) {
+		q->q_sort = INSTANCE_SORT_NAME;
+	}
+	cmp = instance_sorts[q->q_sort];
+	qsort(vec, matched, sizeof(*vec), cmp);
+	/*
+	 * The page starts after the last entry which sorts before or at the
+	 * cursor.
+	 */
+	first = 0;
+	if (q->q_cursor[0] != '\0') {
+		instance_cursor_parse(q->q_cursor, &key);
+		keyp = &key;
+		lo = 0;
+		hi = matched;
+		while (lo < hi) {
+			mid = lo + (hi - lo) / 2;
+			if (cmp(&vec[mid], &keyp) <= 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		first = lo;
+	}
+	count = matched - first;
+	if (q->q_limit != 0 && count > q->q_limit) {
+		count = q->q_limit;
+	}
+	fields = (q->q_fields == 0) ? INSTANCE_F_ALL : q->q_fields;
+	instance_writer_init(&iw, fd);
+	tlv_put_u64(&iw.iw_sb, TLV_COUNT, count);
+	tlv_put_u64(&iw.iw_sb, TLV_MATCHED, matched);
+	if (first + count < matched) {
+		instance_cursor_make(vec[first + count - 1], q->q_sort,
+		    cursor, sizeof(cursor));
+		tlv_put_str(&iw.iw_sb, TLV_CURSOR, cursor);
+	}
+	for (k = first; k < first + count; k++) {
+		instance_writer_put(&iw, vec[k], fields, 1);
+	}
+	free(vec);
+	return (instance_writer_flush(&iw));
+}
+
+int
+dispatch_query_instances(struct cblock_peer *p)
+{
+	struct cblock_instance_query q;
+	struct instance_snap *is;
+	int ret;
+
+	if ((p->p_caps & CBLOCK_CAP_LIST_QUERY) == 0) {
+		warnx("instance query from a peer which did not negotiate it");
+		return (0);
+	}
+	if (sock_ipc_recv_instance_query(p->p_sock, &q) != 1) {
+		return (0);
+	}
+	is = instance_snap_get();
+	ret = instance_query_send(p->p_sock, is, &q);
+	instance_snap_rele(is);
+	return (ret);
+}
@@ -0,0 +1,433 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iosched.h"
+
+/*
+ * Interactive entries are credited weight times the bulk quantum each
+ * round.
+ */
+void
+sched_init(struct sched *s, size_t quantum, u_int weight)
+{
+	int k;
+
+	for (k = 0; k < SCHED_NCLASS; k++) {
+		TAILQ_INIT(&s->s_queue[k]);
+	}
+	s->s_quantum[SCHED_INTERACTIVE] = quantum * weight;
+	s->s_quantum[SCHED_BULK] = quantum;
+	s->s_rounds = 0;
+}
+
+void
+sched_ent_init(struct sched_ent *se, void *arg)
+{
+
+	memset(se, 0, sizeof(*se));
+	se->se_arg = arg;
+	se->se_class = -1;
+}
+
+/*
+ * Queue an entry which has been reported ready. An entry which is already
+ * queued keeps its place (and class) until it next leaves the queue.
+ */
+void
+sched_add(struct sched *s, struct sched_ent *se, int class)
+{
+
+	se->se_ready = 1;
+	if (se->se_class != -1) {
+		return;
+	}
+	se->se_class = class;
+	se->se_deficit = 0;
+	TAILQ_INSERT_TAIL(&s->s_queue[class], se, se_glue);
+}
+
+void
+sched_remove(struct sched *s, struct sched_ent *se)
+{
+
+	if (se->se_class == -1) {
+		return;
+	}
+	TAILQ_REMOVE(&s->s_queue[se->se_class], se, se_glue);
+	se->se_class = -1;
+	se->se_deficit = 0;
+}
+
+/*
+ * Give an entry its turn: credit it with its quantum and service it until
+ * the credit runs out, then put it at the back of its queue. An entry with
+ * nothing more to read leaves the queue instead.
+ */
+static void
+sched_turn(struct sched *s, struct sched_ent *se, sched_service_t service)
+{
+	int class;
+	size_t cc;
+
+	class = se->se_class;
+	TAILQ_REMOVE(&s->s_queue[class], se, se_glue);
+	se->se_deficit += s->s_quantum[class];
+	while (se->se_deficit > 0) {
+		cc = service(se->se_arg, se->se_deficit);
+		if (cc == 0) {
+			se->se_class = -1;
+			se->se_deficit = 0;
+			return;
+		}
+		se->se_deficit -= cc;
+	}
+	TAILQ_INSERT_TAIL(&s->s_queue[class], se, se_glue);
+}
+
+/*
+ * Give every interactive entry a turn, followed by the bulk entry at the
+ * front of the queue. Bulk entries thus take their turns one per call, and
+ * the caller checks for new events (without blocking) in between, so
+ * interactive output never waits for more than one bulk quantum. Returns
+ * non-zero if any entries are left queued.
+ */
+int
+sched_run(struct sched *s, sched_service_t service)
+{
+	struct sched_ent *se;
+	int n;
+
+	s->s_rounds++;
+	n = 0;
+	TAILQ_FOREACH(se, &s->s_queue[SCHED_INTERACTIVE], se_glue) {
+		n++;
+	}
+	while (n-- > 0) {
+		sched_turn(s, TAILQ_FIRST(&s->s_queue[SCHED_INTERACTIVE]),
+		    service);
+	}
+	se = TAILQ_FIRST(&s->s_queue[SCHED_BULK]);
+	if (se != NULL) {
+		sched_turn(s, se, service);
+	}
+	return (!TAILQ_EMPTY(&s->s_queue[SCHED_INTERACTIVE]) ||
+	    !TAILQ_EMPTY(&s->s_queue[SCHED_BULK]));
+}
+
+#ifdef __BENCH_SCHED_CODE__
+#include <sys/ioctl.h>
+#include <pthread.h>
+#include <termios.h>
+#include <libutil.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "poller.h"
+#include "ratelimit.h"
+#include "batch.h"
+
+/*
+ * A number of ptys are flooded with output by threads writing to the
+ * slave side as fast as they can, while another thread types a byte into
+ * an "interactive" pty every millisecond. The ptys are serviced the way
+ * the tty I/O loop used to (one read per ready event, in the order the
+ * kernel reports them) and with the deficit round-robin scheduler, with a
+ * per byte cost standing in for the scrollback, screen model and fan-out.
+ * Reported are the interactive latency, the share each flood got, and the
+ * throughput of a flood which is rate limited.
+ *
+ * cc -O2 -D__BENCH_SCHED_CODE__ iosched.c ratelimit.c poller.c batch.c \
+ *     -lpthread -lutil
+ */
+#define	BENCH_FLOODS		8
+#define	BENCH_SECONDS		2
+#define	BENCH_QUANTUM		16384
+#define	BENCH_WEIGHT		4
+#define	BENCH_LIMITED_RATE	(1024 * 1024)
+#define	BENCH_SAMPLES		4096
+
+struct bench_pty {
+	int			 bp_master;
+	int			 bp_slave;
+	int			 bp_interactive;
+	uint64_t		 bp_bytes;
+	struct ratelimit	 bp_limit;
+	uint64_t		 bp_wakeup;	/* throttled until */
+	struct sched_ent	 bp_sched;
+};
+
+static struct bench_pty	 bench_ptys[BENCH_FLOODS + 1];
+static struct poller	*bench_poller;
+static volatile int	 bench_stop;
+static uint64_t		 bench_sent[BENCH_SAMPLES];
+static uint64_t		 bench_lat[BENCH_SAMPLES];
+static volatile u_int	 bench_nsent;
+static u_int		 bench_nlat;
+static volatile uint32_t bench_sink;
+
+static void
+bench_work(const u_char *buf, size_t len)
+{
+	uint32_t h;
+	size_t k;
+	int pass;
+
+	h = 0;
+	for (pass = 0; pass < 4; pass++) {
+		for (k = 0; k < len; k++) {
+			h = h * 31 + buf[k];
+		}
+	}
+	bench_sink += h;
+}
+
+static void *
+bench_flood(void *arg)
+{
+	struct bench_pty *bp;
+	char buf[4096];
+
+	bp = arg;
+	memset(buf, 'y', sizeof(buf));
+	while (!bench_stop) {
+		if (write(bp->bp_slave, buf, sizeof(buf)) == -1 &&
+		    errno != EINTR && errno != EAGAIN) {
+			break;
+		}
+	}
+	return (NULL);
+}
+
+static void *
+bench_typist(void *arg)
+{
+	struct bench_pty *bp;
+	u_int n;
+
+	bp = arg;
+	while (!bench_stop && bench_nsent < BENCH_SAMPLES) {
+		n = bench_nsent;
+		bench_sent[n] = batch_now();
+		bench_nsent = n + 1;
+		(void) write(bp->bp_slave, "k", 1);
+		usleep(1000);
+	}
+	return (NULL);
+}
+
+/*
+ * Reads at most len bytes, without blocking: unless the poller has just
+ * reported the pty ready, the bytes waiting are checked first.
+ */
+static size_t
+bench_read(struct bench_pty *bp, size_t len, int throttle)
+{
+	u_char buf[8192];
+	uint64_t now;
+	size_t allowed;
+	ssize_t cc;
+	int avail, k;
+
+	if (!bp->bp_sched.se_ready) {
+		if (ioctl(bp->bp_master, FIONREAD, &avail) == -1 ||
+		    avail <= 0) {
+			return (0);
+		}
+		if ((size_t)avail < len) {
+			len = avail;
+		}
+	}
+	bp->bp_sched.se_ready = 0;
+	if (throttle) {
+		now = batch_now();
+		allowed = ratelimit_avail(&bp->bp_limit, now);
+		if (allowed == 0) {
+			(void) poller_del(bench_poller, bp->bp_master, 0);
+			bp->bp_wakeup = now + ratelimit_wait(&bp->bp_limit,
+			    RATELIMIT_MIN_BURST);
+			return (0);
+		}
+		if (len > allowed) {
+			len = allowed;
+		}
+	}
+	if (len > sizeof(buf)) {
+		len = sizeof(buf);
+	}
+	cc = read(bp->bp_master, buf, len);
+	if (cc <= 0) {
+		return (0);
+	}
+	if (throttle) {
+		ratelimit_take(&bp->bp_limit, cc);
+	}
+	bench_work(buf, cc);
+	bp->bp_bytes += cc;
+	if (bp->bp_interactive) {
+		now = batch_now();
+		for (k = 0; k < cc && bench_nlat < bench_nsent; k++) {
+			bench_lat[bench_nlat] = now - bench_sent[bench_nlat];
+			bench_nlat++;
+		}
+	}
+	return (cc);
+}
+
+static size_t
+bench_service(void *arg, size_t len)
+{
+
+	return (bench_read(arg, len, 1));
+}
+
+static int
+bench_cmp(const void *a, const void *b)
+{
+	const uint64_t *x = a, *y = b;
+
+	return (*x < *y ? -1 : *x > *y);
+}
+
+static void
+bench_run(const char *name, int drr, int limit)
+{
+	struct poller_event events[POLLER_MAX_EVENTS];
+	pthread_t thr[BENCH_FLOODS + 1];
+	struct bench_pty *bp;
+	struct termios t;
+	struct sched s;
+	uint64_t start, end, now, min, max;
+	int k, n, timeout, queued;
+
+	bench_poller = poller_create();
+	sched_init(&s, BENCH_QUANTUM, BENCH_WEIGHT);
+	bench_stop = 0;
+	bench_nsent = bench_nlat = 0;
+	start = batch_now();
+	for (k = 0; k <= BENCH_FLOODS; k++) {
+		bp = &bench_ptys[k];
+		memset(bp, 0, sizeof(*bp));
+		if (openpty(&bp->bp_master, &bp->bp_slave, NULL, NULL,
+		    NULL) == -1) {
+			err(1, "openpty");
+		}
+		tcgetattr(bp->bp_slave, &t);
+		cfmakeraw(&t);
+		tcsetattr(bp->bp_slave, TCSANOW, &t);
+		bp->bp_interactive = k == BENCH_FLOODS;
+		ratelimit_init(&bp->bp_limit, limit && k == 0 ?
+		    BENCH_LIMITED_RATE : 0, 0, start);
+		sched_ent_init(&bp->bp_sched, bp);
+		if (poller_add(bench_poller, bp->bp_master, bp, 0) == -1) {
+			err(1, "poller_add");
+		}
+		pthread_create(&thr[k], NULL,
+		    bp->bp_interactive ? bench_typist : bench_flood, bp);
+	}
+	end = start + BENCH_SECONDS * 1000000ULL;
+	queued = 0;
+	while ((now = batch_now()) < end) {
+		timeout = queued ? 0 : 1000;
+		for (k = 0; k < BENCH_FLOODS; k++) {
+			bp = &bench_ptys[k];
+			if (bp->bp_wakeup == 0) {
+				continue;
+			}
+			if (bp->bp_wakeup <= now) {
+				bp->bp_wakeup = 0;
+				(void) poller_add(bench_poller, bp->bp_master,
+				    bp, 0);
+			} else if (bp->bp_wakeup - now < (uint64_t)timeout) {
+				timeout = bp->bp_wakeup - now;
+			}
+		}
+		n = poller_wait(bench_poller, events, POLLER_MAX_EVENTS,
+		    timeout);
+		for (k = 0; k < n; k++) {
+			bp = events[k].pe_arg;
+			if (!drr) {
+				bp->bp_sched.se_ready = 1;
+				(void) bench_read(bp, 8192, limit);
+				continue;
+			}
+			sched_add(&s, &bp->bp_sched, bp->bp_interactive ?
+			    SCHED_INTERACTIVE : SCHED_BULK);
+		}
+		if (drr) {
+			queued = sched_run(&s, bench_service);
+		}
+	}
+	bench_stop = 1;
+	for (k = 0; k <= BENCH_FLOODS; k++) {
+		bp = &bench_ptys[k];
+		/* the writers see EIO once the master is gone */
+		close(bp->bp_master);
+		pthread_join(thr[k], NULL);
+		close(bp->bp_slave);
+	}
+	qsort(bench_lat, bench_nlat, sizeof(bench_lat[0]), bench_cmp);
+	min = UINT64_MAX;
+	max = 0;
+	for (k = limit ? 1 : 0; k < BENCH_FLOODS; k++) {
+		if (bench_ptys[k].bp_bytes < min) {
+			min = bench_ptys[k].bp_bytes;
+		}
+		if (bench_ptys[k].bp_bytes > max) {
+			max = bench_ptys[k].bp_bytes;
+		}
+	}
+	printf("%-22s latency p50 %6.2f ms p99 %6.2f ms, flood %6.1f-%6.1f "
+	    "MB/s", name, bench_nlat ? bench_lat[bench_nlat / 2] / 1e3 : 0,
+	    bench_nlat ? bench_lat[bench_nlat * 99 / 100] / 1e3 : 0,
+	    min / 1048576.0 / BENCH_SECONDS, max / 1048576.0 / BENCH_SECONDS);
+	if (limit) {
+		printf(", limited %5.2f MB/s", bench_ptys[0].bp_bytes /
+		    1048576.0 / BENCH_SECONDS);
+	}
+	printf("\n");
+	close(bench_poller->p_fd);
+	free(bench_poller);
+}
+
+int
+main(int argc, char *argv [])
+{
+
+	bench_run("one read per event", 0, 0);
+	bench_run("deficit round-robin", 1, 0);
+	bench_run("drr + 1MB/s limit", 1, 1);
+	return (0);
+}
+#endif	/* __BENCH_SCHED_CODE__ */
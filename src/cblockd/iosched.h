@@ -0,0 +1,67 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef IOSCHED_DOT_H_
+#define	IOSCHED_DOT_H_
+
+/*
+ * Deficit round-robin over the ptys which have output to be read. On its
+ * turn, a queued entry is credited with its class's quantum of bytes and
+ * serviced until the credit runs out or there is nothing more to read, in
+ * which case it leaves the queue and forfeits what is left. Interactive
+ * entries get a larger quantum and take their turns ahead of bulk ones.
+ */
+#define	SCHED_INTERACTIVE	0
+#define	SCHED_BULK		1
+#define	SCHED_NCLASS		2
+
+struct sched_ent {
+	TAILQ_ENTRY(sched_ent)	 se_glue;
+	void			*se_arg;
+	size_t			 se_deficit;
+	int			 se_class;	/* -1 if not queued */
+	int			 se_ready;	/* reported ready since serviced */
+};
+
+/*
+ * Reads at most the given number of bytes. Returns how many were read, or
+ * 0 if the entry has nothing more for now and should leave the queue.
+ */
+typedef size_t	(*sched_service_t)(void *, size_t);
+
+struct sched {
+	TAILQ_HEAD( , sched_ent) s_queue[SCHED_NCLASS];
+	size_t			 s_quantum[SCHED_NCLASS];
+	uint64_t		 s_rounds;	/* calls to sched_run() */
+};
+
+void		sched_init(struct sched *, size_t, u_int);
+void		sched_ent_init(struct sched_ent *, void *);
+void		sched_add(struct sched *, struct sched_ent *, int);
+void		sched_remove(struct sched *, struct sched_ent *);
+int		sched_run(struct sched *, sched_service_t);
+
+#endif	/* IOSCHED_DOT_H_ */
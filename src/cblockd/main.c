@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/ttycom.h>
@@ -47,9 +48,15 @@
 #include <pthread.h>
 
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "sock_ipc.h"
 #include "dispatch.h"
+#include "conlog.h"
 
 #include "config.h"
 #include "cblock.h"
@@ -72,6 +79,7 @@ static char *data_sub_dirs[] = {
 	"instances",
 	"unions",
 	"networks",
+	"logs",
 	NULL,
 };
 
@@ -83,6 +91,8 @@ static struct option long_options[] = {
 	{ "listen-host",	required_argument, 0, 's' },
 	{ "listen-port",	required_argument, 0, 'p' },
 	{ "tty-buffer-size",	required_argument, 0, 'T' },
+	{ "tty-buffer-total",	required_argument, 0, 'B' },
+	{ "tty-buffer-min",	required_argument, 0, 'M' },
 	{ "data-directory",	required_argument, 0, 'd' },
 	{ "help",		no_argument, 0, 'h' },
 	{ "ufs",		no_argument, 0, 'u' },
@@ -93,6 +103,21 @@ static struct option long_options[] = {
 	{ "sock-owner",		required_argument, 0, 'o' },
 	{ "logfile",		required_argument, 0, 'l' },
 	{ "create-forge",	required_argument, 0, 'f' },
+	{ "worker-threads",	required_argument, 0, 'W' },
+	{ "worker-queue",	required_argument, 0, 'Q' },
+	{ "control-threads",	required_argument, 0, 'k' },
+	{ "console-threads",	required_argument, 0, 'S' },
+	{ "cleanup-threads",	required_argument, 0, 'w' },
+	{ "console-queue",	required_argument, 0, 'C' },
+	{ "console-policy",	required_argument, 0, 'P' },
+	{ "console-log-size",	required_argument, 0, 'L' },
+	{ "console-log-age",	required_argument, 0, 'A' },
+	{ "console-log-keep",	required_argument, 0, 'K' },
+	{ "console-batch",	required_argument, 0, 'G' },
+	{ "console-delay",	required_argument, 0, 'D' },
+	{ "console-screen",	no_argument, 0, 'V' },
+	{ "console-quantum",	required_argument, 0, 'R' },
+	{ "console-compress",	required_argument, 0, 'c' },
 	{ 0, 0, 0, 0 }
 };
 
@@ -109,6 +134,8 @@ usage(void)
 	    " -s, --listen-host=HOST      Listen host/address\n"
 	    " -p, --listen-port=PORT      Listen on port\n"
 	    " -T, --tty-buffer-size=SIZE  Store at most SIZE bytes in console\n"
+	    " -B, --tty-buffer-total=SIZE Store at most SIZE bytes across all consoles\n"
+	    " -M, --tty-buffer-min=SIZE   Guarantee SIZE bytes of console to each container\n"
 	    " -d, --data-directory        Where the cblockd data/spools/images are stored\n"
 	    " -u, --ufs                   UFS as the underlying file system\n"
 	    " -z, --zfs                   ZFS as the underlying file system\n"
@@ -118,10 +145,45 @@ usage(void)
 	    " -o, --sock-owner=USER       Allow user/groups to connect to socket\n"
 	    " -l, --logfile=FILE          Path to cblock daemon log\n"
 	    " -f, --create-forge=FILE     Create the base image to forge containers\n"
+	    " -W, --worker-threads=NUM    Service blocking commands with NUM threads\n"
+	    " -Q, --worker-queue=NUM      Queue at most NUM pending commands\n"
+	    " -k, --control-threads=NUM   Service short commands with NUM threads\n"
+	    " -S, --console-threads=NUM   Serve at most NUM attached consoles at once\n"
+	    " -w, --cleanup-threads=NUM   Tear down at most NUM containers at once\n"
+	    " -C, --console-queue=SIZE    Queue at most SIZE bytes for a console\n"
+	    " -P, --console-policy=POLICY What to do when a console queue is full\n"
+	    "                             (drop, disconnect or pause)\n"
+	    " -L, --console-log-size=SIZE Log console output to disk in SIZE byte segments\n"
+	    " -A, --console-log-age=SECS  Start a new console log segment every SECS seconds\n"
+	    " -K, --console-log-keep=NUM  Keep NUM compressed console log segments\n"
+	    " -G, --console-batch=SIZE    Batch up to SIZE bytes of console output (0 disables)\n"
+	    " -D, --console-delay=USECS   Hold batched console output for at most USECS\n"
+	    " -V, --console-screen        Track each console screen, send it on attach\n"
+	    " -R, --console-quantum=SIZE  Read at most SIZE bytes per console per turn\n"
+	    " -c, --console-compress=LVL  Compress inet console output at LVL (0: off)\n"
 	);
 	exit(1);
 }
 
+static int
+console_policy(const char *policy)
+{
+
+	if (strcmp(policy, "drop") == 0) {
+		return (CONSOLE_POLICY_DROP);
+	}
+	if (strcmp(policy, "disconnect") == 0) {
+		return (CONSOLE_POLICY_DISCONNECT);
+	}
+	if (strcmp(policy, "pause") == 0) {
+		return (CONSOLE_POLICY_PAUSE);
+	}
+	errx(1, "invalid console policy: %s (drop, disconnect or pause)",
+	    policy);
+	/* NOT REACHED */
+	return (-1);
+}
+
 static int
 create_forge(char *forge_path)
 {
@@ -232,18 +294,35 @@ int
 main(int argc, char *argv [], char *env[])
 {
 	int option_index, c, zfs_selected;
+	extern struct worker_pool dispatch_pool, control_pool, console_pool;
+	extern struct worker_pool cleanup_pool;
+	char *r, path[MAXPATHLEN];
 	pthread_t thr;
-	char *r;
 
 	gcfg.c_data_dir = DEFAULT_DATA_DIR;
 	gcfg.global_env = env;
 	gcfg.c_callback = cblock_handle_request;
 	gcfg.c_family = PF_UNSPEC;
 	gcfg.c_tty_buf_size = 5 * 4096;
+	gcfg.c_tty_buf_total = 64 * 1024 * 1024;
+	gcfg.c_tty_buf_min = 4096;
 	gcfg.c_name = "/var/run/cblock.sock";
+	gcfg.c_worker_threads = 64;
+	gcfg.c_worker_queue = 256;
+	gcfg.c_control_threads = 4;
+	gcfg.c_console_threads = 256;
+	gcfg.c_cleanup_threads = 8;
+	gcfg.c_console_queue_size = 256 * 1024;
+	gcfg.c_console_policy = CONSOLE_POLICY_DROP;
+	gcfg.c_console_log_age = 3600;
+	gcfg.c_console_log_keep = 8;
+	gcfg.c_console_batch = 32768;
+	gcfg.c_console_delay = 1000;
+	gcfg.c_console_quantum = 16384;
+	gcfg.c_console_compress = 1;
 	while (1) {
 		option_index = 0;
-		c = getopt_long(argc, argv, "f:l:o:bd:T:46U:s:p:huzNv", long_options,
+		c = getopt_long(argc, argv, "c:R:VG:D:L:A:K:B:M:C:P:W:Q:k:S:w:f:l:o:bd:T:46U:s:p:huzNv", long_options,
 		    &option_index);
 		if (c == -1) {
 			break;
@@ -252,6 +331,102 @@ main(int argc, char *argv [], char *env[])
 		case 'I':
 			gcfg.c_inet = 1;
 			break;
+		case 'C':
+			gcfg.c_console_queue_size = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_queue_size < 65536) {
+				errx(1, "invalid console queue size: %s "
+				    "(minimum 65536)", optarg);
+			}
+			break;
+		case 'P':
+			gcfg.c_console_policy = console_policy(optarg);
+			break;
+		case 'L':
+			gcfg.c_console_log_size = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_log_size < 4096) {
+				errx(1, "invalid console log segment size: %s "
+				    "(minimum 4096)", optarg);
+			}
+			break;
+		case 'G':
+			gcfg.c_console_batch = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_batch > 65536) {
+				errx(1, "invalid console batch size: %s "
+				    "(maximum 65536)", optarg);
+			}
+			break;
+		case 'D':
+			gcfg.c_console_delay = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_delay > 1000000) {
+				errx(1, "invalid console delay: %s "
+				    "(maximum 1000000)", optarg);
+			}
+			break;
+		case 'V':
+			gcfg.c_console_screen = 1;
+			break;
+		case 'c':
+			gcfg.c_console_compress = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_compress > 9) {
+				errx(1, "invalid console compression level: "
+				    "%s (0 to 9)", optarg);
+			}
+			break;
+		case 'R':
+			gcfg.c_console_quantum = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_quantum < 512) {
+				errx(1, "invalid console quantum: %s "
+				    "(minimum 512)", optarg);
+			}
+			break;
+		case 'A':
+			gcfg.c_console_log_age = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid console log age: %s", optarg);
+			}
+			break;
+		case 'K':
+			gcfg.c_console_log_keep = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid console log segment count: %s",
+				    optarg);
+			}
+			break;
+		case 'W':
+			gcfg.c_worker_threads = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_worker_threads == 0) {
+				errx(1, "invalid worker thread count: %s",
+				    optarg);
+			}
+			break;
+		case 'Q':
+			gcfg.c_worker_queue = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_worker_queue == 0) {
+				errx(1, "invalid worker queue limit: %s",
+				    optarg);
+			}
+			break;
+		case 'k':
+			gcfg.c_control_threads = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_control_threads == 0) {
+				errx(1, "invalid control thread count: %s",
+				    optarg);
+			}
+			break;
+		case 'S':
+			gcfg.c_console_threads = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_console_threads == 0) {
+				errx(1, "invalid console thread count: %s",
+				    optarg);
+			}
+			break;
+		case 'w':
+			gcfg.c_cleanup_threads = strtoul(optarg, &r, 10);
+			if (*r != '\0' || gcfg.c_cleanup_threads == 0) {
+				errx(1, "invalid cleanup thread count: %s",
+				    optarg);
+			}
+			break;
 		case 'f':
 			gcfg.c_forge_path = optarg;
 			break;
@@ -272,6 +447,19 @@ main(int argc, char *argv [], char *env[])
 			if (*r != '\0') {
 				errx(1, "invalid TTY buf size: %s", optarg);
 			}
+			break;
+		case 'B':
+			gcfg.c_tty_buf_total = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid TTY buf total: %s", optarg);
+			}
+			break;
+		case 'M':
+			gcfg.c_tty_buf_min = strtoul(optarg, &r, 10);
+			if (*r != '\0') {
+				errx(1, "invalid TTY buf minimum: %s", optarg);
+			}
+			break;
 		case '4':
 			gcfg.c_family = PF_INET;
 			break;
@@ -309,6 +497,11 @@ main(int argc, char *argv [], char *env[])
 	if (gcfg.c_family != PF_UNSPEC && gcfg.c_name) {
 		errx(1, "-4, -6 and --unix-sock are incompatable");
 	}
+	if (gcfg.c_tty_buf_min > gcfg.c_tty_buf_size) {
+		gcfg.c_tty_buf_min = gcfg.c_tty_buf_size;
+	}
+	termbuf_pool_init(gcfg.c_tty_buf_total, gcfg.c_tty_buf_min,
+	    gcfg.c_tty_buf_size);
 	if (gcfg.c_underlying_fs == NULL) {
 		errx(1, "must specify underlying file system:\n"
 		    "    --ufs\n"
@@ -335,9 +528,30 @@ main(int argc, char *argv [], char *env[])
 	if (gcfg.c_background) {
 		daemonize(&gcfg);
 	}
+	if (gcfg.c_console_log_size > 0) {
+		(void) snprintf(path, sizeof(path), "%s/logs",
+		    gcfg.c_data_dir);
+		conlog_init(path, gcfg.c_console_log_size,
+		    gcfg.c_console_log_age, gcfg.c_console_log_keep);
+	}
+	tty_io_queue_init();
+	worker_pool_init(&dispatch_pool, "dispatch", gcfg.c_worker_threads,
+	    gcfg.c_worker_queue);
+	worker_pool_init(&control_pool, "control", gcfg.c_control_threads,
+	    gcfg.c_worker_queue);
+	worker_pool_init(&console_pool, "console", gcfg.c_console_threads,
+	    gcfg.c_worker_queue);
+	/*
+	 * Teardown queues without limit, the threads bound how many cleanup
+	 * handlers run at once.
+	 */
+	worker_pool_init(&cleanup_pool, "cleanup", gcfg.c_cleanup_threads, 0);
 	if (pthread_create(&thr, NULL, tty_io_queue_loop, NULL) == -1) {
 		err(1, "pthread_create(tty_io_queue_loop)");
 	}
+	if (pthread_create(&thr, NULL, tty_io_logs_loop, NULL) != 0) {
+		err(1, "pthread_create(tty_io_logs_loop)");
+	}
 	sock_ipc_event_loop(&gcfg);
 	return (0);
 }
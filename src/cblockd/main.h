@@ -29,6 +29,14 @@
 
 #define	MAXSOCKS	64
 
+/*
+ * What to do when a console peer is not keeping up with the output of the
+ * instance it is attached to.
+ */
+#define	CONSOLE_POLICY_DROP		1	/* drop the oldest output */
+#define	CONSOLE_POLICY_DISCONNECT	2	/* disconnect the peer */
+#define	CONSOLE_POLICY_PAUSE		3	/* stop reading the pty */
+
 struct global_params {
 	char		*c_name;
 	char		*c_host;
@@ -39,6 +47,8 @@ struct global_params {
 	void		*(*c_callback)(void *);
 	char		**global_env;
 	size_t		 c_tty_buf_size;
+	size_t		 c_tty_buf_total;
+	size_t		 c_tty_buf_min;
 	char		*c_data_dir;
 	char		*c_underlying_fs;
 	int		 c_verbose;
@@ -47,6 +57,21 @@ struct global_params {
 	char		*c_logfile;
 	char		*c_forge_path;
 	int		 c_inet;
+	size_t		 c_worker_threads;
+	size_t		 c_worker_queue;
+	size_t		 c_control_threads;
+	size_t		 c_console_threads;
+	size_t		 c_cleanup_threads;
+	size_t		 c_console_queue_size;
+	int		 c_console_policy;
+	size_t		 c_console_batch;
+	uint64_t	 c_console_delay;
+	int		 c_console_screen;
+	size_t		 c_console_quantum;
+	int		 c_console_compress;	/* deflate level, 0: off */
+	size_t		 c_console_log_size;
+	time_t		 c_console_log_age;
+	u_int		 c_console_log_keep;
 };
 
 #endif
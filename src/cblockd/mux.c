@@ -0,0 +1,303 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+
+#include "outq.h"
+#include "poller.h"
+#include "mux.h"
+
+/*
+ * The socket is registered with the poller for read readiness by the
+ * caller. A duplicate of the descriptor is registered for write readiness
+ * whenever output is queued, since a descriptor can only be registered for
+ * one direction at a time.
+ */
+struct console_mux *
+mux_create(int sock, size_t limit, struct poller *pp, void *arg)
+{
+	struct console_mux *cm;
+
+	cm = calloc(1, sizeof(*cm));
+	if (cm == NULL) {
+		return (NULL);
+	}
+	cm->cm_in = malloc(sizeof(struct cblock_mux_frame) +
+	    CBLOCK_MUX_FRAME_MAX);
+	if (cm->cm_in == NULL) {
+		free(cm);
+		return (NULL);
+	}
+	cm->cm_wfd = dup(sock);
+	if (cm->cm_wfd == -1) {
+		free(cm->cm_in);
+		free(cm);
+		return (NULL);
+	}
+	pthread_mutex_init(&cm->cm_mtx, NULL);
+	cm->cm_sock = sock;
+	cm->cm_poller = pp;
+	cm->cm_arg = arg;
+	outq_init(&cm->cm_outq, limit);
+	TAILQ_INIT(&cm->cm_channels);
+	return (cm);
+}
+
+/*
+ * The channels must all have been removed (and their peers detached) by
+ * now. The socket itself belongs to the caller.
+ */
+void
+mux_free(struct console_mux *cm)
+{
+
+	if ((cm->cm_flags & MUX_WAIT) != 0) {
+		(void) poller_del(cm->cm_poller, cm->cm_wfd, POLLER_WRITE);
+	}
+	(void) close(cm->cm_wfd);
+	outq_purge(&cm->cm_outq);
+	pthread_mutex_destroy(&cm->cm_mtx);
+	free(cm->cm_in);
+	free(cm);
+}
+
+/*
+ * Shutting the socket down has the logs loop tear the connection down.
+ * Called with cm_mtx held.
+ */
+static void
+mux_disconnect(struct console_mux *cm)
+{
+
+	(void) shutdown(cm->cm_sock, SHUT_RDWR);
+	if ((cm->cm_flags & MUX_WAIT) != 0) {
+		(void) poller_del(cm->cm_poller, cm->cm_wfd, POLLER_WRITE);
+		cm->cm_flags &= ~MUX_WAIT;
+	}
+	outq_purge(&cm->cm_outq);
+	cm->cm_flags |= MUX_GONE;
+}
+
+static int
+mux_update(struct console_mux *cm, int ret)
+{
+
+	if (ret == -1) {
+		mux_disconnect(cm);
+		return (-1);
+	}
+	if (ret == 1 && (cm->cm_flags & MUX_WAIT) == 0) {
+		if (poller_add(cm->cm_poller, cm->cm_wfd, cm->cm_arg,
+		    POLLER_WRITE) == -1) {
+			warn("failed to register console mux");
+			mux_disconnect(cm);
+			return (-1);
+		}
+		cm->cm_flags |= MUX_WAIT;
+	}
+	if (ret == 0 && (cm->cm_flags & MUX_WAIT) != 0) {
+		(void) poller_del(cm->cm_poller, cm->cm_wfd, POLLER_WRITE);
+		cm->cm_flags &= ~MUX_WAIT;
+	}
+	return (0);
+}
+
+/*
+ * Send a frame on a channel. Unless force is set, a frame which does not
+ * fit in the queue disconnects the whole connection: channels are watchers,
+ * which are never allowed to hold up an instance. Returns 0 if the frame
+ * was sent or queued, and -1 if the connection has gone away.
+ */
+int
+mux_send(struct console_mux *cm, uint32_t cmd, uint32_t channel,
+    const struct iovec *iov, int iovcnt, int force)
+{
+	struct cblock_mux_frame mf;
+	struct iovec *fiov;
+	size_t len;
+	int k, ret;
+
+	len = 0;
+	for (k = 0; k < iovcnt; k++) {
+		len += iov[k].iov_len;
+	}
+	fiov = calloc(iovcnt + 1, sizeof(*fiov));
+	if (fiov == NULL) {
+		err(1, "calloc(iovec) failed");
+	}
+	mf.mf_cmd = cmd;
+	mf.mf_channel = channel;
+	mf.mf_len = len;
+	fiov[0].iov_base = &mf;
+	fiov[0].iov_len = sizeof(mf);
+	if (iovcnt > 0) {
+		memcpy(&fiov[1], iov, iovcnt * sizeof(*iov));
+	}
+	pthread_mutex_lock(&cm->cm_mtx);
+	if ((cm->cm_flags & MUX_GONE) != 0) {
+		pthread_mutex_unlock(&cm->cm_mtx);
+		free(fiov);
+		return (-1);
+	}
+	if (!force && cm->cm_outq.oq_bytes + sizeof(mf) + len >
+	    cm->cm_outq.oq_limit) {
+		warnx("console mux %d is not keeping up, disconnecting",
+		    cm->cm_sock);
+		mux_disconnect(cm);
+		pthread_mutex_unlock(&cm->cm_mtx);
+		free(fiov);
+		return (-1);
+	}
+	ret = outq_send(&cm->cm_outq, cm->cm_sock, fiov, iovcnt + 1);
+	ret = mux_update(cm, ret);
+	pthread_mutex_unlock(&cm->cm_mtx);
+	free(fiov);
+	return (ret);
+}
+
+/*
+ * Write out what is queued, once the socket has drained.
+ */
+int
+mux_flush(struct console_mux *cm)
+{
+	int ret;
+
+	pthread_mutex_lock(&cm->cm_mtx);
+	ret = -1;
+	if ((cm->cm_flags & MUX_GONE) == 0) {
+		ret = mux_update(cm, outq_flush(&cm->cm_outq, cm->cm_sock));
+	}
+	pthread_mutex_unlock(&cm->cm_mtx);
+	return (ret);
+}
+
+/*
+ * Read what the client has sent. Returns -1 once the connection has been
+ * closed. Only called from the logs loop, when the socket is readable.
+ */
+int
+mux_fill(struct console_mux *cm)
+{
+	size_t size;
+	ssize_t cc;
+
+	size = sizeof(struct cblock_mux_frame) + CBLOCK_MUX_FRAME_MAX;
+	if (cm->cm_inoff > 0) {
+		memmove(cm->cm_in, cm->cm_in + cm->cm_inoff,
+		    cm->cm_inlen - cm->cm_inoff);
+		cm->cm_inlen -= cm->cm_inoff;
+		cm->cm_inoff = 0;
+	}
+	cc = read(cm->cm_sock, cm->cm_in + cm->cm_inlen,
+	    size - cm->cm_inlen);
+	if (cc == -1 && (errno == EINTR || errno == EAGAIN)) {
+		return (0);
+	}
+	if (cc <= 0) {
+		return (-1);
+	}
+	cm->cm_inlen += cc;
+	return (0);
+}
+
+/*
+ * Return 1 and the next complete frame the client has sent, 0 if there is
+ * none or -1 if the frame is too large to be valid.
+ */
+int
+mux_frame(struct console_mux *cm, struct cblock_mux_frame *mf,
+    u_char **payload)
+{
+	size_t avail;
+
+	avail = cm->cm_inlen - cm->cm_inoff;
+	if (avail < sizeof(*mf)) {
+		return (0);
+	}
+	memcpy(mf, cm->cm_in + cm->cm_inoff, sizeof(*mf));
+	if (mf->mf_len > CBLOCK_MUX_FRAME_MAX) {
+		return (-1);
+	}
+	if (avail < sizeof(*mf) + mf->mf_len) {
+		return (0);
+	}
+	*payload = cm->cm_in + cm->cm_inoff + sizeof(*mf);
+	cm->cm_inoff += sizeof(*mf) + mf->mf_len;
+	return (1);
+}
+
+struct mux_channel *
+mux_channel_find(struct console_mux *cm, uint32_t id)
+{
+	struct mux_channel *mc;
+
+	TAILQ_FOREACH(mc, &cm->cm_channels, mc_glue) {
+		if (mc->mc_id == id) {
+			return (mc);
+		}
+	}
+	return (NULL);
+}
+
+struct mux_channel *
+mux_channel_add(struct console_mux *cm, uint32_t id, struct console_peer *cp)
+{
+	struct mux_channel *mc;
+
+	mc = calloc(1, sizeof(*mc));
+	if (mc == NULL) {
+		err(1, "calloc(mux channel) failed");
+	}
+	mc->mc_id = id;
+	mc->mc_peer = cp;
+	TAILQ_INSERT_TAIL(&cm->cm_channels, mc, mc_glue);
+	cm->cm_nchannels++;
+	return (mc);
+}
+
+void
+mux_channel_remove(struct console_mux *cm, struct mux_channel *mc)
+{
+
+	TAILQ_REMOVE(&cm->cm_channels, mc, mc_glue);
+	cm->cm_nchannels--;
+	free(mc);
+}
@@ -0,0 +1,74 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef MUX_DOT_H_
+#define	MUX_DOT_H_
+
+/*
+ * A console multiplexing connection. Its channels are console peers which
+ * share the connection, so their output goes through the one queue here
+ * rather than their own, and only whole frames are ever queued. Output is
+ * sent from whichever thread produces it (with cm_mtx held); the logs loop
+ * reads the client's frames and writes out what the socket did not take.
+ */
+struct mux_channel {
+	uint32_t			 mc_id;
+	struct console_peer		*mc_peer;
+	TAILQ_ENTRY(mux_channel)	 mc_glue;
+};
+
+struct console_mux {
+	pthread_mutex_t			 cm_mtx;	/* protects the queue */
+	int				 cm_sock;
+	int				 cm_wfd;	/* for write readiness */
+	int				 cm_flags;
+#define	MUX_WAIT		0x00000001	/* waiting for socket to drain */
+#define	MUX_GONE		0x00000002	/* disconnected */
+	struct outq			 cm_outq;
+	struct poller			*cm_poller;
+	void				*cm_arg;
+	u_char				*cm_in;		/* partial client frames */
+	size_t				 cm_inlen;
+	size_t				 cm_inoff;
+	u_int				 cm_nchannels;	/* logs loop only */
+	TAILQ_HEAD( , mux_channel)	 cm_channels;
+};
+
+struct console_mux	*mux_create(int, size_t, struct poller *, void *);
+void			 mux_free(struct console_mux *);
+int			 mux_send(struct console_mux *, uint32_t, uint32_t,
+			    const struct iovec *, int, int);
+int			 mux_flush(struct console_mux *);
+int			 mux_fill(struct console_mux *);
+int			 mux_frame(struct console_mux *,
+			    struct cblock_mux_frame *, u_char **);
+struct mux_channel	*mux_channel_find(struct console_mux *, uint32_t);
+struct mux_channel	*mux_channel_add(struct console_mux *, uint32_t,
+			    struct console_peer *);
+void			 mux_channel_remove(struct console_mux *,
+			    struct mux_channel *);
+
+#endif	/* MUX_DOT_H_ */
@@ -0,0 +1,451 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "outq.h"
+
+#if defined(__BENCH_OUTQ_CODE__) || defined(__BENCH_BATCH_CODE__)
+#include <poll.h>
+#endif
+
+#ifdef __BENCH_OUTQ_CODE__
+#include <pthread.h>
+#include <time.h>
+
+static uint64_t outq_bench_copied;
+#endif
+
+void
+outq_init(struct outq *oq, size_t limit)
+{
+
+	TAILQ_INIT(&oq->oq_head);
+	oq->oq_bytes = 0;
+	oq->oq_limit = limit;
+	oq->oq_hwm = 0;
+	oq->oq_dropped = 0;
+	oq->oq_writes = 0;
+	oq->oq_written = 0;
+	oq->oq_held = 0;
+}
+
+static void
+outq_frame_free(struct outq_frame *of)
+{
+
+	outq_buf_rele(of->of_buf);
+	free(of);
+}
+
+void
+outq_purge(struct outq *oq)
+{
+	struct outq_frame *of;
+
+	while ((of = TAILQ_FIRST(&oq->oq_head)) != NULL) {
+		TAILQ_REMOVE(&oq->oq_head, of, of_glue);
+		outq_frame_free(of);
+	}
+	oq->oq_bytes = 0;
+}
+
+static struct outq_buf *
+outq_buf_create(const struct iovec *iov, int iovcnt)
+{
+	struct outq_buf *ob;
+	size_t len;
+	u_char *vptr;
+	int k;
+
+	len = 0;
+	for (k = 0; k < iovcnt; k++) {
+		len += iov[k].iov_len;
+	}
+	ob = malloc(sizeof(*ob) + len);
+	if (ob == NULL) {
+		err(1, "malloc(outq buffer) failed");
+	}
+	ob->ob_refs = 1;
+	ob->ob_len = len;
+#ifdef __BENCH_OUTQ_CODE__
+	outq_bench_copied += len;
+#endif
+	vptr = ob->ob_data;
+	for (k = 0; k < iovcnt; k++) {
+		if (iov[k].iov_len == 0) {
+			continue;
+		}
+		memcpy(vptr, iov[k].iov_base, iov[k].iov_len);
+		vptr += iov[k].iov_len;
+	}
+	return (ob);
+}
+
+void
+outq_buf_rele(struct outq_buf *ob)
+{
+
+	if (--ob->ob_refs == 0) {
+		free(ob);
+	}
+}
+
+/*
+ * Queue the message, the first sent bytes of which have already been
+ * written. The message is copied into *obp unless an earlier queue has
+ * already done so, in which case the copy is shared.
+ */
+static void
+outq_append(struct outq *oq, const struct iovec *iov, int iovcnt,
+    size_t sent, struct outq_buf **obp)
+{
+	struct outq_frame *of;
+
+	of = malloc(sizeof(*of));
+	if (of == NULL) {
+		err(1, "malloc(outq frame) failed");
+	}
+	if (*obp == NULL) {
+		*obp = outq_buf_create(iov, iovcnt);
+	}
+	of->of_buf = *obp;
+	of->of_buf->ob_refs++;
+	of->of_off = sent;
+	TAILQ_INSERT_TAIL(&oq->oq_head, of, of_glue);
+	oq->oq_bytes += of->of_buf->ob_len - sent;
+	if (oq->oq_bytes > oq->oq_hwm) {
+		oq->oq_hwm = oq->oq_bytes;
+	}
+}
+
+/*
+ * Queue a message gathered from iovcnt buffers. If nothing is queued ahead
+ * of it, try sending it straight from the caller's buffers, only the part
+ * the socket did not accept is copied into the queue. The caller is
+ * responsible for enforcing oq_limit before calling this. Returns 0 if the
+ * queue is empty, 1 if data remains queued and -1 if the peer has gone
+ * away.
+ */
+int
+outq_send(struct outq *oq, int sock, const struct iovec *iov, int iovcnt)
+{
+	struct outq_buf *ob;
+	int ret;
+
+	ob = NULL;
+	ret = outq_send_shared(oq, sock, iov, iovcnt, &ob);
+	if (ob != NULL) {
+		outq_buf_rele(ob);
+	}
+	return (ret);
+}
+
+/*
+ * As outq_send(), for a message which is being sent to several queues.
+ * *obp must be NULL for the first queue. If the message has to be queued
+ * its copy is returned in *obp and shared by the following queues; the
+ * caller releases it with outq_buf_rele() once the message has been sent
+ * to every queue.
+ */
+int
+outq_send_shared(struct outq *oq, int sock, const struct iovec *iov,
+    int iovcnt, struct outq_buf **obp)
+{
+	struct msghdr msg;
+	size_t len;
+	ssize_t cc;
+	int k;
+
+	/*
+	 * If messages are already queued the socket was full the last time
+	 * we tried it, so just queue this one behind them. Whoever queued
+	 * them is waiting for the socket to become writable. A large
+	 * scrollback can span more pages than sendmsg(2) accepts iovecs;
+	 * such a message is copied into the queue and sent from there.
+	 */
+	if (!TAILQ_EMPTY(&oq->oq_head) || oq->oq_held) {
+		outq_append(oq, iov, iovcnt, 0, obp);
+		return (1);
+	}
+	if (iovcnt > IOV_MAX) {
+		outq_append(oq, iov, iovcnt, 0, obp);
+		return (outq_flush(oq, sock));
+	}
+	len = 0;
+	for (k = 0; k < iovcnt; k++) {
+		len += iov[k].iov_len;
+	}
+	bzero(&msg, sizeof(msg));
+	msg.msg_iov = (struct iovec *)iov;
+	msg.msg_iovlen = iovcnt;
+	while (1) {
+		cc = sendmsg(sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		oq->oq_writes++;
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		break;
+	}
+	if (cc == -1 && errno != EAGAIN) {
+		return (-1);
+	}
+	if (cc == -1) {
+		cc = 0;
+	}
+	oq->oq_written += cc;
+	if (cc == len) {
+		return (0);
+	}
+	outq_append(oq, iov, iovcnt, cc, obp);
+	return (1);
+}
+
+/*
+ * Drop whole messages from the head of the queue until need bytes fit
+ * under the limit. A message which has been partially sent can not be
+ * dropped without corrupting the stream, so it is skipped. Returns the
+ * number of bytes dropped.
+ */
+size_t
+outq_drop_oldest(struct outq *oq, size_t need)
+{
+	struct outq_frame *of, *of_temp;
+	size_t dropped;
+
+	dropped = 0;
+	TAILQ_FOREACH_SAFE(of, &oq->oq_head, of_glue, of_temp) {
+		if (oq->oq_bytes + need <= oq->oq_limit) {
+			break;
+		}
+		if (of->of_off != 0) {
+			continue;
+		}
+		TAILQ_REMOVE(&oq->oq_head, of, of_glue);
+		oq->oq_bytes -= of->of_buf->ob_len;
+		dropped += of->of_buf->ob_len;
+		outq_frame_free(of);
+	}
+	oq->oq_dropped += dropped;
+	return (dropped);
+}
+
+/*
+ * Write as much of the queue as the socket will take without blocking.
+ * Returns 0 when the queue has been drained, 1 if data remains and -1 if
+ * the peer has gone away.
+ */
+int
+outq_flush(struct outq *oq, int sock)
+{
+	struct outq_frame *of;
+	ssize_t cc;
+
+	if (oq->oq_held) {
+		return (!TAILQ_EMPTY(&oq->oq_head));
+	}
+	while ((of = TAILQ_FIRST(&oq->oq_head)) != NULL) {
+		cc = send(sock, of->of_buf->ob_data + of->of_off,
+		    of->of_buf->ob_len - of->of_off,
+		    MSG_DONTWAIT | MSG_NOSIGNAL);
+		oq->oq_writes++;
+		if (cc == -1 && errno == EINTR) {
+			continue;
+		}
+		if (cc == -1 && errno == EAGAIN) {
+			return (1);
+		}
+		if (cc == -1) {
+			return (-1);
+		}
+		oq->oq_written += cc;
+		of->of_off += cc;
+		oq->oq_bytes -= cc;
+		if (of->of_off < of->of_buf->ob_len) {
+			continue;
+		}
+		TAILQ_REMOVE(&oq->oq_head, of, of_glue);
+		outq_frame_free(of);
+	}
+	return (0);
+}
+
+#if defined(__BENCH_OUTQ_CODE__) || defined(__BENCH_BATCH_CODE__)
+/*
+ * Flush the queue, blocking until it is empty or the peer makes no progress
+ * for timeout milliseconds. Only the benchmarks use this: nothing in the
+ * daemon may wait on a peer.
+ */
+int
+outq_drain(struct outq *oq, int sock, int timeout)
+{
+	struct pollfd pfd;
+	int ret;
+
+	while ((ret = outq_flush(oq, sock)) == 1) {
+		pfd.fd = sock;
+		pfd.events = POLLOUT;
+		ret = poll(&pfd, 1, timeout);
+		if (ret == -1 && errno == EINTR) {
+			continue;
+		}
+		if (ret <= 0) {
+			return (-1);
+		}
+	}
+	return (ret);
+}
+#endif
+
+#ifdef __BENCH_OUTQ_CODE__
+/*
+ * Fan a stream of 4KB pty reads out to N console watchers, each on its own
+ * socket pair with a thread draining the other end, and report the CPU
+ * time the fan-out thread (the tty I/O loop in the daemon) spends per read
+ * along with how much output ends up being copied. Sockets are given small
+ * send buffers so watchers regularly fall behind and output has to be
+ * queued. "copy" queues a private copy for each watcher that falls
+ * behind, "shared" queues one copy for all of them.
+ *
+ * Sharing keeps the copying flat, not the CPU time: every watcher still
+ * costs a send(2) per read (about 2us here), so the time per read grows
+ * linearly with the number of watchers. Only log subscribers reading the
+ * shared memory ring (shmring.c) avoid that, at the price of a wakeup.
+ *
+ * cc -O2 -D__BENCH_OUTQ_CODE__ outq.c -lpthread
+ * ./a.out [reads]
+ */
+#define	BENCH_READ_SIZE		4096
+#define	BENCH_MAX_PEERS		64
+
+static void *
+bench_drain(void *arg)
+{
+	u_char buf[65536];
+	int fd;
+
+	fd = *(int *)arg;
+	while (read(fd, buf, sizeof(buf)) > 0) {
+		;
+	}
+	return (NULL);
+}
+
+static void
+bench_run(const char *name, int shared, int npeers, size_t nreads)
+{
+	struct timespec start, end;
+	struct iovec iov[2];
+	struct outq oq[BENCH_MAX_PEERS];
+	int fds[BENCH_MAX_PEERS][2], k, sndbuf;
+	pthread_t thr[BENCH_MAX_PEERS];
+	u_char hdr[12], buf[BENCH_READ_SIZE];
+	struct outq_buf *ob;
+	double ns;
+	size_t n;
+
+	memset(buf, 'x', sizeof(buf));
+	memset(hdr, 0, sizeof(hdr));
+	sndbuf = 16384;
+	for (k = 0; k < npeers; k++) {
+		if (socketpair(PF_UNIX, SOCK_STREAM, 0, fds[k]) == -1) {
+			err(1, "socketpair");
+		}
+		(void) setsockopt(fds[k][0], SOL_SOCKET, SO_SNDBUF, &sndbuf,
+		    sizeof(sndbuf));
+		outq_init(&oq[k], SIZE_MAX);
+		if (pthread_create(&thr[k], NULL, bench_drain,
+		    &fds[k][1]) != 0) {
+			errx(1, "pthread_create failed");
+		}
+	}
+	iov[0].iov_base = hdr;
+	iov[0].iov_len = sizeof(hdr);
+	iov[1].iov_base = buf;
+	iov[1].iov_len = sizeof(buf);
+	outq_bench_copied = 0;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &start);
+	for (n = 0; n < nreads; n++) {
+		ob = NULL;
+		for (k = 0; k < npeers; k++) {
+			/*
+			 * Stands in for the write readiness events.
+			 */
+			if (!TAILQ_EMPTY(&oq[k].oq_head)) {
+				(void) outq_flush(&oq[k], fds[k][0]);
+			}
+			if (shared) {
+				(void) outq_send_shared(&oq[k], fds[k][0],
+				    iov, 2, &ob);
+			} else {
+				(void) outq_send(&oq[k], fds[k][0], iov, 2);
+			}
+		}
+		if (ob != NULL) {
+			outq_buf_rele(ob);
+		}
+	}
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &end);
+	ns = (end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec);
+	printf("%-7s %3d watchers %8.1f us/read %7.2f us/read/watcher "
+	    "%8.1f MB copied\n", name, npeers, ns / nreads / 1000,
+	    ns / nreads / npeers / 1000,
+	    outq_bench_copied / (1024.0 * 1024.0));
+	for (k = 0; k < npeers; k++) {
+		(void) outq_drain(&oq[k], fds[k][0], -1);
+		(void) close(fds[k][0]);
+		(void) pthread_join(thr[k], NULL);
+		(void) close(fds[k][1]);
+	}
+}
+
+int
+main(int argc, char *argv [])
+{
+	size_t nreads;
+	int npeers;
+
+	nreads = argc > 1 ? strtoul(argv[1], NULL, 10) : 20000;
+	for (npeers = 1; npeers <= BENCH_MAX_PEERS; npeers *= 2) {
+		bench_run("copy", 0, npeers, nreads);
+		bench_run("shared", 1, npeers, nreads);
+	}
+	return (0);
+}
+#endif	/* __BENCH_OUTQ_CODE__ */
@@ -0,0 +1,81 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef OUTQ_DOT_H_
+#define	OUTQ_DOT_H_
+
+/*
+ * Bounded queue of outbound messages for a peer which is written to from
+ * the I/O loop. Messages are only ever written with non-blocking sends,
+ * anything the socket will not accept right away is queued and flushed
+ * once the socket becomes writable again. Messages are kept whole, so
+ * dropping data never splits a message on the wire.
+ *
+ * Queued message data lives in reference counted buffers, so a message fanned
+ * out to several peers is copied at most once. The reference counts are
+ * not atomic: queues which share buffers must be protected by the same
+ * lock.
+ *
+ * While a queue is held, messages are queued but not sent, so the owner
+ * can write to the socket itself (with blocking I/O, and without the lock)
+ * ahead of them.
+ */
+struct outq_buf {
+	u_int			 ob_refs;
+	size_t			 ob_len;
+	u_char			 ob_data[];
+};
+
+struct outq_frame {
+	TAILQ_ENTRY(outq_frame)	 of_glue;
+	struct outq_buf		*of_buf;
+	size_t			 of_off;	/* bytes already sent */
+};
+
+struct outq {
+	TAILQ_HEAD( , outq_frame) oq_head;
+	size_t			 oq_bytes;	/* unsent bytes queued */
+	size_t			 oq_limit;
+	size_t			 oq_hwm;
+	uint64_t		 oq_dropped;	/* bytes dropped */
+	uint64_t		 oq_writes;	/* send calls made */
+	uint64_t		 oq_written;	/* bytes sent */
+	int			 oq_held;
+};
+
+void		outq_init(struct outq *, size_t);
+void		outq_purge(struct outq *);
+void		outq_buf_rele(struct outq_buf *);
+int		outq_send(struct outq *, int, const struct iovec *, int);
+int		outq_send_shared(struct outq *, int, const struct iovec *, int,
+		    struct outq_buf **);
+size_t		outq_drop_oldest(struct outq *, size_t);
+int		outq_flush(struct outq *, int);
+#if defined(__BENCH_OUTQ_CODE__) || defined(__BENCH_BATCH_CODE__)
+int		outq_drain(struct outq *, int, int);
+#endif
+
+#endif	/* OUTQ_DOT_H_ */
@@ -0,0 +1,364 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/time.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#else
+#include <sys/event.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include "poller.h"
+
+#ifdef __BENCH_POLLER_CODE__
+#include <sys/select.h>
+#include <sys/resource.h>
+#include <time.h>
+#endif
+
+struct poller *
+poller_create(void)
+{
+	struct poller *pp;
+
+	pp = calloc(1, sizeof(*pp));
+	if (pp == NULL) {
+		err(1, "calloc(poller) failed");
+	}
+#ifdef __linux__
+	pp->p_fd = epoll_create1(EPOLL_CLOEXEC);
+#else
+	pp->p_fd = kqueue();
+#endif
+	if (pp->p_fd == -1) {
+		err(1, "failed to create poller");
+	}
+	return (pp);
+}
+
+/*
+ * Register interest in read readiness for fd. If POLLER_ONESHOT is set
+ * the descriptor is disabled after the first event is delivered, and the
+ * caller must call poller_add() again to re-arm it.  This allows a
+ * descriptor to be handed off to another thread without the poller
+ * reporting it again in the meantime.
+ */
+int
+poller_add(struct poller *pp, int fd, void *arg, int flags)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLRDHUP;
+	ev.data.u64 = (uintptr_t)arg;
+	/*
+	 * epoll does not tell us which direction an error or hangup relates
+	 * to, so tag write registrations in the low bit of the argument. The
+	 * next bit tags process exits, see poller_add_proc().
+	 */
+	if ((flags & POLLER_WRITE) != 0) {
+		ev.events = EPOLLOUT;
+		ev.data.u64 |= 1;
+	}
+	if ((flags & POLLER_ONESHOT) != 0) {
+		ev.events |= EPOLLONESHOT;
+	}
+	if (epoll_ctl(pp->p_fd, EPOLL_CTL_ADD, fd, &ev) == 0) {
+		return (0);
+	}
+	if (errno != EEXIST) {
+		return (-1);
+	}
+	return (epoll_ctl(pp->p_fd, EPOLL_CTL_MOD, fd, &ev));
+#else
+	struct kevent kev;
+	u_short kflags;
+	short filter;
+
+	kflags = EV_ADD | EV_ENABLE;
+	if ((flags & POLLER_ONESHOT) != 0) {
+		kflags |= EV_ONESHOT;
+	}
+	filter = EVFILT_READ;
+	if ((flags & POLLER_WRITE) != 0) {
+		filter = EVFILT_WRITE;
+	}
+	EV_SET(&kev, fd, filter, kflags, 0, 0, arg);
+	return (kevent(pp->p_fd, &kev, 1, NULL, 0, NULL));
+#endif
+}
+
+int
+poller_del(struct poller *pp, int fd, int flags)
+{
+	int ret;
+
+#ifdef __linux__
+	struct epoll_event ev;
+
+	bzero(&ev, sizeof(ev));
+	ret = epoll_ctl(pp->p_fd, EPOLL_CTL_DEL, fd, &ev);
+#else
+	struct kevent kev;
+
+	EV_SET(&kev, fd, (flags & POLLER_WRITE) != 0 ? EVFILT_WRITE :
+	    EVFILT_READ, EV_DELETE, 0, 0, NULL);
+	ret = kevent(pp->p_fd, &kev, 1, NULL, 0, NULL);
+#endif
+	/*
+	 * One-shot events which have already fired are no longer known to
+	 * the kernel, so this is not an error.
+	 */
+	if (ret == -1 && errno == ENOENT) {
+		return (0);
+	}
+	return (ret);
+}
+
+/*
+ * Register interest in the exit of the child process pid. It is reported
+ * once, by an event with pe_pid set (and no argument), after which the
+ * process can be reaped without blocking. A process which has already
+ * exited is reported right away. On Linux this takes a process descriptor,
+ * which is returned in *fdp for the caller to close once the process has
+ * been reaped; elsewhere *fdp is -1.
+ */
+int
+poller_add_proc(struct poller *pp, pid_t pid, int *fdp)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	int fd;
+
+	*fdp = -1;
+	fd = syscall(SYS_pidfd_open, pid, 0);
+	if (fd == -1) {
+		return (-1);
+	}
+	bzero(&ev, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLONESHOT;
+	ev.data.u64 = ((uint64_t)pid << 2) | 2;
+	if (epoll_ctl(pp->p_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+		(void) close(fd);
+		return (-1);
+	}
+	*fdp = fd;
+	return (0);
+#else
+	struct kevent kev;
+
+	*fdp = -1;
+	EV_SET(&kev, pid, EVFILT_PROC, EV_ADD | EV_ONESHOT, NOTE_EXIT, 0,
+	    NULL);
+	return (kevent(pp->p_fd, &kev, 1, NULL, 0, NULL));
+#endif
+}
+
+/*
+ * Wait for up to nevents events, or timeout microseconds. A timeout of -1
+ * waits indefinitely. epoll(7) only has millisecond resolution, so there
+ * the timeout is rounded up. Returns the number of events, 0 on timeout or
+ * -1 on error.
+ */
+int
+poller_wait(struct poller *pp, struct poller_event *events, int nevents,
+    int timeout)
+{
+	int k, n;
+
+	if (nevents > POLLER_MAX_EVENTS) {
+		nevents = POLLER_MAX_EVENTS;
+	}
+#ifdef __linux__
+	struct epoll_event ev[POLLER_MAX_EVENTS];
+
+	n = epoll_wait(pp->p_fd, ev, nevents,
+	    timeout > 0 ? (timeout + 999) / 1000 : timeout);
+	for (k = 0; k < n; k++) {
+		events[k].pe_arg = (void *)(uintptr_t)(ev[k].data.u64 & ~3ULL);
+		events[k].pe_eof =
+		    (ev[k].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) != 0;
+		events[k].pe_write = (ev[k].data.u64 & 1) != 0;
+		events[k].pe_pid = 0;
+		if ((ev[k].data.u64 & 2) != 0) {
+			events[k].pe_arg = NULL;
+			events[k].pe_pid = ev[k].data.u64 >> 2;
+		}
+	}
+#else
+	struct kevent kev[POLLER_MAX_EVENTS];
+	struct timespec ts, *tsp;
+
+	tsp = NULL;
+	if (timeout >= 0) {
+		ts.tv_sec = timeout / 1000000;
+		ts.tv_nsec = (timeout % 1000000) * 1000;
+		tsp = &ts;
+	}
+	n = kevent(pp->p_fd, NULL, 0, kev, nevents, tsp);
+	for (k = 0; k < n; k++) {
+		events[k].pe_arg = kev[k].udata;
+		events[k].pe_eof = (kev[k].flags & EV_EOF) != 0;
+		events[k].pe_write = kev[k].filter == EVFILT_WRITE;
+		events[k].pe_pid = 0;
+		if (kev[k].filter == EVFILT_PROC) {
+			events[k].pe_pid = kev[k].ident;
+		}
+	}
+#endif
+	return (n);
+}
+
+#ifdef __BENCH_POLLER_CODE__
+/*
+ * Measure the cost of servicing a single readable descriptor out of a set
+ * of N idle ones, using the poller and using the old approach of building
+ * an fd_set from the whole set and calling select(2) on every iteration.
+ * Pipes stand in for ptys, select is skipped once the descriptors no
+ * longer fit in FD_SETSIZE.
+ *
+ * cc -D__BENCH_POLLER_CODE__ poller.c
+ */
+#define	BENCH_ITERATIONS	100000
+
+static double
+bench_elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) * 1e9 +
+	    (end.tv_nsec - start->tv_nsec));
+}
+
+static double
+bench_poller(int (*fds)[2], int nfds)
+{
+	struct poller_event ev[POLLER_MAX_EVENTS];
+	struct timespec start;
+	struct poller *pp;
+	int k, n;
+	char c;
+
+	pp = poller_create();
+	for (k = 0; k < nfds; k++) {
+		if (poller_add(pp, fds[k][0], &fds[k], 0) == -1) {
+			err(1, "poller_add");
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k = 0; k < BENCH_ITERATIONS; k++) {
+		(void) write(fds[k % nfds][1], "x", 1);
+		n = poller_wait(pp, ev, POLLER_MAX_EVENTS, -1);
+		if (n != 1) {
+			errx(1, "expected a single event, got %d", n);
+		}
+		(void) read((*(int (*)[2])ev[0].pe_arg)[0], &c, 1);
+	}
+	close(pp->p_fd);
+	free(pp);
+	return (bench_elapsed(&start) / BENCH_ITERATIONS);
+}
+
+static double
+bench_select(int (*fds)[2], int nfds)
+{
+	struct timespec start;
+	int j, k, maxfd;
+	fd_set rfds;
+	char c;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k = 0; k < BENCH_ITERATIONS; k++) {
+		(void) write(fds[k % nfds][1], "x", 1);
+		FD_ZERO(&rfds);
+		maxfd = 0;
+		for (j = 0; j < nfds; j++) {
+			if (fds[j][0] > maxfd) {
+				maxfd = fds[j][0];
+			}
+			FD_SET(fds[j][0], &rfds);
+		}
+		if (select(maxfd + 1, &rfds, NULL, NULL, NULL) != 1) {
+			errx(1, "select");
+		}
+		for (j = 0; j < nfds; j++) {
+			if (!FD_ISSET(fds[j][0], &rfds)) {
+				continue;
+			}
+			(void) read(fds[j][0], &c, 1);
+		}
+	}
+	return (bench_elapsed(&start) / BENCH_ITERATIONS);
+}
+
+int
+main(int argc, char *argv [])
+{
+	int sizes[] = { 10, 100, 500, 1000, 2500, 5000 };
+	int (*fds)[2], k, j, nfds;
+	struct rlimit rl;
+
+	rl.rlim_cur = rl.rlim_max = 2 * 5000 + 64;
+	if (setrlimit(RLIMIT_NOFILE, &rl) == -1) {
+		err(1, "setrlimit(RLIMIT_NOFILE)");
+	}
+	printf("%6s %16s %16s\n", "fds", "poller ns/event", "select ns/event");
+	for (k = 0; k < sizeof(sizes) / sizeof(sizes[0]); k++) {
+		nfds = sizes[k];
+		fds = calloc(nfds, sizeof(*fds));
+		for (j = 0; j < nfds; j++) {
+			if (pipe(fds[j]) == -1) {
+				err(1, "pipe");
+			}
+		}
+		printf("%6d %16.0f ", nfds, bench_poller(fds, nfds));
+		if (fds[nfds - 1][1] < FD_SETSIZE) {
+			printf("%16.0f\n", bench_select(fds, nfds));
+		} else {
+			printf("%16s\n", "n/a");
+		}
+		for (j = 0; j < nfds; j++) {
+			close(fds[j][0]);
+			close(fds[j][1]);
+		}
+		free(fds);
+	}
+	return (0);
+}
+#endif	/* __BENCH_POLLER_CODE__ */
@@ -0,0 +1,59 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef POLLER_DOT_H_
+#define	POLLER_DOT_H_
+
+/*
+ * Thin wrapper around kqueue(2) and epoll(7). Descriptors are registered
+ * for read (or with POLLER_WRITE, write) readiness along with an opaque
+ * argument which is handed back when the descriptor becomes ready. A
+ * descriptor is expected to be registered for one direction at a time.
+ * Child processes may be registered too, their exit is reported once, as
+ * an event with pe_pid set.
+ */
+#define	POLLER_ONESHOT		0x00000001
+#define	POLLER_WRITE		0x00000002
+#define	POLLER_MAX_EVENTS	64
+
+struct poller_event {
+	void		*pe_arg;
+	int		 pe_eof;
+	int		 pe_write;
+	pid_t		 pe_pid;	/* exited, or 0 */
+};
+
+struct poller {
+	int		 p_fd;
+};
+
+struct poller	*poller_create(void);
+int		 poller_add(struct poller *, int, void *, int);
+int		 poller_del(struct poller *, int, int);
+int		 poller_add_proc(struct poller *, pid_t, int *);
+int		 poller_wait(struct poller *, struct poller_event *, int, int);
+
+#endif	/* POLLER_DOT_H_ */
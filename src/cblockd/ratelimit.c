@@ -0,0 +1,111 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdint.h>
+
+#include "ratelimit.h"
+
+#define	RATELIMIT_SCALE		1000000ULL	/* credit per byte */
+
+/*
+ * Without an explicit burst, a quarter of a second's worth of output may be
+ * read in one go. The bucket starts out full.
+ */
+void
+ratelimit_init(struct ratelimit *rl, uint64_t rate, uint64_t burst,
+    uint64_t now)
+{
+
+	if (burst == 0) {
+		burst = rate / 4;
+	}
+	if (burst < RATELIMIT_MIN_BURST) {
+		burst = RATELIMIT_MIN_BURST;
+	}
+	rl->rl_rate = rate;
+	rl->rl_burst = burst;
+	rl->rl_credit = burst * RATELIMIT_SCALE;
+	rl->rl_last = now;
+}
+
+/*
+ * Add the credit earned since the last call, and return the number of
+ * bytes which may be read now.
+ */
+size_t
+ratelimit_avail(struct ratelimit *rl, uint64_t now)
+{
+	uint64_t elapsed, cap;
+
+	if (rl->rl_rate == 0) {
+		return (SIZE_MAX);
+	}
+	cap = rl->rl_burst * RATELIMIT_SCALE;
+	elapsed = now > rl->rl_last ? now - rl->rl_last : 0;
+	rl->rl_last = now;
+	if (elapsed >= (cap - rl->rl_credit) / rl->rl_rate) {
+		rl->rl_credit = cap;
+	} else {
+		rl->rl_credit += elapsed * rl->rl_rate;
+	}
+	return (rl->rl_credit / RATELIMIT_SCALE);
+}
+
+void
+ratelimit_take(struct ratelimit *rl, size_t len)
+{
+	uint64_t cost;
+
+	if (rl->rl_rate == 0) {
+		return;
+	}
+	cost = len * RATELIMIT_SCALE;
+	rl->rl_credit = cost < rl->rl_credit ? rl->rl_credit - cost : 0;
+}
+
+/*
+ * Microseconds until len bytes (or a full bucket, if that is less) may be
+ * read.
+ */
+uint64_t
+ratelimit_wait(struct ratelimit *rl, size_t len)
+{
+	uint64_t need;
+
+	if (rl->rl_rate == 0) {
+		return (0);
+	}
+	if (len > rl->rl_burst) {
+		len = rl->rl_burst;
+	}
+	need = len * RATELIMIT_SCALE;
+	if (need <= rl->rl_credit) {
+		return (0);
+	}
+	return ((need - rl->rl_credit + rl->rl_rate - 1) / rl->rl_rate);
+}
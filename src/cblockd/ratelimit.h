@@ -0,0 +1,51 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef RATELIMIT_DOT_H_
+#define	RATELIMIT_DOT_H_
+
+/*
+ * Token bucket limiting how fast console output is read from a pty. Credit
+ * accrues at rl_rate bytes per second, up to rl_burst bytes. It is kept in
+ * millionths of a byte so short intervals at low rates are not lost to
+ * rounding.
+ */
+#define	RATELIMIT_MIN_BURST	4096
+
+struct ratelimit {
+	uint64_t	 rl_rate;	/* bytes per second, 0: unlimited */
+	uint64_t	 rl_burst;
+	uint64_t	 rl_credit;
+	uint64_t	 rl_last;	/* usecs, when credit was last added */
+};
+
+void		ratelimit_init(struct ratelimit *, uint64_t, uint64_t,
+		    uint64_t);
+size_t		ratelimit_avail(struct ratelimit *, uint64_t);
+void		ratelimit_take(struct ratelimit *, size_t);
+uint64_t	ratelimit_wait(struct ratelimit *, size_t);
+
+#endif	/* RATELIMIT_DOT_H_ */
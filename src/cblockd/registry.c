@@ -0,0 +1,504 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
+#include "worker.h"
+#include "dispatch.h"
+#include "registry.h"
+
+#define	REGISTRY_MIN_BUCKETS	64
+
+cblock_instance_head_t pr_head = TAILQ_HEAD_INITIALIZER(pr_head);
+pthread_rwlock_t cblock_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+/*
+ * The hash tables (by tag and by pid) double whenever there are more
+ * instances than buckets, and reg_sorted holds the instances ordered by
+ * tag.
+ */
+static cblock_instance_head_t	*reg_buckets;
+static cblock_instance_head_t	*reg_pid_buckets;
+static size_t			 reg_nbuckets;
+static struct cblock_instance	**reg_sorted;
+static size_t			 reg_sorted_max;
+static size_t			 reg_count;
+static _Atomic(uint64_t)	 reg_epoch;
+
+/*
+ * Instances are hashed by the first REGISTRY_PREFIX_LEN characters of
+ * their tag, which is all of it for the tags gen_sha256_instance_id()
+ * makes, so listed IDs and longer names land in the same bucket.
+ */
+static uint32_t
+registry_hash(const char *tag)
+{
+	uint32_t h;
+	size_t k;
+
+	h = 2166136261U;	/* FNV-1a */
+	for (k = 0; k < REGISTRY_PREFIX_LEN && tag[k] != '\0'; k++) {
+		h ^= (u_char)tag[k];
+		h *= 16777619U;
+	}
+	return (h);
+}
+
+static cblock_instance_head_t *
+registry_bucket(const char *tag)
+{
+
+	return (&reg_buckets[registry_hash(tag) & (reg_nbuckets - 1)]);
+}
+
+static cblock_instance_head_t *
+registry_pid_bucket(pid_t pid)
+{
+
+	return (&reg_pid_buckets[(uint32_t)pid & (reg_nbuckets - 1)]);
+}
+
+static void
+registry_rehash(void)
+{
+	cblock_instance_head_t *old, *old_pid;
+	struct cblock_instance *pi;
+	size_t k, n;
+
+	old = reg_buckets;
+	old_pid = reg_pid_buckets;
+	n = reg_nbuckets;
+	reg_nbuckets = (n == 0) ? REGISTRY_MIN_BUCKETS : n * 2;
+	reg_buckets = calloc(reg_nbuckets, sizeof(*reg_buckets));
+	reg_pid_buckets = calloc(reg_nbuckets, sizeof(*reg_pid_buckets));
+	if (reg_buckets == NULL || reg_pid_buckets == NULL) {
+		err(1, "calloc failed");
+	}
+	for (k = 0; k < reg_nbuckets; k++) {
+		TAILQ_INIT(&reg_buckets[k]);
+		TAILQ_INIT(&reg_pid_buckets[k]);
+	}
+	for (k = 0; k < n; k++) {
+		while ((pi = TAILQ_FIRST(&old[k])) != NULL) {
+			TAILQ_REMOVE(&old[k], pi, p_hash_glue);
+			TAILQ_INSERT_TAIL(registry_bucket(pi->p_instance_tag),
+			    pi, p_hash_glue);
+		}
+		while ((pi = TAILQ_FIRST(&old_pid[k])) != NULL) {
+			TAILQ_REMOVE(&old_pid[k], pi, p_pid_glue);
+			TAILQ_INSERT_TAIL(registry_pid_bucket(pi->p_pid), pi,
+			    p_pid_glue);
+		}
+	}
+	free(old);
+	free(old_pid);
+}
+
+/*
+ * Returns the index of the first instance whose tag does not sort before
+ * the given one, comparing at most len characters (all of them if len is
+ * 0).
+ */
+static size_t
+registry_bound(const char *tag, size_t len)
+{
+	size_t lo, hi, mid;
+	int cmp;
+
+	lo = 0;
+	hi = reg_count;
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (len == 0) {
+			cmp = strcmp(reg_sorted[mid]->p_instance_tag, tag);
+		} else {
+			cmp = strncmp(reg_sorted[mid]->p_instance_tag, tag, len);
+		}
+		if (cmp < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return (lo);
+}
+
+/*
+ * Link a new instance into the registry. The caller holds cblock_lock for
+ * writing.
+ */
+void
+registry_insert(struct cblock_instance *pi)
+{
+	struct cblock_instance **vec;
+	size_t k;
+
+	if (reg_count == reg_sorted_max) {
+		reg_sorted_max = (reg_sorted_max == 0) ? REGISTRY_MIN_BUCKETS :
+		    reg_sorted_max * 2;
+		vec = realloc(reg_sorted, reg_sorted_max * sizeof(*vec));
+		if (vec == NULL) {
+			err(1, "realloc failed");
+		}
+		reg_sorted = vec;
+	}
+	if (reg_count >= reg_nbuckets) {
+		registry_rehash();
+	}
+	TAILQ_INSERT_HEAD(&pr_head, pi, p_glue);
+	TAILQ_INSERT_HEAD(registry_bucket(pi->p_instance_tag), pi,
+	    p_hash_glue);
+	TAILQ_INSERT_HEAD(registry_pid_bucket(pi->p_pid), pi, p_pid_glue);
+	k = registry_bound(pi->p_instance_tag, 0);
+	memmove(&reg_sorted[k + 1], &reg_sorted[k],
+	    (reg_count - k) * sizeof(*reg_sorted));
+	reg_sorted[k] = pi;
+	reg_count++;
+	atomic_fetch_add(&reg_epoch, 1);
+}
+
+/*
+ * Unlink an instance from the registry, leaving its reference to the
+ * caller. The caller holds cblock_lock for writing.
+ */
+void
+registry_unlink(struct cblock_instance *pi)
+{
+	size_t k;
+
+	TAILQ_REMOVE(&pr_head, pi, p_glue);
+	TAILQ_REMOVE(registry_bucket(pi->p_instance_tag), pi, p_hash_glue);
+	if (!pi->p_terminating) {
+		TAILQ_REMOVE(registry_pid_bucket(pi->p_pid), pi, p_pid_glue);
+	}
+	for (k = registry_bound(pi->p_instance_tag, 0); k < reg_count; k++) {
+		if (reg_sorted[k] == pi) {
+			break;
+		}
+	}
+	assert(k < reg_count);
+	memmove(&reg_sorted[k], &reg_sorted[k + 1],
+	    (reg_count - k - 1) * sizeof(*reg_sorted));
+	reg_count--;
+	atomic_fetch_add(&reg_epoch, 1);
+}
+
+/*
+ * Mark an instance whose process has been reaped as terminating. It stays
+ * on the list and in the tag indexes until its teardown has finished and
+ * it is unlinked, but leaves the pid index now, since the pid may be used
+ * again before then. The caller holds cblock_lock for writing.
+ */
+void
+registry_reaped(struct cblock_instance *pi)
+{
+
+	assert(!pi->p_terminating);
+	TAILQ_REMOVE(registry_pid_bucket(pi->p_pid), pi, p_pid_glue);
+	pi->p_terminating = 1;
+	atomic_fetch_add(&reg_epoch, 1);
+}
+
+/*
+ * Look up an instance by name. A name of REGISTRY_PREFIX_LEN characters
+ * (which is how instances are listed, and what their tags are) matches
+ * the tag it starts, a longer one must match the tag exactly; both are
+ * answered by the hash table. A shorter name is an abbreviated ID, which
+ * is looked up in the sorted array and only matches if it is unique. No
+ * reference is taken: the caller holds cblock_lock (for reading at least)
+ * for as long as it uses the result, or takes one itself.
+ */
+struct cblock_instance *
+registry_find(const char *name)
+{
+	struct cblock_instance *pi;
+	size_t k, len;
+
+	if (reg_count == 0) {
+		return (NULL);
+	}
+	len = strlen(name);
+	if (len >= REGISTRY_PREFIX_LEN) {
+		TAILQ_FOREACH(pi, registry_bucket(name), p_hash_glue) {
+			if (len == REGISTRY_PREFIX_LEN ?
+			    strncmp(pi->p_instance_tag, name, len) == 0 :
+			    strcmp(pi->p_instance_tag, name) == 0) {
+				return (pi);
+			}
+		}
+		return (NULL);
+	}
+	if (len == 0) {
+		return (NULL);
+	}
+	k = registry_bound(name, len);
+	if (k == reg_count ||
+	    strncmp(reg_sorted[k]->p_instance_tag, name, len) != 0) {
+		return (NULL);
+	}
+	if (k + 1 < reg_count &&
+	    strncmp(reg_sorted[k + 1]->p_instance_tag, name, len) == 0) {
+		return (NULL);	/* ambiguous */
+	}
+	return (reg_sorted[k]);
+}
+
+/*
+ * Look up an instance by the pid of its process, under the same rules as
+ * registry_find().
+ */
+struct cblock_instance *
+registry_find_pid(pid_t pid)
+{
+	struct cblock_instance *pi;
+
+	if (reg_count == 0) {
+		return (NULL);
+	}
+	TAILQ_FOREACH(pi, registry_pid_bucket(pid), p_pid_glue) {
+		if (pi->p_pid == pid) {
+			return (pi);
+		}
+	}
+	return (NULL);
+}
+
+size_t
+registry_count(void)
+{
+
+	return (reg_count);
+}
+
+/*
+ * The epoch advances whenever an instance comes or goes, or something
+ * listings show about one changes (registry_touch()), so a copy of the
+ * registry made at a given epoch is current for as long as the epoch is.
+ * It may be read without cblock_lock; under it, only a touch moves it.
+ */
+uint64_t
+registry_epoch(void)
+{
+
+	return (atomic_load(&reg_epoch));
+}
+
+void
+registry_touch(void)
+{
+
+	atomic_fetch_add(&reg_epoch, 1);
+}
+
+#ifdef __BENCH_REGISTRY_CODE__
+#include <time.h>
+
+/*
+ * Registers a number of instances with random tags, of the length
+ * gen_sha256_instance_id() makes them, and looks them up by tag and by
+ * abbreviated ID, first the way cblock_lookup_instance() used to (a scan
+ * of pr_head under a mutex) and then through the indexes under the
+ * reader/writer lock. The same lookups are then made by several threads
+ * at once, to show what the mutex cost them.
+ *
+ * cc -O2 -D__BENCH_REGISTRY_CODE__ registry.c -lpthread
+ */
+#define	BENCH_INSTANCES		10000
+#define	BENCH_LOOKUPS		100000
+#define	BENCH_THREADS		4
+#define	BENCH_SHORT_LEN		8	/* abbreviated ID */
+
+static pthread_mutex_t	 bench_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char		 bench_names[BENCH_LOOKUPS][REGISTRY_PREFIX_LEN + 1];
+static int		 bench_indexed;
+static volatile size_t	 bench_found;
+
+static uint64_t
+bench_usecs(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+static struct cblock_instance *
+bench_scan(const char *name)
+{
+	struct cblock_instance *pi;
+	size_t slen;
+
+	slen = strlen(name);
+	pthread_mutex_lock(&bench_mutex);
+	TAILQ_FOREACH(pi, &pr_head, p_glue) {
+		if (slen <= REGISTRY_PREFIX_LEN ?
+		    strncmp(pi->p_instance_tag, name, slen) == 0 :
+		    strcmp(pi->p_instance_tag, name) == 0) {
+			break;
+		}
+	}
+	pthread_mutex_unlock(&bench_mutex);
+	return (pi);
+}
+
+static struct cblock_instance *
+bench_find(const char *name)
+{
+	struct cblock_instance *pi;
+
+	pthread_rwlock_rdlock(&cblock_lock);
+	pi = registry_find(name);
+	pthread_rwlock_unlock(&cblock_lock);
+	return (pi);
+}
+
+static void *
+bench_lookups(void *arg)
+{
+	size_t k, found;
+
+	found = 0;
+	for (k = 0; k < BENCH_LOOKUPS; k++) {
+		if (bench_indexed) {
+			found += bench_find(bench_names[k]) != NULL;
+		} else {
+			found += bench_scan(bench_names[k]) != NULL;
+		}
+	}
+	bench_found = found;
+	return (NULL);
+}
+
+static void
+bench_names_fill(struct cblock_instance **vec, size_t len)
+{
+	size_t k;
+
+	for (k = 0; k < BENCH_LOOKUPS; k++) {
+		strlcpy(bench_names[k],
+		    vec[random() % BENCH_INSTANCES]->p_instance_tag, len + 1);
+	}
+}
+
+static void
+bench_run(const char *what)
+{
+	pthread_t thr[BENCH_THREADS];
+	uint64_t start, elapsed[2][2];
+	int k, indexed;
+
+	for (indexed = 0; indexed < 2; indexed++) {
+		bench_indexed = indexed;
+		start = bench_usecs();
+		bench_lookups(NULL);
+		elapsed[indexed][0] = bench_usecs() - start;
+		if (bench_found != BENCH_LOOKUPS) {
+			errx(1, "%zu of %d %s lookups failed",
+			    BENCH_LOOKUPS - bench_found, BENCH_LOOKUPS, what);
+		}
+		start = bench_usecs();
+		for (k = 0; k < BENCH_THREADS; k++) {
+			if (pthread_create(&thr[k], NULL, bench_lookups,
+			    NULL) != 0) {
+				errx(1, "pthread_create failed");
+			}
+		}
+		for (k = 0; k < BENCH_THREADS; k++) {
+			pthread_join(thr[k], NULL);
+		}
+		elapsed[indexed][1] = bench_usecs() - start;
+	}
+	printf("%-8s scan %8.1f ns/lookup (%d threads %8.1f)  "
+	    "indexed %6.1f ns/lookup (%d threads %6.1f)\n", what,
+	    elapsed[0][0] * 1000.0 / BENCH_LOOKUPS, BENCH_THREADS,
+	    elapsed[0][1] * 1000.0 / (BENCH_LOOKUPS * BENCH_THREADS),
+	    elapsed[1][0] * 1000.0 / BENCH_LOOKUPS, BENCH_THREADS,
+	    elapsed[1][1] * 1000.0 / (BENCH_LOOKUPS * BENCH_THREADS));
+}
+
+int
+main(int argc, char *argv [])
+{
+	static const char hex[] = "0123456789abcdef";
+	struct cblock_instance **vec, *pi;
+	size_t k, j;
+	char *tag;
+
+	vec = calloc(BENCH_INSTANCES, sizeof(*vec));
+	if (vec == NULL) {
+		err(1, "calloc failed");
+	}
+	srandom(1);
+	for (k = 0; k < BENCH_INSTANCES; k++) {
+		pi = calloc(1, sizeof(*pi));
+		tag = malloc(REGISTRY_PREFIX_LEN + 1);
+		if (pi == NULL || tag == NULL) {
+			err(1, "calloc failed");
+		}
+		for (j = 0; j < REGISTRY_PREFIX_LEN; j++) {
+			tag[j] = hex[random() % 16];
+		}
+		tag[REGISTRY_PREFIX_LEN] = '\0';
+		pi->p_instance_tag = tag;
+		pthread_rwlock_wrlock(&cblock_lock);
+		registry_insert(pi);
+		pthread_rwlock_unlock(&cblock_lock);
+		vec[k] = pi;
+	}
+	printf("%zu instances\n", registry_count());
+	bench_names_fill(vec, REGISTRY_PREFIX_LEN);
+	bench_run("id");
+	bench_names_fill(vec, BENCH_SHORT_LEN);
+	bench_run("short");
+	for (k = 0; k < BENCH_INSTANCES; k += 2) {
+		pthread_rwlock_wrlock(&cblock_lock);
+		registry_unlink(vec[k]);
+		pthread_rwlock_unlock(&cblock_lock);
+		if (bench_find(vec[k]->p_instance_tag) != NULL ||
+		    bench_find(vec[k + 1]->p_instance_tag) != vec[k + 1]) {
+			errx(1, "registry inconsistent after unlink");
+		}
+	}
+	printf("%zu instances after unlinking half\n", registry_count());
+	return (0);
+}
+#endif	/* __BENCH_REGISTRY_CODE__ */
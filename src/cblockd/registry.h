@@ -0,0 +1,54 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef REGISTRY_DOT_H_
+#define	REGISTRY_DOT_H_
+
+/*
+ * The registry of running instances. Besides the list (pr_head), which is
+ * what the instance listing walks, instances are indexed by a hash of
+ * their tag (the ID instances are listed by), by a sorted array of tags,
+ * which answers IDs abbreviated further with a binary search, and by the
+ * pid the reaper is told has exited. The list and the indexes are protected by cblock_lock:
+ * lookups take it for reading, so console connects, commands and stats
+ * requests do not serialize behind each other, while launches, the reaper
+ * and the cleanup threads take it for writing. A reaped instance is left
+ * registered (as terminating) until its cleanup has finished.
+ */
+#define	REGISTRY_PREFIX_LEN	10
+
+void		registry_insert(struct cblock_instance *);
+void		registry_unlink(struct cblock_instance *);
+void		registry_reaped(struct cblock_instance *);
+struct cblock_instance *
+		registry_find(const char *);
+struct cblock_instance *
+		registry_find_pid(pid_t);
+size_t		registry_count(void);
+uint64_t	registry_epoch(void);
+void		registry_touch(void);
+
+#endif	/* REGISTRY_DOT_H_ */
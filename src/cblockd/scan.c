@@ -0,0 +1,512 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "scan.h"
+
+/*
+ * Console output is scanned from the end, either for the start of the last
+ * N lines or for the last byte which is not white space (or NUL), and
+ * from the start for runs of printable ASCII to feed the screen model. Each
+ * vector of SCAN_WIDTH bytes is reduced to a mask holding SCAN_BPB bits
+ * per byte, lowest address in the lowest bits. NEON has no movemask, the
+ * narrowing shift trick yields four bits per byte instead.
+ */
+#if defined(__AVX2__)
+#define	SCAN_WIDTH	32
+#define	SCAN_BPB	1
+typedef uint32_t	scan_mask_t;
+
+static inline scan_mask_t
+scan_nl_mask(const u_char *p)
+{
+	__m256i v;
+
+	v = _mm256_loadu_si256((const __m256i *)p);
+	return (_mm256_movemask_epi8(_mm256_cmpeq_epi8(v,
+	    _mm256_set1_epi8('\n'))));
+}
+
+static inline scan_mask_t
+scan_text_mask(const u_char *p)
+{
+	__m256i v, x, sp;
+
+	v = _mm256_loadu_si256((const __m256i *)p);
+	/* \t through \r are 9 through 13 */
+	x = _mm256_sub_epi8(v, _mm256_set1_epi8(9));
+	sp = _mm256_cmpeq_epi8(_mm256_min_epu8(x, _mm256_set1_epi8(4)), x);
+	sp = _mm256_or_si256(sp, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')));
+	sp = _mm256_or_si256(sp, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+	return (~(scan_mask_t)_mm256_movemask_epi8(sp));
+}
+
+static inline scan_mask_t
+scan_ctl_mask(const u_char *p)
+{
+	__m256i v, c;
+
+	/* signed compare, so bytes with the top bit set are below ' ' too */
+	v = _mm256_loadu_si256((const __m256i *)p);
+	c = _mm256_cmpgt_epi8(_mm256_set1_epi8(' '), v);
+	c = _mm256_or_si256(c, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(0x7f)));
+	return (_mm256_movemask_epi8(c));
+}
+#elif defined(__SSE2__)
+#define	SCAN_WIDTH	16
+#define	SCAN_BPB	1
+typedef uint32_t	scan_mask_t;
+
+static inline scan_mask_t
+scan_nl_mask(const u_char *p)
+{
+	__m128i v;
+
+	v = _mm_loadu_si128((const __m128i *)p);
+	return (_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8('\n'))));
+}
+
+static inline scan_mask_t
+scan_text_mask(const u_char *p)
+{
+	__m128i v, x, sp;
+
+	v = _mm_loadu_si128((const __m128i *)p);
+	/* \t through \r are 9 through 13 */
+	x = _mm_sub_epi8(v, _mm_set1_epi8(9));
+	sp = _mm_cmpeq_epi8(_mm_min_epu8(x, _mm_set1_epi8(4)), x);
+	sp = _mm_or_si128(sp, _mm_cmpeq_epi8(v, _mm_set1_epi8(' ')));
+	sp = _mm_or_si128(sp, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	return (~_mm_movemask_epi8(sp) & 0xffff);
+}
+
+static inline scan_mask_t
+scan_ctl_mask(const u_char *p)
+{
+	__m128i v, c;
+
+	/* signed compare, so bytes with the top bit set are below ' ' too */
+	v = _mm_loadu_si128((const __m128i *)p);
+	c = _mm_cmplt_epi8(v, _mm_set1_epi8(' '));
+	c = _mm_or_si128(c, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f)));
+	return (_mm_movemask_epi8(c));
+}
+#elif defined(__ARM_NEON)
+#define	SCAN_WIDTH	16
+#define	SCAN_BPB	4
+typedef uint64_t	scan_mask_t;
+
+static inline scan_mask_t
+scan_neon_mask(uint8x16_t cmp)
+{
+
+	return (vget_lane_u64(vreinterpret_u64_u8(
+	    vshrn_n_u16(vreinterpretq_u16_u8(cmp), 4)), 0));
+}
+
+static inline scan_mask_t
+scan_nl_mask(const u_char *p)
+{
+
+	return (scan_neon_mask(vceqq_u8(vld1q_u8(p), vdupq_n_u8('\n'))));
+}
+
+static inline scan_mask_t
+scan_text_mask(const u_char *p)
+{
+	uint8x16_t v, sp;
+
+	v = vld1q_u8(p);
+	/* \t through \r are 9 through 13 */
+	sp = vcleq_u8(vsubq_u8(v, vdupq_n_u8(9)), vdupq_n_u8(4));
+	sp = vorrq_u8(sp, vceqq_u8(v, vdupq_n_u8(' ')));
+	sp = vorrq_u8(sp, vceqq_u8(v, vdupq_n_u8(0)));
+	return (~scan_neon_mask(sp));
+}
+
+static inline scan_mask_t
+scan_ctl_mask(const u_char *p)
+{
+	uint8x16_t v, c;
+
+	v = vld1q_u8(p);
+	c = vcltq_s8(vreinterpretq_s8_u8(v), vdupq_n_s8(' '));
+	c = vorrq_u8(c, vceqq_u8(v, vdupq_n_u8(0x7f)));
+	return (scan_neon_mask(c));
+}
+#endif
+
+static int
+scan_is_text(u_char c)
+{
+
+	return (!isspace(c) && c != '\0');
+}
+
+static size_t
+scan_rtrim_scalar(const u_char *buf, size_t len)
+{
+
+	while (len > 0 && !scan_is_text(buf[len - 1])) {
+		len--;
+	}
+	return (len);
+}
+
+static size_t
+scan_printable_scalar(const u_char *buf, size_t len)
+{
+	size_t k;
+
+	for (k = 0; k < len; k++) {
+		if (buf[k] < ' ' || buf[k] > '~') {
+			break;
+		}
+	}
+	return (k);
+}
+
+static const u_char *
+scan_rnewline_scalar(const u_char *buf, size_t len, size_t *n)
+{
+
+	while (len > 0) {
+		len--;
+		if (buf[len] == '\n' && --(*n) == 0) {
+			return (buf + len);
+		}
+	}
+	return (NULL);
+}
+
+#ifdef SCAN_WIDTH
+/*
+ * Index of the highest byte whose bits are set in the mask.
+ */
+static inline int
+scan_mask_high(scan_mask_t mask)
+{
+
+	if (sizeof(mask) == sizeof(uint64_t)) {
+		return ((63 - __builtin_clzll(mask)) / SCAN_BPB);
+	}
+	return ((31 - __builtin_clz(mask)) / SCAN_BPB);
+}
+
+/*
+ * Index of the lowest byte whose bits are set in the mask.
+ */
+static inline int
+scan_mask_low(scan_mask_t mask)
+{
+
+	if (sizeof(mask) == sizeof(uint64_t)) {
+		return (__builtin_ctzll(mask) / SCAN_BPB);
+	}
+	return (__builtin_ctz(mask) / SCAN_BPB);
+}
+
+static inline int
+scan_mask_count(scan_mask_t mask)
+{
+
+	if (sizeof(mask) == sizeof(uint64_t)) {
+		return (__builtin_popcountll(mask) / SCAN_BPB);
+	}
+	return (__builtin_popcount(mask) / SCAN_BPB);
+}
+#endif
+
+/*
+ * Returns the length of buf once trailing white space and NUL bytes have
+ * been trimmed.
+ */
+size_t
+scan_rtrim(const u_char *buf, size_t len)
+{
+#ifdef SCAN_WIDTH
+	scan_mask_t mask;
+
+	while (len >= SCAN_WIDTH) {
+		mask = scan_text_mask(buf + len - SCAN_WIDTH);
+		if (mask != 0) {
+			return (len - SCAN_WIDTH + scan_mask_high(mask) + 1);
+		}
+		len -= SCAN_WIDTH;
+	}
+#endif
+	return (scan_rtrim_scalar(buf, len));
+}
+
+/*
+ * Search backwards for the *n'th newline in buf. Returns a pointer to it,
+ * or NULL if buf holds fewer newlines, in which case *n is reduced by the
+ * number it does hold so the search can carry on into the buffer before.
+ */
+const u_char *
+scan_rnewline(const u_char *buf, size_t len, size_t *n)
+{
+#ifdef SCAN_WIDTH
+	scan_mask_t mask;
+	int cnt, k;
+
+	while (len >= SCAN_WIDTH) {
+		len -= SCAN_WIDTH;
+		mask = scan_nl_mask(buf + len);
+		if (mask == 0) {
+			continue;
+		}
+		cnt = scan_mask_count(mask);
+		if (cnt < *n) {
+			*n -= cnt;
+			continue;
+		}
+		for (;;) {
+			k = scan_mask_high(mask);
+			if (--(*n) == 0) {
+				return (buf + len + k);
+			}
+			mask &= ~((((scan_mask_t)1 << SCAN_BPB) - 1) <<
+			    (k * SCAN_BPB));
+		}
+	}
+#endif
+	return (scan_rnewline_scalar(buf, len, n));
+}
+
+/*
+ * Returns the length of the run of printable ASCII (' ' through '~') at
+ * the start of buf.
+ */
+size_t
+scan_printable(const u_char *buf, size_t len)
+{
+#ifdef SCAN_WIDTH
+	scan_mask_t mask;
+	size_t off;
+
+	off = 0;
+	while (len - off >= SCAN_WIDTH) {
+		mask = scan_ctl_mask(buf + off);
+		if (mask != 0) {
+			return (off + scan_mask_low(mask));
+		}
+		off += SCAN_WIDTH;
+	}
+	return (off + scan_printable_scalar(buf + off, len - off));
+#else
+	return (scan_printable_scalar(buf, len));
+#endif
+}
+
+#ifdef __BENCH_SCAN_CODE__
+#include <time.h>
+#include <err.h>
+
+/*
+ * Compare the vectorized scans against the byte at a time versions over a
+ * 1MB scrollback held in 4KB pages, and against the old attach path which
+ * copied the whole scrollback into one buffer and trimmed it with
+ * isspace(3). The scans are checked against each other on random input
+ * first.
+ *
+ * cc -O2 -D__BENCH_SCAN_CODE__ scan.c
+ * cc -O2 -mavx2 -D__BENCH_SCAN_CODE__ scan.c
+ */
+#define	BENCH_SIZE	(1024 * 1024)
+#define	BENCH_PAGE	4096
+#define	BENCH_ROUNDS	200
+
+typedef const u_char *(*rnewline_fn)(const u_char *, size_t, size_t *);
+typedef size_t (*rtrim_fn)(const u_char *, size_t);
+
+static double
+bench_ns(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) * 1e9 +
+	    (end.tv_nsec - start->tv_nsec));
+}
+
+/*
+ * Offset of the start of the last nlines lines, searching page by page
+ * from the end as termbuf_lines_start() does.
+ */
+static size_t
+bench_lines(rnewline_fn fn, const u_char *buf, size_t len, size_t nlines)
+{
+	const u_char *nl;
+	size_t off, n;
+
+	off = len;
+	while (off > 0) {
+		n = off % BENCH_PAGE ? off % BENCH_PAGE : BENCH_PAGE;
+		off -= n;
+		nl = fn(buf + off, n, &nlines);
+		if (nl != NULL) {
+			return (nl - buf + 1);
+		}
+	}
+	return (0);
+}
+
+static void
+bench_check(void)
+{
+	u_char buf[512];
+	size_t len, n1, n2, k;
+	const u_char *p1, *p2;
+	int round;
+
+	for (round = 0; round < 100000; round++) {
+		len = random() % sizeof(buf);
+		for (k = 0; k < len; k++) {
+			buf[k] = "ab \t\n\r\0\v\f"[random() % 9];
+		}
+		if (scan_rtrim(buf, len) != scan_rtrim_scalar(buf, len)) {
+			errx(1, "scan_rtrim mismatch (len %zu)", len);
+		}
+		n1 = n2 = 1 + random() % 8;
+		p1 = scan_rnewline(buf, len, &n1);
+		p2 = scan_rnewline_scalar(buf, len, &n2);
+		if (p1 != p2 || n1 != n2) {
+			errx(1, "scan_rnewline mismatch (len %zu)", len);
+		}
+		for (k = 0; k < len; k++) {
+			buf[k] = random() % 64 ? ' ' + random() % 95 :
+			    "\x1b\x7f\x80\xe9\x1f~ "[random() % 7];
+		}
+		if (scan_printable(buf, len) != scan_printable_scalar(buf,
+		    len)) {
+			errx(1, "scan_printable mismatch (len %zu)", len);
+		}
+	}
+}
+
+static void
+bench_report(const char *name, struct timespec *start)
+{
+
+	printf("%-28s %10.1f us\n", name, bench_ns(start) / BENCH_ROUNDS /
+	    1000);
+}
+
+int
+main(int argc, char *argv [])
+{
+	static const size_t nlines[] = { 10, 1000, SIZE_MAX };
+	struct timespec start;
+	u_char *buf, *contig;
+	volatile size_t sink;
+	char name[64];
+	size_t k, len;
+	int round, j;
+
+	bench_check();
+	printf("vector width %d\n",
+#ifdef SCAN_WIDTH
+	    SCAN_WIDTH
+#else
+	    0
+#endif
+	);
+	buf = malloc(BENCH_SIZE);
+	if (buf == NULL) {
+		err(1, "malloc");
+	}
+	for (k = 0; k < BENCH_SIZE; k++) {
+		buf[k] = random() % 70 == 0 ? '\n' : 'a' + random() % 26;
+	}
+	/*
+	 * Full screen applications leave plenty of trailing blanks.
+	 */
+	memset(buf + BENCH_SIZE - 65536, ' ', 65536);
+	len = BENCH_SIZE;
+	sink = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		contig = calloc(1, len);
+		for (k = 0; k < len; k += BENCH_PAGE) {
+			memcpy(contig + k, buf + k, BENCH_PAGE);
+		}
+		k = len;
+		while (k > 0 && (isspace(contig[k - 1]) ||
+		    contig[k - 1] == '\0')) {
+			k--;
+		}
+		sink += k;
+		free(contig);
+	}
+	bench_report("trim: copy + isspace", &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		sink += scan_rtrim_scalar(buf, len);
+	}
+	bench_report("trim: in place, scalar", &start);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (round = 0; round < BENCH_ROUNDS; round++) {
+		sink += scan_rtrim(buf, len);
+	}
+	bench_report("trim: in place, vector", &start);
+	for (j = 0; j < 3; j++) {
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (round = 0; round < BENCH_ROUNDS; round++) {
+			sink += bench_lines(scan_rnewline_scalar, buf, len,
+			    nlines[j]);
+		}
+		snprintf(name, sizeof(name), "last %s lines: scalar",
+		    nlines[j] == SIZE_MAX ? "all" :
+		    nlines[j] == 10 ? "10" : "1000");
+		bench_report(name, &start);
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (round = 0; round < BENCH_ROUNDS; round++) {
+			sink += bench_lines(scan_rnewline, buf, len,
+			    nlines[j]);
+		}
+		snprintf(name, sizeof(name), "last %s lines: vector",
+		    nlines[j] == SIZE_MAX ? "all" :
+		    nlines[j] == 10 ? "10" : "1000");
+		bench_report(name, &start);
+	}
+	free(buf);
+	return (0);
+}
+#endif	/* __BENCH_SCAN_CODE__ */
@@ -26,9 +26,9 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/select.h>
 #include <sys/param.h>
 #include <sys/un.h>
 
@@ -43,11 +43,23 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <err.h>
 #include <pwd.h>
 
+#include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "poller.h"
+#include "worker.h"
 #include "sock_ipc.h"
+#include "dispatch.h"
+
+static struct poller *ipc_poller;
 
 int
 sock_ipc_setup_unix(struct global_params *cmd)
@@ -144,50 +156,95 @@ sock_ipc_setup_inet(struct global_params *cmd)
 }
 
 static int
-sock_ipc_accept_connection(int sock)
+sock_ipc_get_family(int sock)
 {
-	extern struct global_params gcfg;
-	struct sockaddr_storage addrs;
-	struct cblock_peer *p;
-	struct sockaddr sa;
+	struct sockaddr_storage ss;
 	socklen_t slen;
-	int nsock;
-	uid_t uid;
-	gid_t gid;
 
-	slen = sizeof(sa);
-	if (getsockname(sock, &sa, &slen) == -1) {
+	slen = sizeof(ss);
+	if (getsockname(sock, (struct sockaddr *)&ss, &slen) == -1) {
 		err(1, "getsockname failed");
 	}
-	switch (sa.sa_family) {
+	switch (ss.ss_family) {
 	case PF_UNIX:
-		slen = sizeof(struct sockaddr_un);
-		break;
 	case PF_INET:
-		slen = sizeof(struct sockaddr_in);
-		break;
 	case PF_INET6:
-		slen = sizeof(struct sockaddr_in6);
 		break;
 	default:
 		errx(1, "un-supported address family");
 	}
+	return (ss.ss_family);
+}
+
+int
+sock_ipc_set_nonblock(int sock, int on)
+{
+	int flags;
+
+	flags = fcntl(sock, F_GETFL);
+	if (flags == -1) {
+		return (-1);
+	}
+	if (on) {
+		flags |= O_NONBLOCK;
+	} else {
+		flags &= ~O_NONBLOCK;
+	}
+	return (fcntl(sock, F_SETFL, flags));
+}
+
+/*
+ * Peers wait in the poller with a non-blocking socket, so the event loop
+ * can collect the command word a piece at a time without being held up by
+ * a peer which has sent only part of it. dispatch_peer_ready() switches the
+ * socket back to blocking before the command is handed to a worker.
+ */
+int
+sock_ipc_rearm(struct cblock_peer *p)
+{
+
+	if (sock_ipc_set_nonblock(p->p_sock, 1) == -1) {
+		return (-1);
+	}
+	return (poller_add(ipc_poller, p->p_sock, p, POLLER_ONESHOT));
+}
+
+/*
+ * The listen sockets are non-blocking, so drain any pending connections
+ * before going back to the poller.
+ */
+static int
+sock_ipc_accept_connection(struct cblock_peer *lp)
+{
+	extern struct global_params gcfg;
+	struct sockaddr_storage addrs;
+	struct cblock_peer *p;
+	socklen_t slen;
+	int nsock;
+	uid_t uid;
+	gid_t gid;
+
 	while (1) {
-		nsock = accept(sock, (struct sockaddr *)&addrs, &slen);
-		if (nsock == -1 && errno == EINTR) {
+		slen = sizeof(addrs);
+		nsock = accept(lp->p_sock, (struct sockaddr *)&addrs, &slen);
+		if (nsock == -1 && (errno == EINTR || errno == ECONNABORTED)) {
 			continue;
 		}
+		if (nsock == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			break;
+		}
 		if (nsock == -1) {
 			err(1, "accept failed");
 		}
-		if (sa.sa_family == PF_UNIX) {
+		p = sock_ipc_construct_peer(nsock, lp->p_family);
+		if (lp->p_family == PF_UNIX) {
 			if (getpeereid(nsock, &uid, &gid) == -1) {
 				err(1, "getpeereid failed");
 			}
-			printf("user %d gid %d\n", uid, gid);
+			p->p_uid = uid;
+			p->p_gid = gid;
 		}
 		printf("accepted connection %d\n", nsock);
-		p = sock_ipc_construct_peer(nsock, sa.sa_family);
 		(void) (*gcfg.c_callback)(p);
 	}
 	return (0);
@@ -196,31 +253,37 @@ sock_ipc_accept_connection(int sock)
 int
 sock_ipc_event_loop(struct global_params *gcp)
 {
-	int error, maxfd, s;
-	fd_set rfds;
+	struct poller_event events[POLLER_MAX_EVENTS];
+	struct cblock_peer *p;
+	int k, n, s;
 
-	while (1) {
-		maxfd = 0;
-		FD_ZERO(&rfds);
-		for (s = 0; s < gcp->c_sock_count; s++) {
-			if (gcp->c_socks[s] > maxfd) {
-				maxfd = gcp->c_socks[s];
-			}
-			FD_SET(gcp->c_socks[s], &rfds);
+	ipc_poller = poller_create();
+	for (s = 0; s < gcp->c_sock_count; s++) {
+		if (sock_ipc_set_nonblock(gcp->c_socks[s], 1) == -1) {
+			err(1, "fcntl(O_NONBLOCK) failed");
+		}
+		p = sock_ipc_construct_peer(gcp->c_socks[s],
+		    sock_ipc_get_family(gcp->c_socks[s]));
+		p->p_flags |= PEER_LISTENER;
+		if (poller_add(ipc_poller, p->p_sock, p, 0) == -1) {
+			err(1, "poller_add(listen socket) failed");
 		}
-		error = select(maxfd + 1, &rfds, NULL, NULL, NULL);
-		if (error == -1 && errno == EINTR) {
+	}
+	while (1) {
+		n = poller_wait(ipc_poller, events, POLLER_MAX_EVENTS, -1);
+		if (n == -1 && errno == EINTR) {
 			continue;
 		}
-		if (error == -1) {
-			err(1, "select failed");
+		if (n == -1) {
+			err(1, "poller_wait failed");
 		}
-		printf("scanning fd set\n");
-		for (s = 0; s < gcp->c_sock_count; s++) {
-			if (!FD_ISSET(gcp->c_socks[s], &rfds)) {
+		for (k = 0; k < n; k++) {
+			p = events[k].pe_arg;
+			if ((p->p_flags & PEER_LISTENER) != 0) {
+				(void) sock_ipc_accept_connection(p);
 				continue;
 			}
-			(void) sock_ipc_accept_connection(gcp->c_socks[s]);
+			dispatch_peer_ready(p);
 		}
 	}
 	return (0);
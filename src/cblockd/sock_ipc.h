@@ -30,15 +30,25 @@
 int		sock_ipc_setup_unix(struct global_params *);
 int		sock_ipc_setup_inet(struct global_params *);
 int		sock_ipc_event_loop(struct global_params *);
-
 struct cblock_peer {
 	int				p_sock;	/* socket associated with peer */
 	uid_t				p_uid;	/* UID if available (PF_UNIX) */
 	gid_t				p_gid;	/* GID if available (PF_UNIX) */
 	int				p_family; /* address family */
-	pthread_t			p_thr;
-	pthread_attr_t			p_detached;
+	int				p_proto; /* negotiated protocol version */
+	uint32_t			p_caps;	/* negotiated capabilities */
+	int				p_flags;
+#define	PEER_LISTENER		0x00000001
+#define	PEER_HANDOFF		0x00000002	/* owned by the logs loop */
+	uint32_t			p_cmd;	/* command handed to worker */
+	size_t				p_cmdlen; /* bytes of p_cmd read */
+	struct console_peer		*p_console; /* log subscription */
+	struct console_mux		*p_mux;	/* console multiplexing */
+	struct work			p_work;
 	TAILQ_ENTRY(cblock_peer)	p_glue;
 };
 
+int		sock_ipc_rearm(struct cblock_peer *);
+int		sock_ipc_set_nonblock(int, int);
+
 #endif	/* SOCK_IPC_DOT_H_ */
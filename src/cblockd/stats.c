@@ -0,0 +1,114 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
+#include "main.h"
+#include "worker.h"
+#include "sock_ipc.h"
+#include "dispatch.h"
+#include "cblock.h"
+#include "stats.h"
+#include "conlog.h"
+
+static void
+stats_flush(struct stats_ctx *ctx)
+{
+
+	(void) tlv_msg_write(ctx->s_sock, &ctx->s_sb);
+	tlv_msg_init(&ctx->s_sb, ctx->s_buf, sizeof(ctx->s_buf));
+}
+
+void
+stats_put(struct stats_ctx *ctx, const char *name, uint64_t value)
+{
+	size_t need;
+
+	need = 2 * TLV_HDR_LEN + strlen(name) + sizeof(value) + 1;
+	if (sbuf_len(&ctx->s_sb) + need >= sizeof(ctx->s_buf)) {
+		stats_flush(ctx);
+	}
+	tlv_put_str(&ctx->s_sb, TLV_STAT_NAME, name);
+	tlv_put_u64(&ctx->s_sb, TLV_STAT_VALUE, value);
+	ctx->s_count++;
+}
+
+static size_t
+stats_peer_count(void)
+{
+	extern pthread_mutex_t peer_mutex;
+	extern cblock_peer_head_t p_head;
+	struct cblock_peer *p;
+	size_t count;
+
+	count = 0;
+	pthread_mutex_lock(&peer_mutex);
+	TAILQ_FOREACH(p, &p_head, p_glue) {
+		count++;
+	}
+	pthread_mutex_unlock(&peer_mutex);
+	return (count);
+}
+
+int
+dispatch_get_stats(struct cblock_peer *p)
+{
+	extern struct worker_pool dispatch_pool, control_pool, console_pool;
+	extern struct worker_pool cleanup_pool;
+	struct stats_ctx ctx;
+
+	ctx.s_sock = p->p_sock;
+	ctx.s_count = 0;
+	tlv_msg_init(&ctx.s_sb, ctx.s_buf, sizeof(ctx.s_buf));
+	stats_put(&ctx, "ipc.peers", stats_peer_count());
+	worker_pool_stats(&dispatch_pool, &ctx);
+	worker_pool_stats(&control_pool, &ctx);
+	worker_pool_stats(&console_pool, &ctx);
+	worker_pool_stats(&cleanup_pool, &ctx);
+	cblock_cleanup_stats(&ctx);
+	tty_io_stats(&ctx);
+	conlog_stats(&ctx);
+	tlv_put_u64(&ctx.s_sb, TLV_COUNT, ctx.s_count);
+	(void) tlv_msg_write(ctx.s_sock, &ctx.s_sb);
+	return (1);
+}
@@ -26,153 +26,629 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <time.h>
 #include <err.h>
 
 #include "main.h"
 #include "termbuf.h"
+#include "scan.h"
 
-#ifdef __TEST_TERMBUF_CODE__
-termbuf_head_t t_head;
-size_t term_buf_tot_len;
+#if defined(__TEST_TERMBUF_CODE__) || defined(__BENCH_TERMBUF_CODE__)
 struct global_params gcfg;
 #endif
+#ifdef __BENCH_TERMBUF_CODE__
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+/*
+ * Pages are carved out of slabs of TERMBUF_SLAB_PAGES, and are kept on a
+ * free list rather than being returned to the allocator.
+ */
+#define	TERMBUF_SLAB_PAGES	64
+
+static struct termbuf_pool {
+	pthread_mutex_t			 tp_mutex;
+	TAILQ_HEAD( , termbuf_page)	 tp_free;
+	TAILQ_HEAD( , tty_buffer)	 tp_lru;	/* least recent first */
+	size_t				 tp_nfree;
+	size_t				 tp_used;	/* pages held */
+	size_t				 tp_budget;	/* pages */
+	size_t				 tp_min;	/* pages */
+	size_t				 tp_max;	/* bytes */
+	uint64_t			 tp_evictions;
+} tb_pool = {
+	.tp_mutex = PTHREAD_MUTEX_INITIALIZER,
+	.tp_free = TAILQ_HEAD_INITIALIZER(tb_pool.tp_free),
+	.tp_lru = TAILQ_HEAD_INITIALIZER(tb_pool.tp_lru),
+};
 
-char *
-termbuf_to_contig(struct tty_buffer *ttyb)
+void
+termbuf_pool_init(size_t budget, size_t min, size_t max)
 {
-	struct termbuf *tbp;
-	char *buf, *vptr;
 
-	if (TAILQ_EMPTY(&ttyb->t_head)) {
-		return (NULL);
+	pthread_mutex_lock(&tb_pool.tp_mutex);
+	tb_pool.tp_budget = budget / TERMBUF_PAGE_SIZE;
+	tb_pool.tp_min = (min + TERMBUF_PAGE_SIZE - 1) / TERMBUF_PAGE_SIZE;
+	if (tb_pool.tp_min == 0) {
+		tb_pool.tp_min = 1;
 	}
-	buf = calloc(1, ttyb->t_tot_len + 1);
-	if (buf == NULL) {
-		err(1, "calloc(termbuf_to_contig) failed)");
+	tb_pool.tp_max = max;
+	pthread_mutex_unlock(&tb_pool.tp_mutex);
+}
+
+void
+termbuf_pool_usage(struct termbuf_usage *tu)
+{
+
+	pthread_mutex_lock(&tb_pool.tp_mutex);
+	tu->tu_budget = tb_pool.tp_budget * TERMBUF_PAGE_SIZE;
+	tu->tu_used = tb_pool.tp_used * TERMBUF_PAGE_SIZE;
+	tu->tu_free = tb_pool.tp_nfree * TERMBUF_PAGE_SIZE;
+	tu->tu_min = tb_pool.tp_min * TERMBUF_PAGE_SIZE;
+	tu->tu_max = tb_pool.tp_max;
+	tu->tu_evictions = tb_pool.tp_evictions;
+	pthread_mutex_unlock(&tb_pool.tp_mutex);
+}
+
+/*
+ * Must be called with the pool lock held.
+ */
+static struct termbuf_page *
+termbuf_page_alloc(void)
+{
+	struct termbuf_page *slab, *tbp;
+	int k;
+
+	if (TAILQ_EMPTY(&tb_pool.tp_free)) {
+		slab = calloc(TERMBUF_SLAB_PAGES, sizeof(*slab));
+		if (slab == NULL) {
+			err(1, "calloc(termbuf slab) failed");
+		}
+		for (k = 0; k < TERMBUF_SLAB_PAGES; k++) {
+			TAILQ_INSERT_TAIL(&tb_pool.tp_free, &slab[k], tp_glue);
+		}
+		tb_pool.tp_nfree += TERMBUF_SLAB_PAGES;
 	}
-	vptr = buf;
-	TAILQ_FOREACH(tbp, &ttyb->t_head, t_glue) {
-		switch (tbp->t_flag) {
-		case TERMBUF_DYNAMIC:
-			bcopy(tbp->t_dynamic, vptr, tbp->t_len);
-			break;
-		case TERMBUF_STATIC:
-			bcopy(tbp->t_static, vptr, tbp->t_len);
-			break;
+	tbp = TAILQ_FIRST(&tb_pool.tp_free);
+	TAILQ_REMOVE(&tb_pool.tp_free, tbp, tp_glue);
+	tb_pool.tp_nfree--;
+	tb_pool.tp_used++;
+	return (tbp);
+}
+
+/*
+ * Must be called with the pool lock held.
+ */
+static void
+termbuf_page_release(struct termbuf_page *tbp)
+{
+
+	TAILQ_INSERT_HEAD(&tb_pool.tp_free, tbp, tp_glue);
+	tb_pool.tp_nfree++;
+	tb_pool.tp_used--;
+}
+
+/*
+ * Unlink the oldest page of a buffer, discarding whatever it holds. The
+ * caller must hold both the buffer and the pool lock, and the buffer must
+ * have more than one page. Holding both for every change to t_npages lets
+ * the eviction scan read it under the pool lock alone.
+ */
+static struct termbuf_page *
+termbuf_take_oldest(struct tty_buffer *ttyb)
+{
+	struct termbuf_page *tbp;
+
+	assert(ttyb->t_npages > 1);
+	tbp = TAILQ_FIRST(&ttyb->t_pages);
+	TAILQ_REMOVE(&ttyb->t_pages, tbp, tp_glue);
+	ttyb->t_npages--;
+	ttyb->t_len -= TERMBUF_PAGE_SIZE - ttyb->t_off;
+	ttyb->t_off = 0;
+	return (tbp);
+}
+
+/*
+ * Find a page for a buffer which has filled its last page. Called with the
+ * buffer and pool locks held. Pages come from
+ * the pool while it is within budget (or the buffer is below its
+ * guaranteed minimum). Otherwise the oldest page of the least recently
+ * attached buffer which is above the minimum is taken. Buffers which are
+ * busy are skipped rather than waited for. If there is nothing to take,
+ * the buffer re-uses its own oldest page.
+ */
+static struct termbuf_page *
+termbuf_page_get(struct tty_buffer *ttyb)
+{
+	struct termbuf_page *tbp;
+	struct tty_buffer *victim;
+
+	if (tb_pool.tp_used < tb_pool.tp_budget ||
+	    ttyb->t_npages < tb_pool.tp_min) {
+		return (termbuf_page_alloc());
+	}
+	TAILQ_FOREACH(victim, &tb_pool.tp_lru, t_lru) {
+		if (victim == ttyb || victim->t_npages <= tb_pool.tp_min ||
+		    victim->t_npages < 2) {
+			continue;
+		}
+		if (pthread_mutex_trylock(victim->t_lock) != 0) {
+			continue;
 		}
-		vptr += tbp->t_len;
+		tbp = termbuf_take_oldest(victim);
+		pthread_mutex_unlock(victim->t_lock);
+		tb_pool.tp_evictions++;
+		return (tbp);
 	}
-	return (buf);
+	if (ttyb->t_npages > 1) {
+		return (termbuf_take_oldest(ttyb));
+	}
+	return (termbuf_page_alloc());
 }
 
-size_t
-termbuf_remove_oldest(struct tty_buffer *ttyb)
+/*
+ * Add an empty page to the end of the buffer.
+ */
+static void
+termbuf_page_add(struct tty_buffer *ttyb)
+{
+	struct termbuf_page *tbp;
+
+	pthread_mutex_lock(&tb_pool.tp_mutex);
+	tbp = termbuf_page_get(ttyb);
+	TAILQ_INSERT_TAIL(&ttyb->t_pages, tbp, tp_glue);
+	ttyb->t_npages++;
+	ttyb->t_tail = 0;
+	pthread_mutex_unlock(&tb_pool.tp_mutex);
+}
+
+void
+termbuf_init(struct tty_buffer *ttyb, pthread_mutex_t *lock)
+{
+
+	TAILQ_INIT(&ttyb->t_pages);
+	ttyb->t_npages = 0;
+	ttyb->t_len = 0;
+	ttyb->t_off = 0;
+	ttyb->t_tail = 0;
+	ttyb->t_head = 0;
+	ttyb->t_lock = lock;
+	pthread_mutex_lock(&tb_pool.tp_mutex);
+	TAILQ_INSERT_HEAD(&tb_pool.tp_lru, ttyb, t_lru);
+	pthread_mutex_unlock(&tb_pool.tp_mutex);
+}
+
+void
+termbuf_free(struct tty_buffer *ttyb)
 {
-	struct termbuf *tbp;
+	struct termbuf_page *tbp;
 
-	assert(!TAILQ_EMPTY(&ttyb->t_head));
-	tbp = TAILQ_FIRST(&ttyb->t_head);
-	TAILQ_REMOVE(&ttyb->t_head, tbp, t_glue);
-	if (tbp->t_flag == TERMBUF_DYNAMIC) {
-		free(tbp->t_dynamic);
+	pthread_mutex_lock(&tb_pool.tp_mutex);
+	TAILQ_REMOVE(&tb_pool.tp_lru, ttyb, t_lru);
+	while ((tbp = TAILQ_FIRST(&ttyb->t_pages)) != NULL) {
+		TAILQ_REMOVE(&ttyb->t_pages, tbp, tp_glue);
+		termbuf_page_release(tbp);
 	}
-	ttyb->t_tot_len -= tbp->t_len;
-	free(tbp);
-	return (ttyb->t_tot_len);
+	ttyb->t_npages = 0;
+	ttyb->t_len = 0;
+	pthread_mutex_unlock(&tb_pool.tp_mutex);
 }
 
+/*
+ * Mark the buffer as the most recently attached, making it the last
+ * candidate for eviction.
+ */
 void
-termbuf_append(struct tty_buffer *ttyb, u_char *bytes, size_t len)
+termbuf_touch(struct tty_buffer *ttyb)
 {
-	extern struct global_params gcfg;
-	struct termbuf *tbp;
-	size_t cur;
 
-	assert(bytes != NULL);
-	assert(len != 0);
-	tbp = calloc(1, sizeof(*tbp));
-	if (tbp == NULL) {
-		err(1, "calloc(termbuf) failed");
+	pthread_mutex_lock(&tb_pool.tp_mutex);
+	TAILQ_REMOVE(&tb_pool.tp_lru, ttyb, t_lru);
+	TAILQ_INSERT_TAIL(&tb_pool.tp_lru, ttyb, t_lru);
+	pthread_mutex_unlock(&tb_pool.tp_mutex);
+}
+
+size_t
+termbuf_len(struct tty_buffer *ttyb)
+{
+
+	return (ttyb->t_len);
+}
+
+/*
+ * Stream offset of the next byte to be appended.
+ */
+uint64_t
+termbuf_head(struct tty_buffer *ttyb)
+{
+
+	return (ttyb->t_head);
+}
+
+/*
+ * Stream offset of the oldest byte still held.
+ */
+uint64_t
+termbuf_start(struct tty_buffer *ttyb)
+{
+
+	return (ttyb->t_head - ttyb->t_len);
+}
+
+/*
+ * Stream offset of the start of the last *nlines lines held, or of the
+ * oldest byte if there are fewer, in which case *nlines is left with the
+ * number of lines still wanted (otherwise 0), so the search can carry on
+ * into older output. A newline at the very end of the output does not
+ * start a new line. The pages are scanned from the newest.
+ */
+uint64_t
+termbuf_lines_start(struct tty_buffer *ttyb, size_t *nlines)
+{
+	struct termbuf_page *tbp;
+	const u_char *nl;
+	size_t start, end;
+	uint64_t off;
+
+	off = ttyb->t_head;
+	if (*nlines == 0) {
+		return (off);
 	}
-	tbp->t_len = len;
-	if (len >= sizeof(tbp->t_static)) {
-		tbp->t_dynamic = calloc(1, sizeof(len));
-		if (tbp->t_dynamic == NULL) {
-			err(1, "calloc(t_dynamic) failed");
+	TAILQ_FOREACH_REVERSE(tbp, &ttyb->t_pages, termbuf_pages_head,
+	    tp_glue) {
+		start = 0;
+		if (tbp == TAILQ_FIRST(&ttyb->t_pages)) {
+			start = ttyb->t_off;
+		}
+		end = TERMBUF_PAGE_SIZE;
+		if (TAILQ_NEXT(tbp, tp_glue) == NULL) {
+			end = ttyb->t_tail;
+			if (end > start && tbp->tp_data[end - 1] == '\n') {
+				end--;
+				off--;
+			}
+		}
+		if (end <= start) {
+			continue;
+		}
+		off -= end - start;
+		nl = scan_rnewline(tbp->tp_data + start, end - start, nlines);
+		if (nl != NULL) {
+			return (off + (nl - (tbp->tp_data + start)) + 1);
 		}
-		bcopy(bytes, tbp->t_dynamic, tbp->t_len);
-		tbp->t_flag = TERMBUF_DYNAMIC;
-	} else {
-		tbp->t_flag = TERMBUF_STATIC;
-		bcopy(bytes, tbp->t_static, tbp->t_len);
 	}
-	ttyb->t_tot_len += tbp->t_len;
-	TAILQ_INSERT_TAIL(&ttyb->t_head, tbp, t_glue);
-	if (ttyb->t_tot_len > gcfg.c_tty_buf_size) {
-		cur = ttyb->t_tot_len;
-		while (cur >= gcfg.c_tty_buf_size) {
-			cur = termbuf_remove_oldest(ttyb);
+	return (termbuf_start(ttyb));
+}
+
+/*
+ * Stream offset from which the buffer holds output written at or after
+ * "since". Times are only kept per page, so this can include up to a page
+ * of older output.
+ */
+uint64_t
+termbuf_time_start(struct tty_buffer *ttyb, time_t since)
+{
+	struct termbuf_page *tbp;
+	uint64_t off;
+
+	off = termbuf_start(ttyb);
+	TAILQ_FOREACH(tbp, &ttyb->t_pages, tp_glue) {
+		if (tbp->tp_mtime >= since) {
+			return (off);
+		}
+		if (tbp == TAILQ_FIRST(&ttyb->t_pages)) {
+			off += TERMBUF_PAGE_SIZE - ttyb->t_off;
+		} else {
+			off += TERMBUF_PAGE_SIZE;
 		}
 	}
+	return (ttyb->t_head);
 }
 
+/*
+ * Drop the oldest bytes until the buffer is within the per-instance limit.
+ * Pages which empty out go back to the pool.
+ */
 static void
-termbuf_print_buf(struct termbuf *tbp)
+termbuf_trim(struct tty_buffer *ttyb)
 {
-	u_char *p;
+	size_t drop, avail;
 
-	switch (tbp->t_flag) {
-	case TERMBUF_STATIC:
-		p = tbp->t_static;
-		break;
-	case TERMBUF_DYNAMIC:
-		p = tbp->t_dynamic;
-		break;
+	while (ttyb->t_len > tb_pool.tp_max) {
+		drop = ttyb->t_len - tb_pool.tp_max;
+		avail = TERMBUF_PAGE_SIZE - ttyb->t_off;
+		if (ttyb->t_npages == 1) {
+			avail = ttyb->t_tail - ttyb->t_off;
+		}
+		if (drop < avail || ttyb->t_npages == 1) {
+			ttyb->t_off += drop;
+			ttyb->t_len -= drop;
+			break;
+		}
+		pthread_mutex_lock(&tb_pool.tp_mutex);
+		termbuf_page_release(termbuf_take_oldest(ttyb));
+		pthread_mutex_unlock(&tb_pool.tp_mutex);
 	}
-	printf("%s", (char *)p);
 }
 
-
 void
-termbuf_print_queue(termbuf_head_t *head)
+termbuf_append(struct tty_buffer *ttyb, const u_char *bytes, size_t len)
+{
+	struct termbuf_page *tbp;
+	time_t now;
+	size_t n;
+
+	assert(bytes != NULL);
+	assert(len != 0);
+	now = time(NULL);
+	while (len > 0) {
+		if (ttyb->t_npages == 0 || ttyb->t_tail == TERMBUF_PAGE_SIZE) {
+			termbuf_page_add(ttyb);
+		}
+		tbp = TAILQ_LAST(&ttyb->t_pages, termbuf_pages_head);
+		n = TERMBUF_PAGE_SIZE - ttyb->t_tail;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(tbp->tp_data + ttyb->t_tail, bytes, n);
+		tbp->tp_mtime = now;
+		ttyb->t_tail += n;
+		ttyb->t_len += n;
+		ttyb->t_head += n;
+		bytes += n;
+		len -= n;
+	}
+	termbuf_trim(ttyb);
+}
+
+/*
+ * Describe the contents of the buffer from stream offset "from" onwards,
+ * oldest first, without copying. Offsets before the start of the buffer
+ * describe everything it holds. Returns the number of iovecs used, at most
+ * one per page. The iovecs point into the pages, so they are only valid
+ * while the buffer lock is held.
+ */
+int
+termbuf_snapshot(struct tty_buffer *ttyb, struct iovec *iov, int maxiov,
+    uint64_t from)
 {
-	struct termbuf *tbp;
+	struct termbuf_page *tbp;
+	size_t start, end;
+	uint64_t skip;
+	int cnt;
 
-	TAILQ_FOREACH(tbp, head, t_glue) {
-		termbuf_print_buf(tbp);
+	skip = 0;
+	if (from > termbuf_start(ttyb)) {
+		skip = from - termbuf_start(ttyb);
+	}
+	cnt = 0;
+	TAILQ_FOREACH(tbp, &ttyb->t_pages, tp_glue) {
+		if (cnt == maxiov) {
+			break;
+		}
+		start = 0;
+		if (tbp == TAILQ_FIRST(&ttyb->t_pages)) {
+			start = ttyb->t_off;
+		}
+		end = TERMBUF_PAGE_SIZE;
+		if (TAILQ_NEXT(tbp, tp_glue) == NULL) {
+			end = ttyb->t_tail;
+		}
+		if (skip >= end - start) {
+			skip -= end - start;
+			continue;
+		}
+		start += skip;
+		skip = 0;
+		if (end == start) {
+			continue;
+		}
+		iov[cnt].iov_base = tbp->tp_data + start;
+		iov[cnt].iov_len = end - start;
+		cnt++;
 	}
+	return (cnt);
 }
 
 #ifdef __TEST_TERMBUF_CODE__
+static void
+termbuf_print(struct tty_buffer *ttyb, uint64_t from)
+{
+	struct iovec iov[8];
+	int k, cnt;
+
+	cnt = termbuf_snapshot(ttyb, iov, 8, from);
+	for (k = 0; k < cnt; k++) {
+		printf("%.*s", (int)iov[k].iov_len, (char *)iov[k].iov_base);
+	}
+	printf("\n");
+}
+
 int
 main(int argc, char *argv [])
 {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
 	struct tty_buffer ttyb;
 	char *p;
 
-	gcfg.c_tty_buf_size = 1024;
-	TAILQ_INIT(&ttyb.t_head);
+	termbuf_pool_init(1024 * 1024, 4096, 16);
+	termbuf_init(&ttyb, &lock);
 	p = "test 1";
 	termbuf_append(&ttyb, (u_char *)p, strlen(p));
 	p = "test 2";
 	termbuf_append(&ttyb, (u_char *)p, strlen(p));
+	termbuf_print(&ttyb, 0);
+	printf("wrapping\n");
 	p = "test 3";
 	termbuf_append(&ttyb, (u_char *)p, strlen(p));
-	termbuf_print_queue(&ttyb.t_head);
-	printf("removing oldest\n");
-	termbuf_remove_oldest(&ttyb);
-	termbuf_print_queue(&ttyb.t_head);
-	printf("adding another\n");
-	p = "whakawkwa";
+	termbuf_print(&ttyb, 0);
+	printf("adding one larger than the limit\n");
+	p = "0123456789abcdefwhakawkwa";
 	termbuf_append(&ttyb, (u_char *)p, strlen(p));
-	termbuf_print_queue(&ttyb.t_head);
-	printf("---\n");
-	printf("%s\n", termbuf_to_contig(&ttyb));
+	termbuf_print(&ttyb, 0);
+	printf("resuming from %ju of [%ju, %ju)\n",
+	    (uintmax_t)termbuf_head(&ttyb) - 4,
+	    (uintmax_t)termbuf_start(&ttyb), (uintmax_t)termbuf_head(&ttyb));
+	termbuf_print(&ttyb, termbuf_head(&ttyb) - 4);
+	termbuf_free(&ttyb);
 	return (0);
 }
 #endif	/* __TEST_TERMBUF_CODE__ */
+
+#ifdef __BENCH_TERMBUF_CODE__
+/*
+ * Compare the paged buffers against the chunk list they replaced: the list
+ * allocated a ~4.2KB chunk for every pty read and freed the oldest ones once
+ * the scrollback limit was exceeded. The "pool" variant caps the total
+ * scrollback at a quarter of what the instances would otherwise hold. Each
+ * variant runs in its own process so its peak RSS can be reported
+ * separately.
+ *
+ * cc -O2 -D__BENCH_TERMBUF_CODE__ -I../include termbuf.c -lpthread
+ * ./a.out [instances] [write size] [writes]
+ */
+struct legacy_termbuf {
+	u_char			 t_static[4192];
+	size_t			 t_len;
+	TAILQ_ENTRY(legacy_termbuf) t_glue;
+};
+
+struct legacy_tty_buffer {
+	TAILQ_HEAD( , legacy_termbuf) t_head;
+	size_t			 t_tot_len;
+};
+
+static void
+legacy_append(struct legacy_tty_buffer *ttyb, const u_char *bytes,
+    size_t len)
+{
+	struct legacy_termbuf *tbp;
+
+	tbp = calloc(1, sizeof(*tbp));
+	if (tbp == NULL) {
+		err(1, "calloc(termbuf) failed");
+	}
+	tbp->t_len = len;
+	bcopy(bytes, tbp->t_static, len);
+	ttyb->t_tot_len += len;
+	TAILQ_INSERT_TAIL(&ttyb->t_head, tbp, t_glue);
+	while (ttyb->t_tot_len >= gcfg.c_tty_buf_size) {
+		tbp = TAILQ_FIRST(&ttyb->t_head);
+		TAILQ_REMOVE(&ttyb->t_head, tbp, t_glue);
+		ttyb->t_tot_len -= tbp->t_len;
+		free(tbp);
+	}
+}
+
+static void
+bench_run(const char *name, int legacy, size_t budget, size_t ninst,
+    size_t wsize, size_t nwrites)
+{
+	struct termbuf_usage tu;
+	struct legacy_tty_buffer *lvec;
+	pthread_mutex_t *locks;
+	struct timespec start, end;
+	struct tty_buffer *vec;
+	struct rusage ru;
+	u_char buf[4096];
+	int status;
+	size_t k;
+	double ns;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if (pid == -1) {
+		err(1, "fork");
+	}
+	if (pid != 0) {
+		if (wait4(pid, &status, 0, &ru) == -1) {
+			err(1, "wait4");
+		}
+#ifdef __linux__
+		ru.ru_maxrss *= 1024;
+#endif
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			printf("%-8s did not complete (out of memory?)\n",
+			    name);
+		}
+		printf("%-8s peak RSS %8.1f MB\n", name,
+		    ru.ru_maxrss / (1024.0 * 1024.0));
+		return;
+	}
+	memset(buf, 'x', sizeof(buf));
+	vec = NULL;
+	lvec = NULL;
+	if (legacy) {
+		lvec = calloc(ninst, sizeof(*lvec));
+		for (k = 0; k < ninst; k++) {
+			TAILQ_INIT(&lvec[k].t_head);
+		}
+	} else {
+		termbuf_pool_init(budget, TERMBUF_PAGE_SIZE,
+		    gcfg.c_tty_buf_size);
+		vec = calloc(ninst, sizeof(*vec));
+		locks = calloc(ninst, sizeof(*locks));
+		for (k = 0; k < ninst; k++) {
+			pthread_mutex_init(&locks[k], NULL);
+			termbuf_init(&vec[k], &locks[k]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k = 0; k < nwrites; k++) {
+		if (legacy) {
+			legacy_append(&lvec[k % ninst], buf, wsize);
+		} else {
+			pthread_mutex_lock(&locks[k % ninst]);
+			termbuf_append(&vec[k % ninst], buf, wsize);
+			pthread_mutex_unlock(&locks[k % ninst]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	ns = (end.tv_sec - start.tv_sec) * 1e9 +
+	    (end.tv_nsec - start.tv_nsec);
+	printf("%-8s %8.1f ns/append %8.1f MB/s\n", name, ns / nwrites,
+	    (nwrites * wsize) / (ns / 1e9) / (1024 * 1024));
+	if (!legacy) {
+		termbuf_pool_usage(&tu);
+		printf("%-8s %8.1f MB held %8ju evictions\n", name,
+		    tu.tu_used / (1024.0 * 1024.0),
+		    (uintmax_t)tu.tu_evictions);
+	}
+	fflush(stdout);
+	_exit(0);
+}
+
+int
+main(int argc, char *argv [])
+{
+	size_t ninst, wsize, nwrites;
+
+	ninst = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000;
+	wsize = argc > 2 ? strtoul(argv[2], NULL, 10) : 64;
+	nwrites = argc > 3 ? strtoul(argv[3], NULL, 10) : 10000000;
+	if (wsize == 0 || wsize > 4096) {
+		errx(1, "write size must be between 1 and 4096");
+	}
+	gcfg.c_tty_buf_size = 5 * 4096;
+	printf("%zu instances, %zu byte writes, %zu writes, %zu byte "
+	    "scrollback\n", ninst, wsize, nwrites, gcfg.c_tty_buf_size);
+	bench_run("termbuf", 1, 0, ninst, wsize, nwrites);
+	bench_run("paged", 0, SIZE_MAX, ninst, wsize, nwrites);
+	bench_run("pool", 0, ninst * gcfg.c_tty_buf_size / 4, ninst, wsize,
+	    nwrites);
+	return (0);
+}
+#endif	/* __BENCH_TERMBUF_CODE__ */
@@ -27,26 +27,57 @@
 #ifndef TERMBUF_DOT_H_
 #define TERMBUF_DOT_H_
 
-struct termbuf {
-	int			 t_flag;
-#define	TERMBUF_STATIC		1
-#define	TERMBUF_DYNAMIC		2
-	u_char			 t_static[4192];
-	u_char			*t_dynamic;
-	size_t	 t_len;
-	TAILQ_ENTRY(termbuf)	 t_glue;
-};
+/*
+ * Console scrollback. Each instance holds its most recent output in a list
+ * of fixed size pages, oldest first. Pages come from a pool shared by all
+ * instances which is bounded by a global byte budget: once the budget has
+ * been spent, pages are taken from the instances which were least recently
+ * attached to, but never below the guaranteed per-instance minimum.
+ *
+ * Every byte appended is numbered by its offset in the instance's output
+ * stream, t_head is the offset of the next byte. Bytes which have been
+ * trimmed or evicted are gone, the buffer holds [t_head - t_len, t_head).
+ */
+#define	TERMBUF_PAGE_SIZE	4096
 
-typedef TAILQ_HEAD( , termbuf) termbuf_head_t;
+struct termbuf_page {
+	TAILQ_ENTRY(termbuf_page)	 tp_glue;
+	time_t				 tp_mtime;	/* last appended to */
+	u_char				 tp_data[TERMBUF_PAGE_SIZE];
+};
 
 struct tty_buffer {
-	termbuf_head_t	t_head;
-	size_t		t_tot_len;
+	TAILQ_HEAD(termbuf_pages_head, termbuf_page) t_pages;
+	size_t				 t_npages;
+	size_t				 t_len;		/* bytes held */
+	size_t				 t_off;		/* start in first page */
+	size_t				 t_tail;	/* bytes in last page */
+	uint64_t			 t_head;	/* stream offset */
+	pthread_mutex_t			*t_lock;	/* protects this buffer */
+	TAILQ_ENTRY(tty_buffer)		 t_lru;
+};
+
+struct termbuf_usage {
+	size_t		 tu_budget;	/* bytes */
+	size_t		 tu_used;	/* bytes held by instances */
+	size_t		 tu_free;	/* bytes cached on the free list */
+	size_t		 tu_min;	/* guaranteed per instance */
+	size_t		 tu_max;	/* limit per instance */
+	uint64_t	 tu_evictions;	/* pages taken from other instances */
 };
 
-char		*termbuf_to_contig(struct tty_buffer *);
-size_t	 	 termbuf_remove_oldest(struct tty_buffer *);
-void		 termbuf_append(struct tty_buffer *, u_char *, size_t);
-void		 termbuf_print_queue(termbuf_head_t *);
+void		 termbuf_pool_init(size_t, size_t, size_t);
+void		 termbuf_pool_usage(struct termbuf_usage *);
+void		 termbuf_init(struct tty_buffer *, pthread_mutex_t *);
+void		 termbuf_free(struct tty_buffer *);
+void		 termbuf_touch(struct tty_buffer *);
+size_t		 termbuf_len(struct tty_buffer *);
+uint64_t	 termbuf_head(struct tty_buffer *);
+uint64_t	 termbuf_start(struct tty_buffer *);
+uint64_t	 termbuf_lines_start(struct tty_buffer *, size_t *);
+uint64_t	 termbuf_time_start(struct tty_buffer *, time_t);
+void		 termbuf_append(struct tty_buffer *, const u_char *, size_t);
+int		 termbuf_snapshot(struct tty_buffer *, struct iovec *, int,
+		    uint64_t);
 
 #endif
@@ -26,6 +26,7 @@
  */
 #include <sys/types.h>
 #include <sys/queue.h>
+#include <sys/uio.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/wait.h>
@@ -51,11 +52,18 @@
 #include <openssl/sha.h>
 
 #include "termbuf.h"
+#include "batch.h"
+#include "iosched.h"
+#include "ratelimit.h"
+#include "outq.h"
 #include "main.h"
+#include "worker.h"
 #include "dispatch.h"
 #include "sock_ipc.h"
 #include "cblock.h"
 #include "config.h"
+#include "scan.h"
+#include "conin.h"
 
 #include <cblock/libcblock.h>
 
@@ -73,75 +81,152 @@ tty_handle_resize(int ttyfd, char *buf)
 	}
 }
 
-void
-tty_console_session(const char *instance, int sock, int ttyfd)
+/*
+ * Console input from peers which pre-date CBLOCK_CAP_CONSOLE_FRAMES: each
+ * read is taken to be a single message. Returns 0 once the session should
+ * end.
+ */
+static int
+tty_console_legacy(struct cblock_instance *pi, int sock, int writer)
 {
 	char buf[1024], *vptr;
+	struct winsize ws;
 	uint32_t *cmd;
-	ssize_t bytes;
+	ssize_t bytes, cc;
+	int ttyfd;
 
-	printf("tty_console_session: enter, reading commands from client\n");
-	for (;;) {
-		bzero(buf, sizeof(buf));
-		ssize_t cc = read(sock, buf, sizeof(buf));
-		if (cc == 0) {
-			printf("read EOF from socket\n");
-			break;
-		}
-		if (cc == -1 && errno == EINTR) {
-			continue;
+	bzero(buf, sizeof(buf));
+	cc = read(sock, buf, sizeof(buf));
+	if (cc == 0) {
+		return (0);
+	}
+	if (cc == -1 && errno == EINTR) {
+		return (1);
+	}
+	if (cc == -1) {
+		warn("%s: read failed", __func__);
+		return (0);
+	}
+	/*
+	 * Watchers are read-only, whatever they send is discarded.
+	 */
+	if (!writer) {
+		return (1);
+	}
+	ttyfd = pi->p_ttyfd;
+	vptr = buf;
+	cmd = (uint32_t *)vptr;
+	switch (*cmd) {
+	case PRISON_IPC_CONSOL_RESIZE:
+		memcpy(&ws, buf + sizeof(uint32_t), sizeof(ws));
+		tty_io_resize(pi, ws.ws_row, ws.ws_col);
+		tty_handle_resize(ttyfd, buf);
+		break;
+	case PRISON_IPC_CONSOLE_DATA:
+		vptr += sizeof(uint32_t);
+		cc -= sizeof(uint32_t);
+		bytes = write(ttyfd, vptr, cc);
+		if (bytes != cc) {
+			warn("tty_write failed");
+			return (0);
 		}
-		if (cc == -1) {
-			err(1, "%s: read failed", __func__);
+		break;
+	default:
+		warnx("unknown console instruction");
+		return (0);
+	}
+	return (1);
+}
+
+static void
+tty_console_resize(void *arg, const struct winsize *ws)
+{
+
+	tty_io_resize(arg, ws->ws_row, ws->ws_col);
+}
+
+static void
+tty_console_tee(void *arg, const u_char *buf, size_t len)
+{
+
+	tty_io_tee(arg, buf, len);
+}
+
+/*
+ * The caller holds a reference on the instance for the duration of the
+ * session, so the pty stays open even if the instance is reaped while we
+ * are still attached.
+ */
+void
+tty_console_session(struct console_peer *cp)
+{
+	struct cblock_instance *pi;
+	int ttyfd, sock, writer, framed, direct, ret;
+	struct conin ci;
+
+	pi = cp->cp_inst;
+	sock = cp->cp_sock;
+	ttyfd = pi->p_ttyfd;
+	/*
+	 * The writer role and the input framing are fixed for the life of
+	 * the peer.
+	 */
+	pthread_mutex_lock(&pi->p_mtx);
+	writer = (cp->cp_flags & PEER_WRITER) != 0;
+	framed = (cp->cp_flags & PEER_FRAMED) != 0;
+	direct = (cp->cp_flags & PEER_DIRECT) != 0;
+	pthread_mutex_unlock(&pi->p_mtx);
+	printf("tty_console_session: enter, reading commands from client\n");
+	if (framed) {
+		conin_init(&ci);
+		ci.ci_resize = tty_console_resize;
+		if (direct) {
+			ci.ci_tee = tty_console_tee;
 		}
-		/*
-		 * NB: There probably needs to be a better way to do this 
-		 * rather than iterating through the jail list for read input
-		 * from the console.
-		 */
-		if (cblock_instance_is_dead(instance)) {
-			break;
+		ci.ci_arg = pi;
+	}
+	for (;;) {
+		if (framed) {
+			/*
+			 * Watchers are read-only, their input is parsed and
+			 * discarded.
+			 */
+			ret = conin_pump(&ci, sock, ttyfd, !writer);
+		} else {
+			ret = tty_console_legacy(pi, sock, writer);
 		}
-		vptr = buf;
-		cmd = (uint32_t *)vptr;
-		switch (*cmd) {
-		case PRISON_IPC_CONSOL_RESIZE:
-			tty_handle_resize(ttyfd, buf);
-			break;
-		case PRISON_IPC_CONSOLE_DATA:
-			vptr += sizeof(uint32_t);
-			cc -= sizeof(uint32_t);
-			bytes = write(ttyfd, vptr, cc);
-			if (bytes != cc) {
-				err(1, "tty_write failed");
-			}
+		if (ret <= 0 || cblock_instance_is_dead(pi)) {
 			break;
-		default:
-			errx(1, "unknown console instruction");
 		}
 	}
+	if (framed) {
+		conin_free(&ci);
+	}
 	printf("console dis-connected\n");
 }
 
-char *
-tty_trim_buffer(char *input, size_t len, size_t *newlen)
+/*
+ * Trim trailing white space (and NUL bytes) from the console backlog
+ * described by iov, adjusting the iovecs in place. Returns the number of
+ * bytes which remain.
+ */
+size_t
+tty_trim_iov(struct iovec *iov, int *iovcnt)
 {
-	uintptr_t old, new;
-	char  *ep;
-
-	new = 0;
-	ep = input + len - 1;
-	old = (uintptr_t) ep;
-	while (ep > input) {
-		if (isspace(*ep) || *ep == '\0') {
-			ep--;
-			continue;
+	size_t len;
+	int k;
+
+	while (*iovcnt > 0) {
+		k = *iovcnt - 1;
+		iov[k].iov_len = scan_rtrim(iov[k].iov_base, iov[k].iov_len);
+		if (iov[k].iov_len > 0) {
+			break;
 		}
-		new = (uintptr_t) ep;
-		ep++;
-		*ep = '\0';
-		break;
+		(*iovcnt)--;
+	}
+	len = 0;
+	for (k = 0; k < *iovcnt; k++) {
+		len += iov[k].iov_len;
 	}
-	*newlen = len - (old - new);
-	return (input);
+	return (len);
 }
@@ -0,0 +1,1462 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <err.h>
+
+#include <cblock/sbuf.h>
+
+#include "scan.h"
+#include "vt.h"
+
+#define	VT_GROUND		0
+#define	VT_ESCAPE		1
+#define	VT_ESCAPE_SKIP		2	/* charset designation and friends */
+#define	VT_CSI			3
+#define	VT_STRING		4	/* OSC, DCS, SOS, PM, APC */
+#define	VT_STRING_ESC		5
+
+#define	VT_BLANK_ATTRS	(VT_ATTR_UNDERLINE | VT_ATTR_REVERSE | VT_ATTR_STRIKE)
+
+static const struct vt_cell vt_default_pen = {
+	' ', VT_COLOR_DEFAULT, VT_COLOR_DEFAULT, 0
+};
+
+/*
+ * Runs of printable ASCII skip the state machine. Only the benchmark
+ * turns this off.
+ */
+static int vt_fastpath = 1;
+
+static void	vt_byte(struct vt *, u_char);
+
+static inline struct vt_cell *
+vt_cell(struct vt *vt, u_int y, u_int x)
+{
+
+	return (&vt->vt_screen[y][x]);
+}
+
+/*
+ * Erased cells take the current background color, as xterm does.
+ */
+static void
+vt_blank(struct vt *vt, struct vt_cell *c, size_t n)
+{
+	struct vt_cell blank;
+
+	blank = vt_default_pen;
+	blank.vc_bg = vt->vt_pen.vc_bg;
+	while (n-- > 0) {
+		*c++ = blank;
+	}
+}
+
+static void
+vt_blank_rows(struct vt *vt, u_int y, u_int n)
+{
+
+	while (n-- > 0) {
+		vt_blank(vt, vt->vt_screen[y++], vt->vt_cols);
+	}
+}
+
+static struct vt_cell **
+vt_screen_alloc(u_int rows, u_int cols)
+{
+	struct vt_cell **screen;
+	u_int y, x;
+
+	screen = calloc(rows, sizeof(*screen));
+	if (screen == NULL) {
+		err(1, "%s: calloc failed", __func__);
+	}
+	for (y = 0; y < rows; y++) {
+		screen[y] = calloc(cols, sizeof(**screen));
+		if (screen[y] == NULL) {
+			err(1, "%s: calloc failed", __func__);
+		}
+		for (x = 0; x < cols; x++) {
+			screen[y][x] = vt_default_pen;
+		}
+	}
+	return (screen);
+}
+
+static void
+vt_screen_free(struct vt_cell **screen, u_int rows)
+{
+	u_int y;
+
+	for (y = 0; y < rows; y++) {
+		free(screen[y]);
+	}
+	free(screen);
+}
+
+static void
+vt_save(struct vt *vt)
+{
+
+	vt->vt_saved_x = vt->vt_x;
+	vt->vt_saved_y = vt->vt_y;
+	vt->vt_saved_pen = vt->vt_pen;
+}
+
+static void
+vt_restore(struct vt *vt)
+{
+
+	vt->vt_x = vt->vt_saved_x;
+	vt->vt_y = vt->vt_saved_y;
+	if (vt->vt_x >= vt->vt_cols) {
+		vt->vt_x = vt->vt_cols - 1;
+	}
+	if (vt->vt_y >= vt->vt_rows) {
+		vt->vt_y = vt->vt_rows - 1;
+	}
+	vt->vt_pen = vt->vt_saved_pen;
+	vt->vt_wrapnext = 0;
+}
+
+static void
+vt_reset(struct vt *vt)
+{
+
+	vt->vt_pen = vt_default_pen;
+	vt->vt_modes = VT_MODE_AUTOWRAP;
+	vt->vt_top = 0;
+	vt->vt_bottom = vt->vt_rows - 1;
+	vt->vt_x = vt->vt_y = 0;
+	vt->vt_wrapnext = 0;
+	vt->vt_last = 0;
+	vt_save(vt);
+	vt->vt_screen = vt->vt_alt;
+	vt_blank_rows(vt, 0, vt->vt_rows);
+	vt->vt_screen = vt->vt_main;
+	vt_blank_rows(vt, 0, vt->vt_rows);
+}
+
+struct vt *
+vt_create(u_int rows, u_int cols)
+{
+	struct vt *vt;
+
+	vt = calloc(1, sizeof(*vt));
+	if (vt == NULL) {
+		err(1, "%s: calloc failed", __func__);
+	}
+	if (rows == 0 || cols == 0) {
+		rows = VT_DEFAULT_ROWS;
+		cols = VT_DEFAULT_COLS;
+	}
+	vt->vt_rows = rows > VT_MAX_ROWS ? VT_MAX_ROWS : rows;
+	vt->vt_cols = cols > VT_MAX_COLS ? VT_MAX_COLS : cols;
+	vt->vt_main = vt_screen_alloc(vt->vt_rows, vt->vt_cols);
+	vt->vt_alt = vt_screen_alloc(vt->vt_rows, vt->vt_cols);
+	vt_reset(vt);
+	return (vt);
+}
+
+void
+vt_destroy(struct vt *vt)
+{
+
+	vt_screen_free(vt->vt_main, vt->vt_rows);
+	vt_screen_free(vt->vt_alt, vt->vt_rows);
+	free(vt);
+}
+
+static struct vt_cell **
+vt_screen_resize(struct vt *vt, struct vt_cell **old, u_int rows, u_int cols,
+    u_int shift)
+{
+	struct vt_cell **new;
+	u_int y, w;
+
+	new = vt_screen_alloc(rows, cols);
+	w = cols < vt->vt_cols ? cols : vt->vt_cols;
+	for (y = 0; y < rows && y + shift < vt->vt_rows; y++) {
+		memcpy(new[y], old[y + shift], w * sizeof(**new));
+	}
+	vt_screen_free(old, vt->vt_rows);
+	return (new);
+}
+
+/*
+ * Lines are kept from the top, unless the cursor would fall off the
+ * bottom, in which case enough are dropped from the top to keep it on
+ * screen. The scroll region is reset, as the application is expected to
+ * set it up again once it sees SIGWINCH.
+ */
+void
+vt_resize(struct vt *vt, u_int rows, u_int cols)
+{
+	int alt;
+	u_int shift;
+
+	if (rows == 0 || cols == 0) {
+		return;
+	}
+	rows = rows > VT_MAX_ROWS ? VT_MAX_ROWS : rows;
+	cols = cols > VT_MAX_COLS ? VT_MAX_COLS : cols;
+	if (rows == vt->vt_rows && cols == vt->vt_cols) {
+		return;
+	}
+	shift = vt->vt_y >= rows ? vt->vt_y - rows + 1 : 0;
+	alt = vt->vt_screen == vt->vt_alt;
+	vt->vt_main = vt_screen_resize(vt, vt->vt_main, rows, cols, shift);
+	vt->vt_alt = vt_screen_resize(vt, vt->vt_alt, rows, cols, shift);
+	vt->vt_screen = alt ? vt->vt_alt : vt->vt_main;
+	vt->vt_rows = rows;
+	vt->vt_cols = cols;
+	vt->vt_y -= shift;
+	if (vt->vt_x >= cols) {
+		vt->vt_x = cols - 1;
+	}
+	vt->vt_saved_y = vt->vt_saved_y >= shift ? vt->vt_saved_y - shift : 0;
+	vt->vt_top = 0;
+	vt->vt_bottom = rows - 1;
+	vt->vt_wrapnext = 0;
+}
+
+/*
+ * Scrolling rotates the row pointers within the region, so only the rows
+ * which are scrolled in are touched.
+ */
+static void
+vt_scroll_up(struct vt *vt, u_int top, u_int bottom, u_int n)
+{
+	struct vt_cell *rows[VT_MAX_ROWS];
+	u_int lines;
+
+	lines = bottom - top + 1;
+	if (n > lines) {
+		n = lines;
+	}
+	memcpy(rows, &vt->vt_screen[top], n * sizeof(rows[0]));
+	memmove(&vt->vt_screen[top], &vt->vt_screen[top + n],
+	    (lines - n) * sizeof(rows[0]));
+	memcpy(&vt->vt_screen[bottom - n + 1], rows, n * sizeof(rows[0]));
+	vt_blank_rows(vt, bottom - n + 1, n);
+}
+
+static void
+vt_scroll_down(struct vt *vt, u_int top, u_int bottom, u_int n)
+{
+	struct vt_cell *rows[VT_MAX_ROWS];
+	u_int lines;
+
+	lines = bottom - top + 1;
+	if (n > lines) {
+		n = lines;
+	}
+	memcpy(rows, &vt->vt_screen[bottom - n + 1], n * sizeof(rows[0]));
+	memmove(&vt->vt_screen[top + n], &vt->vt_screen[top],
+	    (lines - n) * sizeof(rows[0]));
+	memcpy(&vt->vt_screen[top], rows, n * sizeof(rows[0]));
+	vt_blank_rows(vt, top, n);
+}
+
+static void
+vt_linefeed(struct vt *vt)
+{
+
+	vt->vt_wrapnext = 0;
+	if (vt->vt_y == vt->vt_bottom) {
+		vt_scroll_up(vt, vt->vt_top, vt->vt_bottom, 1);
+	} else if (vt->vt_y < vt->vt_rows - 1) {
+		vt->vt_y++;
+	}
+}
+
+static void
+vt_reverse_index(struct vt *vt)
+{
+
+	vt->vt_wrapnext = 0;
+	if (vt->vt_y == vt->vt_top) {
+		vt_scroll_down(vt, vt->vt_top, vt->vt_bottom, 1);
+	} else if (vt->vt_y > 0) {
+		vt->vt_y--;
+	}
+}
+
+/*
+ * Move the cursor to an absolute position, kept within the scroll region
+ * in origin mode.
+ */
+static void
+vt_moveto(struct vt *vt, u_int y, u_int x)
+{
+	u_int min, max;
+
+	if ((vt->vt_modes & VT_MODE_ORIGIN) != 0) {
+		min = vt->vt_top;
+		max = vt->vt_bottom;
+	} else {
+		min = 0;
+		max = vt->vt_rows - 1;
+	}
+	vt->vt_y = y < min ? min : y > max ? max : y;
+	vt->vt_x = x >= vt->vt_cols ? vt->vt_cols - 1 : x;
+	vt->vt_wrapnext = 0;
+}
+
+static void
+vt_insert_chars(struct vt *vt, u_int n)
+{
+	struct vt_cell *c;
+
+	if (n > vt->vt_cols - vt->vt_x) {
+		n = vt->vt_cols - vt->vt_x;
+	}
+	c = vt_cell(vt, vt->vt_y, vt->vt_x);
+	memmove(c + n, c, (vt->vt_cols - vt->vt_x - n) * sizeof(*c));
+	vt_blank(vt, c, n);
+}
+
+static void
+vt_delete_chars(struct vt *vt, u_int n)
+{
+	struct vt_cell *c;
+
+	if (n > vt->vt_cols - vt->vt_x) {
+		n = vt->vt_cols - vt->vt_x;
+	}
+	c = vt_cell(vt, vt->vt_y, vt->vt_x);
+	memmove(c, c + n, (vt->vt_cols - vt->vt_x - n) * sizeof(*c));
+	vt_blank(vt, vt_cell(vt, vt->vt_y, vt->vt_cols - n), n);
+}
+
+static void
+vt_put(struct vt *vt, uint32_t ch)
+{
+	struct vt_cell *c;
+
+	if (vt->vt_wrapnext) {
+		vt->vt_x = 0;
+		vt_linefeed(vt);
+	}
+	if ((vt->vt_modes & VT_MODE_INSERT) != 0) {
+		vt_insert_chars(vt, 1);
+	}
+	c = vt_cell(vt, vt->vt_y, vt->vt_x);
+	*c = vt->vt_pen;
+	c->vc_ch = ch;
+	vt->vt_last = ch;
+	if (vt->vt_x + 1 < vt->vt_cols) {
+		vt->vt_x++;
+	} else if ((vt->vt_modes & VT_MODE_AUTOWRAP) != 0) {
+		vt->vt_wrapnext = 1;
+	}
+}
+
+/*
+ * Store a run of printable ASCII a line at a time.
+ */
+static void
+vt_put_run(struct vt *vt, const u_char *buf, size_t len)
+{
+	struct vt_cell *c;
+	size_t n, k;
+
+	if ((vt->vt_modes & VT_MODE_INSERT) != 0) {
+		while (len-- > 0) {
+			vt_put(vt, *buf++);
+		}
+		return;
+	}
+	while (len > 0) {
+		if (vt->vt_wrapnext) {
+			vt->vt_x = 0;
+			vt_linefeed(vt);
+		}
+		n = vt->vt_cols - vt->vt_x;
+		if (n > len) {
+			n = len;
+		}
+		c = vt_cell(vt, vt->vt_y, vt->vt_x);
+		for (k = 0; k < n; k++) {
+			c[k] = vt->vt_pen;
+			c[k].vc_ch = buf[k];
+		}
+		buf += n;
+		len -= n;
+		vt->vt_last = buf[-1];
+		if (vt->vt_x + n < vt->vt_cols) {
+			vt->vt_x += n;
+			continue;
+		}
+		vt->vt_x = vt->vt_cols - 1;
+		if ((vt->vt_modes & VT_MODE_AUTOWRAP) != 0) {
+			vt->vt_wrapnext = 1;
+		}
+	}
+}
+
+static void
+vt_control(struct vt *vt, u_char c)
+{
+
+	switch (c) {
+	case '\b':
+		if (vt->vt_x > 0) {
+			vt->vt_x--;
+		}
+		vt->vt_wrapnext = 0;
+		break;
+	case '\t':
+		vt->vt_x = (vt->vt_x + 8) & ~7;
+		if (vt->vt_x >= vt->vt_cols) {
+			vt->vt_x = vt->vt_cols - 1;
+		}
+		vt->vt_wrapnext = 0;
+		break;
+	case '\n':
+	case '\v':
+	case '\f':
+		vt_linefeed(vt);
+		break;
+	case '\r':
+		vt->vt_x = 0;
+		vt->vt_wrapnext = 0;
+		break;
+	case 0x1b:
+		vt->vt_state = VT_ESCAPE;
+		break;
+	}
+}
+
+static void
+vt_altscreen(struct vt *vt, int on, int save)
+{
+
+	if (on == ((vt->vt_modes & VT_MODE_ALTSCREEN) != 0)) {
+		return;
+	}
+	if (on) {
+		if (save) {
+			vt_save(vt);
+		}
+		vt->vt_modes |= VT_MODE_ALTSCREEN;
+		vt->vt_screen = vt->vt_alt;
+		vt_blank_rows(vt, 0, vt->vt_rows);
+		return;
+	}
+	vt->vt_modes &= ~VT_MODE_ALTSCREEN;
+	vt->vt_screen = vt->vt_main;
+	if (save) {
+		vt_restore(vt);
+	}
+}
+
+static void
+vt_escape(struct vt *vt, u_char c)
+{
+
+	vt->vt_state = VT_GROUND;
+	switch (c) {
+	case '[':
+		vt->vt_state = VT_CSI;
+		vt->vt_nparams = 0;
+		vt->vt_private = 0;
+		vt->vt_inter = 0;
+		memset(vt->vt_params, 0, sizeof(vt->vt_params));
+		break;
+	case ']':
+	case 'P':
+	case 'X':
+	case '^':
+	case '_':
+		vt->vt_state = VT_STRING;
+		break;
+	case ' ':
+	case '#':
+	case '%':
+	case '(':
+	case ')':
+	case '*':
+	case '+':
+	case '-':
+	case '.':
+	case '/':
+		vt->vt_state = VT_ESCAPE_SKIP;
+		break;
+	case '7':
+		vt_save(vt);
+		break;
+	case '8':
+		vt_restore(vt);
+		break;
+	case 'D':
+		vt_linefeed(vt);
+		break;
+	case 'E':
+		vt->vt_x = 0;
+		vt_linefeed(vt);
+		break;
+	case 'M':
+		vt_reverse_index(vt);
+		break;
+	case 'c':
+		vt_reset(vt);
+		break;
+	case '=':
+		vt->vt_modes |= VT_MODE_APPKEYPAD;
+		break;
+	case '>':
+		vt->vt_modes &= ~VT_MODE_APPKEYPAD;
+		break;
+	}
+}
+
+static u_int
+vt_param(struct vt *vt, int i, u_int def)
+{
+
+	if (i >= vt->vt_nparams || vt->vt_params[i] == 0) {
+		return (def);
+	}
+	return (vt->vt_params[i]);
+}
+
+/*
+ * 38;5;N and 38;2;R;G;B (and 48). Returns the index of the last parameter
+ * used.
+ */
+static int
+vt_sgr_color(struct vt *vt, int i, uint32_t *color)
+{
+	u_int *p;
+
+	p = vt->vt_params;
+	if (i + 2 < vt->vt_nparams && p[i + 1] == 5) {
+		*color = VT_COLOR_INDEX | (p[i + 2] & 0xff);
+		return (i + 2);
+	}
+	if (i + 4 < vt->vt_nparams && p[i + 1] == 2) {
+		*color = VT_COLOR_RGB | (p[i + 2] & 0xff) << 16 |
+		    (p[i + 3] & 0xff) << 8 | (p[i + 4] & 0xff);
+		return (i + 4);
+	}
+	return (vt->vt_nparams);
+}
+
+static void
+vt_sgr(struct vt *vt)
+{
+	struct vt_cell *pen;
+	u_int p;
+	int i;
+
+	pen = &vt->vt_pen;
+	if (vt->vt_nparams == 0) {
+		*pen = vt_default_pen;
+		return;
+	}
+	for (i = 0; i < vt->vt_nparams; i++) {
+		p = vt->vt_params[i];
+		switch (p) {
+		case 0:
+			*pen = vt_default_pen;
+			break;
+		case 1:
+			pen->vc_attr |= VT_ATTR_BOLD;
+			break;
+		case 2:
+			pen->vc_attr |= VT_ATTR_DIM;
+			break;
+		case 3:
+			pen->vc_attr |= VT_ATTR_ITALIC;
+			break;
+		case 4:
+		case 21:
+			pen->vc_attr |= VT_ATTR_UNDERLINE;
+			break;
+		case 5:
+		case 6:
+			pen->vc_attr |= VT_ATTR_BLINK;
+			break;
+		case 7:
+			pen->vc_attr |= VT_ATTR_REVERSE;
+			break;
+		case 8:
+			pen->vc_attr |= VT_ATTR_HIDDEN;
+			break;
+		case 9:
+			pen->vc_attr |= VT_ATTR_STRIKE;
+			break;
+		case 22:
+			pen->vc_attr &= ~(VT_ATTR_BOLD | VT_ATTR_DIM);
+			break;
+		case 23:
+			pen->vc_attr &= ~VT_ATTR_ITALIC;
+			break;
+		case 24:
+			pen->vc_attr &= ~VT_ATTR_UNDERLINE;
+			break;
+		case 25:
+			pen->vc_attr &= ~VT_ATTR_BLINK;
+			break;
+		case 27:
+			pen->vc_attr &= ~VT_ATTR_REVERSE;
+			break;
+		case 28:
+			pen->vc_attr &= ~VT_ATTR_HIDDEN;
+			break;
+		case 29:
+			pen->vc_attr &= ~VT_ATTR_STRIKE;
+			break;
+		case 38:
+			i = vt_sgr_color(vt, i, &pen->vc_fg);
+			break;
+		case 39:
+			pen->vc_fg = VT_COLOR_DEFAULT;
+			break;
+		case 48:
+			i = vt_sgr_color(vt, i, &pen->vc_bg);
+			break;
+		case 49:
+			pen->vc_bg = VT_COLOR_DEFAULT;
+			break;
+		default:
+			if (p >= 30 && p <= 37) {
+				pen->vc_fg = VT_COLOR_INDEX | (p - 30);
+			} else if (p >= 40 && p <= 47) {
+				pen->vc_bg = VT_COLOR_INDEX | (p - 40);
+			} else if (p >= 90 && p <= 97) {
+				pen->vc_fg = VT_COLOR_INDEX | (p - 90 + 8);
+			} else if (p >= 100 && p <= 107) {
+				pen->vc_bg = VT_COLOR_INDEX | (p - 100 + 8);
+			}
+			break;
+		}
+	}
+}
+
+static void
+vt_set_mode(struct vt *vt, u_int mode, int set)
+{
+
+	if (set) {
+		vt->vt_modes |= mode;
+	} else {
+		vt->vt_modes &= ~mode;
+	}
+}
+
+static void
+vt_dec_mode(struct vt *vt, int set)
+{
+	int i;
+
+	for (i = 0; i < vt->vt_nparams; i++) {
+		switch (vt->vt_params[i]) {
+		case 1:
+			vt_set_mode(vt, VT_MODE_APPCURSOR, set);
+			break;
+		case 6:
+			vt_set_mode(vt, VT_MODE_ORIGIN, set);
+			vt_moveto(vt, set ? vt->vt_top : 0, 0);
+			break;
+		case 7:
+			vt_set_mode(vt, VT_MODE_AUTOWRAP, set);
+			if (!set) {
+				vt->vt_wrapnext = 0;
+			}
+			break;
+		case 25:
+			vt_set_mode(vt, VT_MODE_HIDECURSOR, !set);
+			break;
+		case 47:
+		case 1047:
+			vt_altscreen(vt, set, 0);
+			break;
+		case 1049:
+			vt_altscreen(vt, set, 1);
+			break;
+		case 1000:
+			vt_set_mode(vt, VT_MODE_MOUSE, set);
+			break;
+		case 1002:
+			vt_set_mode(vt, VT_MODE_MOUSE_DRAG, set);
+			break;
+		case 1003:
+			vt_set_mode(vt, VT_MODE_MOUSE_ANY, set);
+			break;
+		case 1004:
+			vt_set_mode(vt, VT_MODE_FOCUS, set);
+			break;
+		case 1006:
+			vt_set_mode(vt, VT_MODE_MOUSE_SGR, set);
+			break;
+		case 2004:
+			vt_set_mode(vt, VT_MODE_PASTE, set);
+			break;
+		}
+	}
+}
+
+static void
+vt_csi(struct vt *vt, u_char final)
+{
+	u_int n, origin, top, bottom;
+	int i;
+
+	if (vt->vt_private == '?') {
+		if (final == 'h' || final == 'l') {
+			vt_dec_mode(vt, final == 'h');
+		}
+		return;
+	}
+	/*
+	 * DECSTR, the soft reset, is the only one with an intermediate we
+	 * care about.
+	 */
+	if (vt->vt_private != 0 || vt->vt_inter != 0) {
+		if (vt->vt_private == 0 && vt->vt_inter == '!' &&
+		    final == 'p') {
+			vt->vt_modes &= ~(VT_MODE_INSERT | VT_MODE_ORIGIN |
+			    VT_MODE_APPCURSOR | VT_MODE_APPKEYPAD |
+			    VT_MODE_HIDECURSOR);
+			vt->vt_modes |= VT_MODE_AUTOWRAP;
+			vt->vt_pen = vt_default_pen;
+			vt->vt_top = 0;
+			vt->vt_bottom = vt->vt_rows - 1;
+			vt->vt_saved_x = vt->vt_saved_y = 0;
+			vt->vt_saved_pen = vt_default_pen;
+		}
+		return;
+	}
+	origin = (vt->vt_modes & VT_MODE_ORIGIN) != 0 ? vt->vt_top : 0;
+	n = vt_param(vt, 0, 1);
+	switch (final) {
+	case '@':
+		vt_insert_chars(vt, n);
+		break;
+	case 'A':
+		top = vt->vt_y >= vt->vt_top ? vt->vt_top : 0;
+		vt_moveto(vt, vt->vt_y - top > n ? vt->vt_y - n : top,
+		    vt->vt_x);
+		break;
+	case 'B':
+	case 'e':
+		bottom = vt->vt_y <= vt->vt_bottom ? vt->vt_bottom :
+		    vt->vt_rows - 1;
+		vt_moveto(vt, bottom - vt->vt_y > n ? vt->vt_y + n : bottom,
+		    vt->vt_x);
+		break;
+	case 'C':
+	case 'a':
+		vt_moveto(vt, vt->vt_y, vt->vt_x + n);
+		break;
+	case 'D':
+		vt_moveto(vt, vt->vt_y, vt->vt_x > n ? vt->vt_x - n : 0);
+		break;
+	case 'E':
+		bottom = vt->vt_y <= vt->vt_bottom ? vt->vt_bottom :
+		    vt->vt_rows - 1;
+		vt_moveto(vt, bottom - vt->vt_y > n ? vt->vt_y + n : bottom,
+		    0);
+		break;
+	case 'F':
+		top = vt->vt_y >= vt->vt_top ? vt->vt_top : 0;
+		vt_moveto(vt, vt->vt_y - top > n ? vt->vt_y - n : top, 0);
+		break;
+	case 'G':
+	case '`':
+		vt_moveto(vt, vt->vt_y, n - 1);
+		break;
+	case 'H':
+	case 'f':
+		vt_moveto(vt, origin + n - 1, vt_param(vt, 1, 1) - 1);
+		break;
+	case 'd':
+		vt_moveto(vt, origin + n - 1, vt->vt_x);
+		break;
+	case 'J':
+		vt->vt_wrapnext = 0;
+		switch (vt_param(vt, 0, 0)) {
+		case 0:
+			vt_blank(vt, vt_cell(vt, vt->vt_y, vt->vt_x),
+			    vt->vt_cols - vt->vt_x);
+			vt_blank_rows(vt, vt->vt_y + 1,
+			    vt->vt_rows - vt->vt_y - 1);
+			break;
+		case 1:
+			vt_blank_rows(vt, 0, vt->vt_y);
+			vt_blank(vt, vt_cell(vt, vt->vt_y, 0), vt->vt_x + 1);
+			break;
+		case 2:
+		case 3:
+			vt_blank_rows(vt, 0, vt->vt_rows);
+			break;
+		}
+		break;
+	case 'K':
+		vt->vt_wrapnext = 0;
+		switch (vt_param(vt, 0, 0)) {
+		case 0:
+			vt_blank(vt, vt_cell(vt, vt->vt_y, vt->vt_x),
+			    vt->vt_cols - vt->vt_x);
+			break;
+		case 1:
+			vt_blank(vt, vt_cell(vt, vt->vt_y, 0), vt->vt_x + 1);
+			break;
+		case 2:
+			vt_blank(vt, vt_cell(vt, vt->vt_y, 0), vt->vt_cols);
+			break;
+		}
+		break;
+	case 'L':
+		if (vt->vt_y >= vt->vt_top && vt->vt_y <= vt->vt_bottom) {
+			vt_scroll_down(vt, vt->vt_y, vt->vt_bottom, n);
+			vt_moveto(vt, vt->vt_y, 0);
+		}
+		break;
+	case 'M':
+		if (vt->vt_y >= vt->vt_top && vt->vt_y <= vt->vt_bottom) {
+			vt_scroll_up(vt, vt->vt_y, vt->vt_bottom, n);
+			vt_moveto(vt, vt->vt_y, 0);
+		}
+		break;
+	case 'P':
+		vt_delete_chars(vt, n);
+		break;
+	case 'X':
+		if (n > vt->vt_cols - vt->vt_x) {
+			n = vt->vt_cols - vt->vt_x;
+		}
+		vt_blank(vt, vt_cell(vt, vt->vt_y, vt->vt_x), n);
+		break;
+	case 'S':
+		vt_scroll_up(vt, vt->vt_top, vt->vt_bottom, n);
+		break;
+	case 'T':
+		/* with more parameters, this is mouse highlight tracking */
+		if (vt->vt_nparams <= 1) {
+			vt_scroll_down(vt, vt->vt_top, vt->vt_bottom, n);
+		}
+		break;
+	case 'b':
+		if (vt->vt_last == 0) {
+			break;
+		}
+		if (n > vt->vt_rows * vt->vt_cols) {
+			n = vt->vt_rows * vt->vt_cols;
+		}
+		while (n-- > 0) {
+			vt_put(vt, vt->vt_last);
+		}
+		break;
+	case 'h':
+	case 'l':
+		for (i = 0; i < vt->vt_nparams; i++) {
+			if (vt->vt_params[i] == 4) {
+				vt_set_mode(vt, VT_MODE_INSERT, final == 'h');
+			}
+		}
+		break;
+	case 'm':
+		vt_sgr(vt);
+		break;
+	case 'r':
+		top = vt_param(vt, 0, 1) - 1;
+		bottom = vt_param(vt, 1, vt->vt_rows) - 1;
+		if (bottom >= vt->vt_rows) {
+			bottom = vt->vt_rows - 1;
+		}
+		if (top < bottom) {
+			vt->vt_top = top;
+			vt->vt_bottom = bottom;
+			vt_moveto(vt, (vt->vt_modes & VT_MODE_ORIGIN) != 0 ?
+			    top : 0, 0);
+		}
+		break;
+	case 's':
+		vt_save(vt);
+		break;
+	case 'u':
+		vt_restore(vt);
+		break;
+	}
+}
+
+static void
+vt_csi_byte(struct vt *vt, u_char c)
+{
+	u_int *p;
+
+	if (c >= '0' && c <= '9') {
+		if (vt->vt_nparams == 0) {
+			vt->vt_nparams = 1;
+		}
+		p = &vt->vt_params[vt->vt_nparams - 1];
+		if (*p < 65536) {
+			*p = *p * 10 + c - '0';
+		}
+		return;
+	}
+	/*
+	 * Sub-parameters (38:2:R:G:B) are treated as parameters.
+	 */
+	if (c == ';' || c == ':') {
+		if (vt->vt_nparams == 0) {
+			vt->vt_nparams = 1;
+		}
+		if (vt->vt_nparams < VT_MAX_PARAMS) {
+			vt->vt_nparams++;
+		}
+		return;
+	}
+	if (c >= '<' && c <= '?') {
+		if (vt->vt_nparams == 0) {
+			vt->vt_private = c;
+		}
+		return;
+	}
+	if (c >= 0x20 && c <= 0x2f) {
+		vt->vt_inter = c;
+		return;
+	}
+	if (c >= 0x40 && c <= 0x7e) {
+		vt->vt_state = VT_GROUND;
+		vt_csi(vt, c);
+		return;
+	}
+	if (c < 0x20) {
+		vt_control(vt, c);
+	}
+}
+
+static void
+vt_ground(struct vt *vt, u_char c)
+{
+
+	if (vt->vt_utf8_left > 0) {
+		if ((c & 0xc0) == 0x80) {
+			vt->vt_utf8 = vt->vt_utf8 << 6 | (c & 0x3f);
+			if (--vt->vt_utf8_left == 0) {
+				vt_put(vt, vt->vt_utf8);
+			}
+			return;
+		}
+		vt->vt_utf8_left = 0;
+		vt_put(vt, 0xfffd);
+	}
+	if (c < 0x20) {
+		vt_control(vt, c);
+	} else if (c < 0x7f) {
+		vt_put(vt, c);
+	} else if (c >= 0xc2 && c <= 0xdf) {
+		vt->vt_utf8 = c & 0x1f;
+		vt->vt_utf8_left = 1;
+	} else if (c >= 0xe0 && c <= 0xef) {
+		vt->vt_utf8 = c & 0x0f;
+		vt->vt_utf8_left = 2;
+	} else if (c >= 0xf0 && c <= 0xf4) {
+		vt->vt_utf8 = c & 0x07;
+		vt->vt_utf8_left = 3;
+	} else if (c != 0x7f) {
+		vt_put(vt, 0xfffd);
+	}
+}
+
+static void
+vt_byte(struct vt *vt, u_char c)
+{
+
+	/* CAN and SUB abort any sequence */
+	if (c == 0x18 || c == 0x1a) {
+		vt->vt_state = VT_GROUND;
+		vt->vt_utf8_left = 0;
+		return;
+	}
+	switch (vt->vt_state) {
+	case VT_GROUND:
+		vt_ground(vt, c);
+		break;
+	case VT_ESCAPE:
+		if (c < 0x20) {
+			vt_control(vt, c);
+		} else {
+			vt_escape(vt, c);
+		}
+		break;
+	case VT_ESCAPE_SKIP:
+		if (c < 0x20) {
+			vt_control(vt, c);
+		} else {
+			vt->vt_state = VT_GROUND;
+		}
+		break;
+	case VT_CSI:
+		vt_csi_byte(vt, c);
+		break;
+	case VT_STRING:
+		if (c == 0x07) {
+			vt->vt_state = VT_GROUND;
+		} else if (c == 0x1b) {
+			vt->vt_state = VT_STRING_ESC;
+		}
+		break;
+	case VT_STRING_ESC:
+		if (c == '\\') {
+			vt->vt_state = VT_GROUND;
+		} else {
+			vt->vt_state = VT_ESCAPE;
+			vt_byte(vt, c);
+		}
+		break;
+	}
+}
+
+/*
+ * Feed pty output to the model. Output can be split anywhere, including
+ * in the middle of escape sequences and UTF-8 characters.
+ */
+void
+vt_feed(struct vt *vt, const u_char *buf, size_t len)
+{
+	size_t n;
+
+	vt->vt_bytes += len;
+	while (len > 0) {
+		if (vt->vt_state == VT_GROUND && vt->vt_utf8_left == 0 &&
+		    vt_fastpath) {
+			n = scan_printable(buf, len);
+			if (n > 0) {
+				vt_put_run(vt, buf, n);
+				buf += n;
+				len -= n;
+				continue;
+			}
+		}
+		vt_byte(vt, *buf++);
+		len--;
+	}
+}
+
+static void
+vt_redraw_color(struct sbuf *sb, uint32_t color, u_int base)
+{
+	u_int idx;
+
+	switch (color & 0xff000000) {
+	case VT_COLOR_INDEX:
+		idx = color & 0xff;
+		if (idx < 8) {
+			sbuf_printf(sb, ";%u", base + idx);
+		} else if (idx < 16) {
+			sbuf_printf(sb, ";%u", base + 60 + idx - 8);
+		} else {
+			sbuf_printf(sb, ";%u;5;%u", base + 8, idx);
+		}
+		break;
+	case VT_COLOR_RGB:
+		sbuf_printf(sb, ";%u;2;%u;%u;%u", base + 8,
+		    (color >> 16) & 0xff, (color >> 8) & 0xff, color & 0xff);
+		break;
+	}
+}
+
+static void
+vt_redraw_sgr(struct sbuf *sb, const struct vt_cell *pen)
+{
+	static const struct {
+		uint32_t	attr;
+		u_int		code;
+	} attrs[] = {
+		{ VT_ATTR_BOLD,		1 },
+		{ VT_ATTR_DIM,		2 },
+		{ VT_ATTR_ITALIC,	3 },
+		{ VT_ATTR_UNDERLINE,	4 },
+		{ VT_ATTR_BLINK,	5 },
+		{ VT_ATTR_REVERSE,	7 },
+		{ VT_ATTR_HIDDEN,	8 },
+		{ VT_ATTR_STRIKE,	9 },
+	};
+	size_t k;
+
+	sbuf_cat(sb, "\033[0");
+	for (k = 0; k < sizeof(attrs) / sizeof(attrs[0]); k++) {
+		if ((pen->vc_attr & attrs[k].attr) != 0) {
+			sbuf_printf(sb, ";%u", attrs[k].code);
+		}
+	}
+	vt_redraw_color(sb, pen->vc_fg, 30);
+	vt_redraw_color(sb, pen->vc_bg, 40);
+	sbuf_putc(sb, 'm');
+}
+
+static int
+vt_same_pen(const struct vt_cell *a, const struct vt_cell *b)
+{
+
+	return (a->vc_fg == b->vc_fg && a->vc_bg == b->vc_bg &&
+	    a->vc_attr == b->vc_attr);
+}
+
+static void
+vt_redraw_char(struct sbuf *sb, uint32_t ch)
+{
+	char u[4];
+
+	if (ch < 0x80) {
+		sbuf_putc(sb, ch);
+		return;
+	}
+	if (ch < 0x800) {
+		u[0] = 0xc0 | ch >> 6;
+		u[1] = 0x80 | (ch & 0x3f);
+		sbuf_bcat(sb, u, 2);
+	} else if (ch < 0x10000) {
+		u[0] = 0xe0 | ch >> 12;
+		u[1] = 0x80 | ((ch >> 6) & 0x3f);
+		u[2] = 0x80 | (ch & 0x3f);
+		sbuf_bcat(sb, u, 3);
+	} else {
+		u[0] = 0xf0 | ch >> 18;
+		u[1] = 0x80 | ((ch >> 12) & 0x3f);
+		u[2] = 0x80 | ((ch >> 6) & 0x3f);
+		u[3] = 0x80 | (ch & 0x3f);
+		sbuf_bcat(sb, u, 4);
+	}
+}
+
+/*
+ * Paint the rows of a screen which is known to be clear, skipping
+ * trailing blanks and only changing attributes where they differ.
+ */
+static void
+vt_redraw_screen(struct vt *vt, struct vt_cell **screen, struct sbuf *sb)
+{
+	const struct vt_cell *row, *c;
+	struct vt_cell pen;
+	u_int y, x, len;
+
+	pen = vt_default_pen;
+	for (y = 0; y < vt->vt_rows; y++) {
+		row = screen[y];
+		for (len = vt->vt_cols; len > 0; len--) {
+			c = &row[len - 1];
+			if (c->vc_ch != ' ' || c->vc_bg != VT_COLOR_DEFAULT ||
+			    (c->vc_attr & VT_BLANK_ATTRS) != 0) {
+				break;
+			}
+		}
+		if (len == 0) {
+			continue;
+		}
+		sbuf_printf(sb, "\033[%uH", y + 1);
+		for (x = 0; x < len; x++) {
+			c = &row[x];
+			if (!vt_same_pen(c, &pen)) {
+				vt_redraw_sgr(sb, c);
+				pen = *c;
+			}
+			vt_redraw_char(sb, c->vc_ch);
+		}
+	}
+	if (!vt_same_pen(&pen, &vt_default_pen)) {
+		sbuf_cat(sb, "\033[0m");
+	}
+}
+
+/*
+ * Append the output which takes a terminal, in whatever state it was left
+ * in, to the screen held by the model: the modes are put back to their
+ * defaults, both screens are painted, then the saved cursor, the scroll
+ * region, the modes, the cursor and the pen are set up.
+ */
+void
+vt_redraw(struct vt *vt, struct sbuf *sb)
+{
+	static const struct {
+		u_int		 mode;
+		const char	*seq;
+	} modes[] = {
+		{ VT_MODE_APPCURSOR,	"\033[?1h" },
+		{ VT_MODE_APPKEYPAD,	"\033=" },
+		{ VT_MODE_INSERT,	"\033[4h" },
+		{ VT_MODE_ORIGIN,	"\033[?6h" },
+		{ VT_MODE_MOUSE,	"\033[?1000h" },
+		{ VT_MODE_MOUSE_DRAG,	"\033[?1002h" },
+		{ VT_MODE_MOUSE_ANY,	"\033[?1003h" },
+		{ VT_MODE_FOCUS,	"\033[?1004h" },
+		{ VT_MODE_MOUSE_SGR,	"\033[?1006h" },
+		{ VT_MODE_PASTE,	"\033[?2004h" },
+	};
+	size_t k;
+
+	sbuf_cat(sb, "\033[?25l\033[?1049l\033[0m\033[r\033[4l\033>"
+	    "\033[?1l\033[?6l\033[?7h\033[?1000l\033[?1002l\033[?1003l"
+	    "\033[?1004l\033[?1006l\033[?2004l\033[H\033[2J");
+	vt_redraw_screen(vt, vt->vt_main, sb);
+	if ((vt->vt_modes & VT_MODE_ALTSCREEN) != 0) {
+		sbuf_cat(sb, "\033[?1049h\033[H\033[2J");
+		vt_redraw_screen(vt, vt->vt_alt, sb);
+	}
+	vt_redraw_sgr(sb, &vt->vt_saved_pen);
+	sbuf_printf(sb, "\033[%u;%uH\0337", vt->vt_saved_y + 1,
+	    vt->vt_saved_x + 1);
+	if (vt->vt_top != 0 || vt->vt_bottom != vt->vt_rows - 1) {
+		sbuf_printf(sb, "\033[%u;%ur", vt->vt_top + 1,
+		    vt->vt_bottom + 1);
+	}
+	for (k = 0; k < sizeof(modes) / sizeof(modes[0]); k++) {
+		if ((vt->vt_modes & modes[k].mode) != 0) {
+			sbuf_cat(sb, modes[k].seq);
+		}
+	}
+	if ((vt->vt_modes & VT_MODE_AUTOWRAP) == 0) {
+		sbuf_cat(sb, "\033[?7l");
+	}
+	sbuf_printf(sb, "\033[%u;%uH", vt->vt_y + 1 -
+	    ((vt->vt_modes & VT_MODE_ORIGIN) != 0 ? vt->vt_top : 0),
+	    vt->vt_x + 1);
+	vt_redraw_sgr(sb, &vt->vt_pen);
+	if ((vt->vt_modes & VT_MODE_HIDECURSOR) == 0) {
+		sbuf_cat(sb, "\033[?25h");
+	}
+}
+
+#ifdef __BENCH_VT_CODE__
+#include <time.h>
+
+/*
+ * Parser throughput for plain text, for the cursor addressing and color
+ * heavy output of a top(1) like program, and for UTF-8 text, with and
+ * without the printable ASCII fast path. Each redraw is fed to a second
+ * model, which has to end up with the same screen.
+ *
+ * cc -O2 -D__BENCH_VT_CODE__ -I../include vt.c scan.c ../libcblock/sbuf.c
+ * cc -O2 -mavx2 -D__BENCH_VT_CODE__ -I../include vt.c scan.c \
+ *     ../libcblock/sbuf.c
+ */
+#define	BENCH_SIZE	(16 * 1024 * 1024)
+#define	BENCH_CHUNK	4096	/* pty read size */
+#define	BENCH_ROUNDS	10
+
+static double
+bench_ns(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) * 1e9 +
+	    (end.tv_nsec - start->tv_nsec));
+}
+
+static size_t
+bench_text(char *buf, size_t size)
+{
+	size_t off, col, n;
+
+	off = col = 0;
+	while (off + 16 < size) {
+		n = 1 + random() % 10;
+		if (col + n > 72) {
+			off += sprintf(buf + off, "\r\n");
+			col = 0;
+		}
+		while (n-- > 0) {
+			buf[off++] = 'a' + random() % 26;
+			col++;
+		}
+		buf[off++] = ' ';
+		col++;
+	}
+	return (off);
+}
+
+static size_t
+bench_top(char *buf, size_t size)
+{
+	size_t off;
+	int row;
+
+	off = row = 0;
+	while (off + 256 < size) {
+		if (row == 0) {
+			off += sprintf(buf + off, "\033[H\033[1mtop - "
+			    "%02ld:%02ld up 3 days, load %ld.%02ld\033[m"
+			    "\033[K", random() % 24, random() % 60,
+			    random() % 8, random() % 100);
+		} else {
+			off += sprintf(buf + off, "\033[%d;1H\033[%dm%6ld "
+			    "root      20   0 %7ldK \033[1;38;5;%ldm%5ld.%ld"
+			    "\033[22;39m  0:%02ld.%02ld \033[48;2;0;0;%ldm"
+			    "cblockd\033[m\033[K", row + 1, 30 + row % 8,
+			    random() % 99999, random() % 999999,
+			    random() % 256, random() % 100, random() % 10,
+			    random() % 60, random() % 100, random() % 256);
+		}
+		row = (row + 1) % 24;
+	}
+	return (off);
+}
+
+static size_t
+bench_utf8(char *buf, size_t size)
+{
+	static const char *words[] = {
+		"καλημέρα", "κόσμε", "こんにちは", "世界", "grüße",
+		"naïve", "cblock", "→", "█▓▒░",
+	};
+	size_t off;
+	int k;
+
+	off = 0;
+	k = 0;
+	while (off + 64 < size) {
+		off += sprintf(buf + off, "%s%s", words[random() % 9],
+		    ++k % 8 == 0 ? "\r\n" : " ");
+	}
+	return (off);
+}
+
+static void
+bench_feed(struct vt *vt, const char *buf, size_t len)
+{
+	size_t off, n;
+
+	for (off = 0; off < len; off += n) {
+		n = len - off < BENCH_CHUNK ? len - off : BENCH_CHUNK;
+		vt_feed(vt, (const u_char *)buf + off, n);
+	}
+}
+
+static void
+bench_compare(struct vt *a, struct vt *b)
+{
+	size_t n;
+	u_int y;
+
+	n = a->vt_cols * sizeof(struct vt_cell);
+	for (y = 0; y < a->vt_rows; y++) {
+		if (memcmp(a->vt_main[y], b->vt_main[y], n) != 0) {
+			errx(1, "redraw: main screen row %u differs", y);
+		}
+		if ((a->vt_modes & VT_MODE_ALTSCREEN) != 0 &&
+		    memcmp(a->vt_alt[y], b->vt_alt[y], n) != 0) {
+			errx(1, "redraw: alternate screen row %u differs", y);
+		}
+	}
+	if (a->vt_x != b->vt_x || a->vt_y != b->vt_y ||
+	    a->vt_modes != b->vt_modes || a->vt_top != b->vt_top ||
+	    a->vt_bottom != b->vt_bottom ||
+	    memcmp(&a->vt_pen, &b->vt_pen, sizeof(a->vt_pen)) != 0) {
+		errx(1, "redraw: cursor, modes or pen differ");
+	}
+}
+
+static void
+bench_redraw(struct vt *vt, const char *name)
+{
+	struct timespec start;
+	struct sbuf *sb;
+	struct vt *copy;
+
+	sb = sbuf_new_auto();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	vt_redraw(vt, sb);
+	sbuf_finish(sb);
+	printf("%-10s redraw %5zd bytes in %6.1f us (%ux%u)\n", name,
+	    sbuf_len(sb), bench_ns(&start) / 1000, vt->vt_cols, vt->vt_rows);
+	copy = vt_create(vt->vt_rows, vt->vt_cols);
+	vt_feed(copy, (u_char *)sbuf_data(sb), sbuf_len(sb));
+	bench_compare(vt, copy);
+	vt_destroy(copy);
+	sbuf_delete(sb);
+}
+
+int
+main(int argc, char *argv [])
+{
+	static const struct {
+		const char	*name;
+		size_t		(*gen)(char *, size_t);
+	} inputs[] = {
+		{ "text",	bench_text },
+		{ "top",	bench_top },
+		{ "utf-8",	bench_utf8 },
+	};
+	struct timespec start;
+	struct vt *vt;
+	size_t len, k;
+	double ns;
+	char *buf;
+	int round, fast;
+
+	buf = malloc(BENCH_SIZE);
+	if (buf == NULL) {
+		err(1, "malloc");
+	}
+	for (k = 0; k < sizeof(inputs) / sizeof(inputs[0]); k++) {
+		len = inputs[k].gen(buf, BENCH_SIZE);
+		for (fast = 0; fast < 2; fast++) {
+			vt_fastpath = fast;
+			vt = vt_create(50, 200);
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (round = 0; round < BENCH_ROUNDS; round++) {
+				bench_feed(vt, buf, len);
+			}
+			ns = bench_ns(&start);
+			printf("%-10s %-8s %8.1f MB/s\n", inputs[k].name,
+			    fast ? "fast" : "scalar",
+			    (double)len * BENCH_ROUNDS / ns * 1e9 /
+			    (1024 * 1024));
+			if (fast) {
+				bench_redraw(vt, inputs[k].name);
+			}
+			vt_destroy(vt);
+		}
+	}
+	/*
+	 * A full screen program on the alternate screen, in a region, with
+	 * the terminal resized under it.
+	 */
+	vt = vt_create(24, 80);
+	len = bench_top(buf, 65536);
+	vt_feed(vt, (u_char *)"\033[?1049h\033[?1h\033=\033[?2004h"
+	    "\033[?1000h\033[?1006h\033[2;23r", 47);
+	bench_feed(vt, buf, len);
+	vt_resize(vt, 50, 132);
+	bench_feed(vt, buf, len);
+	vt_feed(vt, (u_char *)"\033[5;20r\033[?6h\033[3;7H\033[?25l", 25);
+	bench_redraw(vt, "alt");
+	vt_destroy(vt);
+	free(buf);
+	return (0);
+}
+#endif	/* __BENCH_VT_CODE__ */
@@ -0,0 +1,111 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef VT_DOT_H_
+#define	VT_DOT_H_
+
+/*
+ * Screen model of a VT100/xterm terminal, fed with the pty output so a
+ * console which attaches can be sent the current screen instead of the raw
+ * scrollback. It covers the cursor movement, erasing, scrolling, SGR and
+ * mode sequences full screen programs use; anything else is parsed and
+ * ignored. Every character is taken to be one column wide.
+ */
+#define	VT_MAX_PARAMS		16
+#define	VT_DEFAULT_ROWS		24
+#define	VT_DEFAULT_COLS		80
+#define	VT_MAX_ROWS		1024
+#define	VT_MAX_COLS		1024
+
+#define	VT_COLOR_DEFAULT	0x00000000
+#define	VT_COLOR_INDEX		0x01000000	/* palette index in low byte */
+#define	VT_COLOR_RGB		0x02000000	/* 0xRRGGBB in low bytes */
+
+struct vt_cell {
+	uint32_t		 vc_ch;
+	uint32_t		 vc_fg;
+	uint32_t		 vc_bg;
+	uint32_t		 vc_attr;
+#define	VT_ATTR_BOLD		0x0001
+#define	VT_ATTR_DIM		0x0002
+#define	VT_ATTR_ITALIC		0x0004
+#define	VT_ATTR_UNDERLINE	0x0008
+#define	VT_ATTR_BLINK		0x0010
+#define	VT_ATTR_REVERSE		0x0020
+#define	VT_ATTR_HIDDEN		0x0040
+#define	VT_ATTR_STRIKE		0x0080
+};
+
+struct vt {
+	u_int			 vt_rows;
+	u_int			 vt_cols;
+	struct vt_cell		**vt_main;	/* rows, scrolled in place */
+	struct vt_cell		**vt_alt;
+	struct vt_cell		**vt_screen;	/* vt_main or vt_alt */
+	u_int			 vt_x;
+	u_int			 vt_y;
+	int			 vt_wrapnext;	/* next character wraps */
+	struct vt_cell		 vt_pen;	/* attributes for output */
+	u_int			 vt_top;	/* scroll region, inclusive */
+	u_int			 vt_bottom;
+	u_int			 vt_modes;
+#define	VT_MODE_AUTOWRAP	0x0001
+#define	VT_MODE_HIDECURSOR	0x0002
+#define	VT_MODE_ALTSCREEN	0x0004
+#define	VT_MODE_APPCURSOR	0x0008
+#define	VT_MODE_APPKEYPAD	0x0010
+#define	VT_MODE_INSERT		0x0020
+#define	VT_MODE_ORIGIN		0x0040
+#define	VT_MODE_PASTE		0x0080	/* bracketed paste */
+#define	VT_MODE_MOUSE		0x0100	/* 1000, button events */
+#define	VT_MODE_MOUSE_DRAG	0x0200	/* 1002 */
+#define	VT_MODE_MOUSE_ANY	0x0400	/* 1003 */
+#define	VT_MODE_MOUSE_SGR	0x0800	/* 1006 */
+#define	VT_MODE_FOCUS		0x1000	/* 1004 */
+	u_int			 vt_saved_x;	/* DECSC/DECRC */
+	u_int			 vt_saved_y;
+	struct vt_cell		 vt_saved_pen;
+	uint32_t		 vt_last;	/* last character, for REP */
+	/* parser state */
+	int			 vt_state;
+	u_int			 vt_params[VT_MAX_PARAMS];
+	int			 vt_nparams;
+	u_char			 vt_private;
+	u_char			 vt_inter;
+	uint32_t		 vt_utf8;
+	int			 vt_utf8_left;
+	uint64_t		 vt_bytes;	/* parsed, for stats */
+};
+
+struct sbuf;
+
+struct vt *	vt_create(u_int, u_int);
+void		vt_destroy(struct vt *);
+void		vt_resize(struct vt *, u_int, u_int);
+void		vt_feed(struct vt *, const u_char *, size_t);
+void		vt_redraw(struct vt *, struct sbuf *);
+
+#endif	/* VT_DOT_H_ */
@@ -0,0 +1,152 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/queue.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+#include "stats.h"
+#include "worker.h"
+
+static void *
+worker_thread(void *arg)
+{
+	struct worker_pool *wp;
+	struct work *w;
+
+	wp = arg;
+	pthread_mutex_lock(&wp->wp_mutex);
+	for (;;) {
+		while (TAILQ_EMPTY(&wp->wp_head)) {
+			pthread_cond_wait(&wp->wp_cond, &wp->wp_mutex);
+		}
+		w = TAILQ_FIRST(&wp->wp_head);
+		TAILQ_REMOVE(&wp->wp_head, w, w_glue);
+		wp->wp_depth--;
+		wp->wp_active++;
+		pthread_mutex_unlock(&wp->wp_mutex);
+		(*w->w_fn)(w->w_arg);
+		pthread_mutex_lock(&wp->wp_mutex);
+		wp->wp_active--;
+		wp->wp_completed++;
+	}
+	/* NOT REACHED */
+	return (NULL);
+}
+
+void
+worker_pool_init(struct worker_pool *wp, const char *name, size_t threads,
+    size_t max_queue)
+{
+	pthread_attr_t attr;
+	pthread_t thr;
+	size_t k;
+
+	bzero(wp, sizeof(*wp));
+	wp->wp_name = name;
+	wp->wp_threads = threads;
+	wp->wp_max_queue = max_queue;
+	TAILQ_INIT(&wp->wp_head);
+	pthread_mutex_init(&wp->wp_mutex, NULL);
+	pthread_cond_init(&wp->wp_cond, NULL);
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	for (k = 0; k < threads; k++) {
+		if (pthread_create(&thr, &attr, worker_thread, wp) != 0) {
+			err(1, "pthread_create(%s worker) failed", name);
+		}
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * Queue work for the pool. Returns -1 if the queue is already at its
+ * limit, in which case the caller still owns the work item.
+ */
+int
+worker_pool_enqueue(struct worker_pool *wp, struct work *w)
+{
+
+	pthread_mutex_lock(&wp->wp_mutex);
+	if (wp->wp_max_queue != 0 && wp->wp_depth >= wp->wp_max_queue) {
+		wp->wp_rejected++;
+		pthread_mutex_unlock(&wp->wp_mutex);
+		return (-1);
+	}
+	TAILQ_INSERT_TAIL(&wp->wp_head, w, w_glue);
+	wp->wp_depth++;
+	if (wp->wp_depth > wp->wp_depth_hwm) {
+		wp->wp_depth_hwm = wp->wp_depth;
+	}
+	pthread_cond_signal(&wp->wp_cond);
+	pthread_mutex_unlock(&wp->wp_mutex);
+	return (0);
+}
+
+void
+worker_pool_stats(struct worker_pool *wp, struct stats_ctx *ctx)
+{
+	size_t threads, active, depth, depth_hwm, max_queue;
+	uint64_t completed, rejected;
+	char name[64];
+
+	/*
+	 * Copy the counters out so we are not holding the pool lock while
+	 * the stats are written out to the peer.
+	 */
+	pthread_mutex_lock(&wp->wp_mutex);
+	threads = wp->wp_threads;
+	active = wp->wp_active;
+	depth = wp->wp_depth;
+	depth_hwm = wp->wp_depth_hwm;
+	max_queue = wp->wp_max_queue;
+	completed = wp->wp_completed;
+	rejected = wp->wp_rejected;
+	pthread_mutex_unlock(&wp->wp_mutex);
+	snprintf(name, sizeof(name), "%s.threads", wp->wp_name);
+	stats_put(ctx, name, threads);
+	snprintf(name, sizeof(name), "%s.active", wp->wp_name);
+	stats_put(ctx, name, active);
+	snprintf(name, sizeof(name), "%s.queue_depth", wp->wp_name);
+	stats_put(ctx, name, depth);
+	snprintf(name, sizeof(name), "%s.queue_depth_max", wp->wp_name);
+	stats_put(ctx, name, depth_hwm);
+	snprintf(name, sizeof(name), "%s.queue_limit", wp->wp_name);
+	stats_put(ctx, name, max_queue);
+	snprintf(name, sizeof(name), "%s.completed", wp->wp_name);
+	stats_put(ctx, name, completed);
+	snprintf(name, sizeof(name), "%s.rejected", wp->wp_name);
+	stats_put(ctx, name, rejected);
+}
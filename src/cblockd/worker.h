@@ -0,0 +1,62 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#ifndef WORKER_DOT_H_
+#define	WORKER_DOT_H_
+
+/*
+ * Fixed size pool of threads servicing a bounded queue of work. Work items
+ * are embedded in the objects they operate on, so queueing work does not
+ * allocate.
+ */
+struct stats_ctx;
+
+struct work {
+	void			(*w_fn)(void *);
+	void			*w_arg;
+	TAILQ_ENTRY(work)	 w_glue;
+};
+
+struct worker_pool {
+	const char		*wp_name;
+	pthread_mutex_t		 wp_mutex;
+	pthread_cond_t		 wp_cond;
+	TAILQ_HEAD( , work)	 wp_head;
+	size_t			 wp_threads;
+	size_t			 wp_max_queue;
+	size_t			 wp_depth;
+	size_t			 wp_depth_hwm;
+	size_t			 wp_active;
+	uint64_t		 wp_completed;
+	uint64_t		 wp_rejected;
+};
+
+void		worker_pool_init(struct worker_pool *, const char *, size_t,
+		    size_t);
+int		worker_pool_enqueue(struct worker_pool *, struct work *);
+void		worker_pool_stats(struct worker_pool *, struct stats_ctx *);
+
+#endif	/* WORKER_DOT_H_ */
@@ -42,6 +42,9 @@
 
 struct tailhead_stage;
 struct tailhead_step;
+struct iovec;
+struct zstream;
+struct shmring;
 
 #define	MAX_PRISON_NAME	512
 #define	MAX_ERR_BUF	512
@@ -65,6 +68,140 @@ enum {
 #define	PRISON_IPC_GET_INSTANCES	9
 #define	PRISON_IPC_GENERIC_COMMAND	10
 #define	PRISON_IPC_NETWORK_CTL		11
+#define	PRISON_IPC_HELLO		12
+#define	PRISON_IPC_GET_STATS		13
+#define	PRISON_IPC_CONSOLE_OFFSET	14
+#define	PRISON_IPC_CONSOLE_SIGNAL	15
+#define	PRISON_IPC_CONSOLE_LIMIT	16
+#define	PRISON_IPC_CONSOLE_DEFLATE	17
+#define	PRISON_IPC_CONSOLE_MUX		18
+#define	PRISON_IPC_MUX_SUBSCRIBE	19
+#define	PRISON_IPC_MUX_UNSUBSCRIBE	20
+#define	PRISON_IPC_CONSOLE_SHM		21
+#define	PRISON_IPC_CONSOLE_HANDOFF	22
+#define	PRISON_IPC_CONSOLE_TEE		23
+#define	PRISON_IPC_QUERY_INSTANCES	24
+
+/*
+ * Protocol negotiation. Clients which support the TLV encoding open the
+ * connection with PRISON_IPC_HELLO followed by a cblock_hello structure.
+ * The daemon responds with the version and capabilities it will use for
+ * the remainder of the connection. Peers which never send a hello are
+ * assumed to speak the legacy (raw structure) protocol.
+ */
+#define	CBLOCK_PROTO_MAGIC		0x43424c4b	/* "CBLK" */
+#define	CBLOCK_PROTO_LEGACY		0
+#define	CBLOCK_PROTO_TLV		1
+#define	CBLOCK_PROTO_VERSION		CBLOCK_PROTO_TLV
+
+#define	CBLOCK_CAP_TLV			0x00000001
+#define	CBLOCK_CAP_CONSOLE_FRAMES	0x00000002
+#define	CBLOCK_CAP_CONSOLE_LOGS		0x00000004
+/*
+ * Console output may be sent as PRISON_IPC_CONSOLE_DEFLATE messages: the
+ * payload is the next part of a raw deflate stream (one per console
+ * connection), ending with a sync flush. Only offered on inet sockets.
+ */
+#define	CBLOCK_CAP_CONSOLE_DEFLATE	0x00000008
+#define	CBLOCK_CAP_CONSOLE_MUX		0x00000010
+/*
+ * Log subscribers may ask (p_shm) for live output to be read from a shared
+ * memory ring instead of the socket. Only offered on UNIX domain sockets.
+ */
+#define	CBLOCK_CAP_CONSOLE_SHM		0x00000020
+/*
+ * A console writer may ask (p_handoff) for the pty itself, to read and write
+ * it directly. Only offered on UNIX domain sockets, and only granted to root
+ * and the user the daemon runs as.
+ */
+#define	CBLOCK_CAP_CONSOLE_HANDOFF	0x00000040
+/*
+ * Instance listings may carry as many entries per message as fit, each
+ * starting with its TLV_INSTANCE field (see tlv_get_instance()).
+ */
+#define	CBLOCK_CAP_LIST_STREAM		0x00000080
+#define	CBLOCK_CAP_LIST_QUERY		0x00000100
+#define	CBLOCK_CAPS			(CBLOCK_CAP_TLV | \
+					 CBLOCK_CAP_CONSOLE_FRAMES | \
+					 CBLOCK_CAP_CONSOLE_LOGS | \
+					 CBLOCK_CAP_CONSOLE_DEFLATE | \
+					 CBLOCK_CAP_CONSOLE_MUX | \
+					 CBLOCK_CAP_CONSOLE_SHM | \
+					 CBLOCK_CAP_CONSOLE_HANDOFF | \
+					 CBLOCK_CAP_LIST_STREAM | \
+					 CBLOCK_CAP_LIST_QUERY)
+
+struct cblock_hello {
+	uint32_t				h_magic;
+	uint32_t				h_version;
+	uint32_t				h_caps;
+};
+
+/*
+ * TLV encoded messages are prefixed with a 32-bit length, followed by
+ * any number of fields.  Each field carries a 16-bit type and a 16-bit
+ * length.  All integers are in network byte order.  Fields which are not
+ * understood by the receiver are skipped.
+ */
+#define	TLV_MSG_MAX			16384
+#define	TLV_HDR_LEN			4
+
+#define	TLV_ECODE			1
+#define	TLV_ERRBUF			2
+#define	TLV_NAME			3
+#define	TLV_TAG				4
+#define	TLV_TERM			5
+#define	TLV_ENTRY_POINT_ARGS		6
+#define	TLV_VOLUMES			7
+#define	TLV_PORTS			8
+#define	TLV_NETWORK			9
+#define	TLV_VERBOSE			10
+#define	TLV_INSTANCE			11
+#define	TLV_WINSIZE			12
+#define	TLV_TERMIOS			13
+#define	TLV_CMDNAME			14
+#define	TLV_MLEN			15
+#define	TLV_IMAGE_NAME			16
+#define	TLV_CBLOCK_FILE			17
+#define	TLV_CONTEXT_SIZE		18
+#define	TLV_NSTAGES			19
+#define	TLV_NSTEPS			20
+#define	TLV_ENTRY_POINT			21
+#define	TLV_FIM_SPEC			22
+#define	TLV_OS_RELEASE			23
+#define	TLV_AUDITCFG			24
+#define	TLV_PID				25
+#define	TLV_TTY_LINE			26
+#define	TLV_START_TIME			27
+#define	TLV_TYPE			28
+#define	TLV_COUNT			29
+#define	TLV_STAT_NAME			30
+#define	TLV_STAT_VALUE			31
+#define	TLV_RESUME_OFFSET		32
+#define	TLV_WATCH			33
+#define	TLV_REPLAY_LINES		34
+#define	TLV_REPLAY_BYTES		35
+#define	TLV_LOGS			36
+#define	TLV_SINCE_TIME			37
+#define	TLV_OUTPUT_RATE			38
+#define	TLV_OUTPUT_BURST		39
+#define	TLV_SHM				40
+#define	TLV_HANDOFF			41
+#define	TLV_MATCHED			42
+#define	TLV_CURSOR			43
+#define	TLV_ENTRY			44
+#define	TLV_STATE			45
+#define	TLV_FIELDS			46
+#define	TLV_SORT			47
+#define	TLV_LIMIT			48
+#define	TLV_QUERY_TYPE			49
+#define	TLV_QUERY_STATE			50
+
+struct tlv_iter {
+	const u_char				*ti_buf;
+	size_t					 ti_len;
+	size_t					 ti_off;
+};
 
 struct instance_ent {
 	char					p_instance_name[MAX_PRISON_NAME];
@@ -73,6 +210,57 @@ struct instance_ent {
 	char					p_tty_line[MAXPATHLEN];
 	time_t					p_start_time;
 	char					p_type[MAXPATHLEN];
+	/*
+	 * "attached" if a console is connected, else "detached". Only
+	 * carried by the TLV protocol.
+	 */
+	char					p_state[16];
+};
+
+/*
+ * With CBLOCK_CAP_LIST_QUERY, a listing may be asked for with
+ * PRISON_IPC_QUERY_INSTANCES: instances are filtered by image, type and
+ * state, ordered by the sort key (and then by name), and returned a page
+ * (q_limit entries) at a time with just the fields asked for. The response
+ * (see sock_ipc_recv_instance_page()) carries the number of entries in
+ * the page, the number which matched, and unless the page is the last one
+ * a cursor, which is passed back in q_cursor to get the next page.
+ */
+#define	INSTANCE_F_NAME				0x00000001
+#define	INSTANCE_F_IMAGE			0x00000002
+#define	INSTANCE_F_PID				0x00000004
+#define	INSTANCE_F_TTY				0x00000008
+#define	INSTANCE_F_START			0x00000010
+#define	INSTANCE_F_TYPE				0x00000020
+#define	INSTANCE_F_STATE			0x00000040
+#define	INSTANCE_F_ALL				0x0000007f
+
+#define	INSTANCE_SORT_NAME			0
+#define	INSTANCE_SORT_IMAGE			1
+#define	INSTANCE_SORT_START			2
+#define	INSTANCE_SORT_PID			3
+
+#define	INSTANCE_STATE_ANY			0
+#define	INSTANCE_STATE_ATTACHED			1
+#define	INSTANCE_STATE_DETACHED			2
+#define	INSTANCE_STATE_TERMINATING		3	/* being torn down */
+
+#define	INSTANCE_CURSOR_MAX	(MAX_PRISON_NAME + MAXPATHLEN)
+
+struct cblock_instance_query {
+	char					q_image[MAXPATHLEN];
+	uint32_t				q_type;	/* PRISON_TYPE_NONE: any */
+	uint32_t				q_state;
+	uint32_t				q_fields; /* 0: all */
+	uint32_t				q_sort;
+	uint32_t				q_limit; /* 0: no limit */
+	char					q_cursor[INSTANCE_CURSOR_MAX];
+};
+
+struct cblock_instance_page {
+	size_t					p_count;
+	size_t					p_matched;
+	char					p_cursor[INSTANCE_CURSOR_MAX];
 };
 
 struct cblock_generic_command {
@@ -111,6 +299,21 @@ struct cblock_launch {
 	char					p_ports[MAX_ARG_STRING];
 	char					p_network[IF_NAMESIZE];
 	int					p_verbose;
+	/*
+	 * Console output rate limit, bytes per second (0: unlimited). Only
+	 * carried by the TLV protocol.
+	 */
+	uint64_t				p_output_rate;
+	uint64_t				p_output_burst;	/* 0: default */
+};
+
+/*
+ * Change the console output rate limit of a running instance.
+ */
+struct cblock_console_limit {
+	char					p_instance[MAX_PRISON_NAME];
+	uint64_t				p_output_rate;	/* 0: unlimited */
+	uint64_t				p_output_burst;	/* 0: default */
 };
 
 struct cblock_console_connect {
@@ -119,7 +322,107 @@ struct cblock_console_connect {
 	struct winsize				p_winsize;
 	struct termios				p_termios;
 	char					p_term[MAX_TERM_NAME];
+	/*
+	 * Resuming, watching and limiting the replay are only supported by
+	 * the TLV protocol, the legacy protocol carries the structure up to
+	 * p_resume.
+	 */
+	int					p_resume;
+	uint64_t				p_resume_offset;
+	int					p_watch;	/* read-only */
+	uint64_t				p_replay_lines;	/* 0: all */
+	uint64_t				p_replay_bytes;	/* 0: all */
+	/*
+	 * Log subscribers (CBLOCK_CAP_CONSOLE_LOGS) are watchers which send
+	 * no input at all, and leave the terminal settings alone. The
+	 * backlog can start at the output written since p_since_time.
+	 */
+	int					p_logs;
+	int64_t					p_since_time;	/* 0: all */
+	int					p_shm;
+	int					p_handoff;
+};
+
+/*
+ * Sent in a PRISON_IPC_CONSOLE_OFFSET frame to consoles which asked to
+ * resume, once the backlog has been sent. co_offset is the stream offset
+ * of the first byte of live output which follows, co_gap is the number of
+ * bytes after the requested offset which had already been discarded and
+ * could not be sent.
+ */
+struct cblock_console_offset {
+	uint64_t				co_offset;
+	uint64_t				co_gap;
+};
+
+/*
+ * With CBLOCK_CAP_CONSOLE_FRAMES, console input is sent as a stream of
+ * frames, each a cblock_console_frame header followed by cf_len bytes of
+ * payload, in host byte order like the rest of the console stream.
+ * cf_cmd is PRISON_IPC_CONSOLE_DATA (any length of terminal input),
+ * PRISON_IPC_CONSOL_RESIZE (a struct winsize) or PRISON_IPC_CONSOLE_SIGNAL
+ * (an int32_t signal number for the foreground process group). Frames
+ * which are not understood are skipped. Without it, each write is taken
+ * to be a single uint32_t command followed by its payload.
+ */
+struct cblock_console_frame {
+	uint32_t				cf_cmd;
+	uint32_t				cf_len;
+};
+
+/*
+ * A log subscriber which asked for a shared memory ring is sent a
+ * PRISON_IPC_CONSOLE_SHM message right after the response, before the
+ * backlog. If cs_size is non-zero, the ring and the read end of a wakeup
+ * socket come with it as SCM_RIGHTS, in that order. Live output is then
+ * written to the ring, starting at position cs_head (the output offset in
+ * the PRISON_IPC_CONSOLE_OFFSET message which ends the backlog), and a byte
+ * is sent on the wakeup socket when there is more of it. Everything else
+ * still comes over the connection. If cs_size is zero, the daemon could
+ * not set the ring up and output comes over the connection as usual.
+ */
+struct cblock_console_shm {
+	uint64_t				cs_size;
+	uint64_t				cs_head;
+};
+#define	SHMRING_MIN_SIZE		65536
+
+/*
+ * A console writer which asked for the pty is sent an empty
+ * PRISON_IPC_CONSOLE_HANDOFF message right after the response, with the pty
+ * master attached (SCM_RIGHTS) if it was granted. The daemon stops reading
+ * the pty, and sends the backlog over the connection followed by a second,
+ * empty, PRISON_IPC_CONSOLE_HANDOFF message, after which the client reads
+ * and writes the pty itself. Whatever it reads from the pty it also sends
+ * to the daemon in PRISON_IPC_CONSOLE_TEE frames (CBLOCK_CAP_CONSOLE_FRAMES),
+ * which go to the scrollback and the other consoles. Any output the daemon
+ * still reads comes over the connection as usual. Once the client detaches,
+ * the daemon goes back to reading the pty.
+ */
+
+/*
+ * With CBLOCK_CAP_CONSOLE_MUX, a connection which sends PRISON_IPC_CONSOLE_MUX
+ * (and is sent a cblock_response) goes on to carry the output of any number
+ * of consoles, each on a channel numbered by the client. Every message in
+ * either direction is a cblock_mux_frame header followed by mf_len bytes of
+ * payload, in host byte order.
+ *
+ * The client opens a channel with PRISON_IPC_MUX_SUBSCRIBE, the payload
+ * being the TLV encoded console connect fields (tlv_put_console_connect()),
+ * and closes it with PRISON_IPC_MUX_UNSUBSCRIBE. Channels are watch-only.
+ * The daemon answers a subscription with a PRISON_IPC_MUX_SUBSCRIBE frame,
+ * empty if the channel was opened and holding the error message if not.
+ * After that, the channel gets the same messages (console output, offsets
+ * and PRISON_IPC_CONSOLE_SESSION_DONE) a console connection would, with the
+ * payload of each in a frame of its own. Frames for channels which have
+ * been unsubscribed may still arrive, and are to be ignored.
+ */
+struct cblock_mux_frame {
+	uint32_t				mf_cmd;
+	uint32_t				mf_channel;
+	uint32_t				mf_len;
 };
+#define	CBLOCK_MUX_FRAME_MAX		65536	/* largest client frame */
 
 struct build_step_root_pivot {
 	char					sr_dir[MAXPATHLEN];
@@ -228,6 +531,8 @@ struct vec {
 
 typedef struct vec vec_t;
 
+struct sbuf;
+
 void		print_red(FILE *, char *, ...);
 void		print_bold_prefix(FILE *);
 pid_t		waitpid_ignore_intr(pid_t, int *);
@@ -243,7 +548,74 @@ int		vec_merge(vec_t *, vec_t *);
 int		sock_ipc_may_read(int, void *, size_t);
 ssize_t		sock_ipc_must_read(int, void *, size_t);
 ssize_t		sock_ipc_must_write(int, void *, size_t);
+ssize_t		sock_ipc_send_fds(int, void *, size_t, int *, int);
+ssize_t		sock_ipc_recv_fds(int, void *, size_t, int *, int *);
 ssize_t		sock_ipc_from_to(int, int, off_t);
 void		sock_ipc_from_sock_to_tty(int);
+int		tlv_put(struct sbuf *, uint16_t, const void *, size_t);
+int		tlv_put_str(struct sbuf *, uint16_t, const char *);
+int		tlv_put_u32(struct sbuf *, uint16_t, uint32_t);
+int		tlv_put_u64(struct sbuf *, uint16_t, uint64_t);
+void		tlv_iter_init(struct tlv_iter *, const void *, size_t);
+int		tlv_next(struct tlv_iter *, uint16_t *, const u_char **,
+		    size_t *);
+void		tlv_get_str(const u_char *, size_t, char *, size_t);
+uint32_t	tlv_get_u32(const u_char *, size_t);
+uint64_t	tlv_get_u64(const u_char *, size_t);
+void		tlv_msg_init(struct sbuf *, char *, size_t);
+ssize_t		tlv_msg_write(int, struct sbuf *);
+int		tlv_msg_read(int, u_char *, size_t, size_t *);
+struct zstream	*zstream_deflate_init(int);
+struct zstream	*zstream_inflate_init(void);
+void		zstream_free(struct zstream *);
+void		zstream_counts(struct zstream *, uint64_t *, uint64_t *);
+u_char *	zstream_deflate(struct zstream *, const struct iovec *, int,
+		    size_t *);
+u_char *	zstream_inflate(struct zstream *, const u_char *, size_t,
+		    size_t *);
+struct shmring	*shmring_create(size_t);
+struct shmring	*shmring_attach(int);
+void		shmring_free(struct shmring *);
+int		shmring_fd(struct shmring *);
+size_t		shmring_size(struct shmring *);
+uint64_t	shmring_head(struct shmring *);
+void		shmring_write(struct shmring *, const void *, size_t);
+size_t		shmring_read(struct shmring *, uint64_t *, void *, size_t,
+		    uint64_t *);
+int		sock_ipc_send_response(int, int, struct cblock_response *);
+int		sock_ipc_recv_response(int, int, struct cblock_response *);
+int		sock_ipc_send_launch(int, int, struct cblock_launch *);
+int		sock_ipc_recv_launch(int, int, struct cblock_launch *);
+int		sock_ipc_send_console_limit(int, int,
+		    struct cblock_console_limit *);
+int		sock_ipc_recv_console_limit(int, int,
+		    struct cblock_console_limit *);
+void		tlv_put_console_connect(struct sbuf *,
+		    struct cblock_console_connect *);
+int		tlv_get_console_connect(struct tlv_iter *,
+		    struct cblock_console_connect *);
+int		sock_ipc_send_console_connect(int, int,
+		    struct cblock_console_connect *);
+int		sock_ipc_recv_console_connect(int, int,
+		    struct cblock_console_connect *);
+int		sock_ipc_send_generic_command(int, int,
+		    struct cblock_generic_command *);
+int		sock_ipc_recv_generic_command(int, int,
+		    struct cblock_generic_command *);
+int		sock_ipc_send_build_context(int, int,
+		    struct cblock_build_context *);
+int		sock_ipc_recv_build_context(int, int,
+		    struct cblock_build_context *);
+int		tlv_get_instance(struct tlv_iter *, struct instance_ent *);
+int		sock_ipc_send_instances(int, int, struct instance_ent *,
+		    size_t);
+struct instance_ent *
+		sock_ipc_recv_instances(int, int, size_t *);
+int		sock_ipc_send_instance_query(int,
+		    struct cblock_instance_query *);
+int		sock_ipc_recv_instance_query(int,
+		    struct cblock_instance_query *);
+struct instance_ent *
+		sock_ipc_recv_instance_page(int, struct cblock_instance_page *);
 
 #endif	/* BUILD_DOT_H_ */
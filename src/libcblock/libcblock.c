@@ -28,6 +28,7 @@
 #include <sys/wait.h>
 #include <sys/queue.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <sys/param.h>
 #include <sys/un.h>
@@ -166,6 +167,141 @@ sock_ipc_must_write(int fd, void *buf, size_t n)
 	return (n);
 }
 
+#define	SOCK_IPC_MAX_FDS	4
+
+/*
+ * Write a message along with up to SOCK_IPC_MAX_FDS descriptors (possibly
+ * none), which are passed (SCM_RIGHTS) with the first part of it. Returns
+ * n once the whole message has been written, 0 if the peer has closed the
+ * connection and -1 on any other error. Unlike sock_ipc_must_write(),
+ * errors are left to the caller: the daemon uses this with peers which
+ * may go away at any time.
+ */
+ssize_t
+sock_ipc_send_fds(int fd, void *buf, size_t n, int *fds, int nfds)
+{
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int) * SOCK_IPC_MAX_FDS)];
+	} cmsgbuf;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	ssize_t res;
+	size_t pos;
+
+	if (nfds < 0 || nfds > SOCK_IPC_MAX_FDS) {
+		errno = EINVAL;
+		return (-1);
+	}
+	bzero(&msg, sizeof(msg));
+	bzero(&cmsgbuf, sizeof(cmsgbuf));
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (nfds > 0) {
+		msg.msg_control = cmsgbuf.buf;
+		msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfds);
+		cmsg = CMSG_FIRSTHDR(&msg);
+		cmsg->cmsg_level = SOL_SOCKET;
+		cmsg->cmsg_type = SCM_RIGHTS;
+		cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfds);
+		memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfds);
+	}
+	pos = 0;
+	while (pos < n) {
+		res = sendmsg(fd, &msg, MSG_NOSIGNAL);
+		if (res == -1 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		if (res <= 0) {
+			return (res);
+		}
+		/*
+		 * The descriptors went with the first part, the rest of the
+		 * message is written without them.
+		 */
+		pos += res;
+		iov.iov_base = (char *)buf + pos;
+		iov.iov_len = n - pos;
+		msg.msg_control = NULL;
+		msg.msg_controllen = 0;
+	}
+	return (n);
+}
+
+/*
+ * Read a message sent by sock_ipc_send_fds(). *nfds is the number of
+ * descriptors fds can hold on entry, and the number which were received on
+ * return (any beyond what fds can hold are closed). Returns 0 on EOF, like
+ * sock_ipc_must_read().
+ */
+ssize_t
+sock_ipc_recv_fds(int fd, void *buf, size_t n, int *fds, int *nfds)
+{
+	union {
+		struct cmsghdr	hdr;
+		char		buf[CMSG_SPACE(sizeof(int) * SOCK_IPC_MAX_FDS)];
+	} cmsgbuf;
+	struct cmsghdr *cmsg;
+	struct msghdr msg;
+	struct iovec iov;
+	int k, max, got, *cfds;
+	ssize_t res;
+
+	max = *nfds;
+	*nfds = 0;
+	bzero(&msg, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = n;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cmsgbuf.buf;
+	msg.msg_controllen = sizeof(cmsgbuf.buf);
+	while (1) {
+		res = recvmsg(fd, &msg, 0);
+		if (res == -1 && (errno == EINTR || errno == EAGAIN)) {
+			continue;
+		}
+		break;
+	}
+	switch (res) {
+	case -1:
+		err(1, "%s: recvmsg failed", __func__);
+	case 0:
+		return (0);
+	}
+	if ((msg.msg_flags & MSG_CTRUNC) != 0) {
+		warnx("%s: descriptors were dropped", __func__);
+	}
+	for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL;
+	    cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+		if (cmsg->cmsg_level != SOL_SOCKET ||
+		    cmsg->cmsg_type != SCM_RIGHTS) {
+			continue;
+		}
+		cfds = (int *)CMSG_DATA(cmsg);
+		got = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+		for (k = 0; k < got; k++) {
+			if (*nfds < max) {
+				fds[(*nfds)++] = cfds[k];
+			} else {
+				(void) close(cfds[k]);
+			}
+		}
+	}
+	if ((size_t)res < n &&
+	    sock_ipc_must_read(fd, (char *)buf + res, n - res) == 0) {
+		for (k = 0; k < *nfds; k++) {
+			(void) close(fds[k]);
+		}
+		*nfds = 0;
+		return (0);
+	}
+	return (n);
+}
+
 ssize_t
 sock_ipc_from_to(int from, int to, off_t len)
 {
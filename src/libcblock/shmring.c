@@ -0,0 +1,480 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <cblock/libcblock.h>
+
+/*
+ * A ring of console output in shared memory, written by the daemon and read
+ * by any number of local clients, each of which keeps its own position.
+ * Positions count the bytes written since the ring was created. The writer
+ * never waits for the readers: a reader which falls more than the size of
+ * the ring behind loses the output which has been overwritten, and is told
+ * how much it lost.
+ *
+ * The writer publishes rh_reserve before it copies data into the ring and
+ * rh_head once it is done. A reader copies out what is below rh_head, then
+ * checks rh_reserve to see whether the writer could have been overwriting
+ * any of it in the meantime (the scheme is that of a seqlock).
+ */
+#define	SHMRING_MAGIC		0x43425247	/* "CBRG" */
+#define	SHMRING_HDR_LEN		4096		/* data is page aligned */
+
+struct shmring_hdr {
+	uint32_t		 rh_magic;
+	uint32_t		 rh_hdrlen;
+	uint64_t		 rh_size;	/* power of two */
+	_Atomic uint64_t	 rh_reserve;
+	_Atomic uint64_t	 rh_head;
+};
+
+struct shmring {
+	int			 sr_fd;
+	int			 sr_writer;
+	size_t			 sr_maplen;
+	struct shmring_hdr	*sr_hdr;
+	u_char			*sr_data;
+	uint64_t		 sr_mask;
+};
+
+static struct shmring *
+shmring_map(int fd, size_t maplen, int writer)
+{
+	struct shmring *sr;
+	int prot;
+	void *va;
+
+	prot = PROT_READ;
+	if (writer) {
+		prot |= PROT_WRITE;
+	}
+	va = mmap(NULL, maplen, prot, MAP_SHARED, fd, 0);
+	if (va == MAP_FAILED) {
+		return (NULL);
+	}
+	sr = calloc(1, sizeof(*sr));
+	if (sr == NULL) {
+		(void) munmap(va, maplen);
+		return (NULL);
+	}
+	sr->sr_fd = fd;
+	sr->sr_writer = writer;
+	sr->sr_maplen = maplen;
+	sr->sr_hdr = va;
+	sr->sr_data = (u_char *)va + SHMRING_HDR_LEN;
+	return (sr);
+}
+
+/*
+ * Create a ring holding size bytes of output, rounded up to a power of two.
+ */
+struct shmring *
+shmring_create(size_t size)
+{
+	struct shmring_hdr *rh;
+	struct shmring *sr;
+	size_t ringsize;
+	int fd;
+
+	ringsize = SHMRING_MIN_SIZE;
+	while (ringsize < size) {
+		ringsize <<= 1;
+	}
+	fd = shm_open(SHM_ANON, O_RDWR, 0600);
+	if (fd == -1) {
+		return (NULL);
+	}
+	if (ftruncate(fd, SHMRING_HDR_LEN + ringsize) == -1) {
+		(void) close(fd);
+		return (NULL);
+	}
+	sr = shmring_map(fd, SHMRING_HDR_LEN + ringsize, 1);
+	if (sr == NULL) {
+		(void) close(fd);
+		return (NULL);
+	}
+	rh = sr->sr_hdr;
+	rh->rh_hdrlen = SHMRING_HDR_LEN;
+	rh->rh_size = ringsize;
+	atomic_init(&rh->rh_reserve, 0);
+	atomic_init(&rh->rh_head, 0);
+	rh->rh_magic = SHMRING_MAGIC;
+	sr->sr_mask = ringsize - 1;
+	return (sr);
+}
+
+/*
+ * Map a ring which was created by someone else (and passed to us), read
+ * only. The descriptor belongs to the ring from here on, even on failure.
+ */
+struct shmring *
+shmring_attach(int fd)
+{
+	struct shmring_hdr *rh;
+	struct shmring *sr;
+	struct stat sb;
+	uint64_t size;
+
+	if (fstat(fd, &sb) == -1) {
+		(void) close(fd);
+		return (NULL);
+	}
+	if (sb.st_size <= SHMRING_HDR_LEN) {
+		(void) close(fd);
+		errno = EINVAL;
+		return (NULL);
+	}
+	sr = shmring_map(fd, sb.st_size, 0);
+	if (sr == NULL) {
+		(void) close(fd);
+		return (NULL);
+	}
+	rh = sr->sr_hdr;
+	size = rh->rh_size;
+	if (rh->rh_magic != SHMRING_MAGIC || rh->rh_hdrlen != SHMRING_HDR_LEN ||
+	    size < SHMRING_MIN_SIZE || (size & (size - 1)) != 0 ||
+	    SHMRING_HDR_LEN + size > (uint64_t)sb.st_size) {
+		shmring_free(sr);
+		errno = EINVAL;
+		return (NULL);
+	}
+	sr->sr_mask = size - 1;
+	return (sr);
+}
+
+void
+shmring_free(struct shmring *sr)
+{
+
+	(void) munmap(sr->sr_hdr, sr->sr_maplen);
+	(void) close(sr->sr_fd);
+	free(sr);
+}
+
+int
+shmring_fd(struct shmring *sr)
+{
+
+	return (sr->sr_fd);
+}
+
+size_t
+shmring_size(struct shmring *sr)
+{
+
+	return (sr->sr_hdr->rh_size);
+}
+
+uint64_t
+shmring_head(struct shmring *sr)
+{
+
+	return (atomic_load_explicit(&sr->sr_hdr->rh_head,
+	    memory_order_acquire));
+}
+
+/*
+ * Append len bytes to the ring. If there is more than the ring can hold,
+ * only the tail end of it is kept, but the position still advances by len.
+ */
+void
+shmring_write(struct shmring *sr, const void *buf, size_t len)
+{
+	struct shmring_hdr *rh;
+	const u_char *src;
+	uint64_t head;
+	size_t off, n;
+
+	rh = sr->sr_hdr;
+	src = buf;
+	head = atomic_load_explicit(&rh->rh_head, memory_order_relaxed);
+	atomic_store_explicit(&rh->rh_reserve, head + len,
+	    memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	if (len > rh->rh_size) {
+		src += len - rh->rh_size;
+		head += len - rh->rh_size;
+		len = rh->rh_size;
+	}
+	off = head & sr->sr_mask;
+	n = rh->rh_size - off;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(sr->sr_data + off, src, n);
+	memcpy(sr->sr_data, src + n, len - n);
+	atomic_store_explicit(&rh->rh_head, head + len, memory_order_release);
+}
+
+/*
+ * Copy up to len bytes of output, starting at *pos, into buf. *pos is
+ * advanced past what was copied and anything which was lost, and the
+ * number of bytes lost is stored in *gap. Returns the number of bytes
+ * copied, 0 if the reader has caught up with the writer.
+ */
+size_t
+shmring_read(struct shmring *sr, uint64_t *pos, void *buf, size_t len,
+    uint64_t *gap)
+{
+	struct shmring_hdr *rh;
+	uint64_t head, start, oldest, reserve;
+	size_t off, n;
+	u_char *dst;
+
+	rh = sr->sr_hdr;
+	dst = buf;
+	*gap = 0;
+	head = atomic_load_explicit(&rh->rh_head, memory_order_acquire);
+	start = *pos;
+	if (head - start > rh->rh_size) {
+		*gap = head - rh->rh_size - start;
+		start = head - rh->rh_size;
+	}
+	if (len > head - start) {
+		len = head - start;
+	}
+	off = start & sr->sr_mask;
+	n = rh->rh_size - off;
+	if (n > len) {
+		n = len;
+	}
+	memcpy(dst, sr->sr_data + off, n);
+	memcpy(dst + n, sr->sr_data, len - n);
+	/*
+	 * Anything below oldest may have been overwritten while it was being
+	 * copied.
+	 */
+	atomic_thread_fence(memory_order_acquire);
+	reserve = atomic_load_explicit(&rh->rh_reserve, memory_order_relaxed);
+	oldest = reserve > rh->rh_size ? reserve - rh->rh_size : 0;
+	if (start < oldest) {
+		n = oldest - start;
+		if (n > len) {
+			n = len;
+		}
+		memmove(dst, dst + n, len - n);
+		*gap += n;
+		start += n;
+		len -= n;
+	}
+	*pos = start + len;
+	return (len);
+}
+
+#ifdef __BENCH_SHMRING_CODE__
+/*
+ * Push BENCH_BYTES of output from one process to another, the way console
+ * output gets to a local client, first as length prefixed messages over a
+ * UNIX domain socket and then through a ring with a socket for wakeups.
+ * Reports the throughput and the CPU time used by both processes. The
+ * writer is held back when the reader is more than half a ring behind, so
+ * nothing is lost and the two runs move the same amount of data.
+ *
+ * cc -O2 -D__BENCH_SHMRING_CODE__ -I../include shmring.c libcblock.c
+ */
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+#include <err.h>
+
+#define	BENCH_BYTES	(1024ULL * 1024 * 1024)
+#define	BENCH_CHUNK	16384
+#define	BENCH_RING	(4 * 1024 * 1024)
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+static double
+bench_cpu(int who)
+{
+	struct rusage ru;
+
+	getrusage(who, &ru);
+	return (ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	    ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6);
+}
+
+static void
+bench_report(const char *name, double secs, double cpu0, double cpu1)
+{
+	double cpu;
+
+	cpu = bench_cpu(RUSAGE_SELF) - cpu0 +
+	    bench_cpu(RUSAGE_CHILDREN) - cpu1;
+	printf("%-8s %8.1f MB/s %7.2f s cpu (%.0f%% of one core)\n", name,
+	    BENCH_BYTES / secs / 1e6, cpu, cpu / secs * 100);
+}
+
+static void
+bench_socket(const u_char *chunk)
+{
+	double t0, cpu0, cpu1;
+	u_char buf[BENCH_CHUNK + 12];
+	uint64_t total;
+	uint32_t cmd;
+	size_t len;
+	int sv[2];
+	pid_t pid;
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		err(1, "socketpair");
+	}
+	cpu0 = bench_cpu(RUSAGE_SELF);
+	cpu1 = bench_cpu(RUSAGE_CHILDREN);
+	t0 = bench_now();
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		total = 0;
+		while (total < BENCH_BYTES) {
+			if (sock_ipc_must_read(sv[1], &cmd, sizeof(cmd)) == 0 ||
+			    sock_ipc_must_read(sv[1], &len, sizeof(len)) == 0 ||
+			    sock_ipc_must_read(sv[1], buf, len) == 0) {
+				errx(1, "short stream");
+			}
+			total += len;
+		}
+		_exit(0);
+	}
+	close(sv[1]);
+	cmd = PRISON_IPC_CONSOLE_TO_CLIENT;
+	len = BENCH_CHUNK;
+	memcpy(buf, &cmd, sizeof(cmd));
+	memcpy(buf + sizeof(cmd), &len, sizeof(len));
+	for (total = 0; total < BENCH_BYTES; total += BENCH_CHUNK) {
+		memcpy(buf + sizeof(cmd) + sizeof(len), chunk, BENCH_CHUNK);
+		sock_ipc_must_write(sv[0], buf,
+		    sizeof(cmd) + sizeof(len) + BENCH_CHUNK);
+	}
+	waitpid(pid, NULL, 0);
+	close(sv[0]);
+	bench_report("socket", bench_now() - t0, cpu0, cpu1);
+}
+
+static void
+bench_ring(const u_char *chunk)
+{
+	double t0, cpu0, cpu1;
+	_Atomic uint64_t *tail;
+	uint64_t pos, gap, lost;
+	u_char buf[BENCH_CHUNK];
+	struct pollfd pfd;
+	struct shmring *sr, *rd;
+	size_t n;
+	int sv[2];
+	pid_t pid;
+	char c;
+
+	sr = shmring_create(BENCH_RING);
+	if (sr == NULL) {
+		err(1, "shmring_create");
+	}
+	tail = mmap(NULL, sizeof(*tail), PROT_READ | PROT_WRITE,
+	    MAP_SHARED | MAP_ANON, -1, 0);
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		err(1, "socketpair");
+	}
+	cpu0 = bench_cpu(RUSAGE_SELF);
+	cpu1 = bench_cpu(RUSAGE_CHILDREN);
+	t0 = bench_now();
+	pid = fork();
+	if (pid == 0) {
+		close(sv[0]);
+		rd = shmring_attach(dup(shmring_fd(sr)));
+		if (rd == NULL) {
+			err(1, "shmring_attach");
+		}
+		pos = lost = 0;
+		pfd.fd = sv[1];
+		pfd.events = POLLIN;
+		while (pos < BENCH_BYTES) {
+			n = shmring_read(rd, &pos, buf, sizeof(buf), &gap);
+			lost += gap;
+			atomic_store(tail, pos);
+			if (n > 0) {
+				continue;
+			}
+			poll(&pfd, 1, -1);
+			while (recv(sv[1], &c, 1, MSG_DONTWAIT) == 1)
+				;
+		}
+		if (lost != 0) {
+			errx(1, "lost %ju bytes", (uintmax_t)lost);
+		}
+		_exit(0);
+	}
+	close(sv[1]);
+	c = 0;
+	for (pos = 0; pos < BENCH_BYTES; pos += BENCH_CHUNK) {
+		while (pos - atomic_load(tail) > BENCH_RING / 2) {
+			sched_yield();
+		}
+		shmring_write(sr, chunk, BENCH_CHUNK);
+		(void) send(sv[0], &c, 1, MSG_DONTWAIT);
+	}
+	waitpid(pid, NULL, 0);
+	close(sv[0]);
+	shmring_free(sr);
+	bench_report("ring", bench_now() - t0, cpu0, cpu1);
+}
+
+int
+main(int argc, char *argv [])
+{
+	u_char chunk[BENCH_CHUNK];
+	size_t k;
+
+	for (k = 0; k < sizeof(chunk); k++) {
+		chunk[k] = 'a' + k % 26;
+	}
+	printf("%llu MB in %d byte writes\n", BENCH_BYTES >> 20, BENCH_CHUNK);
+	bench_socket(chunk);
+	bench_ring(chunk);
+	return (0);
+}
+#endif	/* __BENCH_SHMRING_CODE__ */
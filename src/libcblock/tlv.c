@@ -0,0 +1,1147 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/endian.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <err.h>
+
+#include <cblock/libcblock.h>
+#include <cblock/sbuf.h>
+
+/*
+ * Legacy peers exchange the console connect structure as it was before
+ * resuming was added.
+ */
+#define	CONSOLE_CONNECT_LEGACY_LEN	\
+	offsetof(struct cblock_console_connect, p_resume)
+#define	INSTANCE_LEGACY_LEN	\
+	offsetof(struct instance_ent, p_state)
+
+/*
+ * The launch structure as legacy peers send it. The rate limit fields are
+ * 64 bit, so the offset of the first of them includes the padding after
+ * p_verbose, which the old structure did not have.
+ */
+struct cblock_launch_legacy {
+	char			p_name[MAX_PRISON_NAME];
+	char			p_tag[MAXPATHLEN];
+	char			p_term[MAX_TERM_NAME];
+	char			p_entry_point_args[MAXPATHLEN];
+	char			p_volumes[MAX_ARG_STRING];
+	char			p_ports[MAX_ARG_STRING];
+	char			p_network[IF_NAMESIZE];
+	int			p_verbose;
+};
+#define	LAUNCH_LEGACY_LEN	sizeof(struct cblock_launch_legacy)
+
+_Static_assert(offsetof(struct cblock_launch, p_verbose) ==
+    offsetof(struct cblock_launch_legacy, p_verbose),
+    "legacy launch layout changed");
+_Static_assert(LAUNCH_LEGACY_LEN <= offsetof(struct cblock_launch,
+    p_output_rate), "legacy launch longer than its prefix");
+
+#ifdef __BENCH_TLV_CODE__
+#include <pthread.h>
+#include <time.h>
+#endif
+
+int
+tlv_put(struct sbuf *sb, uint16_t type, const void *val, size_t len)
+{
+	u_char hdr[TLV_HDR_LEN];
+
+	if (len > UINT16_MAX) {
+		return (-1);
+	}
+	be16enc(&hdr[0], type);
+	be16enc(&hdr[2], len);
+	if (sbuf_bcat(sb, hdr, sizeof(hdr)) == -1) {
+		return (-1);
+	}
+	if (len == 0) {
+		return (0);
+	}
+	return (sbuf_bcat(sb, val, len));
+}
+
+/*
+ * Strings are sent without the trailing NUL. Empty strings are not
+ * sent at all, the receiver zero fills the fields it does not see.
+ */
+int
+tlv_put_str(struct sbuf *sb, uint16_t type, const char *str)
+{
+
+	if (str == NULL || *str == '\0') {
+		return (0);
+	}
+	return (tlv_put(sb, type, str, strlen(str)));
+}
+
+int
+tlv_put_u32(struct sbuf *sb, uint16_t type, uint32_t val)
+{
+	u_char buf[sizeof(val)];
+
+	be32enc(buf, val);
+	return (tlv_put(sb, type, buf, sizeof(buf)));
+}
+
+int
+tlv_put_u64(struct sbuf *sb, uint16_t type, uint64_t val)
+{
+	u_char buf[sizeof(val)];
+
+	be64enc(buf, val);
+	return (tlv_put(sb, type, buf, sizeof(buf)));
+}
+
+void
+tlv_iter_init(struct tlv_iter *ti, const void *buf, size_t len)
+{
+
+	ti->ti_buf = buf;
+	ti->ti_len = len;
+	ti->ti_off = 0;
+}
+
+/*
+ * Return 1 and the next field in the message, 0 when the message has been
+ * consumed or -1 if the field header claims more data than is present.
+ */
+int
+tlv_next(struct tlv_iter *ti, uint16_t *type, const u_char **val,
+    size_t *len)
+{
+	const u_char *p;
+	size_t vlen;
+
+	if (ti->ti_off == ti->ti_len) {
+		return (0);
+	}
+	if (ti->ti_len - ti->ti_off < TLV_HDR_LEN) {
+		return (-1);
+	}
+	p = ti->ti_buf + ti->ti_off;
+	vlen = be16dec(p + 2);
+	if (ti->ti_len - ti->ti_off - TLV_HDR_LEN < vlen) {
+		return (-1);
+	}
+	*type = be16dec(p);
+	*val = p + TLV_HDR_LEN;
+	*len = vlen;
+	ti->ti_off += TLV_HDR_LEN + vlen;
+	return (1);
+}
+
+void
+tlv_get_str(const u_char *val, size_t len, char *dst, size_t dstlen)
+{
+
+	if (len >= dstlen) {
+		len = dstlen - 1;
+	}
+	bcopy(val, dst, len);
+	dst[len] = '\0';
+}
+
+uint32_t
+tlv_get_u32(const u_char *val, size_t len)
+{
+
+	if (len != sizeof(uint32_t)) {
+		return (0);
+	}
+	return (be32dec(val));
+}
+
+uint64_t
+tlv_get_u64(const u_char *val, size_t len)
+{
+
+	if (len != sizeof(uint64_t)) {
+		return (0);
+	}
+	return (be64dec(val));
+}
+
+/*
+ * Initialize a message in the caller supplied storage. The first
+ * TLV_HDR_LEN bytes are reserved for the length prefix, which is filled
+ * in by tlv_msg_write().
+ */
+void
+tlv_msg_init(struct sbuf *sb, char *buf, size_t len)
+{
+	u_char pad[TLV_HDR_LEN];
+
+	sbuf_new(sb, buf, len, SBUF_FIXEDLEN);
+	bzero(pad, sizeof(pad));
+	sbuf_bcat(sb, pad, sizeof(pad));
+}
+
+ssize_t
+tlv_msg_write(int fd, struct sbuf *sb)
+{
+	ssize_t len;
+	char *buf;
+
+	if (sbuf_finish(sb) != 0) {
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	buf = sbuf_data(sb);
+	len = sbuf_len(sb);
+	be32enc(buf, len - TLV_HDR_LEN);
+	return (sock_ipc_must_write(fd, buf, len));
+}
+
+/*
+ * Read a single message into the caller supplied buffer, and the length
+ * of its payload into *lenp. A message may be empty (every field in it
+ * omitted). Returns 1 on success, 0 on EOF and -1 if the message is larger
+ * than the buffer.
+ */
+int
+tlv_msg_read(int fd, u_char *buf, size_t buflen, size_t *lenp)
+{
+	u_char hdr[TLV_HDR_LEN];
+	uint32_t len;
+
+	if (sock_ipc_must_read(fd, hdr, sizeof(hdr)) == 0) {
+		return (0);
+	}
+	len = be32dec(hdr);
+	if (len > buflen) {
+		warnx("TLV message too large: %u bytes", len);
+		return (-1);
+	}
+	*lenp = len;
+	if (len > 0 && sock_ipc_must_read(fd, buf, len) == 0) {
+		return (0);
+	}
+	return (1);
+}
+
+static int
+tlv_msg_begin(int fd, u_char *buf, size_t buflen, struct tlv_iter *ti)
+{
+	size_t len;
+	int ret;
+
+	ret = tlv_msg_read(fd, buf, buflen, &len);
+	if (ret != 1) {
+		return (ret);
+	}
+	tlv_iter_init(ti, buf, len);
+	return (1);
+}
+
+int
+sock_ipc_send_response(int fd, int proto, struct cblock_response *resp)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_write(fd, resp, sizeof(*resp)) != 0);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_u32(&sb, TLV_ECODE, resp->p_ecode);
+	tlv_put_str(&sb, TLV_ERRBUF, resp->p_errbuf);
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_response(int fd, int proto, struct cblock_response *resp)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_read(fd, resp, sizeof(*resp)) != 0);
+	}
+	bzero(resp, sizeof(*resp));
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	while ((ret = tlv_next(&ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_ECODE:
+			resp->p_ecode = (int32_t)tlv_get_u32(val, len);
+			break;
+		case TLV_ERRBUF:
+			tlv_get_str(val, len, resp->p_errbuf,
+			    sizeof(resp->p_errbuf));
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+int
+sock_ipc_send_launch(int fd, int proto, struct cblock_launch *pl)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_write(fd, pl, LAUNCH_LEGACY_LEN) != 0);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_str(&sb, TLV_NAME, pl->p_name);
+	tlv_put_str(&sb, TLV_TAG, pl->p_tag);
+	tlv_put_str(&sb, TLV_TERM, pl->p_term);
+	tlv_put_str(&sb, TLV_ENTRY_POINT_ARGS, pl->p_entry_point_args);
+	tlv_put_str(&sb, TLV_VOLUMES, pl->p_volumes);
+	tlv_put_str(&sb, TLV_PORTS, pl->p_ports);
+	tlv_put_str(&sb, TLV_NETWORK, pl->p_network);
+	tlv_put_u32(&sb, TLV_VERBOSE, pl->p_verbose);
+	if (pl->p_output_rate != 0) {
+		tlv_put_u64(&sb, TLV_OUTPUT_RATE, pl->p_output_rate);
+		tlv_put_u64(&sb, TLV_OUTPUT_BURST, pl->p_output_burst);
+	}
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_launch(int fd, int proto, struct cblock_launch *pl)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	bzero(pl, sizeof(*pl));
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_read(fd, pl, LAUNCH_LEGACY_LEN) != 0);
+	}
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	while ((ret = tlv_next(&ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_NAME:
+			tlv_get_str(val, len, pl->p_name, sizeof(pl->p_name));
+			break;
+		case TLV_TAG:
+			tlv_get_str(val, len, pl->p_tag, sizeof(pl->p_tag));
+			break;
+		case TLV_TERM:
+			tlv_get_str(val, len, pl->p_term, sizeof(pl->p_term));
+			break;
+		case TLV_ENTRY_POINT_ARGS:
+			tlv_get_str(val, len, pl->p_entry_point_args,
+			    sizeof(pl->p_entry_point_args));
+			break;
+		case TLV_VOLUMES:
+			tlv_get_str(val, len, pl->p_volumes,
+			    sizeof(pl->p_volumes));
+			break;
+		case TLV_PORTS:
+			tlv_get_str(val, len, pl->p_ports,
+			    sizeof(pl->p_ports));
+			break;
+		case TLV_NETWORK:
+			tlv_get_str(val, len, pl->p_network,
+			    sizeof(pl->p_network));
+			break;
+		case TLV_VERBOSE:
+			pl->p_verbose = tlv_get_u32(val, len);
+			break;
+		case TLV_OUTPUT_RATE:
+			pl->p_output_rate = tlv_get_u64(val, len);
+			break;
+		case TLV_OUTPUT_BURST:
+			pl->p_output_burst = tlv_get_u64(val, len);
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+int
+sock_ipc_send_console_limit(int fd, int proto,
+    struct cblock_console_limit *pcl)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_write(fd, pcl, sizeof(*pcl)) != 0);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_str(&sb, TLV_INSTANCE, pcl->p_instance);
+	tlv_put_u64(&sb, TLV_OUTPUT_RATE, pcl->p_output_rate);
+	tlv_put_u64(&sb, TLV_OUTPUT_BURST, pcl->p_output_burst);
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_console_limit(int fd, int proto,
+    struct cblock_console_limit *pcl)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	bzero(pcl, sizeof(*pcl));
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_read(fd, pcl, sizeof(*pcl)) != 0);
+	}
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	while ((ret = tlv_next(&ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_INSTANCE:
+			tlv_get_str(val, len, pcl->p_instance,
+			    sizeof(pcl->p_instance));
+			break;
+		case TLV_OUTPUT_RATE:
+			pcl->p_output_rate = tlv_get_u64(val, len);
+			break;
+		case TLV_OUTPUT_BURST:
+			pcl->p_output_burst = tlv_get_u64(val, len);
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+/*
+ * Encode and decode the console connect fields, which console multiplexing
+ * connections carry in their own frames.
+ */
+void
+tlv_put_console_connect(struct sbuf *sb, struct cblock_console_connect *pcc)
+{
+
+	tlv_put_str(sb, TLV_NAME, pcc->p_name);
+	tlv_put_str(sb, TLV_INSTANCE, pcc->p_instance);
+	tlv_put_str(sb, TLV_TERM, pcc->p_term);
+	tlv_put(sb, TLV_WINSIZE, &pcc->p_winsize, sizeof(pcc->p_winsize));
+	tlv_put(sb, TLV_TERMIOS, &pcc->p_termios, sizeof(pcc->p_termios));
+	if (pcc->p_resume) {
+		tlv_put_u64(sb, TLV_RESUME_OFFSET, pcc->p_resume_offset);
+	}
+	if (pcc->p_watch) {
+		tlv_put_u32(sb, TLV_WATCH, 1);
+	}
+	if (pcc->p_replay_lines != 0) {
+		tlv_put_u64(sb, TLV_REPLAY_LINES, pcc->p_replay_lines);
+	}
+	if (pcc->p_replay_bytes != 0) {
+		tlv_put_u64(sb, TLV_REPLAY_BYTES, pcc->p_replay_bytes);
+	}
+	if (pcc->p_logs) {
+		tlv_put_u32(sb, TLV_LOGS, 1);
+	}
+	if (pcc->p_since_time != 0) {
+		tlv_put_u64(sb, TLV_SINCE_TIME, pcc->p_since_time);
+	}
+	if (pcc->p_shm) {
+		tlv_put_u32(sb, TLV_SHM, 1);
+	}
+	if (pcc->p_handoff) {
+		tlv_put_u32(sb, TLV_HANDOFF, 1);
+	}
+}
+
+int
+tlv_get_console_connect(struct tlv_iter *ti,
+    struct cblock_console_connect *pcc)
+{
+	const u_char *val;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	bzero(pcc, sizeof(*pcc));
+	while ((ret = tlv_next(ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_NAME:
+			tlv_get_str(val, len, pcc->p_name,
+			    sizeof(pcc->p_name));
+			break;
+		case TLV_INSTANCE:
+			tlv_get_str(val, len, pcc->p_instance,
+			    sizeof(pcc->p_instance));
+			break;
+		case TLV_TERM:
+			tlv_get_str(val, len, pcc->p_term,
+			    sizeof(pcc->p_term));
+			break;
+		/*
+		 * The window size and terminal attributes are passed through
+		 * as-is, both ends of the connection are expected to share
+		 * the same ABI for these.
+		 */
+		case TLV_WINSIZE:
+			if (len == sizeof(pcc->p_winsize)) {
+				bcopy(val, &pcc->p_winsize, len);
+			}
+			break;
+		case TLV_TERMIOS:
+			if (len == sizeof(pcc->p_termios)) {
+				bcopy(val, &pcc->p_termios, len);
+			}
+			break;
+		case TLV_RESUME_OFFSET:
+			pcc->p_resume = 1;
+			pcc->p_resume_offset = tlv_get_u64(val, len);
+			break;
+		case TLV_WATCH:
+			pcc->p_watch = tlv_get_u32(val, len) != 0;
+			break;
+		case TLV_REPLAY_LINES:
+			pcc->p_replay_lines = tlv_get_u64(val, len);
+			break;
+		case TLV_REPLAY_BYTES:
+			pcc->p_replay_bytes = tlv_get_u64(val, len);
+			break;
+		case TLV_LOGS:
+			pcc->p_logs = tlv_get_u32(val, len) != 0;
+			break;
+		case TLV_SINCE_TIME:
+			pcc->p_since_time = tlv_get_u64(val, len);
+			break;
+		case TLV_SHM:
+			pcc->p_shm = tlv_get_u32(val, len) != 0;
+			break;
+		case TLV_HANDOFF:
+			pcc->p_handoff = tlv_get_u32(val, len) != 0;
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+int
+sock_ipc_send_console_connect(int fd, int proto,
+    struct cblock_console_connect *pcc)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_write(fd, pcc,
+		    CONSOLE_CONNECT_LEGACY_LEN) != 0);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_console_connect(&sb, pcc);
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_console_connect(int fd, int proto,
+    struct cblock_console_connect *pcc)
+{
+	u_char buf[TLV_MSG_MAX];
+	struct tlv_iter ti;
+	int ret;
+
+	bzero(pcc, sizeof(*pcc));
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_read(fd, pcc,
+		    CONSOLE_CONNECT_LEGACY_LEN) != 0);
+	}
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	return (tlv_get_console_connect(&ti, pcc));
+}
+
+int
+sock_ipc_send_generic_command(int fd, int proto,
+    struct cblock_generic_command *arg)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_write(fd, arg, sizeof(*arg)) != 0);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_str(&sb, TLV_CMDNAME, arg->p_cmdname);
+	tlv_put_u64(&sb, TLV_MLEN, arg->p_mlen);
+	tlv_put_u32(&sb, TLV_VERBOSE, arg->p_verbose);
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_generic_command(int fd, int proto,
+    struct cblock_generic_command *arg)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_read(fd, arg, sizeof(*arg)) != 0);
+	}
+	bzero(arg, sizeof(*arg));
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	while ((ret = tlv_next(&ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_CMDNAME:
+			tlv_get_str(val, len, arg->p_cmdname,
+			    sizeof(arg->p_cmdname));
+			break;
+		case TLV_MLEN:
+			arg->p_mlen = tlv_get_u64(val, len);
+			break;
+		case TLV_VERBOSE:
+			arg->p_verbose = tlv_get_u32(val, len);
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+int
+sock_ipc_send_build_context(int fd, int proto,
+    struct cblock_build_context *pbc)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_write(fd, pbc, sizeof(*pbc)) != 0);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_str(&sb, TLV_IMAGE_NAME, pbc->p_image_name);
+	tlv_put_str(&sb, TLV_CBLOCK_FILE, pbc->p_cblock_file);
+	tlv_put_u64(&sb, TLV_CONTEXT_SIZE, pbc->p_context_size);
+	tlv_put_str(&sb, TLV_TAG, pbc->p_tag);
+	tlv_put_u32(&sb, TLV_NSTAGES, pbc->p_nstages);
+	tlv_put_u32(&sb, TLV_NSTEPS, pbc->p_nsteps);
+	tlv_put_str(&sb, TLV_TERM, pbc->p_term);
+	tlv_put_str(&sb, TLV_ENTRY_POINT, pbc->p_entry_point);
+	tlv_put_str(&sb, TLV_ENTRY_POINT_ARGS, pbc->p_entry_point_args);
+	tlv_put_u32(&sb, TLV_VERBOSE, pbc->p_verbose);
+	tlv_put_u32(&sb, TLV_FIM_SPEC, pbc->p_build_fim_spec);
+	tlv_put_str(&sb, TLV_OS_RELEASE, pbc->p_os_release);
+	tlv_put_str(&sb, TLV_AUDITCFG, pbc->p_auditcfg);
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_build_context(int fd, int proto,
+    struct cblock_build_context *pbc)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		return (sock_ipc_must_read(fd, pbc, sizeof(*pbc)) != 0);
+	}
+	bzero(pbc, sizeof(*pbc));
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	while ((ret = tlv_next(&ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_IMAGE_NAME:
+			tlv_get_str(val, len, pbc->p_image_name,
+			    sizeof(pbc->p_image_name));
+			break;
+		case TLV_CBLOCK_FILE:
+			tlv_get_str(val, len, pbc->p_cblock_file,
+			    sizeof(pbc->p_cblock_file));
+			break;
+		case TLV_CONTEXT_SIZE:
+			pbc->p_context_size = tlv_get_u64(val, len);
+			break;
+		case TLV_TAG:
+			tlv_get_str(val, len, pbc->p_tag, sizeof(pbc->p_tag));
+			break;
+		case TLV_NSTAGES:
+			pbc->p_nstages = tlv_get_u32(val, len);
+			break;
+		case TLV_NSTEPS:
+			pbc->p_nsteps = tlv_get_u32(val, len);
+			break;
+		case TLV_TERM:
+			tlv_get_str(val, len, pbc->p_term,
+			    sizeof(pbc->p_term));
+			break;
+		case TLV_ENTRY_POINT:
+			tlv_get_str(val, len, pbc->p_entry_point,
+			    sizeof(pbc->p_entry_point));
+			break;
+		case TLV_ENTRY_POINT_ARGS:
+			tlv_get_str(val, len, pbc->p_entry_point_args,
+			    sizeof(pbc->p_entry_point_args));
+			break;
+		case TLV_VERBOSE:
+			pbc->p_verbose = tlv_get_u32(val, len);
+			break;
+		case TLV_FIM_SPEC:
+			pbc->p_build_fim_spec = tlv_get_u32(val, len);
+			break;
+		case TLV_OS_RELEASE:
+			tlv_get_str(val, len, pbc->p_os_release,
+			    sizeof(pbc->p_os_release));
+			break;
+		case TLV_AUDITCFG:
+			tlv_get_str(val, len, pbc->p_auditcfg,
+			    sizeof(pbc->p_auditcfg));
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+/*
+ * Parse the fields of one instance entry. An entry starts with its
+ * TLV_INSTANCE field, or in query responses (where the name may not have
+ * been asked for) with an empty TLV_ENTRY field, and runs up to the start
+ * of the next one or the end of the message. Returns 1 if an entry was
+ * parsed, 0 if the message has been consumed and -1 if it is malformed.
+ */
+int
+tlv_get_instance(struct tlv_iter *ti, struct instance_ent *ent)
+{
+	const u_char *val;
+	int found, delim, ret;
+	uint16_t type;
+	size_t len, off;
+
+	bzero(ent, sizeof(*ent));
+	found = delim = 0;
+	for (;;) {
+		off = ti->ti_off;
+		ret = tlv_next(ti, &type, &val, &len);
+		if (ret != 1) {
+			break;
+		}
+		switch (type) {
+		case TLV_ENTRY:
+			if (found) {
+				ti->ti_off = off;
+				return (1);
+			}
+			delim = 1;
+			break;
+		case TLV_INSTANCE:
+			if (found && !delim) {
+				ti->ti_off = off;
+				return (1);
+			}
+			tlv_get_str(val, len, ent->p_instance_name,
+			    sizeof(ent->p_instance_name));
+			break;
+		case TLV_IMAGE_NAME:
+			tlv_get_str(val, len, ent->p_image_name,
+			    sizeof(ent->p_image_name));
+			break;
+		case TLV_PID:
+			ent->p_pid = tlv_get_u32(val, len);
+			break;
+		case TLV_TTY_LINE:
+			tlv_get_str(val, len, ent->p_tty_line,
+			    sizeof(ent->p_tty_line));
+			break;
+		case TLV_START_TIME:
+			ent->p_start_time = tlv_get_u64(val, len);
+			break;
+		case TLV_TYPE:
+			tlv_get_str(val, len, ent->p_type,
+			    sizeof(ent->p_type));
+			break;
+		case TLV_STATE:
+			tlv_get_str(val, len, ent->p_state,
+			    sizeof(ent->p_state));
+			break;
+		}
+		found = 1;
+	}
+	if (ret == -1) {
+		return (-1);
+	}
+	return (found);
+}
+
+/*
+ * Instance listings are sent as a message carrying the entry count,
+ * followed by one message per entry. Peers with CBLOCK_CAP_LIST_STREAM
+ * are sent as many entries per message as fit instead, which the receiver
+ * below handles either way.
+ */
+int
+sock_ipc_send_instances(int fd, int proto, struct instance_ent *ents,
+    size_t count)
+{
+	struct instance_ent *cur;
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+	size_t k;
+
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		sock_ipc_must_write(fd, &count, sizeof(count));
+		for (k = 0; k < count; k++) {
+			if (sock_ipc_must_write(fd, &ents[k],
+			    INSTANCE_LEGACY_LEN) == 0) {
+				return (0);
+			}
+		}
+		return (1);
+	}
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_u64(&sb, TLV_COUNT, count);
+	if (tlv_msg_write(fd, &sb) <= 0) {
+		return (0);
+	}
+	for (k = 0; k < count; k++) {
+		cur = &ents[k];
+		tlv_msg_init(&sb, buf, sizeof(buf));
+		tlv_put_str(&sb, TLV_INSTANCE, cur->p_instance_name);
+		tlv_put_str(&sb, TLV_IMAGE_NAME, cur->p_image_name);
+		tlv_put_u32(&sb, TLV_PID, cur->p_pid);
+		tlv_put_str(&sb, TLV_TTY_LINE, cur->p_tty_line);
+		tlv_put_u64(&sb, TLV_START_TIME, cur->p_start_time);
+		tlv_put_str(&sb, TLV_TYPE, cur->p_type);
+		tlv_put_str(&sb, TLV_STATE, cur->p_state);
+		if (tlv_msg_write(fd, &sb) <= 0) {
+			return (0);
+		}
+	}
+	return (1);
+}
+
+/*
+ * Read the entries of a listing whose first message (the one carrying the
+ * counts) is in buf, and may itself carry the first entries.
+ */
+static struct instance_ent *
+tlv_recv_instances(int fd, u_char *buf, size_t buflen, struct tlv_iter *ti,
+    size_t *count)
+{
+	struct instance_ent *ents;
+	size_t k;
+	int ret;
+
+	if (*count == 0) {
+		return (NULL);
+	}
+	ents = calloc(*count, sizeof(*ents));
+	if (ents == NULL) {
+		err(1, "calloc for instance list failed");
+	}
+	k = 0;
+	while (k < *count) {
+		ret = tlv_get_instance(ti, &ents[k]);
+		if (ret == 1) {
+			k++;
+			continue;
+		}
+		if (ret == -1 || tlv_msg_begin(fd, buf, buflen, ti) <= 0) {
+			break;
+		}
+	}
+	*count = k;
+	return (ents);
+}
+
+struct instance_ent *
+sock_ipc_recv_instances(int fd, int proto, size_t *count)
+{
+	struct instance_ent *ents;
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	size_t len, k, off;
+	uint16_t type;
+
+	*count = 0;
+	if (proto == CBLOCK_PROTO_LEGACY) {
+		if (sock_ipc_must_read(fd, count, sizeof(*count)) == 0 ||
+		    *count == 0) {
+			return (NULL);
+		}
+		ents = calloc(*count, sizeof(*ents));
+		if (ents == NULL) {
+			err(1, "calloc for instance list failed");
+		}
+		for (k = 0; k < *count; k++) {
+			if (sock_ipc_must_read(fd, &ents[k],
+			    INSTANCE_LEGACY_LEN) == 0) {
+				*count = k;
+				break;
+			}
+		}
+		return (ents);
+	}
+	if (tlv_msg_begin(fd, buf, sizeof(buf), &ti) <= 0) {
+		return (NULL);
+	}
+	/*
+	 * A packed listing carries the first entries along with the count.
+	 */
+	for (off = ti.ti_off; tlv_next(&ti, &type, &val, &len) == 1;
+	    off = ti.ti_off) {
+		if (type == TLV_INSTANCE) {
+			ti.ti_off = off;
+			break;
+		}
+		if (type == TLV_COUNT) {
+			*count = tlv_get_u64(val, len);
+		}
+	}
+	return (tlv_recv_instances(fd, buf, sizeof(buf), &ti, count));
+}
+
+int
+sock_ipc_send_instance_query(int fd, struct cblock_instance_query *q)
+{
+	char buf[TLV_MSG_MAX];
+	struct sbuf sb;
+
+	tlv_msg_init(&sb, buf, sizeof(buf));
+	tlv_put_str(&sb, TLV_IMAGE_NAME, q->q_image);
+	tlv_put_u32(&sb, TLV_QUERY_TYPE, q->q_type);
+	tlv_put_u32(&sb, TLV_QUERY_STATE, q->q_state);
+	tlv_put_u32(&sb, TLV_FIELDS, q->q_fields);
+	tlv_put_u32(&sb, TLV_SORT, q->q_sort);
+	tlv_put_u32(&sb, TLV_LIMIT, q->q_limit);
+	tlv_put_str(&sb, TLV_CURSOR, q->q_cursor);
+	return (tlv_msg_write(fd, &sb) > 0);
+}
+
+int
+sock_ipc_recv_instance_query(int fd, struct cblock_instance_query *q)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	uint16_t type;
+	size_t len;
+	int ret;
+
+	bzero(q, sizeof(*q));
+	if ((ret = tlv_msg_begin(fd, buf, sizeof(buf), &ti)) <= 0) {
+		return (ret);
+	}
+	while ((ret = tlv_next(&ti, &type, &val, &len)) == 1) {
+		switch (type) {
+		case TLV_IMAGE_NAME:
+			tlv_get_str(val, len, q->q_image,
+			    sizeof(q->q_image));
+			break;
+		case TLV_QUERY_TYPE:
+			q->q_type = tlv_get_u32(val, len);
+			break;
+		case TLV_QUERY_STATE:
+			q->q_state = tlv_get_u32(val, len);
+			break;
+		case TLV_FIELDS:
+			q->q_fields = tlv_get_u32(val, len);
+			break;
+		case TLV_SORT:
+			q->q_sort = tlv_get_u32(val, len);
+			break;
+		case TLV_LIMIT:
+			q->q_limit = tlv_get_u32(val, len);
+			break;
+		case TLV_CURSOR:
+			tlv_get_str(val, len, q->q_cursor,
+			    sizeof(q->q_cursor));
+			break;
+		}
+	}
+	return (ret == 0);
+}
+
+/*
+ * Read a page of a query response. Fields which were not asked for are
+ * left zero filled.
+ */
+struct instance_ent *
+sock_ipc_recv_instance_page(int fd, struct cblock_instance_page *pg)
+{
+	u_char buf[TLV_MSG_MAX];
+	const u_char *val;
+	struct tlv_iter ti;
+	size_t len, off;
+	uint16_t type;
+
+	bzero(pg, sizeof(*pg));
+	if (tlv_msg_begin(fd, buf, sizeof(buf), &ti) <= 0) {
+		return (NULL);
+	}
+	for (off = ti.ti_off; tlv_next(&ti, &type, &val, &len) == 1;
+	    off = ti.ti_off) {
+		if (type == TLV_ENTRY) {
+			ti.ti_off = off;
+			break;
+		}
+		switch (type) {
+		case TLV_COUNT:
+			pg->p_count = tlv_get_u64(val, len);
+			break;
+		case TLV_MATCHED:
+			pg->p_matched = tlv_get_u64(val, len);
+			break;
+		case TLV_CURSOR:
+			tlv_get_str(val, len, pg->p_cursor,
+			    sizeof(pg->p_cursor));
+			break;
+		}
+	}
+	return (tlv_recv_instances(fd, buf, sizeof(buf), &ti,
+	    &pg->p_count));
+}
+
+#ifdef __BENCH_TLV_CODE__
+/*
+ * Compare the legacy and TLV encodings of a typical launch request and
+ * response pair, both in bytes on the wire and round trip latency over a
+ * UNIX domain socket pair.
+ *
+ * cc -D__BENCH_TLV_CODE__ -I../include tlv.c libcblock.c sbuf.c -lpthread
+ */
+#define	BENCH_ITERATIONS	100000
+
+static void *
+bench_server(void *arg)
+{
+	struct cblock_response resp;
+	struct cblock_launch pl;
+	int *args, k;
+
+	args = arg;
+	for (k = 0; k < BENCH_ITERATIONS; k++) {
+		if (sock_ipc_recv_launch(args[0], args[1], &pl) != 1) {
+			errx(1, "short launch read");
+		}
+		bzero(&resp, sizeof(resp));
+		snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "0123456789");
+		sock_ipc_send_response(args[0], args[1], &resp);
+	}
+	return (NULL);
+}
+
+static size_t
+bench_count_bytes(int proto, struct cblock_launch *pl)
+{
+	struct cblock_response resp;
+	int sv[2], avail;
+	size_t total;
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		err(1, "socketpair");
+	}
+	bzero(&resp, sizeof(resp));
+	snprintf(resp.p_errbuf, sizeof(resp.p_errbuf), "0123456789");
+	sock_ipc_send_launch(sv[0], proto, pl);
+	sock_ipc_send_response(sv[0], proto, &resp);
+	if (ioctl(sv[1], FIONREAD, &avail) == -1) {
+		err(1, "ioctl(FIONREAD)");
+	}
+	total = avail;
+	close(sv[0]);
+	close(sv[1]);
+	return (total);
+}
+
+static void
+bench_run(int proto, struct cblock_launch *pl)
+{
+	struct timespec start, end;
+	struct cblock_response resp;
+	pthread_t thr;
+	int sv[2], args[2], k;
+	double usec;
+
+	if (socketpair(PF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		err(1, "socketpair");
+	}
+	args[0] = sv[1];
+	args[1] = proto;
+	pthread_create(&thr, NULL, bench_server, args);
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (k = 0; k < BENCH_ITERATIONS; k++) {
+		sock_ipc_send_launch(sv[0], proto, pl);
+		sock_ipc_recv_response(sv[0], proto, &resp);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	pthread_join(thr, NULL);
+	usec = (end.tv_sec - start.tv_sec) * 1e6 +
+	    (end.tv_nsec - start.tv_nsec) / 1e3;
+	printf("%-8s %8zu bytes/round-trip %8.2f usec/round-trip\n",
+	    proto == CBLOCK_PROTO_LEGACY ? "legacy" : "tlv",
+	    bench_count_bytes(proto, pl), usec / BENCH_ITERATIONS);
+	close(sv[0]);
+	close(sv[1]);
+}
+
+int
+main(int argc, char *argv [])
+{
+	struct cblock_launch pl;
+
+	bzero(&pl, sizeof(pl));
+	strlcpy(pl.p_name, "freebsd-base", sizeof(pl.p_name));
+	strlcpy(pl.p_tag, "latest", sizeof(pl.p_tag));
+	strlcpy(pl.p_term, "xterm-256color", sizeof(pl.p_term));
+	strlcpy(pl.p_volumes, "devfs,procfs,", sizeof(pl.p_volumes));
+	strlcpy(pl.p_ports, "none", sizeof(pl.p_ports));
+	strlcpy(pl.p_network, "default", sizeof(pl.p_network));
+	bench_run(CBLOCK_PROTO_LEGACY, &pl);
+	bench_run(CBLOCK_PROTO_TLV, &pl);
+	return (0);
+}
+#endif	/* __BENCH_TLV_CODE__ */
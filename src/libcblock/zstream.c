@@ -0,0 +1,351 @@
+/*-
+ * Copyright (c) 2020 Christian S.J. Peron
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <cblock/libcblock.h>
+
+/*
+ * Console output streams are compressed with deflate. Each message is
+ * compressed as it is sent and ended with a sync flush, so the other end
+ * can decompress it in full as soon as it arrives, while later messages
+ * still benefit from the history of the earlier ones.
+ */
+struct zstream {
+	z_stream	 zs_strm;
+	int		 zs_deflate;	/* compressing, rather than inflating */
+	uint64_t	 zs_in;		/* uncompressed bytes */
+	uint64_t	 zs_out;	/* compressed bytes */
+};
+
+struct zstream *
+zstream_deflate_init(int level)
+{
+	struct zstream *zs;
+
+	zs = calloc(1, sizeof(*zs));
+	if (zs == NULL) {
+		return (NULL);
+	}
+	/*
+	 * A raw stream: there is no header or trailer, the messages framing
+	 * the stream already delimit it.
+	 */
+	if (deflateInit2(&zs->zs_strm, level, Z_DEFLATED, -MAX_WBITS, 8,
+	    Z_DEFAULT_STRATEGY) != Z_OK) {
+		free(zs);
+		return (NULL);
+	}
+	zs->zs_deflate = 1;
+	return (zs);
+}
+
+struct zstream *
+zstream_inflate_init(void)
+{
+	struct zstream *zs;
+
+	zs = calloc(1, sizeof(*zs));
+	if (zs == NULL) {
+		return (NULL);
+	}
+	if (inflateInit2(&zs->zs_strm, -MAX_WBITS) != Z_OK) {
+		free(zs);
+		return (NULL);
+	}
+	return (zs);
+}
+
+void
+zstream_free(struct zstream *zs)
+{
+
+	if (zs->zs_deflate) {
+		(void) deflateEnd(&zs->zs_strm);
+	} else {
+		(void) inflateEnd(&zs->zs_strm);
+	}
+	free(zs);
+}
+
+void
+zstream_counts(struct zstream *zs, uint64_t *in, uint64_t *out)
+{
+
+	*in = zs->zs_in;
+	*out = zs->zs_out;
+}
+
+static u_char *
+zstream_grow(u_char *buf, size_t *size, z_stream *strm)
+{
+	u_char *nbuf;
+	size_t used;
+
+	used = *size - strm->avail_out;
+	*size *= 2;
+	nbuf = realloc(buf, *size);
+	if (nbuf == NULL) {
+		free(buf);
+		return (NULL);
+	}
+	strm->next_out = nbuf + used;
+	strm->avail_out = *size - used;
+	return (nbuf);
+}
+
+/*
+ * Compress the data described by iov into a newly allocated buffer, which
+ * the caller frees. Returns NULL if memory could not be allocated.
+ */
+u_char *
+zstream_deflate(struct zstream *zs, const struct iovec *iov, int iovcnt,
+    size_t *lenp)
+{
+	z_stream *strm;
+	size_t size, len;
+	u_char *buf;
+	int k, flush;
+
+	strm = &zs->zs_strm;
+	len = 0;
+	for (k = 0; k < iovcnt; k++) {
+		len += iov[k].iov_len;
+	}
+	/* a sync flush adds at most a few bytes to the bound */
+	size = deflateBound(strm, len) + 16;
+	buf = malloc(size);
+	if (buf == NULL) {
+		return (NULL);
+	}
+	strm->next_out = buf;
+	strm->avail_out = size;
+	for (k = 0; k < iovcnt; k++) {
+		strm->next_in = iov[k].iov_base;
+		strm->avail_in = iov[k].iov_len;
+		flush = k == iovcnt - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+		while (1) {
+			(void) deflate(strm, flush);
+			/*
+			 * deflate() is done with this chunk once it has taken
+			 * all of the input and, when flushing, leaves room in
+			 * the output buffer.
+			 */
+			if (strm->avail_in == 0 && strm->avail_out != 0) {
+				break;
+			}
+			if (strm->avail_out == 0) {
+				buf = zstream_grow(buf, &size, strm);
+				if (buf == NULL) {
+					return (NULL);
+				}
+			}
+		}
+	}
+	*lenp = size - strm->avail_out;
+	zs->zs_in += len;
+	zs->zs_out += *lenp;
+	return (buf);
+}
+
+/*
+ * Decompress a message into a newly allocated buffer, which the caller
+ * frees. Returns NULL if the stream is corrupt or memory could not be
+ * allocated.
+ */
+u_char *
+zstream_inflate(struct zstream *zs, const u_char *data, size_t len,
+    size_t *lenp)
+{
+	z_stream *strm;
+	u_char *buf;
+	size_t size;
+	int ret;
+
+	strm = &zs->zs_strm;
+	size = len * 4 + 64;
+	buf = malloc(size);
+	if (buf == NULL) {
+		return (NULL);
+	}
+	strm->next_in = (u_char *)data;
+	strm->avail_in = len;
+	strm->next_out = buf;
+	strm->avail_out = size;
+	while (1) {
+		ret = inflate(strm, Z_SYNC_FLUSH);
+		if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			free(buf);
+			return (NULL);
+		}
+		if (strm->avail_in == 0 && strm->avail_out != 0) {
+			break;
+		}
+		if (strm->avail_out == 0) {
+			buf = zstream_grow(buf, &size, strm);
+			if (buf == NULL) {
+				return (NULL);
+			}
+		} else if (ret == Z_BUF_ERROR) {
+			/* no progress with input left and room to spare */
+			free(buf);
+			return (NULL);
+		}
+	}
+	*lenp = size - strm->avail_out;
+	zs->zs_in += *lenp;
+	zs->zs_out += len;
+	return (buf);
+}
+
+#ifdef __BENCH_ZSTREAM_CODE__
+/*
+ * Compress a synthetic build log the way the daemon sends console output
+ * (in batches of up to BENCH_BATCH bytes, each flushed) at a few levels,
+ * check that it decompresses to the original and report the ratio and
+ * compression throughput.
+ *
+ * cc -O2 -D__BENCH_ZSTREAM_CODE__ -I../include zstream.c -lz
+ */
+#include <time.h>
+#include <err.h>
+
+#define	BENCH_BYTES	(8 * 1024 * 1024)
+
+static u_char *
+bench_log(size_t len)
+{
+	static const char *words[] = {
+		"cc", "-O2", "-Wall", "-c", "-o", "-I../include", "-fPIC",
+		"src/cblockd/dispatch.c", "src/cblockd/termbuf.c", "obj",
+		"warning:", "unused", "variable", "[-Wunused-variable]",
+		"===>", "Building", "for", "pkg-1.14.2", "install", "-m",
+		"0555", "/usr/local/bin", "lib", "libcblock.so", "ld",
+	};
+	size_t nwords, off, n;
+	u_char *buf;
+	char line[256];
+
+	nwords = sizeof(words) / sizeof(words[0]);
+	buf = malloc(len);
+	if (buf == NULL) {
+		err(1, "malloc");
+	}
+	off = 0;
+	srandom(1);
+	while (off < len) {
+		n = snprintf(line, sizeof(line), "[%5ld] ", random() % 100000);
+		while (n < 100 + (size_t)(random() % 40)) {
+			n += snprintf(line + n, sizeof(line) - n, "%s ",
+			    words[random() % nwords]);
+		}
+		line[n - 1] = '\n';
+		if (n > len - off) {
+			n = len - off;
+		}
+		memcpy(buf + off, line, n);
+		off += n;
+	}
+	return (buf);
+}
+
+static double
+bench_elapsed(struct timespec *start)
+{
+	struct timespec end;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return ((end.tv_sec - start->tv_sec) +
+	    (end.tv_nsec - start->tv_nsec) / 1e9);
+}
+
+static void
+bench_run(u_char *log, int level, size_t batch)
+{
+	struct zstream *dz, *iz;
+	struct timespec start;
+	struct iovec iov;
+	u_char *z, *out;
+	size_t off, zlen, olen;
+	uint64_t in, zout;
+	double secs;
+
+	dz = zstream_deflate_init(level);
+	iz = zstream_inflate_init();
+	if (dz == NULL || iz == NULL) {
+		errx(1, "zstream init failed");
+	}
+	secs = 0;
+	for (off = 0; off < BENCH_BYTES; off += batch) {
+		iov.iov_base = log + off;
+		iov.iov_len = batch < BENCH_BYTES - off ?
+		    batch : BENCH_BYTES - off;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		z = zstream_deflate(dz, &iov, 1, &zlen);
+		secs += bench_elapsed(&start);
+		if (z == NULL) {
+			errx(1, "deflate failed");
+		}
+		out = zstream_inflate(iz, z, zlen, &olen);
+		if (out == NULL || olen != iov.iov_len ||
+		    memcmp(out, iov.iov_base, olen) != 0) {
+			errx(1, "round trip mismatch at %zu", off);
+		}
+		free(z);
+		free(out);
+	}
+	zstream_counts(dz, &in, &zout);
+	printf("level %d batch %6zu: %5.1f%% of original, %7.1f MB/s\n",
+	    level, batch, 100.0 * zout / in, in / secs / 1e6);
+	zstream_free(dz);
+	zstream_free(iz);
+}
+
+int
+main(int argc, char *argv [])
+{
+	static const int levels[] = { 1, 3, 6, 9 };
+	static const size_t batches[] = { 512, 32768 };
+	u_char *log;
+	size_t k, j;
+
+	log = bench_log(BENCH_BYTES);
+	for (j = 0; j < sizeof(batches) / sizeof(batches[0]); j++) {
+		for (k = 0; k < sizeof(levels) / sizeof(levels[0]); k++) {
+			bench_run(log, levels[k], batches[j]);
+		}
+	}
+	free(log);
+	return (0);
+}
+#endif	/* __BENCH_ZSTREAM_CODE__ */
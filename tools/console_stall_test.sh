@@ -0,0 +1,105 @@
+#!/bin/sh
+#
+# Copyright (c) 2020 Christian S.J. Peron
+# All rights reserved.
+#
+# Redistribution and use in source and binary forms, with or without
+# modification, are permitted provided that the following conditions
+# are met:
+# 1. Redistributions of source code must retain the above copyright
+#    notice, this list of conditions and the following disclaimer.
+# 2. Redistributions in binary form must reproduce the above copyright
+#    notice, this list of conditions and the following disclaimer in the
+#    documentation and/or other materials provided with the distribution.
+#
+# THIS SOFTWARE IS PROVIDED BY THE AUTHOR AND CONTRIBUTORS ``AS IS'' AND
+# ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+# IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+# ARE DISCLAIMED.  IN NO EVENT SHALL THE AUTHOR OR CONTRIBUTORS BE LIABLE
+# FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+# DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+# OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+# HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+# LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+# OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+# SUCH DAMAGE.
+# Contention test: verify that a console client which stops reading from its
+# socket does not stall the rest of the daemon.
+#
+# An instance which writes continuously to its console is attached to and
+# the console client is then suspended, so the daemon eventually blocks
+# writing console output to it. While it is stalled, a series of launches
+# and instance listings must still complete within TIMEOUT seconds each.
+#
+# The image must have a shell entry point (e.g.: /bin/sh), since the test
+# passes "-c <command>" as the entry point arguments.
+#
+# usage: console_stall_test.sh [image] [launches]
+#
+IMAGE=${1:-base}
+LAUNCHES=${2:-10}
+TIMEOUT=${TIMEOUT:-30}
+
+stalled_instance=""
+console_pid=""
+
+cleanup()
+{
+    if [ -n "${console_pid}" ]; then
+        pkill -CONT -f "cblock console -n ${stalled_instance}"
+        kill ${console_pid} 2>/dev/null
+    fi
+    if [ -n "${stalled_instance}" ]; then
+        pid=`cblock instances -q | awk -v i="${stalled_instance}" '$1 == i { print $4 }'`
+        if [ -n "${pid}" ]; then
+            pkill -P ${pid}
+            kill ${pid} 2>/dev/null
+        fi
+    fi
+    cblock instances --prune > /dev/null 2>&1
+}
+
+fail()
+{
+    echo "FAIL: $*"
+    cleanup
+    exit 1
+}
+
+launch()
+{
+    timeout ${TIMEOUT} cblock launch -A -H -n ${IMAGE} -- -c "$1" | \
+      awk '/instance:/ { print $NF }'
+}
+
+stalled_instance=`launch "yes"`
+if [ -z "${stalled_instance}" ]; then
+    fail "unable to launch ${IMAGE}"
+fi
+echo "-- launched ${stalled_instance}, attaching a console and suspending it"
+sleep 3600 | script -q /dev/null cblock console -n ${stalled_instance} > /dev/null &
+console_pid=$!
+sleep 2
+if ! pkill -STOP -f "cblock console -n ${stalled_instance}"; then
+    fail "unable to suspend console client"
+fi
+#
+# Give the daemon time to fill the socket buffers and block on the write.
+#
+sleep 5
+k=0
+while [ $k -lt ${LAUNCHES} ]; do
+    before=`date +%s`
+    instance=`launch "true"`
+    if [ -z "${instance}" ]; then
+        fail "launch $k did not complete within ${TIMEOUT} seconds"
+    fi
+    if ! timeout ${TIMEOUT} cblock instances > /dev/null; then
+        fail "instance listing $k did not complete within ${TIMEOUT} seconds"
+    fi
+    after=`date +%s`
+    echo "-- launch $k: ${instance} in $((after - before)) seconds"
+    k=$((k + 1))
+done
+cleanup
+echo "PASS: ${LAUNCHES} launches completed while ${stalled_instance} console was stalled"